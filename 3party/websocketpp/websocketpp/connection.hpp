@@ -306,6 +306,10 @@ public:
       , m_local_close_code(close::status::abnormal_close)
       , m_remote_close_code(close::status::abnormal_close)
       , m_was_clean(false)
+      , m_handoff_pausing(false)
+      , m_handoff_paused(false)
+      , m_handoff_cancelled(false)
+      , m_handoff_abort_pending(false)
     {
         m_alog.write(log::alevel::devel,"connection constructor");
     }
@@ -604,6 +608,44 @@ public:
     void close(close::status::value const code, std::string const & reason,
         lib::error_code & ec);
 
+    //////////////////////////////////////////////
+    // Handing an open connection to a process //
+    //////////////////////////////////////////////
+
+    /// Stop reading once the stream is between two messages
+    /**
+     * Asks an open server connection to stop reading at the next message
+     * boundary, so the socket and the opening request can be handed to
+     * another process. The read pending on the socket is cancelled when no
+     * write is outstanding, otherwise the caller should ask again later.
+     * Messages that complete before the boundary are still dispatched.
+     */
+    void pause_for_handoff();
+
+    /// Whether the connection stopped at a boundary with nothing left to send
+    bool ready_for_handoff();
+
+    /// Read again after a handoff that did not take place
+    void resume_after_handoff();
+
+    /// Returns the raw opening request, to be passed to adopt() elsewhere
+    std::string get_handoff_request() {
+        return m_request.raw();
+    }
+
+    /// Take over an open connection handed over by another process
+    /**
+     * Must be called instead of start() on a server connection whose socket
+     * was assigned to the connection of another process that stopped at a
+     * message boundary. The opening request is parsed again to pick the
+     * processor, no handshake takes place and the open handler is not
+     * called, the connection is open once this returns without error.
+     *
+     * @param request The raw opening request of the connection.
+     * @return A status code, zero on success, non-zero otherwise.
+     */
+    lib::error_code adopt(std::string const & request);
+
     ////////////////////////////////////////////////
     // Pass-through access to the uri information //
     ////////////////////////////////////////////////
@@ -1052,6 +1094,7 @@ public:
     void handle_write_frame(lib::error_code const & ec);
 protected:
     void handle_transport_init(lib::error_code const & ec);
+    void handle_adopt_init(lib::error_code const & ec);
 
     /// Set m_processor based on information in m_request. Set m_response
     /// status and return false on error.
@@ -1341,6 +1384,16 @@ private:
 
     /// Whether or not this endpoint initiated the drop of the TCP connection
     bool                    m_dropped_by_me;
+
+    // Handoff state
+    /// Reading stops at the next message boundary
+    bool                    m_handoff_pausing;
+    /// Reading stopped at a message boundary
+    bool                    m_handoff_paused;
+    /// The pending read was cancelled for the handoff
+    bool                    m_handoff_cancelled;
+    /// The cancelled read has not returned yet
+    bool                    m_handoff_abort_pending;
 };
 
 } // namespace websocketpp
@@ -298,6 +298,67 @@ void connection<config>::close(const close::status::value code,
     }
 }
 
+template <typename config>
+void connection<config>::pause_for_handoff() {
+    m_alog.write(log::alevel::devel,"connection pause_for_handoff");
+
+    if (m_state != session::state::open) {
+        return;
+    }
+
+    m_handoff_pausing = true;
+
+    if (m_handoff_paused || m_handoff_cancelled) {
+        return;
+    }
+
+    {
+        scoped_lock_type lock(m_write_lock);
+
+        // cancelling the socket would abort the write as well.
+        if (m_write_flag) {
+            return;
+        }
+    }
+
+    // the read pending returns with operation_aborted and handle_read_frame
+    // decides whether the stream is at a boundary.
+    m_handoff_cancelled = true;
+    m_handoff_abort_pending = true;
+    transport_con_type::cancel_socket();
+}
+
+template <typename config>
+bool connection<config>::ready_for_handoff() {
+    if (!m_handoff_paused || m_state != session::state::open) {
+        return false;
+    }
+
+    scoped_lock_type lock(m_write_lock);
+    return !m_write_flag && m_send_queue.empty();
+}
+
+template <typename config>
+void connection<config>::resume_after_handoff() {
+    m_alog.write(log::alevel::devel,"connection resume_after_handoff");
+
+    bool paused = m_handoff_paused;
+
+    m_handoff_pausing = false;
+    m_handoff_paused = false;
+    m_handoff_cancelled = false;
+
+    // a read still pending or aborted carries on by itself.
+    if (paused) {
+        transport_con_type::async_read_at_least(
+            1,
+            m_buf,
+            config::connection_read_buffer_size,
+            m_handle_read_frame
+        );
+    }
+}
+
 /// Trigger the on_interrupt handler
 /**
  * This is thread safe if the transport is thread safe
@@ -642,6 +703,72 @@ void connection<config>::handle_transport_init(lib::error_code const & ec) {
     }
 }
 
+template <typename config>
+lib::error_code connection<config>::adopt(std::string const & request) {
+    m_alog.write(log::alevel::devel,"connection adopt");
+
+    if (!m_is_server) {
+        return error::make_error_code(error::server_only);
+    }
+
+    try {
+        m_request.consume(request.data(),request.size());
+    } catch (http::exception &) {
+        return error::make_error_code(error::invalid_state);
+    }
+
+    if (!m_request.ready() || !processor::is_websocket_handshake(m_request)) {
+        return error::make_error_code(error::invalid_state);
+    }
+
+    m_processor = get_processor(processor::get_websocket_version(m_request));
+    if (!m_processor) {
+        return error::make_error_code(error::general);
+    }
+    m_uri = m_processor->get_uri(m_request);
+
+    this->atomic_state_change(
+        istate::USER_INIT,
+        istate::TRANSPORT_INIT,
+        "Adopt must be called from user init state"
+    );
+
+    transport_con_type::init(
+        lib::bind(
+            &type::handle_adopt_init,
+            type::get_shared(),
+            lib::placeholders::_1
+        )
+    );
+    return lib::error_code();
+}
+
+template <typename config>
+void connection<config>::handle_adopt_init(lib::error_code const & ec) {
+    m_alog.write(log::alevel::devel,"connection handle_adopt_init");
+
+    if (ec) {
+        std::stringstream s;
+        s << "handle_adopt_init received error: "<< ec.message();
+        m_elog.write(log::elevel::fatal,s.str());
+
+        this->terminate(ec);
+        return;
+    }
+
+    // the handshake took place with the process that handed us the socket.
+    this->atomic_state_change(
+        istate::TRANSPORT_INIT,
+        istate::PROCESS_CONNECTION,
+        session::state::connecting,
+        session::state::open,
+        "handle_adopt_init must be called from transport init state"
+    );
+
+    m_buf_cursor = 0;
+    this->handle_read_frame(lib::error_code(), 0);
+}
+
 template <typename config>
 void connection<config>::read_handshake(size_t num_bytes) {
     m_alog.write(log::alevel::devel,"connection read");
@@ -821,7 +948,12 @@ void connection<config>::handle_read_frame(const lib::error_code& ec,
         "handle_read_frame must be called from PROCESS_CONNECTION state"
     );
 
-    if (ec) {
+    if (ec && m_handoff_abort_pending &&
+        ec == transport::error::operation_aborted)
+    {
+        // cancelled by pause_for_handoff, see below whether we may stop.
+        m_handoff_abort_pending = false;
+    } else if (ec) {
         if (ec == transport::error::eof) {
             if (m_state == session::state::closed) {
                 // we expect to get eof if the connection is closed already
@@ -931,6 +1063,14 @@ void connection<config>::handle_read_frame(const lib::error_code& ec,
         }
     }
 
+    if (m_handoff_pausing && m_state == session::state::open &&
+        m_processor->at_message_boundary())
+    {
+        // the rest of the stream is read by the process we are handed to.
+        m_handoff_paused = true;
+        return;
+    }
+
     transport_con_type::async_read_at_least(
         // std::min wont work with undefined static const values.
         // TODO: is there a more elegant way to do this?
@@ -472,6 +472,12 @@ public:
         return m_bytes_needed;
     }
 
+    bool at_message_boundary() const {
+        return m_state == HEADER_BASIC &&
+               m_bytes_needed == frame::BASIC_HEADER_LENGTH &&
+               !m_data_msg.msg_ptr && !m_permessage_deflate.is_enabled();
+    }
+
     /// Prepare a user data message for writing
     /**
      * Performs validation, masking, compression, etc. will return an error if
@@ -305,6 +305,19 @@ public:
         return 1;
     }
 
+    /// Tests whether the processor stopped between two messages
+    /**
+     * True when no part of a frame or a fragmented message is held and no
+     * per-connection extension state is kept, so the rest of the stream can
+     * be read by a new processor, e.g. in another process the socket was
+     * handed to.
+     *
+     * @return Whether or not the stream is at a message boundary.
+     */
+    virtual bool at_message_boundary() const {
+        return false;
+    }
+
     /// Prepare a data message for writing
     /**
      * Performs validation, masking, compression, etc. will return an error if
@@ -106,7 +106,11 @@ public:
             con->start();
         }
 
-        // TODO: are there cases where we should terminate this loop?
+        // the acceptor was closed by stop_listening, e.g. on a handoff.
+        if (!transport_type::is_listening()) {
+            return;
+        }
+
         start_accept();
     }
 private:
@@ -777,6 +777,9 @@ protected:
         if (ec == boost::asio::error::eof) {
             m_read_handler(make_error_code(transport::error::eof),
             bytes_transferred);
+        } else if (ec == boost::asio::error::operation_aborted) {
+            m_read_handler(make_error_code(transport::error::operation_aborted),
+            bytes_transferred);
         } else if (ec.value() == 335544539) {
             m_read_handler(make_error_code(transport::error::tls_short_read),
             bytes_transferred);
@@ -273,6 +273,45 @@ public:
         ec = lib::error_code();
     }
 
+    /// Set up endpoint for listening on a socket already listening
+    /**
+     * The acceptor takes over a bound and listening socket, e.g. one handed
+     * over by another process. The endpoint must have been initialized by
+     * calling init_asio before listening.
+     *
+     * @param native A listening tcp socket, owned by the acceptor from now on.
+     * @param ec Set to indicate what error occurred, if any.
+     */
+    void listen_on_handle(int native, lib::error_code & ec)
+    {
+        if (m_state != READY) {
+            m_elog->write(log::elevel::library,
+                "asio::listen called from the wrong state");
+            using websocketpp::error::make_error_code;
+            ec = make_error_code(websocketpp::error::invalid_state);
+            return;
+        }
+
+        struct sockaddr_storage ss;
+        socklen_t sl = sizeof(ss);
+        if (::getsockname(native, reinterpret_cast<struct sockaddr *>(&ss), &sl) < 0) {
+            ec = make_error_code(error::pass_through);
+            return;
+        }
+        m_acceptor->assign(ss.ss_family == AF_INET6 ? boost::asio::ip::tcp::v6() :
+            boost::asio::ip::tcp::v4(), native);
+        m_state = LISTENING;
+        ec = lib::error_code();
+    }
+
+    /// Native handle of the listening socket, -1 when not listening
+    int get_listen_handle() const {
+        if (m_state != LISTENING) {
+            return -1;
+        }
+        return m_acceptor->native_handle();
+    }
+
     /// Set up endpoint for listening manually
     /**
      * Bind the internal acceptor using the settings specified by the endpoint e
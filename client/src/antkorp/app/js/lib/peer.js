@@ -192,6 +192,7 @@ Peer.prototype.onIceCandidate = function(event, obj) {
 	if (event.candidate) {
 		var jsonText = {
 			"service" : "rtc",
+			"relay" : obj.id, // relayed by the gateway, not the rtc service.
 			mesgtype : "event",
 			"eventtype" : "candidate_event",
 			"candobj" : {
@@ -314,6 +315,7 @@ Peer.prototype._setLocalAndSendAnswer = function(sessionDescription) {
 	this.peerConn.setLocalDescription(sessionDescription);
 	var pickup = {
 		"service" : "rtc",
+		"relay" : this.id,
 		"mesgtype" : "response",
 		"response" : "answer",
 		answer : {
@@ -333,6 +335,7 @@ Peer.prototype._setLocalAndSendOffer = function(sessionDescription) {
 	var call = {
 
 		"service" : "rtc",
+		"relay" : this.id,
 		"mesgtype" : "request",
 		"request" : "offer",
 		offer : {
@@ -349,6 +352,7 @@ Peer.prototype.liftCall = function(constraints) {
 	// this.peerConn.setLocalDescription(sessionDescription);
 	var pickup = {
 		"service" : "rtc",
+		"relay" : this.id,
 		"mesgtype" : "response",
 		"response" : "pickup",
 		"pickup" : {
@@ -391,15 +395,14 @@ Peer.prototype.makeCall = function(constraints) {
 	return;
 }
 Peer.prototype.dropCall = function(constraints) {
-	var unique = akp_ws.createUUID();
-
+	// relayed as the event the caller gets.
 	var rejectObj = {
 		service : "rtc",
-		mesgtype : "response",
+		relay : this.id,
+		mesgtype : "event",
+		eventtype : "drop",
 		sndr : this.homeId,
-		rcpt : this.id,
-		response : "drop",
-		cookie : unique
+		rcpt : this.id
 	}
 
 	this.audioonly = false;
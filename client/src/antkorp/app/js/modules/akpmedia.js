@@ -572,12 +572,12 @@ define(
 
 			function terminateCall() {
 				if (mediaStatus == "inCall" || mediaStatus == "dialing") {
-					var unique = akp_ws.createUUID();
+					// relayed as the event the peer gets.
 					var obj = {
 						service : "rtc",
-						mesgtype : "request",
-						request : "bye",
-						cookie : unique,
+						relay : sessionUser,
+						mesgtype : "event",
+						eventtype : "bye",
 						sndr : auth.loginuserid,
 						rcpt : sessionUser
 					}
@@ -855,6 +855,11 @@ define(
 			function handleRtcMessage(msg) {
 				// console.log("message Recieved from Rtc service:");
 				// console.log(msg_obj);
+				if (msg.relayfrom !== undefined && msg.relayfrom != sessionUser) {
+					// call signaling relayed by someone we are not in a call with.
+					console.error("dropped rtc message relayed from " + msg.relayfrom);
+					return;
+				}
 				var mesgtype = msg.mesgtype;
 				switch (mesgtype) {
 				case "event":
@@ -117,6 +117,7 @@ define("socketModule",[],function() {
 				this.clientidRecvd = false;
 				this.svcstatus = {};
 				this.regServices = {};
+				this.svcids = {}; // compact service ids from the handshake.
 				this.respondTimer;
 				
 				//For HTTPS :443;
@@ -263,10 +264,20 @@ define("socketModule",[],function() {
 
 				var service = obj.service;
 
-				
+				if (obj.relay) {
+					// addressed to another user, the gateway relays it 
+					// straight to the user without going to the service.
+					var rcpt = obj.relay;
+					delete obj.relay;
+					return this.relayBuffer(rcpt, obj);
+				}
 				
 				delete obj.service;
 
+				// the gateway routes on the id, the name works as well.
+				if (this.svcids[service])
+					service = "#" + this.svcids[service];
+
 				var jsonstring = JSON.stringify(obj);
 				var sendBuffer = new ArrayBuffer(jsonstring.length + 4 + 32);
 				var dv = new DataView(sendBuffer);
@@ -297,6 +308,42 @@ define("socketModule",[],function() {
 				return;
 
 			}
+			// services a frame relayed from another user may be for, each
+			// returns the user the frame says it is from.
+			socketModule.prototype.relaySenders = {
+				rtc : function(msg) {
+					var body = msg.candobj || msg.offer || msg.answer;
+					if (body)
+						return body.sndr;
+					if (msg.pickup)
+						return msg.pickup.callee;
+					return msg.sndr;
+				}
+			};
+
+			socketModule.prototype.relayBuffer = function(rcpt, obj) {
+				// buffer contains "relay,rcpt,jsonstr", the service stays
+				// in the jsonstr for the recipient to dispatch it.
+				var jsonstring = JSON.stringify(obj);
+				var sendBuffer = new ArrayBuffer(jsonstring.length + 4 + 4 + 32);
+				var dv = new DataView(sendBuffer);
+				var service = "relay";
+				for ( var i = 0; i < 32; i++) {
+					dv.setUint8(i, (i < service.length) ? service.charCodeAt(i) : 32);
+				}
+				dv.setInt32(32, jsonstring.length + 4);
+				dv.setInt32(36, rcpt);
+				for ( var i = 0; i < jsonstring.length; i++) {
+					dv.setUint8(i + 40, jsonstring.charCodeAt(i));
+				}
+				try {
+					this.ws.send(sendBuffer);
+				} catch (e) {
+					console.log("cannot send msgs through connection.");
+				}
+				return;
+			}
+
 			socketModule.prototype.toJSON = function(buffer) {
 
 				// converting Buffer to JSON
@@ -308,20 +355,27 @@ define("socketModule",[],function() {
 					service += String.fromCharCode(dv.getUint8(i));
 				}
 				var svcmsgLen = dv.getInt32(32, false);
+				// relayed from another user, sender uid precedes the jsonstr.
+				var relay = (service.indexOf("relay") == 0);
 				var jsonstr = "";
-				for ( var i = 36; i < buffer.byteLength; i++) {
+				for ( var i = (relay ? 40 : 36); i < buffer.byteLength; i++) {
 					jsonstr += String.fromCharCode(dv.getUint8(i));
 				}
 				// console.log(jsonstr);
 				var obj;
 				try {
 					obj = JSON.parse(jsonstr);
-					obj.service = service.toString().replace(
+					obj.service = relay ? obj.service : service.toString().replace(
 							/[\x00-\x1F\x80-\xFF]/g, "");
 				} catch (e) {
+					if (relay) {
+						// written by another user, never eval it.
+						console.error("NOT_JSON_DATA_Err: relayed data failed to parse");
+						return false;
+					}
 					try {
 						obj = eval('(' + jsonstr + ')');
-						obj.service = service.toString().replace(
+						obj.service = relay ? obj.service : service.toString().replace(
 								/[\x00-\x1F\x80-\xFF]/g, "");
 					} catch (e) {
 						console.error("NOT_JSON_DATA_Err: recieved data failed to parse");
@@ -332,6 +386,19 @@ define("socketModule",[],function() {
 					// return false;
 				}
 
+				if (relay) {
+					// the gateway vouches for the sender uid only, the service
+					// and the sender named in the payload are the user's word.
+					obj.relayfrom = dv.getInt32(36, false);
+					var sender = this.relaySenders[obj.service];
+					if (!sender || sender(obj) != obj.relayfrom) {
+						console.error("RELAY_Err: dropped a relayed frame for "
+								+ obj.service + " from " + obj.relayfrom);
+						return false;
+					}
+					delete obj.cookie; // never the answer to one of our requests.
+				}
+
 				// logger(obj);
 
 				return obj;
@@ -346,6 +413,11 @@ define("socketModule",[],function() {
 				if (!this.clientidRecvd) {
 					//this.clientid = msg.clientid;
 					this.clientidRecvd = true;
+					var list = msg.services_list || [];
+					for ( var i = 0; i < list.length; i++) {
+						if (list[i].id)
+							this.svcids[list[i].service] = list[i].id;
+					}
 					this.statusupdate.call(this.handleObj, {
 						status : "clientRegistered",
 						data:msg,
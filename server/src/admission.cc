@@ -0,0 +1,160 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+#include <time.h>
+#include <math.h>
+#include <algorithm>
+#include "admission.hh"
+
+uint64_t
+admissionControl::now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+tokenBucket::tokenBucket(double rate, double burst) :
+    _rate(rate),
+    _burst(std::max(burst, 1.0)),
+    _tokens(_burst),
+    _last(admissionControl::now())
+{
+    return;
+}
+
+void
+tokenBucket::refill(uint64_t now)
+{
+    if(now <= _last) return;
+    _tokens = std::min(_burst, _tokens + (now - _last) * _rate / 1000.0);
+    _last = now;
+    return;
+}
+
+bool
+tokenBucket::available(uint64_t now)
+{
+    if(!limited()) return true;
+    refill(now);
+    return _tokens >= 1.0;
+}
+
+void
+tokenBucket::take(void)
+{
+    if(limited()) _tokens -= 1.0;
+    return;
+}
+
+uint64_t
+tokenBucket::retryAfter(uint64_t now)
+{
+    if(!available(now)) return (uint64_t)ceil((1.0 - _tokens) * 1000.0 / _rate);
+    return 0;
+}
+
+bool
+tokenBucket::full(uint64_t now)
+{
+    if(!limited()) return true;
+    refill(now);
+    return _tokens >= _burst;
+}
+
+admissionControl::admissionControl(double userRate, double userBurst, unsigned int maxInflight) :
+    _userRate(userRate),
+    _userBurst(userBurst),
+    _maxInflight(maxInflight)
+{
+    return;
+}
+
+void
+admissionControl::setServiceRate(int svcid, double rate, double burst)
+{
+    if((size_t)svcid >= _services.size()){
+        _services.resize(svcid + 1);
+        _counters.resize(svcid + 1);
+    }
+    _services[svcid] = tokenBucket(rate, burst);
+    return;
+}
+
+int
+admissionControl::admit(int userKey, int svcid, unsigned int inflight, uint64_t &retryAfter)
+{
+    if((size_t)svcid >= _services.size()) setServiceRate(svcid, 0, 0);
+    admissionCounters &c = _counters[svcid];
+    if(_maxInflight && (inflight >= _maxInflight)){
+        c.inflight++;
+        return BUSY_INFLIGHT;
+    }
+    uint64_t t = now();
+    tokenBucket *user = nullptr;
+    if(_userRate > 0){
+        auto itr = _users.find(userKey);
+        if(itr == _users.end()) itr = _users.insert(std::make_pair(userKey, tokenBucket(_userRate, _userBurst))).first;
+        user = &itr->second;
+        if(!user->available(t)){
+            retryAfter = user->retryAfter(t);
+            c.userRate++;
+            return BUSY_USER_RATE;
+        }
+    }
+    tokenBucket &svc = _services[svcid];
+    if(!svc.available(t)){ //the token of the user is kept, it was not used.
+        retryAfter = svc.retryAfter(t);
+        c.serviceRate++;
+        return BUSY_SERVICE_RATE;
+    }
+    if(user) user->take();
+    svc.take();
+    c.admitted++;
+    return ADMIT;
+}
+
+void
+admissionControl::forgetUser(int userKey)
+{
+    _users.erase(userKey);
+    return;
+}
+
+void
+admissionControl::sweep(void)
+{
+    uint64_t t = now();
+    for(auto itr = _users.begin(); itr != _users.end(); ){
+        if(itr->second.full(t)) itr = _users.erase(itr);
+        else itr++;
+    }
+    return;
+}
+
+const admissionCounters&
+admissionControl::counters(int svcid)
+{
+    if((size_t)svcid >= _counters.size()) setServiceRate(svcid, 0, 0);
+    return _counters[svcid];
+}
+
+const char*
+admissionControl::reason(int verdict)
+{
+    switch(verdict){
+        case BUSY_USER_RATE: return "user_rate";
+        case BUSY_SERVICE_RATE: return "service_rate";
+        case BUSY_INFLIGHT: return "inflight";
+        default: return "";
+    }
+}
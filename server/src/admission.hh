@@ -0,0 +1,80 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+//admission control of the client requests in the gateway. a request is let
+//through to its service if the client has less than the allowed requests in
+//flight and both the bucket of the user and the bucket of the service have a
+//token. a bucket refills at its rate up to its burst, a rate of 0 is no limit.
+//users not logged in yet are keyed by the negated client id.
+#ifndef __INC_ADMISSION_HH
+#define __INC_ADMISSION_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <vector>
+
+class tokenBucket
+{
+    double _rate = 0; //tokens per second.
+    double _burst = 0;
+    double _tokens = 0;
+    uint64_t _last = 0; //milliseconds, last refill.
+
+    void refill(uint64_t now);
+
+    public:
+    tokenBucket(double rate = 0, double burst = 0);
+    bool limited(void) { return _rate > 0; }
+    bool available(uint64_t now);
+    void take(void);
+    uint64_t retryAfter(uint64_t now); //milliseconds till the next token.
+    bool full(uint64_t now);
+};
+
+typedef struct admissionCounters
+{
+    uint64_t admitted = 0;
+    uint64_t userRate = 0; //turned away, the user went over its rate.
+    uint64_t serviceRate = 0; //turned away, the service went over its rate.
+    uint64_t inflight = 0; //turned away, too many requests of the client in flight.
+}admissionCounters;
+
+class admissionControl
+{
+    double _userRate, _userBurst;
+    unsigned int _maxInflight;
+    std::map<int, tokenBucket> _users;
+    std::vector<tokenBucket> _services; //by interned service id.
+    std::vector<admissionCounters> _counters; //by interned service id.
+
+    public:
+    enum
+    {
+        ADMIT = 0,
+        BUSY_USER_RATE = 1,
+        BUSY_SERVICE_RATE = 2,
+        BUSY_INFLIGHT = 3,
+    };
+    admissionControl(double userRate, double userBurst, unsigned int maxInflight);
+    void setServiceRate(int svcid, double rate, double burst);
+    //ADMIT or why not, retryAfter is set when turned away on a rate.
+    int admit(int userKey, int svcid, unsigned int inflight, uint64_t &retryAfter);
+    void forgetUser(int userKey);
+    void sweep(void); //drop the buckets of the users back to full.
+    const admissionCounters& counters(int svcid);
+    size_t services(void) { return _counters.size(); }
+    static const char* reason(int);
+    static uint64_t now(void);
+};
+
+#endif
@@ -16,9 +16,13 @@
 #define AKORP_SVC_ENDPOINT "/tmp/akorp_svc_endpoint"
 #define AKORP_GW_ENDPOINT  "akorp_gw_endpoint"
 #define AKORP_GW_MQ_NAME   "/ngw.mq"
+#define AKORP_NGW_RUNTIME_DIR "/var/run/antkorp" //private to the user of the gateway and services, mode 0700.
+#define AKORP_NGW_HANDOFF_ENDPOINT "ngw_handoff" //in the runtime directory.
+#define AKORP_METRICS_ENDPOINT_PREFIX "akorp_metrics." //in the runtime directory.
 
 #define FILE_MANAGER_SERVICE_TAG "fmgr"
 #define DOC_MANAGER_SERVICE_TAG  "dmgr"
+#define RELAY_SERVICE_TAG        "relay"
 
 #define OPTIMAL_BUF_SIZE 		 (1024*256)
 #define AKORP_OBJECT_CACHE 	"akorp_object_cache1" 
@@ -31,6 +35,17 @@
 #define OCACHE_GNAME_MAP_LOCK 	"ocache_gname_map_lock"
 #define OCACHE_MEMBERSHIP_MAP   "ocache_membership_map"
 #define OCACHE_MEMBERSHIP_MAP_LOCK "ocache_membership_map_lock"
+#define OCACHE_COUNTER_TABLE    "ocache_counter_table"
+#define OCACHE_COUNTER_TABLE_LOCK "ocache_counter_table_lock"
+#define OCACHE_COUNTER_SLOTS    (64*1024)
+#define OCACHE_COUNTER_KEY_LEN  (64)
+#define OCACHE_EVENT_LOG        "ocache_event_log"
+#define OCACHE_EVENT_LOG_LOCK   "ocache_event_log_lock"
+#define OCACHE_EVENT_LOG_DEPTH  (256)        //events kept per user.
+#define OCACHE_EVENT_LOG_BYTES  (256*1024)   //bytes kept per user.
+#define OCACHE_EVENT_LOG_TOTAL_BYTES (1024*1024*48) //bytes kept for all the users.
+#define AKORP_EVENT_LOG_CACHE   "akorp_event_log_cache1" //the event log has a segment of its own.
+#define AKORP_EVENT_LOG_CACHE_SIZE (1024*1024*64)
 #define MAX_SERVICE_NAME_LEN	 (32)
 #define MAX_GROUPS_PER_USER		 (128)
 #define POPEN_PARENT_CHILD_SYNCH_MUTEX_NAME "popenSynchMutex"
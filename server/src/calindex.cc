@@ -0,0 +1,256 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <algorithm>
+#include <limits>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include "calindex.hh"
+
+bool
+calEvent::visibleTo(int uid) const
+{
+    return (ownerUid == uid) || invited.count(uid);
+}
+
+bool
+calEvent::attendedBy(int uid) const
+{
+    return (ownerUid == uid) || (invited.count(uid) && !denied.count(uid));
+}
+
+static bool
+startsBefore(const calOccurrence &a, const calOccurrence &b)
+{
+    return a.tstart < b.tstart;
+}
+
+calendarIndex::intervalMap::interval_type
+calendarIndex::span(time_t tstart, time_t tend)
+{
+    return intervalMap::interval_type::closed(tstart, std::max(tstart, tend));
+}
+
+//the clones of a recurring event are generated till the end of the year of its
+//first occurrence (see recurdaily() and friends in luacal.cc).
+time_t
+calendarIndex::horizon(const calEvent &e)
+{
+    boost::posix_time::ptime start = boost::posix_time::from_time_t(e.tstart);
+    boost::posix_time::ptime nextYear(boost::gregorian::date(start.date().year() + 1, 1, 1));
+    return boost::posix_time::to_time_t(nextYear);
+}
+
+time_t
+calendarIndex::nthStart(const calEvent &e, long n)
+{
+    switch(e.recurring)
+    {
+        case CAL_RECUR_DAILY:
+            return e.tstart + n * 86400;
+        case CAL_RECUR_WEEKLY:
+            return e.tstart + n * 7 * 86400;
+        case CAL_RECUR_MONTHLY:
+            {
+                boost::posix_time::ptime start = boost::posix_time::from_time_t(e.tstart);
+                boost::gregorian::date d = start.date() + boost::gregorian::months(n);
+                return boost::posix_time::to_time_t(boost::posix_time::ptime(d, start.time_of_day()));
+            }
+    }
+    return e.tstart;
+}
+
+//end of the window starting at from that the rules are expanded over.
+time_t
+calendarIndex::expandEnd(time_t from, time_t to)
+{
+    if(from > std::numeric_limits<time_t>::max() - CAL_MAX_EXPAND_SPAN) return to;
+    return std::min(to, from + CAL_MAX_EXPAND_SPAN);
+}
+
+//occurrences past the horizon starting within [from, to], at most limit of them.
+void
+calendarIndex::expand(const calEvent &e, time_t from, time_t to, size_t limit,
+        std::vector<calOccurrence> &out)
+{
+    if(e.recurring == CAL_RECUR_NONE) return;
+    time_t lo = std::max(from, horizon(e));
+    if(lo > to) return;
+    long n = 1;
+    //jump close to the first occurrence instead of walking from the first one.
+    if(e.recurring == CAL_RECUR_MONTHLY){
+        boost::gregorian::date a = boost::posix_time::from_time_t(e.tstart).date();
+        boost::gregorian::date b = boost::posix_time::from_time_t(lo).date();
+        n = std::max(1L, (long)((b.year() - a.year()) * 12 + b.month() - a.month() - 1));
+    }else{
+        time_t period = (e.recurring == CAL_RECUR_DAILY) ? 86400 : 7 * 86400;
+        n = std::max(1L, (long)((lo - e.tstart) / period));
+    }
+    time_t duration = std::max((time_t)0, e.tend - e.tstart);
+    size_t count = 0;
+    for(time_t start = nthStart(e, n); (start <= to) && (count < limit); start = nthStart(e, ++n)){
+        if(start < lo) continue;
+        calOccurrence o;
+        o.id = e.id;
+        o.tstart = start;
+        o.tend = start + duration;
+        o.expanded = true;
+        out.push_back(o);
+        count++;
+    }
+    return;
+}
+
+void
+calendarIndex::put(const calEvent &e)
+{
+    remove(e.id);
+    _events[e.id] = e;
+    groupIndex &g = _groups[e.ownerGid];
+    std::set<std::string> ids;
+    ids.insert(e.id);
+    g.spans += std::make_pair(span(e.tstart, e.tend), ids);
+    g.starts.insert(std::make_pair(e.tstart, e.id));
+    if(e.recurring != CAL_RECUR_NONE) g.recurring.insert(e.id);
+    return;
+}
+
+void
+calendarIndex::remove(const std::string &id)
+{
+    auto itr = _events.find(id);
+    if(itr == _events.end()) return;
+    const calEvent &e = itr->second;
+    groupIndex &g = _groups[e.ownerGid];
+    std::set<std::string> ids;
+    ids.insert(id);
+    g.spans -= std::make_pair(span(e.tstart, e.tend), ids);
+    g.starts.erase(std::make_pair(e.tstart, id));
+    g.recurring.erase(id);
+    _events.erase(itr);
+    return;
+}
+
+std::vector<calOccurrence>
+calendarIndex::range(int gid, int uid, bool personal, time_t tstart, time_t tend)
+{
+    std::vector<calOccurrence> out;
+    auto gitr = _groups.find(gid);
+    if(gitr == _groups.end()) return out;
+    groupIndex &g = gitr->second;
+
+    std::set<std::string> ids;
+    auto segments = g.spans.equal_range(span(tstart, tend));
+    for(auto itr = segments.first; itr != segments.second; ++itr)
+        ids.insert(itr->second.begin(), itr->second.end());
+    for(auto &id : ids){
+        const calEvent &e = _events[id];
+        if((e.personal != personal) || !e.visibleTo(uid)) continue;
+        if((e.tstart < tstart) || (e.tend > tend)) continue;
+        calOccurrence o;
+        o.id = id;
+        o.tstart = e.tstart;
+        o.tend = e.tend;
+        out.push_back(o);
+    }
+
+    time_t expandTo = expandEnd(tstart, tend);
+    for(auto &id : g.recurring){
+        const calEvent &e = _events[id];
+        if((e.personal != personal) || !e.visibleTo(uid)) continue;
+        std::vector<calOccurrence> expanded;
+        expand(e, tstart, expandTo, CAL_MAX_OCCURRENCES, expanded);
+        for(auto &o : expanded) if(o.tend <= tend) out.push_back(o);
+    }
+    std::sort(out.begin(), out.end(), startsBefore);
+    if(out.size() > CAL_MAX_OCCURRENCES) out.resize(CAL_MAX_OCCURRENCES);
+    return out;
+}
+
+std::vector<calOccurrence>
+calendarIndex::upcoming(int gid, int uid, bool personal, time_t from, size_t limit)
+{
+    std::vector<calOccurrence> out;
+    auto gitr = _groups.find(gid);
+    if(gitr == _groups.end()) return out;
+    groupIndex &g = gitr->second;
+    limit = std::min(limit, (size_t)CAL_MAX_OCCURRENCES);
+
+    for(auto itr = g.starts.lower_bound(std::make_pair(from, std::string()));
+            (itr != g.starts.end()) && (out.size() < limit); ++itr){
+        const calEvent &e = _events[itr->second];
+        if((e.personal != personal) || !e.visibleTo(uid)) continue;
+        calOccurrence o;
+        o.id = e.id;
+        o.tstart = e.tstart;
+        o.tend = e.tend;
+        out.push_back(o);
+    }
+
+    for(auto &id : g.recurring){
+        const calEvent &e = _events[id];
+        if((e.personal != personal) || !e.visibleTo(uid)) continue;
+        expand(e, from, expandEnd(from, std::numeric_limits<time_t>::max()), limit, out);
+    }
+    std::sort(out.begin(), out.end(), startsBefore);
+    if(out.size() > limit) out.resize(limit);
+    return out;
+}
+
+std::map<int, calBusyList>
+calendarIndex::freeBusy(int gid, const std::vector<int> &uids, time_t tstart, time_t tend)
+{
+    std::map<int, calBusyList> busy;
+    for(auto uid : uids) busy[uid];
+    tend = expandEnd(tstart, tend);
+    auto gitr = _groups.find(gid);
+    if(gitr == _groups.end()) return busy;
+    groupIndex &g = gitr->second;
+
+    //every occurrence overlapping the window, with the event it belongs to.
+    std::vector<std::pair<const calEvent*, calOccurrence>> overlapping;
+    std::set<std::string> ids;
+    auto segments = g.spans.equal_range(span(tstart, tend));
+    for(auto itr = segments.first; itr != segments.second; ++itr)
+        ids.insert(itr->second.begin(), itr->second.end());
+    for(auto &id : ids){
+        const calEvent &e = _events[id];
+        calOccurrence o;
+        o.id = id;
+        o.tstart = e.tstart;
+        o.tend = e.tend;
+        overlapping.push_back(std::make_pair(&e, o));
+    }
+    for(auto &id : g.recurring){
+        const calEvent &e = _events[id];
+        std::vector<calOccurrence> expanded;
+        expand(e, tstart - std::max((time_t)0, e.tend - e.tstart), tend,
+                CAL_MAX_OCCURRENCES, expanded);
+        for(auto &o : expanded) overlapping.push_back(std::make_pair(&e, o));
+    }
+
+    for(auto &b : busy){
+        calBusyList spans;
+        for(auto &ev : overlapping){
+            if(!ev.first->attendedBy(b.first)) continue;
+            spans.push_back(std::make_pair(std::max(ev.second.tstart, tstart),
+                        std::min(ev.second.tend, tend)));
+        }
+        std::sort(spans.begin(), spans.end());
+        for(auto &s : spans){
+            if(!b.second.empty() && (s.first <= b.second.back().second))
+                b.second.back().second = std::max(b.second.back().second, s.second);
+            else
+                b.second.push_back(s);
+        }
+    }
+    return busy;
+}
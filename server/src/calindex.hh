@@ -0,0 +1,101 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//in memory index of the calendar events of every group.
+//each group keeps an interval map from time to the events spanning it and the
+//events ordered by their start, range, upcoming and free/busy queries are
+//answered from it without going to the database. recurring events are stored
+//once with their rule, the clones materialized in the database cover the year
+//of the first occurrence and the occurrences after it are expanded on demand.
+#ifndef __INC_CALINDEX_HH
+#define __INC_CALINDEX_HH
+
+#include <time.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <utility>
+#include <boost/icl/interval_map.hpp>
+
+#define CAL_MAX_EXPAND_SPAN (366*86400) //recurring events are expanded over at most this much of a query.
+#define CAL_MAX_OCCURRENCES 1000 //occurrences a query returns at most.
+
+enum
+{
+    CAL_RECUR_NONE,
+    CAL_RECUR_DAILY,
+    CAL_RECUR_WEEKLY,
+    CAL_RECUR_MONTHLY,
+};
+
+typedef struct calEvent
+{
+    std::string id;
+    int ownerUid = 0;
+    int ownerGid = 0;
+    bool personal = false;
+    time_t tstart = 0;
+    time_t tend = 0;
+    int recurring = CAL_RECUR_NONE; //set only when the occurrences are to be expanded.
+    std::set<int> invited;
+    std::set<int> denied;
+    bool visibleTo(int uid) const;
+    bool attendedBy(int uid) const;
+}calEvent;
+
+typedef struct calOccurrence
+{
+    std::string id;
+    time_t tstart = 0;
+    time_t tend = 0;
+    bool expanded = false; //not in the database, generated from the rule.
+}calOccurrence;
+
+typedef std::vector<std::pair<time_t, time_t>> calBusyList;
+
+class calendarIndex
+{
+    typedef boost::icl::interval_map<time_t, std::set<std::string>> intervalMap;
+
+    typedef struct groupIndex
+    {
+        intervalMap spans;
+        std::set<std::pair<time_t, std::string>> starts;
+        std::set<std::string> recurring;
+    }groupIndex;
+
+    std::map<int, groupIndex> _groups;
+    std::map<std::string, calEvent> _events;
+
+    static intervalMap::interval_type span(time_t tstart, time_t tend);
+    static time_t horizon(const calEvent &e);
+    static time_t nthStart(const calEvent &e, long n);
+    static time_t expandEnd(time_t from, time_t to);
+    static void expand(const calEvent &e, time_t from, time_t to, size_t limit,
+            std::vector<calOccurrence> &out);
+
+    public:
+    void put(const calEvent &e);
+    void remove(const std::string &id);
+    size_t size(void) const { return _events.size(); }
+    //occurrences lying within [tstart, tend] ordered by start, the ones expanded
+    //from the rules only within CAL_MAX_EXPAND_SPAN of tstart.
+    std::vector<calOccurrence> range(int gid, int uid, bool personal, time_t tstart, time_t tend);
+    //first limit occurrences starting at or after from, the ones expanded from
+    //the rules only within CAL_MAX_EXPAND_SPAN of from.
+    std::vector<calOccurrence> upcoming(int gid, int uid, bool personal, time_t from, size_t limit);
+    //merged busy intervals of each user clipped to [tstart, tend], the window
+    //is cut to CAL_MAX_EXPAND_SPAN.
+    std::map<int, calBusyList> freeBusy(int gid, const std::vector<int> &uids, time_t tstart, time_t tend);
+};
+
+#endif
@@ -12,6 +12,8 @@
 //utility which can simulate a client connection for simulating client activities 
 //can be used to create initial organization and user objects.
 #include <unistd.h>
+#include <fstream>
+#include <sys/resource.h>
 #include "clntsim.hh"
 #include "common.hh"
 
@@ -40,6 +42,12 @@ static std::string server, org = "", user, password, admin_passwd;
 static bool userAdd = false, orgAdd = false, orgDelete = false, userDelete = false, adminPasswdReset = false;
 static int respCount = 0;
 static int requestCount = 0;
+//idle connection benchmark, opens the connections and reads the resident 
+//memory of the gateway before and after.
+static int idleCount = 0, idleLaunched = 0, idleOpened = 0, idleFailed = 0;
+static int gatewayPid = 0;
+static long rssBefore = 0;
+#define IDLE_CONNECT_WINDOW (256) //connects in flight.
 
 #ifdef AKORP_SSL_CAPABLE
 static context_ptr 
@@ -172,6 +180,58 @@ on_message(client* c, websocketpp::connection_hdl hdl, message_ptr msg)
 }
 
 
+//resident memory of a process in kb, from /proc.
+static long
+residentKb(int pid)
+{
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while(std::getline(status, line))
+        if(line.compare(0, 6, "VmRSS:") == 0) return strtol(line.c_str() + 6, nullptr, 10);
+    return 0;
+}
+
+static void idleConnect(void);
+
+static void
+idleSettled(boost::system::error_code ec)
+{
+    long rssAfter = residentKb(gatewayPid);
+    std::cerr<<"\nidle connections: "<<idleOpened<<" failed: "<<idleFailed
+        <<" gateway rss before: "<<rssBefore<<"kb after: "<<rssAfter<<"kb";
+    if(idleOpened)
+        std::cerr<<" per 10k connections: "<<((rssAfter - rssBefore) * 10000 / idleOpened)<<"kb\n";
+    c.stop();
+    return;
+}
+
+static void
+idleDone(websocketpp::connection_hdl hdl, bool opened)
+{
+    if(opened) idleOpened++;
+    else idleFailed++;
+    if((idleOpened + idleFailed) == idleCount){
+        //let the gateway finish the handshakes and the service notifications.
+        responseWaitTimer->expires_from_now(boost::posix_time::seconds(5));
+        responseWaitTimer->async_wait(idleSettled);
+        return;
+    }
+    idleConnect();
+    return;
+}
+
+static void
+idleConnect(void)
+{
+    if(idleLaunched == idleCount) return;
+    websocketpp::lib::error_code ec;
+    client::connection_ptr con = c.get_connection(server, ec);
+    if(ec){ std::cerr<<"unable to create connection: "<<ec.message(); exit(-1); }
+    c.connect(con);
+    idleLaunched++;
+    return;
+}
+
 int
 main(int ac, char* av[]) 
 {
@@ -190,6 +250,8 @@ main(int ac, char* av[])
             ("user-delete", boost::program_options::value<std::string>(), "user name to be deleted.")
             ("admin-passwd-reset", boost::program_options::value<std::string>(), "admin password reset")
             ("password", boost::program_options::value<std::string>(), "password of the user for user creation/reset.")
+            ("idle", boost::program_options::value<int>(), "open these many idle connections and report the memory of the gateway.")
+            ("gateway-pid", boost::program_options::value<int>(), "pid of the gateway to measure with --idle.")
         ;
 
         boost::program_options::variables_map vm;
@@ -204,10 +266,31 @@ main(int ac, char* av[])
         if(vm.count("org-delete")){ org = vm["org-delete"].as<std::string>(); orgDelete = true; requestCount++; }
         if(vm.count("user-delete")){ user = vm["user-delete"].as<std::string>(); userDelete = true; requestCount++; }
         if(vm.count("admin-passwd-reset")){ admin_passwd = vm["admin-passwd-reset"].as<std::string>(); adminPasswdReset = true; requestCount++; }
+        if(vm.count("idle")) idleCount = vm["idle"].as<int>();
+        if(vm.count("gateway-pid")) gatewayPid = vm["gateway-pid"].as<int>();
         if (vm.count("help") || (ac == 1)){ std::cerr << desc << "\n"; return 0; }
+        if(idleCount && !gatewayPid){ std::cerr<<"--idle needs --gateway-pid"; return -1; }
 
         boost::asio::io_service iosvc;
         responseWaitTimer = new boost::asio::deadline_timer(iosvc);
+        if(idleCount){
+            struct rlimit lim;
+            _except(::getrlimit(RLIMIT_NOFILE, &lim));
+            lim.rlim_cur = lim.rlim_max;
+            _except(::setrlimit(RLIMIT_NOFILE, &lim));
+            c.clear_access_channels(websocketpp::log::alevel::all);
+            c.init_asio(&iosvc);
+#ifdef AKORP_SSL_CAPABLE
+            c.set_tls_init_handler(bind(&on_tls_init, ::_1));
+#endif
+            c.set_open_handler(bind(&idleDone, ::_1, true));
+            c.set_fail_handler(bind(&idleDone, ::_1, false));
+            server = uri + server + "/services=ngw,auth,fmgr,kons,rtc,calendar";
+            rssBefore = residentKb(gatewayPid);
+            for(int i = 0; i < IDLE_CONNECT_WINDOW; i++) idleConnect();
+            c.run();
+            return 0;
+        }
         responseWaitTimer->expires_from_now(boost::posix_time::seconds(3));
         responseWaitTimer->async_wait(timeout_handler);
         c.init_asio(&iosvc);
@@ -0,0 +1,222 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <boost/program_options.hpp>
+#include "gwcluster.hh"
+
+//runs several gateway cluster nodes over loopback in one process. every node
+//holds its own users, the nodes find each other through configured peers and
+//announcements, then every node sends a message to every user held elsewhere
+//and a broadcast, a node is stopped and a user moves between nodes.
+typedef struct simNode
+{
+    gatewayCluster *cluster = nullptr;
+    std::vector<int> uids;
+    std::map<int, uint64_t> recvd; //uid to messages delivered for it.
+    uint64_t broadcasts = 0;
+}simNode;
+
+static bool
+runUntil(boost::asio::io_service &iosvc, std::function<bool()> done, int secs = 5)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(secs);
+    while(!done()){
+        if(std::chrono::steady_clock::now() > deadline) return false;
+        if(!iosvc.poll()) usleep(1000);
+        iosvc.reset();
+    }
+    return true;
+}
+
+int
+main(int ac, char* av[])
+{
+    try
+    {
+        int count = 4, users = 50, messages = 10;
+        boost::program_options::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("gateways", boost::program_options::value<int>(), "gateways in the cluster, default 4.")
+            ("users", boost::program_options::value<int>(), "users logged in on every gateway, default 50.")
+            ("messages", boost::program_options::value<int>(), "messages sent to every remote user, default 10.")
+        ;
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(ac, av, desc), vm);
+        boost::program_options::notify(vm);
+        if(vm.count("help")){ std::cerr << desc << "\n"; return 0; }
+        if(vm.count("gateways")) count = vm["gateways"].as<int>();
+        if(vm.count("users")) users = vm["users"].as<int>();
+        if(vm.count("messages")) messages = vm["messages"].as<int>();
+        if((count < 3) || (users < 1)){
+            std::cerr<<"need at least 3 gateways and 1 user per gateway\n";
+            return -1;
+        }
+
+        boost::asio::io_service iosvc;
+        std::vector<simNode> sims(count);
+        for(int i = 0; i < count; i++){
+            simNode &n = sims[i];
+            n.cluster = new gatewayCluster(iosvc, "127.0.0.1", 0, "clustersim");
+            n.cluster->setUserDelivery([&n](int uid, const char *frame, size_t len){ n.recvd[uid]++; });
+            n.cluster->setBroadcastDelivery([&n](const std::string &svcname, const char *frame, size_t len){
+                    if(svcname == "kons") n.broadcasts++; });
+            for(int u = 1; u <= users; u++){
+                n.uids.push_back(i * 100000 + u);
+                n.cluster->userOnline(n.uids.back());
+            }
+        }
+        //every gateway is configured with the ones before it and hears the
+        //announcements of the ones after it, so most pairs dial each other.
+        for(int i = 0; i < count; i++)
+            for(int j = 0; j < i; j++){
+                sims[i].cluster->addPeer(sims[j].cluster->getId());
+                sims[j].cluster->handleAnnouncement(sims[i].cluster->announcement().data(),
+                        sims[i].cluster->announcement().length());
+            }
+
+        bool ok = true;
+        auto allLinked = [&](){
+            for(auto &n : sims){
+                if(n.cluster->peerCount() != (size_t)(count - 1)) return false;
+                for(auto &m : sims) if((&m != &n) && !n.cluster->isRemoteUser(m.uids.back())) return false;
+            }
+            return true;
+        };
+        auto start = std::chrono::steady_clock::now();
+        if(!runUntil(iosvc, allLinked)){
+            std::cerr<<"gateways did not form the cluster\n";
+            return -1;
+        }
+
+        std::string frame(256, 'x');
+        for(int r = 0; r < messages; r++)
+            for(auto &n : sims)
+                for(auto &m : sims){
+                    if(&m == &n) continue;
+                    for(int uid : m.uids)
+                        if(!n.cluster->sendToUser(uid, frame.data(), frame.length())){
+                            std::cerr<<"no route to uid: "<<uid<<"\n";
+                            ok = false;
+                        }
+                }
+        for(auto &n : sims) n.cluster->broadcast("kons", frame.data(), frame.length());
+        uint64_t expected = (uint64_t)messages * (count - 1);
+        runUntil(iosvc, [&](){
+                for(auto &n : sims){
+                    if(n.broadcasts != (uint64_t)(count - 1)) return false;
+                    for(int uid : n.uids) if(n.recvd[uid] != expected) return false;
+                }
+                return true; });
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for(auto &n : sims){
+            uint64_t total = 0;
+            for(int uid : n.uids){
+                total += n.recvd[uid];
+                if(n.recvd[uid] != expected) ok = false;
+            }
+            if(n.broadcasts != (uint64_t)(count - 1)) ok = false;
+            std::cerr<<"gateway: "<<n.cluster->getId()<<" peers: "<<n.cluster->peerCount()
+                <<" user messages: "<<total<<" expected: "<<expected * n.uids.size()
+                <<" broadcasts: "<<n.broadcasts<<" expected: "<<count - 1<<"\n";
+        }
+
+        //a gateway without the secret gets nowhere.
+        {
+            gatewayCluster intruder(iosvc, "127.0.0.1", 0, "not the secret");
+            intruder.userOnline(999999);
+            intruder.addPeer(sims[0].cluster->getId());
+            for(int k = 0; k < 100; k++){ iosvc.poll(); iosvc.reset(); usleep(1000); }
+            if(intruder.peerCount() || sims[0].cluster->isRemoteUser(999999) ||
+                    (sims[0].cluster->peerCount() != (size_t)(count - 1))){
+                std::cerr<<"gateway without the cluster secret was let in\n";
+                ok = false;
+            }
+        }
+
+        //a connection that never authenticates and one that sends a big frame
+        //before it authenticates are both dropped.
+        {
+            using boost::asio::ip::tcp;
+            std::string id = sims[0].cluster->getId();
+            tcp::endpoint ep(boost::asio::ip::address::from_string(id.substr(0, id.rfind(':'))),
+                    sims[0].cluster->getPort());
+            tcp::socket silent(iosvc), big(iosvc);
+            silent.connect(ep);
+            big.connect(ep);
+            uint32_t flen = htonl(GW_CLUSTER_HANDSHAKE_FRAME + 1);
+            std::string frame(reinterpret_cast<char*>(&flen), sizeof(flen));
+            frame.push_back((char)gatewayCluster::PEER_HELLO);
+            boost::asio::write(big, boost::asio::buffer(frame));
+            bool silentDropped = false, bigDropped = false;
+            char buf[256];
+            std::function<void(tcp::socket &, bool &)> drain = [&](tcp::socket &sock, bool &dropped){
+                sock.async_read_some(boost::asio::buffer(buf),
+                        [&](const boost::system::error_code &ec, size_t){
+                            if(ec) dropped = true;
+                            else drain(sock, dropped); });
+            };
+            drain(silent, silentDropped);
+            drain(big, bigDropped);
+            if(!runUntil(iosvc, [&](){ return bigDropped; }, 2)){
+                std::cerr<<"big frame before the auth did not drop the link\n";
+                ok = false;
+            }
+            if(!runUntil(iosvc, [&](){ return silentDropped; }, GW_CLUSTER_HANDSHAKE_TIMEOUT + 5)){
+                std::cerr<<"link that never authenticated was kept\n";
+                ok = false;
+            }
+        }
+
+        //a user moves from the first gateway to the second one.
+        int moved = sims[0].uids.front();
+        sims[0].cluster->userOffline(moved);
+        sims[1].cluster->userOnline(moved);
+        sims[2].recvd.clear();
+        sims[1].recvd.clear();
+        //the del and the add come over different links, let both land.
+        for(int k = 0; k < 100; k++){ iosvc.poll(); iosvc.reset(); usleep(1000); }
+        sims[2].cluster->sendToUser(moved, frame.data(), frame.length());
+        if(!runUntil(iosvc, [&](){ return sims[1].recvd[moved] == 1; })){
+            std::cerr<<"message to the moved user was not delivered\n";
+            ok = false;
+        }
+
+        //the last gateway goes away, its users become unreachable.
+        int goneUid = sims.back().uids.front();
+        delete sims.back().cluster;
+        sims.pop_back();
+        if(!runUntil(iosvc, [&](){
+                    for(auto &n : sims) if(n.cluster->peerCount() != (size_t)(count - 2)) return false;
+                    return true; })){
+            std::cerr<<"gateways did not notice the stopped one\n";
+            ok = false;
+        }
+        for(auto &n : sims)
+            if(n.cluster->isRemoteUser(goneUid)){
+                std::cerr<<"users of the stopped gateway still routed\n";
+                ok = false;
+            }
+
+        std::cerr<<"relayed "<<expected * users * count<<" user messages over "<<count<<" gateways in "
+            <<secs<<" secs"<<(ok ? ", PASS" : ", FAIL")<<"\n";
+        for(auto &n : sims) delete n.cluster;
+        return ok ? 0 : -1;
+    }
+    catch (const std::exception &e){ std::cerr << e.what() << std::endl; return -1; }
+    return 0;
+}
@@ -9,6 +9,7 @@
  * written permission of Neptunium.
  ****************************************************************/
 
+#include <sys/stat.h>
 #include "common.hh"
 
 __thread char _estring[512];
@@ -650,3 +651,14 @@ isCapabilitySet(int caps)
     memset(&d, 0, sizeof(__user_cap_data_struct));
     return false;
 }
+
+//the runtime directory holds the unix endpoints of the daemons, it has to be
+//a directory of our user no one else can enter.
+bool
+privateDir(const std::string &dname)
+{
+    if((::mkdir(dname.c_str(), 0700) < 0) && (errno != EEXIST)) return false;
+    struct stat st;
+    return (::lstat(dname.c_str(), &st) == 0) && S_ISDIR(st.st_mode) &&
+        (st.st_uid == ::geteuid()) && !(st.st_mode & 077);
+}
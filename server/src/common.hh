@@ -294,4 +294,5 @@ bool isValidIpv4(std::string &);
 std::string num2String(int num);
 void setCapability(int);
 bool isCapabilitySet(int);
+bool privateDir(const std::string &); //created 0700, false unless it is ours and closed to others.
 #endif
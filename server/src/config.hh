@@ -29,6 +29,13 @@ getConfigValue(std::string attr)
 	return getPropertyTreeRef().get<T>(attr);
 }
 
+//same as above, the default is returned when the attribute is not configured.
+template<typename T> T 
+getConfigValue(std::string attr, T defval)
+{
+	return getPropertyTreeRef().get<T>(attr, defval);
+}
+
 template <typename T> T
 putConfigValue(std::string attr, T val)
 {
@@ -0,0 +1,217 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <iostream>
+#include <vector>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <boost/program_options.hpp>
+#include "ocache.hh"
+
+//evicts counters of the shared cache while another service increments them,
+//the way akorp_kons writes them back. a child process increments every
+//counter once per round after they were seeded and went idle. the parent
+//stops the child at random points and runs the write back with eviction over
+//the group of counters the child is in. a write back that does not return
+//means the child holds the pin of an increment on an idle counter, the parent
+//increments that counter as well and lets the child go on. an increment that
+//misses the cache is added to the simulated database, the write back sets it
+//to the dirty values it collects. after the round the database has to hold
+//every increment. the counters are under a prefix of their own in the cache
+//of the host.
+#define RACE_WAIT (20) //milliseconds a write back blocked on a pin takes at least.
+
+typedef struct simShared
+{
+    std::atomic<int> round;
+    std::atomic<int> done; //last round the child finished.
+    std::atomic<int> current; //counter the child is at.
+    std::atomic<int64_t> db[1];
+}simShared;
+
+static std::string
+counterKey(const std::string &prefix, int group, int index)
+{
+    return prefix + std::to_string(group) + "." + std::to_string(index);
+}
+
+//the write back, what collectDirtyCounters returned goes over the database.
+static void
+writeBack(simShared *shared, const std::string &prefix, int groupSize, int idleSecs)
+{
+    for(auto &kv : collectDirtyCounters(prefix, idleSecs)){
+        size_t dot = kv.first.rfind('.');
+        size_t gdot = kv.first.rfind('.', dot - 1);
+        int group = std::stoi(kv.first.substr(gdot + 1, dot - gdot - 1));
+        int index = std::stoi(kv.first.substr(dot + 1));
+        shared->db[group * groupSize + index].store(kv.second);
+    }
+}
+
+static void
+child(simShared *shared, const std::string &prefix, int groups, int groupSize)
+{
+    int round = 0;
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    while(true){
+        while(shared->round.load() == round) usleep(100);
+        round = shared->round.load();
+        if(round < 0) _exit(0);
+        for(int g = 0; g < groups; g++){
+            for(int i = 0; i < groupSize; i++){
+                shared->current.store(g * groupSize + i);
+                int64_t value;
+                if(!incrCounter(counterKey(prefix, g, i), 1, value)) shared->db[g * groupSize + i]++;
+            }
+        }
+        shared->done.store(round);
+    }
+}
+
+int
+main(int ac, char* av[])
+{
+    try
+    {
+        int groups = 1024, groupSize = 16, races = 8, rounds = 60;
+        boost::program_options::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("groups", boost::program_options::value<int>(), "groups of counters written back on their own, default 1024.")
+            ("group-size", boost::program_options::value<int>(), "counters in a group, default 16.")
+            ("races", boost::program_options::value<int>(), "evictions under an increment to go through, default 8.")
+            ("rounds", boost::program_options::value<int>(), "rounds at most, a little over a second each, default 60.")
+        ;
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(ac, av, desc), vm);
+        boost::program_options::notify(vm);
+        if(vm.count("help")){ std::cerr << desc << "\n"; return 0; }
+        if(vm.count("groups")) groups = vm["groups"].as<int>();
+        if(vm.count("group-size")) groupSize = vm["group-size"].as<int>();
+        if(vm.count("races")) races = vm["races"].as<int>();
+        if(vm.count("rounds")) rounds = vm["rounds"].as<int>();
+        if((groups < 1) || (groupSize < 1) || (races < 1) || (rounds < 1)){
+            std::cerr<<"need at least 1 group, 1 counter, 1 race and 1 round\n";
+            return -1;
+        }
+
+        int counters = groups * groupSize;
+        size_t sharedSize = sizeof(simShared) + counters * sizeof(std::atomic<int64_t>);
+        void *mem = ::mmap(nullptr, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED) throw std::runtime_error("unable to map the shared state");
+        simShared *shared = static_cast<simShared*>(mem);
+        std::string prefix = "countersim." + std::to_string(getpid()) + ".";
+        std::vector<int64_t> expected(counters, 0);
+        int64_t dummy;
+        getCounter(prefix + "0.0", dummy); //the table is there before the child.
+
+        pid_t pid = fork();
+        if(pid < 0) throw std::runtime_error("fork failed");
+        if(!pid) child(shared, prefix, groups, groupSize);
+
+        int raced = 0, attempts = 0, round = 0;
+        uint64_t lost = 0;
+        bool failed = false;
+        while((raced < races) && (round < rounds)){
+            //seed and let the counters go clean and idle.
+            for(int g = 0; g < groups; g++)
+                for(int i = 0; i < groupSize; i++)
+                    setCounter(counterKey(prefix, g, i), shared->db[g * groupSize + i].load());
+            writeBack(shared, prefix, groupSize, 0);
+            writeBack(shared, prefix, groupSize, 0);
+            time_t seeded = time(nullptr);
+            while(time(nullptr) <= seeded) usleep(1000);
+
+            shared->round.store(++round);
+            std::set<int> collected;
+            while(shared->done.load() != round){
+                usleep(50 + random() % 200);
+                ::kill(pid, SIGSTOP);
+                int status;
+                ::waitpid(pid, &status, WUNTRACED);
+                int current = shared->current.load();
+                int group = current / groupSize;
+                if(collected.count(group) || (shared->done.load() == round)){
+                    ::kill(pid, SIGCONT);
+                    continue;
+                }
+                collected.insert(group);
+                attempts++;
+                std::string groupPrefix = prefix + std::to_string(group) + ".";
+                std::atomic<bool> back(false);
+                std::thread collector([&](){
+                    writeBack(shared, groupPrefix, groupSize, 1);
+                    back.store(true);
+                });
+                auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(RACE_WAIT);
+                while(!back.load() && (std::chrono::steady_clock::now() < until)) usleep(500);
+                if(!back.load()){
+                    //the increment of the child is pinned on an idle counter
+                    //being evicted, one more comes from here.
+                    raced++;
+                    std::thread other([&](){
+                        int64_t value;
+                        std::string key = counterKey(prefix, group, current % groupSize);
+                        if(!incrCounter(key, 1, value)) shared->db[current]++;
+                    });
+                    usleep(RACE_WAIT * 1000);
+                    ::kill(pid, SIGCONT);
+                    other.join();
+                    expected[current]++;
+                }else{
+                    ::kill(pid, SIGCONT);
+                }
+                collector.join();
+            }
+            for(int c = 0; c < counters; c++) expected[c]++;
+            writeBack(shared, prefix, groupSize, 0);
+            for(int c = 0; c < counters; c++){
+                int64_t value = shared->db[c].load();
+                if(value == expected[c]) continue;
+                std::cerr<<"round "<<round<<" counter "<<c<<" has "<<value<<" expected "<<expected[c]<<"\n";
+                lost += expected[c] - value;
+                shared->db[c].store(expected[c]); //the next round starts from the truth.
+                failed = true;
+            }
+        }
+        shared->round.store(-1);
+        ::waitpid(pid, nullptr, 0);
+        for(int g = 0; g < groups; g++){
+            for(int i = 0; i < groupSize; i++){
+                int64_t unflushed;
+                delCounter(counterKey(prefix, g, i), unflushed);
+            }
+        }
+        collectDirtyCounters(prefix); //the last write back is done, the slots can be reused.
+        if(raced < races){
+            std::cerr<<"only "<<raced<<" of "<<races<<" evictions ran into an increment in "<<round<<" rounds\n";
+            failed = true;
+        }
+        std::cout<<"counters: "<<counters<<" rounds: "<<round<<" write backs: "<<attempts
+            <<" under an increment: "<<raced<<" increments lost: "<<lost
+            <<", "<<(failed ? "FAIL" : "PASS")<<std::endl;
+        return failed ? -1 : 0;
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "error: " << e.what() << "\n";
+        return -1;
+    }
+    return 0;
+}
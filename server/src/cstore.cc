@@ -0,0 +1,418 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <unordered_set>
+#include "common.hh"
+#include "cstore.hh"
+
+//a cut is made when the top bits of the gear hash are all zero, more bits
+//before the average size and fewer after it keep the sizes close to it.
+static const uint64_t kMaskSmall = 0xffffc00000000000ull; //18 bits
+static const uint64_t kMaskLarge = 0xfffc000000000000ull; //14 bits
+
+struct gearTable
+{
+    uint64_t v[256];
+    gearTable()
+    {
+        //splitmix64, the table must be the same everywhere chunks are cut.
+        uint64_t seed = 0x616b6f7270ull;
+        for(auto &e : v){
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            e = z ^ (z >> 31);
+        }
+    }
+};
+static const gearTable gear;
+
+size_t
+chunkLength(const unsigned char *data, size_t len)
+{
+    if(len <= CSTORE_MIN_CHUNK) return len;
+    size_t end = std::min(len, (size_t)CSTORE_MAX_CHUNK);
+    size_t normal = std::min(end, (size_t)CSTORE_AVG_CHUNK);
+    uint64_t fp = 0;
+    size_t i = CSTORE_MIN_CHUNK;
+    for(; i < normal; i++){
+        fp = (fp << 1) + gear.v[data[i]];
+        if(!(fp & kMaskSmall)) return i + 1;
+    }
+    for(; i < end; i++){
+        fp = (fp << 1) + gear.v[data[i]];
+        if(!(fp & kMaskLarge)) return i + 1;
+    }
+    return end;
+}
+
+std::string
+hash2Hex(const unsigned char *hash)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(CSTORE_HASH_LEN * 2, '0');
+    for(int i = 0; i < CSTORE_HASH_LEN; i++){
+        hex[2 * i] = digits[hash[i] >> 4];
+        hex[2 * i + 1] = digits[hash[i] & 0xf];
+    }
+    return hex;
+}
+
+bool
+hex2Hash(const std::string &hex, unsigned char *hash)
+{
+    if(hex.length() != CSTORE_HASH_LEN * 2) return false;
+    auto nibble = [](char c) -> int {
+        if((c >= '0') && (c <= '9')) return c - '0';
+        if((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+        return -1;
+    };
+    for(int i = 0; i < CSTORE_HASH_LEN; i++){
+        int hi = nibble(hex[2 * i]), lo = nibble(hex[2 * i + 1]);
+        if((hi < 0) || (lo < 0)) return false;
+        hash[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
+static void
+makeDir(const std::string &dname)
+{
+    if((::mkdir(dname.c_str(), S_IRWXU | S_IRWXG) < 0) && (errno != EEXIST))
+        THROW_ERRNO_EXCEPTION;
+    return;
+}
+
+static void
+writeAll(int fd, const unsigned char *data, size_t len)
+{
+    while(len){
+        ssize_t rc = _except(::write(fd, data, len));
+        data += rc;
+        len -= rc;
+    }
+    return;
+}
+
+//share the extents of the range with dst instead of copying them, only on
+//file systems with reflinks (btrfs, xfs) and block aligned offsets.
+static bool
+cloneRange(int srcFd, off_t srcOff, int dstFd, off_t dstOff, size_t len)
+{
+    if((srcFd < 0) || (srcOff % CSTORE_CLONE_ALIGN) || (dstOff % CSTORE_CLONE_ALIGN)) 
+        return false;
+    struct file_clone_range range = {0};
+    range.src_fd = srcFd;
+    range.src_offset = srcOff;
+    range.src_length = len;
+    range.dest_offset = dstOff;
+    return ::ioctl(dstFd, FICLONERANGE, &range) == 0;
+}
+
+//write data to a temporary file next to the store and move it to path, a
+//reader never sees a partial chunk or manifest. the data is cloned from
+//srcFd at srcOff when it can be. an exclusive write does not replace path
+//and returns false if it is there.
+static bool
+writeFileAtomic(const std::string &tmpDir, const std::string &path,
+        const unsigned char *data, size_t len, bool exclusive = false, 
+        int srcFd = -1, off_t srcOff = 0)
+{
+    makeDir(tmpDir);
+    std::string tmpl = tmpDir + "/XXXXXX";
+    std::vector<char> tmpName(tmpl.begin(), tmpl.end());
+    tmpName.push_back('\0');
+    int fd = _except(mkstemp(tmpName.data()));
+    bool allOk = false;
+    SCOPE_EXIT{
+        _eintr(::close(fd));
+        if(!allOk || exclusive) ::unlink(tmpName.data());
+    };
+    if(!cloneRange(srcFd, srcOff, fd, 0, len)) writeAll(fd, data, len);
+    if(exclusive){
+        if(::link(tmpName.data(), path.c_str()) < 0){
+            if(errno == EEXIST) return false;
+            THROW_ERRNO_EXCEPTION;
+        }
+    }else
+        _except(::rename(tmpName.data(), path.c_str()));
+    allOk = true;
+    return true;
+}
+
+contentStore::contentStore(const std::string &root) :
+    _base(root + "/" + CSTORE_DIR)
+{
+    return;
+}
+
+std::string
+contentStore::chunkPath(const std::string &hash)
+{
+    return _base + "/chunks/" + hash.substr(0, 2) + "/" + hash;
+}
+
+std::string
+contentStore::manifestDir(const std::string &oid)
+{
+    if(oid.empty() || (oid.find('/') != std::string::npos) || (oid[0] == '.'))
+        throw std::runtime_error("invalid object id for manifest:" + oid);
+    return _base + "/manifests/" + oid;
+}
+
+bool
+contentStore::hasChunk(const std::string &hash)
+{
+    //a chunk about to be referenced must outlive the grace of the collector.
+    return ::utimensat(AT_FDCWD, chunkPath(hash).c_str(), nullptr, 0) == 0;
+}
+
+bool
+contentStore::statChunk(const std::string &hash, uint32_t &len)
+{
+    struct stat sb;
+    if(!hasChunk(hash) || (::stat(chunkPath(hash).c_str(), &sb) < 0)) return false;
+    len = sb.st_size;
+    return true;
+}
+
+std::string
+contentStore::putChunk(const unsigned char *data, size_t len, int srcFd, off_t srcOff)
+{
+    unsigned char digest[CSTORE_HASH_LEN];
+    SHA256(data, len, digest);
+    std::string hash = hash2Hex(digest);
+    if(hasChunk(hash)) return hash;
+    makeDir(_base);
+    makeDir(_base + "/chunks");
+    makeDir(_base + "/chunks/" + hash.substr(0, 2));
+    writeFileAtomic(_base + "/tmp", chunkPath(hash), data, len, false, srcFd, srcOff);
+    return hash;
+}
+
+void
+contentStore::ingest(int fd, versionManifest &m)
+{
+    std::vector<unsigned char> buf(2 * CSTORE_MAX_CHUNK);
+    size_t have = 0, pos = 0;
+    off_t off = 0;
+    bool eof = false;
+    m.chunks.clear();
+    m.size = 0;
+    for(;;){
+        //keep a whole max chunk ahead of the cut so boundaries do not depend
+        //on how the reads fell.
+        if(!eof && ((have - pos) < CSTORE_MAX_CHUNK)){
+            memmove(buf.data(), buf.data() + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            while(!eof && (have < buf.size())){
+                ssize_t rc = _except(::pread(fd, buf.data() + have, buf.size() - have, off));
+                if(!rc) eof = true;
+                have += rc;
+                off += rc;
+            }
+        }
+        if(pos == have) break;
+        chunkRef c;
+        c.len = chunkLength(buf.data() + pos, have - pos);
+        c.hash = putChunk(buf.data() + pos, c.len, fd, off - have + pos);
+        m.chunks.push_back(c);
+        m.size += c.len;
+        pos += c.len;
+    }
+    return;
+}
+
+void
+contentStore::materialize(const versionManifest &m, int fd)
+{
+    std::vector<unsigned char> buf(CSTORE_MAX_CHUNK);
+    off_t off = _except(::lseek(fd, 0, SEEK_CUR));
+    for(auto &c : m.chunks){
+        if(c.len > buf.size()) throw std::runtime_error("oversized chunk:" + c.hash);
+        int cfd = ::open(chunkPath(c.hash).c_str(), O_RDONLY);
+        if((cfd < 0) && (errno == ENOENT)) throw std::runtime_error("missing chunk:" + c.hash);
+        _except(cfd);
+        SCOPE_EXIT{ _eintr(::close(cfd)); };
+        off += c.len;
+        if(cloneRange(cfd, 0, fd, off - c.len, c.len)){
+            _except(::lseek(fd, off, SEEK_SET));
+            continue;
+        }
+        size_t len = 0;
+        while(len < c.len){
+            ssize_t rc = _except(::read(cfd, buf.data() + len, c.len - len));
+            if(!rc) throw std::runtime_error("short chunk:" + c.hash);
+            len += rc;
+        }
+        writeAll(fd, buf.data(), len);
+    }
+    return;
+}
+
+bool
+contentStore::writeManifest(const std::string &oid, const versionManifest &m)
+{
+    std::stringstream ss;
+    ss<<"version "<<m.version<<"\n"
+        <<"size "<<m.size<<"\n"
+        <<"uid "<<m.uid<<"\n"
+        <<"time "<<m.time<<"\n";
+    for(auto &c : m.chunks) ss<<c.hash<<" "<<c.len<<"\n";
+    std::string dname = manifestDir(oid);
+    makeDir(_base);
+    makeDir(_base + "/manifests");
+    makeDir(dname);
+    std::string data = ss.str();
+    return writeFileAtomic(_base + "/tmp", dname + "/" + std::to_string(m.version),
+            reinterpret_cast<const unsigned char*>(data.data()), data.length(), true);
+}
+
+bool
+contentStore::readManifest(const std::string &oid, int version, versionManifest &m)
+{
+    std::ifstream in(manifestDir(oid) + "/" + std::to_string(version));
+    if(!in) return false;
+    std::string key;
+    in>>key>>m.version>>key>>m.size>>key>>m.uid>>key>>m.time;
+    if(!in) return false;
+    m.chunks.clear();
+    chunkRef c;
+    while(in>>c.hash>>c.len) m.chunks.push_back(c);
+    return true;
+}
+
+bool
+contentStore::hasVersion(const std::string &oid, int version)
+{
+    return ::access((manifestDir(oid) + "/" + std::to_string(version)).c_str(), F_OK) == 0;
+}
+
+void
+contentStore::listVersions(const std::string &oid, std::vector<versionManifest> &versions)
+{
+    versions.clear();
+    DIR *dir = opendir(manifestDir(oid).c_str());
+    if(!dir) return; //no history yet.
+    SCOPE_EXIT{ closedir(dir); };
+    while(struct dirent *ent = readdir(dir)){
+        char *end = nullptr;
+        long version = strtol(ent->d_name, &end, 10);
+        if((end == ent->d_name) || *end) continue;
+        versionManifest m;
+        if(readManifest(oid, version, m)) versions.push_back(m);
+    }
+    std::sort(versions.begin(), versions.end(),
+            [](const versionManifest &a, const versionManifest &b){ return a.version < b.version; });
+    return;
+}
+
+//version numbers of the manifests of oid.
+static void
+versionNumbers(const std::string &dname, std::vector<long> &numbers)
+{
+    numbers.clear();
+    DIR *dir = opendir(dname.c_str());
+    if(!dir) return;
+    SCOPE_EXIT{ closedir(dir); };
+    while(struct dirent *ent = readdir(dir)){
+        char *end = nullptr;
+        long version = strtol(ent->d_name, &end, 10);
+        if((end != ent->d_name) && !*end) numbers.push_back(version);
+    }
+    std::sort(numbers.begin(), numbers.end());
+    return;
+}
+
+void
+contentStore::pruneVersions(const std::string &oid, size_t keep)
+{
+    std::string dname = manifestDir(oid);
+    std::vector<long> numbers;
+    versionNumbers(dname, numbers);
+    for(size_t i = 0; (i + keep) < numbers.size(); i++)
+        ::unlink((dname + "/" + std::to_string(numbers[i])).c_str());
+    return;
+}
+
+void
+contentStore::dropHistory(const std::string &oid)
+{
+    std::string dname = manifestDir(oid);
+    std::vector<long> numbers;
+    versionNumbers(dname, numbers);
+    for(auto version : numbers) ::unlink((dname + "/" + std::to_string(version)).c_str());
+    ::rmdir(dname.c_str());
+    return;
+}
+
+size_t
+contentStore::collect(time_t grace, int batch, int pauseMs)
+{
+    //mark, every chunk named by a manifest is live.
+    std::unordered_set<std::string> live;
+    DIR *mdir = opendir((_base + "/manifests").c_str());
+    if(mdir){
+        SCOPE_EXIT{ closedir(mdir); };
+        while(struct dirent *ent = readdir(mdir)){
+            if(ent->d_name[0] == '.') continue;
+            std::vector<long> numbers;
+            versionNumbers(_base + "/manifests/" + ent->d_name, numbers);
+            for(auto version : numbers){
+                versionManifest m;
+                if(!readManifest(ent->d_name, version, m)) continue;
+                for(auto &c : m.chunks) live.insert(c.hash);
+            }
+        }
+    }else if(errno != ENOENT) THROW_ERRNO_EXCEPTION;
+    //sweep, chunks and temporaries younger than grace may belong to a
+    //version being committed right now.
+    time_t cutoff = time(nullptr) - grace;
+    size_t removed = 0;
+    auto sweep = [&](const std::string &dname, bool chunks){
+        DIR *dir = opendir(dname.c_str());
+        if(!dir) return;
+        SCOPE_EXIT{ closedir(dir); };
+        while(struct dirent *ent = readdir(dir)){
+            if(ent->d_name[0] == '.') continue;
+            if(chunks && live.count(ent->d_name)) continue;
+            struct stat sb = {0};
+            if(fstatat(dirfd(dir), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) continue;
+            if(!S_ISREG(sb.st_mode) || (sb.st_mtime > cutoff)) continue;
+            if(unlinkat(dirfd(dir), ent->d_name, 0) < 0) continue;
+            if((++removed % std::max(batch, 1)) == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(pauseMs));
+        }
+    };
+    sweep(_base + "/tmp", false);
+    DIR *cdir = opendir((_base + "/chunks").c_str());
+    if(cdir){
+        SCOPE_EXIT{ closedir(cdir); };
+        while(struct dirent *ent = readdir(cdir)){
+            if(ent->d_name[0] == '.') continue;
+            sweep(_base + "/chunks/" + ent->d_name, true);
+        }
+    }
+    return removed;
+}
@@ -0,0 +1,95 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//content addressed chunk store with the version history of the files.
+//files are cut in to chunks at content defined boundaries (gear hash), so an
+//insert in the middle of a file moves only the chunks around it. a chunk is
+//stored once per organization under its sha256, a version of a file is a
+//manifest listing its chunks:
+//  <root>/.cstore/chunks/<first 2 hex>/<sha256 hex>
+//  <root>/.cstore/manifests/<oid of the file>/<version>
+//the oid is the one kept in the user.file.meta record, so the history follows
+//the file through renames and moves. chunks are reflinked from and in to the
+//files where the file system can, and the ones no manifest names any more
+//are collected.
+#ifndef __INC_CSTORE_HH
+#define __INC_CSTORE_HH
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <openssl/sha.h>
+
+#define CSTORE_MIN_CHUNK (16*1024)
+#define CSTORE_AVG_CHUNK (64*1024)
+#define CSTORE_MAX_CHUNK (256*1024)
+#define CSTORE_HASH_LEN (SHA256_DIGEST_LENGTH)
+#define CSTORE_DIR ".cstore"
+#define CSTORE_CLONE_ALIGN 4096 //reflinks are made of whole file system blocks.
+
+struct chunkRef
+{
+    std::string hash; //hex
+    uint32_t len = 0;
+};
+
+struct versionManifest
+{
+    int version = 0;
+    uint64_t size = 0;
+    int uid = 0;
+    time_t time = 0;
+    std::vector<chunkRef> chunks;
+};
+
+//length of the chunk at the start of data, len is what is available. a chunk
+//cut because data ran out is only final at the end of the file.
+size_t chunkLength(const unsigned char *data, size_t len);
+std::string hash2Hex(const unsigned char *hash);
+bool hex2Hash(const std::string &hex, unsigned char *hash);
+
+class contentStore
+{
+    std::string _base;
+    std::string chunkPath(const std::string &hash);
+    std::string manifestDir(const std::string &oid);
+
+    public:
+    contentStore(const std::string &root);
+    //a chunk that is there is kept for the grace of the next collect.
+    bool hasChunk(const std::string &hash);
+    //as hasChunk, with the length of the chunk in the store.
+    bool statChunk(const std::string &hash, uint32_t &len);
+    //store the chunk unless it is already there, returns its hash. the data
+    //is cloned from srcFd at srcOff if it is given and the fs can.
+    std::string putChunk(const unsigned char *data, size_t len, int srcFd = -1, off_t srcOff = 0);
+    //cut the file in to chunks and store the ones not yet there.
+    void ingest(int fd, versionManifest &m);
+    //write the file of the manifest to fd, throws if a chunk is missing.
+    void materialize(const versionManifest &m, int fd);
+    //false if the version is already there, a version is never overwritten.
+    bool writeManifest(const std::string &oid, const versionManifest &m);
+    bool readManifest(const std::string &oid, int version, versionManifest &m);
+    bool hasVersion(const std::string &oid, int version);
+    //the versions of the file oldest first.
+    void listVersions(const std::string &oid, std::vector<versionManifest> &versions);
+    //drop all but the newest keep versions of the file.
+    void pruneVersions(const std::string &oid, size_t keep);
+    //drop the whole history, the file is gone.
+    void dropHistory(const std::string &oid);
+    //unlink the chunks no manifest names and that are older than grace,
+    //pausing pauseMs every batch unlinks. returns the chunks unlinked.
+    size_t collect(time_t grace, int batch, int pauseMs);
+};
+
+#endif
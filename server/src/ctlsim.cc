@@ -0,0 +1,147 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <iostream>
+#include <deque>
+#include <set>
+#include <boost/program_options.hpp>
+#include "ctlstream.hh"
+
+//drives the control stream of one service instance into a queue that holds 
+//far fewer messages than a snapshot takes. the service drains a few messages
+//between the flushes while clients keep arriving and leaving, the snapshot
+//has to finish and the service has to end up with the clients of the gateway.
+typedef struct simService
+{
+    std::deque<service::controlMessage> queue;
+    size_t depth = 10;
+    uint32_t seq = 0;
+    bool seqValid = false;
+    bool gaps = false;
+    std::set<int> known, snapshot;
+    uint64_t snapshots = 0;
+
+    //what service::handleClientBatch does, less the resync request.
+    void receive(service::controlMessage &cmsg)
+    {
+        bool isSnapshot = (cmsg.messageType == service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_SNAPSHOT);
+        if(isSnapshot && !cmsg.clientBatch.part) snapshot.clear();
+        else if(seqValid && (cmsg.clientBatch.seq != seq + 1)) gaps = true;
+        seq = cmsg.clientBatch.seq;
+        seqValid = true;
+        if(!isSnapshot){
+            for(int i = 0; i < cmsg.clientBatch.count; i++){
+                if(cmsg.clientBatch.clients[i].arrival) known.insert(cmsg.clientBatch.clients[i].clientid);
+                else known.erase(cmsg.clientBatch.clients[i].clientid);
+            }
+            return;
+        }
+        for(int i = 0; i < cmsg.clientBatch.count; i++) snapshot.insert(cmsg.clientBatch.clients[i].clientid);
+        if(!cmsg.clientBatch.last) return;
+        known = snapshot;
+        snapshot.clear();
+        snapshots++;
+    }
+
+    void drain(size_t count)
+    {
+        while(count-- && !queue.empty()){
+            receive(queue.front());
+            queue.pop_front();
+        }
+    }
+}simService;
+
+int
+main(int ac, char* av[])
+{
+    try
+    {
+        int clients = 2000, depth = 10, drain = 3;
+        boost::program_options::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("clients", boost::program_options::value<int>(), "clients of the service, default 2000.")
+            ("depth", boost::program_options::value<int>(), "messages the control queue holds, default 10.")
+            ("drain", boost::program_options::value<int>(), "messages the service reads between flushes, default 3.")
+        ;
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(ac, av, desc), vm);
+        boost::program_options::notify(vm);
+        if(vm.count("help")){ std::cerr << desc << "\n"; return 0; }
+        if(vm.count("clients")) clients = vm["clients"].as<int>();
+        if(vm.count("depth")) depth = vm["depth"].as<int>();
+        if(vm.count("drain")) drain = vm["drain"].as<int>();
+        if((clients < 1) || (depth < 1) || (drain < 1)){
+            std::cerr<<"need at least 1 client, a queue of 1 and a drain of 1\n";
+            return -1;
+        }
+
+        simService svc;
+        svc.depth = depth;
+        std::set<int> gwClients; //the clients as the gateway has them.
+        controlStream ctl("ctlsim",
+                [&svc](service::controlMessage &cmsg){
+                    if(svc.queue.size() >= svc.depth) return false;
+                    svc.queue.push_back(cmsg);
+                    return true; },
+                [&gwClients](std::vector<int> &list){ list.assign(gwClients.begin(), gwClients.end()); });
+        int next = 1;
+        for(; next <= clients; next++) gwClients.insert(next);
+
+        //the service comes back and the snapshot runs into the full queue 
+        //after depth parts, clients come and go while the rest goes out.
+        bool ok = true;
+        ctl.resync();
+        ctl.flush();
+        if(!ctl.pending()){
+            std::cerr<<"snapshot of "<<clients<<" clients fit a queue of "<<depth<<", nothing to test\n";
+            ok = false;
+        }
+        int rounds = 0, limit = clients;
+        while(ctl.pending() || !svc.queue.empty()){
+            if(++rounds > limit) break;
+            svc.drain(drain);
+            if(svc.snapshots){
+                //churn stopped, what was queued meanwhile goes out as batches.
+            }else if(rounds % 2){
+                gwClients.insert(next);
+                ctl.queue(next++, true);
+            }else{
+                int gone = *gwClients.begin();
+                gwClients.erase(gone);
+                ctl.queue(gone, false);
+            }
+            ctl.flush();
+        }
+        if(rounds > limit){
+            std::cerr<<"snapshot did not complete in "<<limit<<" flushes\n";
+            ok = false;
+        }
+        if(svc.gaps){
+            std::cerr<<"service saw a gap in the control sequence\n";
+            ok = false;
+        }
+        if(svc.snapshots != 1){
+            std::cerr<<"service got "<<svc.snapshots<<" complete snapshots, expected 1\n";
+            ok = false;
+        }
+        if(svc.known != gwClients){
+            std::cerr<<"service has "<<svc.known.size()<<" clients, the gateway "<<gwClients.size()<<"\n";
+            ok = false;
+        }
+        std::cerr<<"snapshot of "<<clients<<" clients through a queue of "<<depth<<" in "<<rounds
+            <<" flushes, control sequence: "<<ctl.seq()<<(ok ? ", PASS" : ", FAIL")<<"\n";
+        return ok ? 0 : -1;
+    }
+    catch (const std::exception &e){ std::cerr << e.what() << std::endl; return -1; }
+    return 0;
+}
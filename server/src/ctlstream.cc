@@ -0,0 +1,134 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+#include <string.h>
+#include <algorithm>
+#include "log.hh"
+#include "ctlstream.hh"
+
+controlStream::controlStream(const std::string &name, sendFn send, clientsFn clients) :
+    _name(name),
+    _send(send),
+    _clients(clients)
+{
+    return;
+}
+
+void
+controlStream::queue(int clientid, bool arrival)
+{
+    //a snapshot not taken yet will have it.
+    if(_resync && !_snapshotTaken) return;
+    _deltas.push_back(std::make_pair(clientid, arrival));
+    return;
+}
+
+void
+controlStream::resync()
+{
+    _resync = true;
+    _snapshotTaken = false;
+    _snapshot.clear();
+    _deltas.clear();
+    return;
+}
+
+void
+controlStream::reset()
+{
+    _resync = false;
+    _snapshotTaken = false;
+    _snapshot.clear();
+    _deltas.clear();
+    return;
+}
+
+void
+controlStream::flush()
+{
+    if(_resync && !sendSnapshot()) return;
+    size_t sent = 0;
+    bool ok = sendBatch(sent);
+    _deltas.erase(_deltas.begin(), _deltas.begin() + sent);
+    if(ok) return;
+    //nothing was lost, the rest waits for room. past a snapshot worth of 
+    //updates the snapshot is the shorter way.
+    if(_deltas.size() <= CONTROL_CHANNEL_EXPECTED_CLIENTS) return;
+    _error<<"control queue of service: "<<_name<<" is full, "
+        <<_deltas.size()<<" client updates pending, resyncing.";
+    resync();
+    sendSnapshot();
+    return;
+}
+
+//the deltas in order, sent counts the ones the service got.
+bool
+controlStream::sendBatch(size_t &sent)
+{
+    while(sent < _deltas.size()){
+        service::controlMessage cmsg;
+        memset(&cmsg, 0, sizeof(cmsg));
+        memcpy(cmsg.sender, "ngw", strlen("ngw"));
+        cmsg.messageType = service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_BATCH;
+        cmsg.clientBatch.seq = _seq + 1;
+        size_t count = std::min(_deltas.size() - sent, (size_t)CONTROL_CHANNEL_BATCH_SIZE);
+        for(size_t i = 0; i < count; i++){
+            cmsg.clientBatch.clients[i].clientid = _deltas[sent + i].first;
+            cmsg.clientBatch.clients[i].arrival = _deltas[sent + i].second;
+        }
+        cmsg.clientBatch.count = count;
+        if(!_send(cmsg)) return false;
+        _seq++;
+        sent += count;
+    }
+    return true;
+}
+
+//the list is taken on the first attempt, later attempts go on from the part
+//that did not fit. true once the last part is out.
+bool
+controlStream::sendSnapshot()
+{
+    if(!_snapshotTaken){
+        _snapshot.clear();
+        _clients(_snapshot);
+        _snapshotSent = 0;
+        _snapshotPart = 0;
+        _snapshotTaken = true;
+        _deltas.clear();
+    }
+    do{
+        service::controlMessage cmsg;
+        memset(&cmsg, 0, sizeof(cmsg));
+        memcpy(cmsg.sender, "ngw", strlen("ngw"));
+        cmsg.messageType = service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_SNAPSHOT;
+        cmsg.clientBatch.seq = _seq + 1;
+        cmsg.clientBatch.part = _snapshotPart;
+        size_t count = std::min(_snapshot.size() - _snapshotSent, (size_t)CONTROL_CHANNEL_BATCH_SIZE);
+        for(size_t i = 0; i < count; i++){
+            cmsg.clientBatch.clients[i].clientid = _snapshot[_snapshotSent + i];
+            cmsg.clientBatch.clients[i].arrival = 1;
+        }
+        cmsg.clientBatch.count = count;
+        cmsg.clientBatch.last = (_snapshotSent + count == _snapshot.size());
+        if(!_send(cmsg)) return false;
+        _seq++;
+        _snapshotPart++;
+        _snapshotSent += count;
+    }while(_snapshotSent < _snapshot.size());
+    _info<<"sent snapshot of "<<_snapshot.size()<<" clients in "<<_snapshotPart
+        <<" parts to service: "<<_name;
+    _resync = false;
+    _snapshotTaken = false;
+    _snapshot.clear();
+    return true;
+}
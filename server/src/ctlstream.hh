@@ -0,0 +1,62 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+//arrivals and departures of the clients of one service instance on their way
+//to its control queue. they go in batches, the ones that do not fit wait for
+//the next flush. the service gets a snapshot of the whole client list when it
+//comes back, asks for one or too many updates pile up. the snapshot is
+//taken once and sent part by part as the queue drains, a part that does not
+//fit is sent again on the next flush and the ones before it are not. changes
+//made while a snapshot is out are sent as batches after its last part.
+#ifndef __INC_CTLSTREAM_HH
+#define __INC_CTLSTREAM_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include "akorpdefs.h"
+#include "svclib.hh"
+
+class controlStream
+{
+    public:
+    typedef std::function<bool(service::controlMessage &)> sendFn; //false when the queue is full.
+    typedef std::function<void(std::vector<int> &)> clientsFn; //the clients of the service right now.
+
+    private:
+    std::string _name;
+    sendFn _send;
+    clientsFn _clients;
+    uint32_t _seq = 0; //sequence of the last batch or snapshot part the service got.
+    std::vector<std::pair<int, bool>> _deltas; //arrivals and departures waiting for the flush.
+    bool _resync = false; //the service is owed a snapshot.
+    bool _snapshotTaken = false; //_snapshot holds the list being sent.
+    std::vector<int> _snapshot;
+    size_t _snapshotSent = 0; //entries of it the service got.
+    int32_t _snapshotPart = 0; //next part to send.
+    bool sendBatch(size_t &);
+    bool sendSnapshot();
+
+    public:
+    controlStream(const std::string &name, sendFn send, clientsFn clients);
+    void queue(int clientid, bool arrival);
+    void resync(); //a new snapshot from part 0, the service asked or came back.
+    void reset(); //the service went away, nothing is owed.
+    void flush(); //send what fits.
+    bool pending(void) { return _resync || !_deltas.empty(); }
+    uint32_t seq(void) { return _seq; }
+    void resume(uint32_t seq) { _seq = seq; } //carried on from another gateway.
+};
+
+#endif
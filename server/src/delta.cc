@@ -0,0 +1,226 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "common.hh"
+#include "delta.hh"
+
+void
+rollingChecksum::init(const unsigned char *data, size_t len)
+{
+    _a = _b = 0;
+    _len = len;
+    for(size_t i = 0; i < len; i++){
+        _a += data[i];
+        _b += (len - i) * data[i];
+    }
+    return;
+}
+
+void
+rollingChecksum::roll(unsigned char out, unsigned char in)
+{
+    _a += in - out;
+    _b += _a - _len * out;
+    return;
+}
+
+uint32_t
+deltaBlockSize(uint64_t fileSize)
+{
+    uint64_t size = (uint64_t)sqrt((double)fileSize);
+    size = (size + 1023) & ~1023ull;
+    return std::min(std::max(size, (uint64_t)DELTA_MIN_BLOCK), (uint64_t)DELTA_MAX_BLOCK);
+}
+
+static void
+putU32(std::string &buf, uint32_t val)
+{
+    val = htonl(val);
+    buf.append(reinterpret_cast<char*>(&val), sizeof(val));
+    return;
+}
+
+static uint32_t
+getU32(const unsigned char *p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohl(val);
+}
+
+static void
+writeAll(int fd, const unsigned char *data, size_t len)
+{
+    while(len){
+        ssize_t rc = _except(::write(fd, data, len));
+        data += rc;
+        len -= rc;
+    }
+    return;
+}
+
+void
+computeSignatures(int fd, uint32_t blockSize, std::string &sigs)
+{
+    std::vector<unsigned char> block(blockSize);
+    unsigned char *buf = block.data();
+    sigs.clear();
+    for(off_t off = 0;; off += blockSize){
+        size_t len = 0;
+        while(len < blockSize){
+            ssize_t rc = _except(::pread(fd, buf + len, blockSize - len, off + len));
+            if(!rc) break;
+            len += rc;
+        }
+        if(!len) break;
+        rollingChecksum weak;
+        weak.init(buf, len);
+        unsigned char strong[DELTA_STRONG_LEN];
+        MD5(buf, len, strong);
+        putU32(sigs, weak.digest());
+        sigs.append(reinterpret_cast<char*>(strong), DELTA_STRONG_LEN);
+        if(len < blockSize) break;
+    }
+    return;
+}
+
+void
+computeDelta(const std::string &sigs, uint32_t blockSize, uint64_t basisSize, 
+        const unsigned char *data, size_t len, size_t maxLiteral, std::string &ops)
+{
+    const unsigned char *sig = reinterpret_cast<const unsigned char*>(sigs.data());
+    size_t nblocks = sigs.length() / DELTA_SIGNATURE_LEN;
+    size_t tailLen = nblocks ? (basisSize - (uint64_t)(nblocks - 1) * blockSize) : 0;
+    //the short last block can only be at the end of the data.
+    size_t fullBlocks = (tailLen == blockSize) ? nblocks : (nblocks ? nblocks - 1 : 0);
+    std::unordered_multimap<uint32_t, uint32_t> weakIndex;
+    for(size_t i = 0; i < fullBlocks; i++) 
+        weakIndex.insert(std::make_pair(getU32(sig + i * DELTA_SIGNATURE_LEN), i));
+    auto strongMatches = [&](uint32_t block, const unsigned char *p, size_t n){
+        unsigned char strong[DELTA_STRONG_LEN];
+        MD5(p, n, strong);
+        return !memcmp(strong, sig + block * DELTA_SIGNATURE_LEN + sizeof(uint32_t), DELTA_STRONG_LEN);
+    };
+
+    size_t literalStart = 0, pos = 0;
+    uint32_t copyFirst = 0, copyCount = 0;
+    auto flushCopy = [&](){
+        if(!copyCount) return;
+        ops.push_back(DELTA_OP_COPY);
+        putU32(ops, copyFirst);
+        putU32(ops, copyCount);
+        copyCount = 0;
+    };
+    auto flushLiteral = [&](size_t end){
+        if(literalStart < end) flushCopy();
+        while(literalStart < end){
+            size_t n = std::min(end - literalStart, maxLiteral);
+            ops.push_back(DELTA_OP_LITERAL);
+            putU32(ops, n);
+            ops.append(reinterpret_cast<const char*>(data + literalStart), n);
+            literalStart += n;
+        }
+    };
+    auto addCopy = [&](uint32_t block){
+        if(copyCount && (block == copyFirst + copyCount)){
+            copyCount++;
+            return;
+        }
+        flushCopy();
+        copyFirst = block;
+        copyCount = 1;
+    };
+
+    ops.clear();
+    rollingChecksum weak;
+    bool primed = false;
+    while(fullBlocks && (pos + blockSize <= len)){
+        if(!primed) weak.init(data + pos, blockSize);
+        primed = true;
+        auto range = weakIndex.equal_range(weak.digest());
+        int64_t match = -1;
+        for(auto itr = range.first; (itr != range.second) && (match < 0); itr++)
+            if(strongMatches(itr->second, data + pos, blockSize)) match = itr->second;
+        if(match >= 0){
+            flushLiteral(pos);
+            addCopy(match);
+            pos += blockSize;
+            literalStart = pos;
+            primed = false;
+            continue;
+        }
+        if(pos + blockSize < len) weak.roll(data[pos], data[pos + blockSize]);
+        pos++;
+    }
+    if(nblocks && (tailLen < blockSize) && (len >= literalStart + tailLen) && tailLen){
+        const unsigned char *tail = data + len - tailLen;
+        rollingChecksum tw;
+        tw.init(tail, tailLen);
+        if((tw.digest() == getU32(sig + (nblocks - 1) * DELTA_SIGNATURE_LEN)) && 
+                strongMatches(nblocks - 1, tail, tailLen)){
+            flushLiteral(len - tailLen);
+            addCopy(nblocks - 1);
+            literalStart = len;
+        }
+    }
+    flushLiteral(len);
+    flushCopy();
+    return;
+}
+
+bool
+applyDelta(int basisFd, int outFd, const unsigned char *ops, size_t len, 
+        uint32_t blockSize, unsigned char *buf, MD5_CTX *digest, uint64_t &written,
+        uint64_t limit)
+{
+    const unsigned char *end = ops + len;
+    while(ops < end){
+        if((size_t)(end - ops) < 1 + sizeof(uint32_t)) return false;
+        unsigned char op = *ops;
+        uint32_t first = getU32(ops + 1);
+        if(op == DELTA_OP_LITERAL){
+            ops += 1 + sizeof(uint32_t);
+            if(first > (size_t)(end - ops)) return false;
+            if((written + first) > limit) return false;
+            writeAll(outFd, ops, first);
+            written += first;
+            if(digest) MD5_Update(digest, ops, first);
+            ops += first;
+            continue;
+        }
+        if((op != DELTA_OP_COPY) || ((size_t)(end - ops) < DELTA_OP_HEADER_LEN)) return false;
+        uint32_t count = getU32(ops + 1 + sizeof(uint32_t));
+        ops += DELTA_OP_HEADER_LEN;
+        if(basisFd < 0) return false;
+        for(uint64_t block = first; block < (uint64_t)first + count; block++){
+            off_t off = block * blockSize;
+            size_t n = 0;
+            while(n < blockSize){
+                ssize_t rc = _except(::pread(basisFd, buf + n, blockSize - n, off + n));
+                if(!rc) break;
+                n += rc;
+            }
+            if(!n) return false; //past the end of the basis.
+            if((written + n) > limit) return false;
+            writeAll(outFd, buf, n);
+            written += n;
+            if(digest) MD5_Update(digest, buf, n);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,67 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//rsync style delta uploads. the server sends the signatures of the blocks of
+//the file it has, a weak rolling checksum and a strong hash per block. the 
+//client looks for those blocks at every offset of its new copy and sends
+//only the bytes it did not find along with references to the blocks it did:
+//  signature : uint32 weak | md5 of the block, the last block may be short.
+//  COPY      : 'C' | uint32 first block | uint32 block count
+//  LITERAL   : 'L' | uint32 length | bytes
+//numbers are big endian. an op never spans two messages.
+#ifndef __INC_DELTA_HH
+#define __INC_DELTA_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <openssl/md5.h>
+
+#define DELTA_MIN_BLOCK (2*1024)
+#define DELTA_MAX_BLOCK (64*1024)
+#define DELTA_STRONG_LEN (MD5_DIGEST_LENGTH)
+#define DELTA_SIGNATURE_LEN (sizeof(uint32_t) + DELTA_STRONG_LEN)
+#define DELTA_OP_HEADER_LEN (1 + 2 * sizeof(uint32_t))
+
+enum
+{
+    DELTA_OP_COPY = 'C',
+    DELTA_OP_LITERAL = 'L',
+};
+
+//the adler like checksum of rsync, slid a byte at a time.
+class rollingChecksum
+{
+    uint32_t _a = 0, _b = 0;
+    size_t _len = 0;
+
+    public:
+    void init(const unsigned char *data, size_t len);
+    void roll(unsigned char out, unsigned char in);
+    uint32_t digest(void) const { return (_a & 0xffff) | (_b << 16); }
+};
+
+uint32_t deltaBlockSize(uint64_t fileSize); //about the square root of the size.
+//the signatures of the blocks of the file, throws on io errors.
+void computeSignatures(int fd, uint32_t blockSize, std::string &sigs);
+//the ops turning the file of the signatures in to data, maxLiteral bounds a 
+//literal so a message holds at least one op.
+void computeDelta(const std::string &sigs, uint32_t blockSize, uint64_t basisSize, 
+        const unsigned char *data, size_t len, size_t maxLiteral, std::string &ops);
+//write the data of the ops to out at its offset, the blocks are read from the
+//basis in to buf of blockSize bytes. false on a malformed op, a block the
+//basis does not have or output past limit, throws on io errors. digest and
+//written are updated with what is written.
+bool applyDelta(int basisFd, int outFd, const unsigned char *ops, size_t len, 
+        uint32_t blockSize, unsigned char *buf, MD5_CTX *digest, uint64_t &written,
+        uint64_t limit);
+
+#endif
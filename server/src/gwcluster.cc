@@ -0,0 +1,562 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <vector>
+#include <stdexcept>
+#include <boost/bind.hpp>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include "akorpdefs.h"
+#include "gwcluster.hh"
+#include "log.hh"
+
+peerLink::peerLink(gatewayCluster *cluster, boost::asio::io_service &io, bool outbound) :
+    _cluster(cluster),
+    _socket(io),
+    _outbound(outbound),
+    _handshakeTimer(io)
+{
+    return;
+}
+
+void
+peerLink::start(void)
+{
+    boost::system::error_code ec;
+    _socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+    _handshakeTimer.expires_from_now(boost::posix_time::seconds(GW_CLUSTER_HANDSHAKE_TIMEOUT));
+    _handshakeTimer.async_wait(boost::bind(&peerLink::handshakeExpired, shared_from_this(),
+                boost::asio::placeholders::error));
+    readHeader();
+    return;
+}
+
+void
+peerLink::authenticated(void)
+{
+    _authenticated = true;
+    boost::system::error_code ec;
+    _handshakeTimer.cancel(ec);
+    return;
+}
+
+void
+peerLink::handshakeExpired(const boost::system::error_code &ec)
+{
+    if(ec || _authenticated || _closed) return;
+    _error<<"peer: "<<(_id.empty() ? std::string("unknown") : _id)
+        <<" did not authenticate in "<<GW_CLUSTER_HANDSHAKE_TIMEOUT<<" secs, dropping the link.";
+    close();
+    return;
+}
+
+void
+peerLink::readHeader(void)
+{
+    boost::asio::async_read(_socket, boost::asio::buffer(_header),
+            boost::bind(&peerLink::headerComplete, shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+    return;
+}
+
+void
+peerLink::headerComplete(const boost::system::error_code &ec, size_t bytesRecvd)
+{
+    if(ec){
+        if(ec != boost::asio::error::operation_aborted)
+            _info<<"peer link to: "<<_id<<" closed: "<<ec.message();
+        close();
+        return;
+    }
+    uint32_t len;
+    memcpy(&len, _header.data(), sizeof(len));
+    len = ntohl(len);
+    //till the peer authenticates only the hello and the auth, both small.
+    if(!len || (len > (_authenticated ? GW_CLUSTER_MAX_FRAME : GW_CLUSTER_HANDSHAKE_FRAME))){
+        _error<<"peer: "<<_id<<" sent a frame of length: "<<len<<", dropping the link.";
+        close();
+        return;
+    }
+    _body.resize(len - 1);
+    if(_body.empty()){
+        _cluster->frameRecvd(shared_from_this(), _header[4], _body);
+        if(!_closed) readHeader();
+        return;
+    }
+    boost::asio::async_read(_socket, boost::asio::buffer(&_body[0], _body.size()),
+            boost::bind(&peerLink::bodyComplete, shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+    return;
+}
+
+void
+peerLink::bodyComplete(const boost::system::error_code &ec, size_t bytesRecvd)
+{
+    if(ec){
+        if(ec != boost::asio::error::operation_aborted)
+            _info<<"peer link to: "<<_id<<" closed: "<<ec.message();
+        close();
+        return;
+    }
+    _cluster->frameRecvd(shared_from_this(), _header[4], _body);
+    if(!_closed) readHeader();
+    return;
+}
+
+void
+peerLink::send(uint8_t type, const char *body, size_t len, const char *tail, size_t tailLen)
+{
+    if(_closed) return;
+    if(_wqBytes > GW_CLUSTER_MAX_BACKLOG){
+        _error<<"peer: "<<_id<<" is not reading, dropping the link.";
+        close();
+        return;
+    }
+    uint32_t flen = htonl(1 + len + tailLen);
+    std::string frame;
+    frame.reserve(sizeof(flen) + 1 + len + tailLen);
+    frame.append(reinterpret_cast<char*>(&flen), sizeof(flen));
+    frame.push_back((char)type);
+    if(len) frame.append(body, len);
+    if(tailLen) frame.append(tail, tailLen);
+    _wqBytes += frame.length();
+    _wq.push_back(std::move(frame));
+    if(_wq.size() == 1) writeAsync();
+    return;
+}
+
+void
+peerLink::writeAsync(void)
+{
+    boost::asio::async_write(_socket, boost::asio::buffer(_wq.front()),
+            boost::bind(&peerLink::writeComplete, shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+    return;
+}
+
+void
+peerLink::writeComplete(const boost::system::error_code &ec, size_t bytesSent)
+{
+    if(ec){
+        close();
+        return;
+    }
+    _wqBytes -= _wq.front().length();
+    _wq.pop_front();
+    if(!_wq.empty() && !_closed) writeAsync();
+    return;
+}
+
+void
+peerLink::close(void)
+{
+    if(_closed) return;
+    _closed = true;
+    boost::system::error_code ec;
+    _handshakeTimer.cancel(ec);
+    _socket.close(ec);
+    _cluster->linkDown(shared_from_this());
+    return;
+}
+
+gatewayCluster::gatewayCluster(boost::asio::io_service &io, std::string address, unsigned short port,
+        std::string secret) :
+    _io(io),
+    _secret(secret),
+    _acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(address), port))
+{
+    if(_secret.empty()) throw std::invalid_argument("gatewayCluster needs a cluster secret");
+    _id = address + ":" + std::to_string(_acceptor.local_endpoint().port());
+    acceptAsync();
+    return;
+}
+
+gatewayCluster::~gatewayCluster()
+{
+    boost::system::error_code ec;
+    _acceptor.close(ec);
+    std::vector<peerLinkPtr> links(_pending.begin(), _pending.end());
+    for(auto &l : _links) links.push_back(l.second);
+    for(auto &l : _dialing) links.push_back(l.second);
+    for(auto &l : links) l->close();
+    return;
+}
+
+unsigned short
+gatewayCluster::getPort(void)
+{
+    return _acceptor.local_endpoint().port();
+}
+
+void
+gatewayCluster::acceptAsync(void)
+{
+    _accepting.reset(new peerLink(this, _io, false));
+    _acceptor.async_accept(_accepting->getSocket(),
+            boost::bind(&gatewayCluster::acceptComplete, this,
+                boost::asio::placeholders::error));
+    return;
+}
+
+void
+gatewayCluster::acceptComplete(const boost::system::error_code &ec)
+{
+    if(ec == boost::asio::error::operation_aborted) return;
+    if(ec)
+        _error<<"gatewayCluster::acceptComplete() error: "<<ec.message();
+    else
+        linkUp(_accepting);
+    acceptAsync();
+    return;
+}
+
+void
+gatewayCluster::addPeer(const std::string &id)
+{
+    if(id == _id) return;
+    _known.insert(id);
+    dial(id);
+    return;
+}
+
+void
+gatewayCluster::dial(const std::string &id)
+{
+    if((id == _id) || _links.count(id) || _dialing.count(id)) return;
+    size_t colon = id.rfind(':');
+    if(colon == std::string::npos){
+        _error<<"invalid peer: "<<id<<", expected <address>:<port>";
+        return;
+    }
+    boost::system::error_code ec;
+    boost::asio::ip::address addr = boost::asio::ip::address::from_string(id.substr(0, colon), ec);
+    int port = atoi(id.c_str() + colon + 1);
+    if(ec || (port <= 0) || (port > 65535)){
+        _error<<"invalid peer: "<<id<<", expected <address>:<port>";
+        return;
+    }
+    peerLinkPtr link(new peerLink(this, _io, true));
+    _dialing[id] = link;
+    link->getSocket().async_connect(boost::asio::ip::tcp::endpoint(addr, port),
+            boost::bind(&gatewayCluster::dialComplete, this, link, id,
+                boost::asio::placeholders::error));
+    return;
+}
+
+void
+gatewayCluster::dialComplete(peerLinkPtr link, std::string id, const boost::system::error_code &ec)
+{
+    if(ec == boost::asio::error::operation_aborted) return;
+    _dialing.erase(id);
+    if(ec){
+        _info<<"unable to reach peer: "<<id<<" error: "<<ec.message();
+        return;
+    }
+    linkUp(link);
+    return;
+}
+
+//a new link says who we are with a nonce for the peer to sign, the peer does
+//the same.
+void
+gatewayCluster::linkUp(peerLinkPtr link)
+{
+    unsigned char nonce[GW_CLUSTER_NONCE_LEN];
+    if(RAND_bytes(nonce, sizeof(nonce)) != 1){
+        _error<<"gatewayCluster::linkUp() unable to generate a nonce, dropping the link.";
+        link->close();
+        return;
+    }
+    link->nonce().assign(reinterpret_cast<char*>(nonce), sizeof(nonce));
+    _pending.insert(link);
+    link->start();
+    std::string body = _id;
+    body.push_back('\0');
+    body += link->nonce();
+    link->send(PEER_HELLO, body.data(), body.length());
+    return;
+}
+
+std::string
+gatewayCluster::proof(const std::string &nonce, const std::string &id)
+{
+    std::string data = nonce + id;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+    HMAC(EVP_sha256(), _secret.data(), _secret.length(),
+            reinterpret_cast<const unsigned char*>(data.data()), data.length(), md, &mdLen);
+    return std::string(reinterpret_cast<char*>(md), mdLen);
+}
+
+//the peer says who it is, we sign its nonce. it is not one of us till it signs ours.
+void
+gatewayCluster::hello(peerLinkPtr link, const std::string &body)
+{
+    size_t sep = body.find('\0');
+    if(!_pending.count(link) || !link->getId().empty() || (sep == std::string::npos) || 
+            !sep || (body.length() - sep - 1 != GW_CLUSTER_NONCE_LEN)){
+        _error<<"invalid hello from peer: "<<link->getId()<<", dropping the link.";
+        link->close();
+        return;
+    }
+    std::string id = body.substr(0, sep);
+    if(id == _id){
+        link->close(); //talking to ourselves.
+        return;
+    }
+    link->setId(id);
+    link->peerNonce() = body.substr(sep + 1);
+    std::string signature = proof(link->peerNonce(), _id);
+    link->send(PEER_AUTH, signature.data(), signature.length());
+    return;
+}
+
+void
+gatewayCluster::auth(peerLinkPtr link, const std::string &body)
+{
+    if(!_pending.count(link) || link->getId().empty()){
+        _error<<"auth before hello from peer, dropping the link.";
+        link->close();
+        return;
+    }
+    std::string expected = proof(link->nonce(), link->getId());
+    if((body.length() != expected.length()) || 
+            CRYPTO_memcmp(body.data(), expected.data(), expected.length())){
+        _error<<"peer: "<<link->getId()<<" does not hold the cluster secret, dropping the link.";
+        link->close();
+        return;
+    }
+    _pending.erase(link);
+    link->authenticated();
+    registerLink(link);
+    return;
+}
+
+//the link is one of us now, it replaces or loses to a link already there and
+//gets the snapshot of our users. the changes after the snapshot go to it with
+//the other links.
+void
+gatewayCluster::registerLink(peerLinkPtr link)
+{
+    const std::string id = link->getId();
+    _known.insert(id);
+    auto itr = _links.find(id);
+    if(itr != _links.end()){
+        //the link dialed by the smaller node id wins on both sides, a link
+        //dialed by the same side as the old one replaces it.
+        peerLinkPtr old = itr->second;
+        const std::string &dialer = std::min(_id, id);
+        const std::string &oldDialer = old->isOutbound() ? _id : id;
+        const std::string &newDialer = link->isOutbound() ? _id : id;
+        if((oldDialer != newDialer) && (oldDialer == dialer)){
+            link->close();
+            return;
+        }
+        _links.erase(itr);
+        forgetUsers(old);
+        old->close();
+    }
+    _links[id] = link;
+    std::vector<int32_t> uids;
+    uids.reserve(_localUsers.size());
+    for(int uid : _localUsers) uids.push_back(htonl(uid));
+    link->send(PEER_SESSIONS, reinterpret_cast<char*>(uids.data()), uids.size() * sizeof(int32_t));
+    _info<<"linked with peer gateway: "<<id<<(link->isOutbound() ? " (dialed)" : " (accepted)");
+    return;
+}
+
+void
+gatewayCluster::forgetUsers(peerLinkPtr link)
+{
+    for(int uid : link->users()){
+        auto itr = _remoteUsers.find(uid);
+        if((itr != _remoteUsers.end()) && (itr->second == link)) _remoteUsers.erase(itr);
+    }
+    link->users().clear();
+    return;
+}
+
+void
+gatewayCluster::linkDown(peerLinkPtr link)
+{
+    _pending.erase(link);
+    auto itr = _links.find(link->getId());
+    if((itr != _links.end()) && (itr->second == link)){
+        _info<<"lost peer gateway: "<<link->getId();
+        _links.erase(itr);
+    }
+    forgetUsers(link);
+    return;
+}
+
+static int
+parseUid(const std::string &body, size_t offset = 0)
+{
+    int32_t uid;
+    memcpy(&uid, body.data() + offset, sizeof(uid));
+    return ntohl(uid);
+}
+
+void
+gatewayCluster::frameRecvd(peerLinkPtr link, uint8_t type, const std::string &body)
+{
+    if(type == PEER_HELLO){
+        hello(link, body);
+        return;
+    }
+    if(type == PEER_AUTH){
+        auth(link, body);
+        return;
+    }
+    //frames of a link lost to a duplicate or not introduced yet mean nothing.
+    auto litr = _links.find(link->getId());
+    if((litr == _links.end()) || (litr->second != link)) return;
+    switch(type)
+    {
+        case PEER_SESSIONS:
+            forgetUsers(link);
+            for(size_t off = 0; off + sizeof(int32_t) <= body.length(); off += sizeof(int32_t)){
+                int uid = parseUid(body, off);
+                link->users().insert(uid);
+                _remoteUsers[uid] = link;
+            }
+            break;
+        case PEER_SESSION_ADD:
+            if(body.length() < sizeof(int32_t)) break;
+            {
+                int uid = parseUid(body);
+                auto itr = _remoteUsers.find(uid);
+                //the user moved from another gateway, the del from there may come later.
+                if((itr != _remoteUsers.end()) && (itr->second != link)) itr->second->users().erase(uid);
+                link->users().insert(uid);
+                _remoteUsers[uid] = link;
+            }
+            break;
+        case PEER_SESSION_DEL:
+            if(body.length() < sizeof(int32_t)) break;
+            {
+                int uid = parseUid(body);
+                link->users().erase(uid);
+                auto itr = _remoteUsers.find(uid);
+                if((itr != _remoteUsers.end()) && (itr->second == link)) _remoteUsers.erase(itr);
+            }
+            break;
+        case PEER_USER_FRAME:
+            if(body.length() < sizeof(int32_t)) break;
+            _delivered++;
+            if(_userDelivery) _userDelivery(parseUid(body), body.data() + sizeof(int32_t),
+                    body.length() - sizeof(int32_t));
+            break;
+        case PEER_BROADCAST:
+            if(body.length() < MAX_SERVICE_NAME_LEN) break;
+            {
+                std::string svcname(body.data(), MAX_SERVICE_NAME_LEN);
+                svcname = svcname.substr(0, svcname.find_first_of(std::string(" \0", 2)));
+                _delivered++;
+                if(_broadcastDelivery) _broadcastDelivery(svcname, body.data() + MAX_SERVICE_NAME_LEN,
+                        body.length() - MAX_SERVICE_NAME_LEN);
+            }
+            break;
+        default:
+            _error<<"unknown frame type: "<<(int)type<<" from peer: "<<link->getId();
+            break;
+    }
+    return;
+}
+
+std::string
+gatewayCluster::announcement(void)
+{
+    return GW_CLUSTER_MAGIC + _id;
+}
+
+void
+gatewayCluster::handleAnnouncement(const char *data, size_t len)
+{
+    const size_t magicLen = strlen(GW_CLUSTER_MAGIC);
+    if((len <= magicLen) || memcmp(data, GW_CLUSTER_MAGIC, magicLen)) return;
+    std::string id(data + magicLen, len - magicLen);
+    if(!_known.count(id) && (id != _id)) _info<<"heard of peer gateway: "<<id;
+    addPeer(id);
+    return;
+}
+
+void
+gatewayCluster::maintain(void)
+{
+    for(auto &id : _known) dial(id);
+    return;
+}
+
+//a send may drop a link that fell behind and take it out of _links, the
+//sends go over a copy.
+std::vector<peerLinkPtr>
+gatewayCluster::links(void)
+{
+    std::vector<peerLinkPtr> links;
+    links.reserve(_links.size());
+    for(auto &l : _links) links.push_back(l.second);
+    return links;
+}
+
+void
+gatewayCluster::announce(uint8_t type, int uid)
+{
+    int32_t nuid = htonl(uid);
+    for(auto &link : links()) link->send(type, reinterpret_cast<char*>(&nuid), sizeof(nuid));
+    return;
+}
+
+void
+gatewayCluster::userOnline(int uid)
+{
+    if(_localUsers.insert(uid).second) announce(PEER_SESSION_ADD, uid);
+    return;
+}
+
+void
+gatewayCluster::userOffline(int uid)
+{
+    if(_localUsers.erase(uid)) announce(PEER_SESSION_DEL, uid);
+    return;
+}
+
+bool
+gatewayCluster::sendToUser(int uid, const char *frame, size_t len)
+{
+    auto itr = _remoteUsers.find(uid);
+    if(itr == _remoteUsers.end()) return false;
+    int32_t nuid = htonl(uid);
+    peerLinkPtr link = itr->second; //a dropped link takes the entry with it.
+    link->send(PEER_USER_FRAME, reinterpret_cast<char*>(&nuid), sizeof(nuid), frame, len);
+    _forwarded++;
+    return true;
+}
+
+void
+gatewayCluster::broadcast(const std::string &svcname, const char *frame, size_t len)
+{
+    if(_links.empty()) return;
+    char name[MAX_SERVICE_NAME_LEN];
+    memset(name, ' ', sizeof(name));
+    memcpy(name, svcname.data(), std::min(svcname.length(), sizeof(name)));
+    for(auto &link : links()){
+        link->send(PEER_BROADCAST, name, sizeof(name), frame, len);
+        _forwarded++;
+    }
+    return;
+}
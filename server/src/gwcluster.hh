@@ -0,0 +1,172 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//clustering of the network gateways. every gateway listens on the peer port,
+//learns of the other gateways from their multicast announcements or from the
+//configured peers and keeps one tcp link to each of them. over the links the
+//gateways tell each other which users are logged in on them, a message for a
+//user logged in on another gateway and the broadcasts of the services go to
+//the peers. a message crosses one link at most, what comes from a peer is
+//delivered locally and never forwarded again.
+//  frame         : int32 length of type and body | uint8 type | body
+//  HELLO         : node id, "<address>:<port>" of the peer port | '\0' | nonce
+//  AUTH          : hmac-sha256 of the nonce of the peer and our node id under
+//                  the cluster secret
+//  SESSIONS      : int32 uid * n, all the users of the gateway
+//  SESSION_ADD   : int32 uid
+//  SESSION_DEL   : int32 uid
+//  USER_FRAME    : int32 uid | client frame
+//  BROADCAST     : service name[MAX_SERVICE_NAME_LEN] | client frame
+//  announcement  : "AKGW0001" | node id (multicast datagram)
+//a link carries nothing else till both sides proved they hold the secret, the
+//peer then gets the users of the gateway. a link that does not authenticate in
+//GW_CLUSTER_HANDSHAKE_TIMEOUT or sends a bigger frame before it is dropped. both gateways of a pair may dial
+//each other, the link dialed by the gateway with the smaller node id is kept
+//and the other one is closed.
+#ifndef __INC_GWCLUSTER_HH
+#define __INC_GWCLUSTER_HH
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <boost/array.hpp>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#define GW_CLUSTER_MAGIC     "AKGW0001"
+#define GW_CLUSTER_MAX_FRAME (16*1024*1024) //a bigger frame is a broken peer.
+#define GW_CLUSTER_MAX_BACKLOG (64*1024*1024) //a peer this far behind is dropped and resynced on redial.
+#define GW_CLUSTER_NONCE_LEN 16
+#define GW_CLUSTER_HANDSHAKE_FRAME (1024) //biggest frame of a link that has not authenticated.
+#define GW_CLUSTER_HANDSHAKE_TIMEOUT (10) //seconds for a new link to authenticate.
+
+class gatewayCluster;
+
+class peerLink : public boost::enable_shared_from_this<peerLink>
+{
+    gatewayCluster *_cluster;
+    boost::asio::ip::tcp::socket _socket;
+    std::string _id = ""; //node id of the peer, known after its hello.
+    std::string _nonce; //ours, the peer signs it.
+    std::string _peerNonce; //we sign it.
+    bool _outbound = false; //we dialed the peer.
+    bool _closed = false;
+    bool _authenticated = false; //the peer proved it holds the secret.
+    boost::asio::deadline_timer _handshakeTimer;
+    std::set<int> _users; //users logged in on the peer.
+    boost::array<char, 5> _header;
+    std::string _body;
+    std::deque<std::string> _wq; //frames waiting for the socket.
+    size_t _wqBytes = 0;
+
+    void readHeader(void);
+    void headerComplete(const boost::system::error_code &, size_t);
+    void bodyComplete(const boost::system::error_code &, size_t);
+    void writeAsync(void);
+    void writeComplete(const boost::system::error_code &, size_t);
+    void handshakeExpired(const boost::system::error_code &);
+
+    public:
+    peerLink(gatewayCluster *cluster, boost::asio::io_service &io, bool outbound);
+    boost::asio::ip::tcp::socket& getSocket() { return _socket; }
+    std::string getId() { return _id; }
+    void setId(const std::string &id) { _id = id; }
+    std::string& nonce() { return _nonce; }
+    std::string& peerNonce() { return _peerNonce; }
+    bool isOutbound() { return _outbound; }
+    std::set<int>& users() { return _users; }
+    void start(void); //start reading the frames of the peer, it has a while to authenticate.
+    void authenticated(void); //the deadline is off and the frames may be big.
+    void send(uint8_t type, const char *body, size_t len, const char *tail = nullptr, size_t tailLen = 0);
+    void close(void);
+};
+
+typedef boost::shared_ptr<peerLink> peerLinkPtr;
+
+class gatewayCluster
+{
+    public:
+    enum
+    {
+        PEER_HELLO = 1,
+        PEER_SESSIONS = 2,
+        PEER_SESSION_ADD = 3,
+        PEER_SESSION_DEL = 4,
+        PEER_USER_FRAME = 5,
+        PEER_BROADCAST = 6,
+        PEER_AUTH = 7,
+    };
+    typedef std::function<void(int uid, const char *frame, size_t len)> userDeliveryT;
+    typedef std::function<void(const std::string &svcname, const char *frame, size_t len)> broadcastDeliveryT;
+
+    private:
+    boost::asio::io_service &_io;
+    std::string _id; //our node id.
+    std::string _secret; //shared by the gateways of the cluster.
+    boost::asio::ip::tcp::acceptor _acceptor;
+    peerLinkPtr _accepting;
+    std::set<std::string> _known; //node ids of the gateways heard of.
+    std::map<std::string, peerLinkPtr> _dialing; //node ids with a connect in progress.
+    std::set<peerLinkPtr> _pending; //links waiting for the hello and auth of the peer.
+    std::map<std::string, peerLinkPtr> _links; //node id to the link.
+    std::map<int, peerLinkPtr> _remoteUsers; //uid to the link of the gateway holding the user.
+    std::set<int> _localUsers;
+    userDeliveryT _userDelivery;
+    broadcastDeliveryT _broadcastDelivery;
+    uint64_t _forwarded = 0; //frames sent to the peers.
+    uint64_t _delivered = 0; //frames got from the peers.
+
+    void acceptAsync(void);
+    void acceptComplete(const boost::system::error_code &);
+    void dial(const std::string &id);
+    void dialComplete(peerLinkPtr, std::string, const boost::system::error_code &);
+    void linkUp(peerLinkPtr);
+    std::string proof(const std::string &nonce, const std::string &id);
+    void hello(peerLinkPtr, const std::string &body);
+    void auth(peerLinkPtr, const std::string &body);
+    void registerLink(peerLinkPtr);
+    void forgetUsers(peerLinkPtr);
+    std::vector<peerLinkPtr> links(void);
+    void announce(uint8_t type, int uid);
+
+    public:
+    //throws std::invalid_argument without a secret.
+    gatewayCluster(boost::asio::io_service &io, std::string address, unsigned short port,
+            std::string secret);
+    ~gatewayCluster();
+    std::string getId() { return _id; }
+    unsigned short getPort(void);
+    void setUserDelivery(userDeliveryT dh) { _userDelivery = dh; }
+    void setBroadcastDelivery(broadcastDeliveryT bh) { _broadcastDelivery = bh; }
+    void addPeer(const std::string &id); //"<address>:<port>", dialed if not linked yet.
+    std::string announcement(void); //datagram to multicast.
+    void handleAnnouncement(const char *data, size_t len);
+    void maintain(void); //redial the known gateways without a link, call periodically.
+    void userOnline(int uid);
+    void userOffline(int uid);
+    bool isRemoteUser(int uid) { return _remoteUsers.count(uid); }
+    bool sendToUser(int uid, const char *frame, size_t len); //false if no peer holds the user.
+    void broadcast(const std::string &svcname, const char *frame, size_t len);
+    size_t peerCount(void) { return _links.size(); }
+    uint64_t forwarded(void) { return _forwarded; }
+    uint64_t delivered(void) { return _delivered; }
+
+    //called by the links.
+    void linkDown(peerLinkPtr);
+    void frameRecvd(peerLinkPtr, uint8_t type, const std::string &body);
+};
+
+#endif
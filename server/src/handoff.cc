@@ -0,0 +1,227 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "common.hh"
+#include "handoff.hh"
+
+static bool
+readAll(int sock, char *data, size_t len)
+{
+    while(len){
+        ssize_t rc = _eintr(::recv(sock, data, len, 0));
+        if(rc < 0) THROW_ERRNO_EXCEPTION;
+        if(!rc) return false;
+        data += rc;
+        len -= rc;
+    }
+    return true;
+}
+
+void
+handoffWriter::queue(uint32_t type, const std::string &body, const int *fds, size_t nfds)
+{
+    if(nfds > HANDOFF_MAX_FDS) throw std::runtime_error("too many descriptors in a handoff record");
+    uint32_t hdr[3] = {htonl(type), htonl(nfds), htonl(body.length())};
+    chunk head;
+    head.data.assign(reinterpret_cast<char*>(hdr), sizeof(hdr));
+    head.fds.assign(fds, fds + nfds);
+    _chunks.push_back(std::move(head));
+    if(body.empty()) return;
+    chunk rest;
+    rest.data = body;
+    _chunks.push_back(std::move(rest));
+    return;
+}
+
+bool
+handoffWriter::flush(int sock)
+{
+    while(_next < _chunks.size()){
+        chunk &c = _chunks[_next];
+        char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        memset(cbuf, 0, sizeof(cbuf));
+        struct iovec iov = {&c.data[c.off], c.data.length() - c.off};
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        if(!c.off && !c.fds.empty()){
+            mh.msg_control = cbuf;
+            mh.msg_controllen = CMSG_SPACE(sizeof(int) * c.fds.size());
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(sizeof(int) * c.fds.size());
+            memcpy(CMSG_DATA(cm), c.fds.data(), sizeof(int) * c.fds.size());
+        }
+        ssize_t rc = _eintr(::sendmsg(sock, &mh, MSG_NOSIGNAL | MSG_DONTWAIT));
+        if(rc < 0){
+            if((errno == EAGAIN) || (errno == EWOULDBLOCK)) return false;
+            THROW_ERRNO_EXCEPTION;
+        }
+        c.off += rc;
+        if(c.off == c.data.length()) _next++;
+    }
+    _chunks.clear();
+    _next = 0;
+    return true;
+}
+
+bool
+recvHandoffRecord(int sock, handoffRecord &rec)
+{
+    uint32_t hdr[3];
+    char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = {hdr, sizeof(hdr)};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    ssize_t rc = _eintr(::recvmsg(sock, &mh, MSG_CMSG_CLOEXEC));
+    if(rc < 0) THROW_ERRNO_EXCEPTION;
+    if(!rc) return false;
+    rec.fds.clear();
+    for(struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)){
+        if((cm->cmsg_level != SOL_SOCKET) || (cm->cmsg_type != SCM_RIGHTS)) continue;
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int *fds = reinterpret_cast<const int*>(CMSG_DATA(cm));
+        rec.fds.insert(rec.fds.end(), fds, fds + n);
+    }
+    if((rc != sizeof(hdr)) && !readAll(sock, reinterpret_cast<char*>(hdr) + rc, sizeof(hdr) - rc))
+        throw std::runtime_error("handoff stream ended inside a record");
+    rec.type = ntohl(hdr[0]);
+    uint32_t len = ntohl(hdr[2]);
+    if((ntohl(hdr[1]) != rec.fds.size()) || (len > HANDOFF_MAX_RECORD)){
+        for(int fd : rec.fds) ::close(fd);
+        throw std::runtime_error("malformed handoff record");
+    }
+    rec.body.resize(len);
+    if(len && !readAll(sock, &rec.body[0], len))
+        throw std::runtime_error("handoff stream ended inside a record");
+    return true;
+}
+
+int
+handoffListener(int family, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int fd = _except(::socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    int on = 1;
+    try{
+        if(family != AF_UNIX) _except(::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)));
+        _except(::bind(fd, addr, addrlen));
+        _except(::listen(fd, SOMAXCONN));
+    }catch(...){
+        ::close(fd);
+        throw;
+    }
+    return fd;
+}
+
+std::string
+packHandoffClient(const handoffClient &c)
+{
+    std::string body;
+    packU32(body, c.clientid);
+    packU32(body, c.uid);
+    packBytes(body, c.ipAddress);
+    packBytes(body, c.request);
+    packU32(body, c.svcs.size());
+    for(auto &name : c.svcs) packBytes(body, name);
+    return body;
+}
+
+bool
+unpackHandoffClient(const handoffRecord &rec, handoffClient &c)
+{
+    size_t off = 0;
+    uint32_t clientid = 0, uid = 0, count = 0;
+    c.fd = rec.fds.empty() ? -1 : rec.fds[0];
+    if((rec.type != HANDOFF_CLIENT) || (rec.fds.size() != 1)) return false;
+    if(!unpackU32(rec.body, off, clientid) || !unpackU32(rec.body, off, uid) ||
+            !unpackBytes(rec.body, off, c.ipAddress) || !unpackBytes(rec.body, off, c.request) ||
+            !unpackU32(rec.body, off, count))
+        return false;
+    c.clientid = clientid;
+    c.uid = uid;
+    c.svcs.clear();
+    for(uint32_t i = 0; i < count; i++){
+        std::string name;
+        if(!unpackBytes(rec.body, off, name)) return false;
+        c.svcs.push_back(name);
+    }
+    return true;
+}
+
+int
+liftHandoffFd(int fd, int floor)
+{
+    if((fd < 0) || (fd >= floor)) return fd;
+    int nfd = ::fcntl(fd, F_DUPFD_CLOEXEC, floor);
+    if(nfd < 0) return fd;
+    _eintr(::close(fd));
+    return nfd;
+}
+
+bool
+placeHandoffClient(handoffClient &c)
+{
+    if(c.fd == c.clientid) return true;
+    if((c.clientid < 0) || (::fcntl(c.clientid, F_GETFD) >= 0) || (errno != EBADF)) return false;
+    if(::dup3(c.fd, c.clientid, O_CLOEXEC) < 0) return false;
+    _eintr(::close(c.fd));
+    c.fd = c.clientid;
+    return true;
+}
+
+void
+packU32(std::string &buf, uint32_t val)
+{
+    val = htonl(val);
+    buf.append(reinterpret_cast<char*>(&val), sizeof(val));
+    return;
+}
+
+void
+packBytes(std::string &buf, const std::string &val)
+{
+    packU32(buf, val.length());
+    buf.append(val);
+    return;
+}
+
+bool
+unpackU32(const std::string &buf, size_t &off, uint32_t &val)
+{
+    if((off + sizeof(val)) > buf.length()) return false;
+    memcpy(&val, buf.data() + off, sizeof(val));
+    val = ntohl(val);
+    off += sizeof(val);
+    return true;
+}
+
+bool
+unpackBytes(const std::string &buf, size_t &off, std::string &val)
+{
+    uint32_t len;
+    if(!unpackU32(buf, off, len) || ((off + len) > buf.length())) return false;
+    val.assign(buf.data() + off, len);
+    off += len;
+    return true;
+}
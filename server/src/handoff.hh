@@ -0,0 +1,117 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+//service handoff of the network gateway. a new gateway connects to the handoff
+//endpoint of the running one, which hands over its listening sockets, its
+//service connections and its plain websocket clients, so neither the services
+//nor the clients reconnect across a gateway restart. a client is handed over
+//once its stream stopped between two messages with nothing left to send, the
+//socket goes along with the opening request, the new gateway rebuilds the 
+//websocket session from it and reads on. tls clients (AKORP_SSL_CAPABLE) and
+//the clients that do not come to a boundary in time stay with the old gateway
+//which closes them with 1012 (service restart) over ngw.handoff_drain seconds,
+//those reconnect to the new one and log in again. the endpoint is in a 
+//runtime directory private to the user of the gateways and either end checks
+//that the other runs as that user. the old gateway sends the records without
+//blocking, the descriptors riding along:
+//  record    : uint32 type | uint32 descriptor count | uint32 length | body
+//  CLIENT    : a client, the socket. sent first so the new gateway can put 
+//              the sockets on the numbers the services know the clients by.
+//  LISTENERS : no body, the client port and the service endpoint.
+//  SERVICE   : state of a service connection, the socket and the ring segment
+//              and doorbells if the service uses the rings.
+//  DONE      : the old gateway let go of everything, the new one takes over.
+//the header goes in a send of its own so the descriptors come with it.
+#ifndef __INC_HANDOFF_HH
+#define __INC_HANDOFF_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+#define HANDOFF_MAX_FDS    (4)
+#define HANDOFF_MAX_RECORD (16*1024*1024)
+
+enum
+{
+    HANDOFF_LISTENERS = 1,
+    HANDOFF_SERVICE = 2,
+    HANDOFF_DONE = 3,
+    HANDOFF_CLIENT = 4,
+};
+
+typedef struct handoffRecord
+{
+    uint32_t type = 0;
+    std::string body;
+    std::vector<int> fds; //received descriptors, owned by the receiver.
+}handoffRecord;
+
+//records on their way out of a socket without blocking, the caller waits for
+//the socket to be writable between the flushes.
+class handoffWriter
+{
+    typedef struct chunk
+    {
+        std::string data;
+        std::vector<int> fds; //go with the first byte, not owned.
+        size_t off = 0;
+    }chunk;
+    std::vector<chunk> _chunks;
+    size_t _next = 0;
+
+    public:
+    void queue(uint32_t type, const std::string &body, const int *fds, size_t nfds);
+    bool flush(int sock); //true once all is out, throws on errors.
+};
+
+//blocking, throws on errors and returns false at the end of the stream.
+bool recvHandoffRecord(int sock, handoffRecord &rec);
+
+//a client handed over with its socket, the body of a CLIENT record.
+typedef struct handoffClient
+{
+    int clientid = -1; //descriptor on the old gateway, the services know the client by it.
+    int fd = -1;
+    int uid = 0;
+    std::string ipAddress;
+    std::string request; //opening request of the websocket.
+    std::vector<std::string> svcs; //services the client talks to.
+}handoffClient;
+
+//a listening socket for asio to assign. asio leaves the socket of an acceptor
+//it opened in the epoll set when closing it, for the kernel to take out, 
+//which it does not while the new gateway holds the socket, so the events of a 
+//listener handed over would go on coming to the old one. an assigned socket 
+//is taken out. throws on errors.
+int handoffListener(int family, const struct sockaddr *addr, socklen_t addrlen);
+
+std::string packHandoffClient(const handoffClient &c);
+//false if the record is not usable, the socket of the record is in c.fd either way.
+bool unpackHandoffClient(const handoffRecord &rec, handoffClient &c);
+//the descriptors received take the lowest numbers free, which may be those
+//of clients still to be placed. they are lifted to floor or above first, the
+//highest descriptor of the clients plus one, and the same one is returned if
+//that is not possible.
+int liftHandoffFd(int fd, int floor);
+//puts the socket on the descriptor the client had if that is free, true if
+//it is there.
+bool placeHandoffClient(handoffClient &c);
+
+void packU32(std::string &buf, uint32_t val);
+void packBytes(std::string &buf, const std::string &val); //length prefixed.
+bool unpackU32(const std::string &buf, size_t &off, uint32_t &val);
+bool unpackBytes(const std::string &buf, size_t &off, std::string &val);
+
+#endif
@@ -0,0 +1,338 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <boost/program_options.hpp>
+#include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/config/asio_no_tls_client.hpp>
+#include <websocketpp/server.hpp>
+#include <websocketpp/client.hpp>
+#include "handoff.hh"
+
+//restarts a plain websocket gateway under live clients. the clients keep
+//sending numbered messages which the gateway echoes, midway the old gateway
+//stops its connections at a message boundary and hands the listener, the
+//sockets and the opening requests to a new gateway over a unix socket the way
+//akorp_ngw does (see handoff.hh), then goes away. the new gateway adopts the
+//connections and echoes on. no client may see a close or a second open, every
+//message has to come back once and in order, and a client connecting after
+//the restart is served by the new gateway.
+template<typename base> struct leanConfig : public base
+{
+    static const size_t connection_read_buffer_size = 4096; //as the gateway.
+};
+typedef websocketpp::server<leanConfig<websocketpp::config::asio>> server;
+typedef websocketpp::client<websocketpp::config::asio_client> client;
+
+#define HANDOFF_PAUSE_TIMEOUT (1000) //milliseconds the connections get to reach a boundary.
+#define CLIENT_WINDOW (4) //messages a client has on the way.
+
+typedef struct simClient
+{
+    websocketpp::connection_hdl hdl;
+    int opens = 0;
+    int closes = 0;
+    int sent = 0;
+    int echoed = 0;
+    bool outOfOrder = false;
+}simClient;
+
+typedef struct simGateway
+{
+    server *gw = nullptr;
+    std::map<int, server::connection_ptr> conns; //by socket.
+    int opens = 0;
+    uint64_t echoes = 0;
+}simGateway;
+
+static bool
+runUntil(boost::asio::io_service &iosvc, std::function<bool()> done, int secs = 10)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(secs);
+    while(!done()){
+        if(std::chrono::steady_clock::now() > deadline) return false;
+        if(!iosvc.poll_one()) usleep(1000);
+        iosvc.reset();
+    }
+    return true;
+}
+
+static void
+startGateway(boost::asio::io_service &iosvc, simGateway &g)
+{
+    g.gw = new server();
+    g.gw->clear_access_channels(websocketpp::log::alevel::all);
+    g.gw->clear_error_channels(websocketpp::log::elevel::all);
+    g.gw->init_asio(&iosvc);
+    g.gw->set_open_handler([&g](websocketpp::connection_hdl hdl){
+            server::connection_ptr cptr = g.gw->get_con_from_hdl(hdl);
+            g.conns[cptr->get_raw_socket().native_handle()] = cptr;
+            g.opens++;
+            });
+    g.gw->set_message_handler([&g](websocketpp::connection_hdl hdl, server::message_ptr msg){
+            websocketpp::lib::error_code ec;
+            g.gw->send(hdl, msg->get_payload(), msg->get_opcode(), ec);
+            if(!ec) g.echoes++;
+            });
+    return;
+}
+
+static void
+sendNext(client &c, simClient &sc, int messages)
+{
+    while((sc.sent < messages) && ((sc.sent - sc.echoed) < CLIENT_WINDOW)){
+        websocketpp::lib::error_code ec;
+        c.send(sc.hdl, std::to_string(sc.sent), websocketpp::frame::opcode::text, ec);
+        if(ec) return;
+        sc.sent++;
+    }
+    return;
+}
+
+static void
+connectClient(client &c, simClient &sc, int port, int messages)
+{
+    websocketpp::lib::error_code ec;
+    client::connection_ptr con = c.get_connection("ws://127.0.0.1:" + std::to_string(port) + "/", ec);
+    if(ec) throw std::runtime_error("unable to connect a client: " + ec.message());
+    con->set_open_handler([&c, &sc, messages](websocketpp::connection_hdl hdl){
+            sc.hdl = hdl;
+            sc.opens++;
+            sendNext(c, sc, messages);
+            });
+    con->set_close_handler([&sc](websocketpp::connection_hdl){ sc.closes++; });
+    con->set_fail_handler([&sc](websocketpp::connection_hdl){ sc.closes++; });
+    con->set_message_handler([&c, &sc, messages](websocketpp::connection_hdl, client::message_ptr msg){
+            if(msg->get_payload() != std::to_string(sc.echoed)) sc.outOfOrder = true;
+            sc.echoed++;
+            sendNext(c, sc, messages);
+            });
+    c.connect(con);
+    return;
+}
+
+//the old gateway stops its connections at a message boundary and queues the
+//records, the connections that do not get there in time are left out.
+static size_t
+handOver(boost::asio::io_service &iosvc, simGateway &old, int sock)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDOFF_PAUSE_TIMEOUT);
+    runUntil(iosvc, [&old, deadline](){
+            bool paused = true;
+            for(auto &c : old.conns){
+                c.second->pause_for_handoff();
+                if(!c.second->ready_for_handoff()) paused = false;
+            }
+            return paused || (std::chrono::steady_clock::now() > deadline);
+            });
+    handoffWriter out;
+    size_t handed = 0;
+    for(auto &c : old.conns){
+        if(!c.second->ready_for_handoff()) continue;
+        handoffClient hc;
+        hc.clientid = c.first;
+        hc.uid = c.first + 1000;
+        hc.ipAddress = "127.0.0.1";
+        hc.request = c.second->get_handoff_request();
+        hc.svcs.push_back("kons");
+        out.queue(HANDOFF_CLIENT, packHandoffClient(hc), &c.first, 1);
+        handed++;
+    }
+    int listener = old.gw->get_listen_handle();
+    out.queue(HANDOFF_LISTENERS, std::string(), &listener, 1);
+    out.queue(HANDOFF_DONE, std::string(), nullptr, 0);
+    while(!out.flush(sock)) usleep(1000);
+    //only our descriptors of the sockets go, the old gateway exits.
+    for(auto &c : old.conns){
+        boost::system::error_code ec;
+        c.second->get_raw_socket().close(ec);
+    }
+    old.conns.clear();
+    websocketpp::lib::error_code ec;
+    old.gw->stop_listening(ec);
+    return handed;
+}
+
+//the new gateway takes the listener and carries on with the connections on
+//the descriptors they had, as akorp_ngw does.
+static size_t
+takeOver(simGateway &g, std::vector<handoffRecord> &recs, size_t &misplaced)
+{
+    std::vector<handoffClient> clients;
+    int listener = -1;
+    for(auto &rec : recs){
+        if(rec.type == HANDOFF_LISTENERS) listener = rec.fds[0];
+        else if(rec.type == HANDOFF_CLIENT){
+            handoffClient hc;
+            if(unpackHandoffClient(rec, hc)) clients.push_back(hc);
+            else ::close(hc.fd);
+        }
+    }
+    int floor = 0;
+    for(auto &hc : clients) floor = std::max(floor, hc.clientid + 1);
+    listener = liftHandoffFd(listener, floor);
+    for(auto &hc : clients) hc.fd = liftHandoffFd(hc.fd, floor);
+    websocketpp::lib::error_code ec;
+    g.gw->listen_on_handle(listener, ec);
+    if(ec) throw std::runtime_error("unable to listen on the handed listener: " + ec.message());
+    size_t adopted = 0;
+    for(auto &hc : clients){
+        //the descriptors of the old gateway are free in this process.
+        if(!placeHandoffClient(hc)) misplaced++;
+        server::connection_ptr cptr = g.gw->get_connection();
+        boost::system::error_code bec;
+        cptr->get_raw_socket().assign(boost::asio::ip::tcp::v4(), hc.fd, bec);
+        if(bec){
+            ::close(hc.fd);
+            continue;
+        }
+        if(cptr->adopt(hc.request)) continue;
+        g.conns[hc.fd] = cptr;
+        adopted++;
+    }
+    return adopted;
+}
+
+int
+main(int ac, char* av[])
+{
+    try
+    {
+        int clients = 50, messages = 200;
+        boost::program_options::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("clients", boost::program_options::value<int>(), "clients of the gateway, default 50.")
+            ("messages", boost::program_options::value<int>(), "messages every client sends, default 200.")
+        ;
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(ac, av, desc), vm);
+        boost::program_options::notify(vm);
+        if(vm.count("help")){ std::cerr << desc << "\n"; return 0; }
+        if(vm.count("clients")) clients = vm["clients"].as<int>();
+        if(vm.count("messages")) messages = vm["messages"].as<int>();
+        if((clients < 1) || (messages < 4)){
+            std::cerr<<"need at least 1 client and 4 messages\n";
+            return -1;
+        }
+
+        boost::asio::io_service iosvc;
+        simGateway old, young;
+        startGateway(iosvc, old);
+        boost::asio::ip::tcp::endpoint ep(boost::asio::ip::address::from_string("127.0.0.1"), 0);
+        websocketpp::lib::error_code lec;
+        old.gw->listen_on_handle(handoffListener(AF_INET, ep.data(), ep.size()), lec);
+        if(lec) throw std::runtime_error("unable to listen: " + lec.message());
+        old.gw->start_accept();
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        if(::getsockname(old.gw->get_listen_handle(), reinterpret_cast<struct sockaddr*>(&addr), &addrlen) < 0)
+            throw std::runtime_error("unable to find the gateway port");
+        int port = ntohs(addr.sin_port);
+
+        client c;
+        c.clear_access_channels(websocketpp::log::alevel::all);
+        c.clear_error_channels(websocketpp::log::elevel::all);
+        c.init_asio(&iosvc);
+        std::vector<simClient> sims(clients + 1);
+        for(int i = 0; i < clients; i++) connectClient(c, sims[i], port, messages);
+
+        //restart halfway through the messages.
+        bool failed = false;
+        if(!runUntil(iosvc, [&](){
+                    for(int i = 0; i < clients; i++) if(sims[i].echoed < messages / 2) return false;
+                    return true; })){
+            std::cerr<<"clients did not get halfway before the restart\n";
+            failed = true;
+        }
+        int sv[2];
+        if(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+            throw std::runtime_error("unable to create the handoff socket");
+        //the new gateway takes the records as they come, as it does in its own process.
+        std::vector<handoffRecord> recs;
+        std::thread reader([&recs, &sv](){
+                handoffRecord rec;
+                while(recvHandoffRecord(sv[1], rec)){
+                    recs.push_back(rec);
+                    if(rec.type == HANDOFF_DONE) break;
+                }
+                });
+        size_t handed = handOver(iosvc, old, sv[0]);
+        reader.join();
+        startGateway(iosvc, young);
+        size_t misplaced = 0;
+        size_t adopted = takeOver(young, recs, misplaced);
+        ::close(sv[0]);
+        ::close(sv[1]);
+        young.gw->start_accept();
+
+        //a client coming after the restart.
+        connectClient(c, sims[clients], port, messages);
+        bool done = runUntil(iosvc, [&](){
+                for(auto &sc : sims) if(sc.echoed < messages) return false;
+                return true; });
+
+        if(handed != (size_t)clients){
+            std::cerr<<"handed over "<<handed<<" of "<<clients<<" clients\n";
+            failed = true;
+        }
+        if(adopted != handed){
+            std::cerr<<"adopted "<<adopted<<" of "<<handed<<" clients handed over\n";
+            failed = true;
+        }
+        if(misplaced){
+            std::cerr<<misplaced<<" clients did not keep their descriptor\n";
+            failed = true;
+        }
+        if(!done){
+            std::cerr<<"not every message came back\n";
+            failed = true;
+        }
+        int reconnects = 0, closes = 0, disorder = 0;
+        for(auto &sc : sims){
+            reconnects += sc.opens - 1;
+            closes += sc.closes;
+            if(sc.outOfOrder) disorder++;
+        }
+        if(reconnects || closes || disorder){
+            std::cerr<<"reconnects: "<<reconnects<<" closes: "<<closes<<" out of order: "<<disorder<<"\n";
+            failed = true;
+        }
+        if(young.opens != 1){
+            std::cerr<<"the new gateway opened "<<young.opens<<" connections, only the late client should\n";
+            failed = true;
+        }
+        std::cout<<"clients: "<<clients<<" handed over: "<<handed<<" adopted: "<<adopted
+            <<" echoes old: "<<old.echoes<<" new: "<<young.echoes<<", "<<(failed ? "FAIL" : "PASS")<<std::endl;
+        for(auto &sc : sims){
+            websocketpp::lib::error_code ec;
+            c.close(sc.hdl, websocketpp::close::status::going_away, "done", ec);
+        }
+        young.conns.clear();
+        runUntil(iosvc, [](){ return false; }, 1);
+        delete old.gw;
+        delete young.gw;
+        return failed ? -1 : 0;
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "error: " << e.what() << "\n";
+        return -1;
+    }
+    return 0;
+}
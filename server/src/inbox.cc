@@ -0,0 +1,329 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+#include "inbox.hh"
+#include "log.hh"
+
+/*
+   layout:
+   entry  { box, uid, seq, timestamp, notif }
+   state  { box, head, watermark, bits : { "<word>" : NumberLong } }
+   bit n of word w stands for the sequence number w*64 + n. every update of the
+   state is a single atomic document update ($inc, $bit or a $set conditional on
+   the old watermark), so the daemons emitting and reading notifications need no
+   other coordination.
+*/
+
+bool
+notificationInbox::readState::isRead(int64_t seq) const
+{
+    if(seq <= watermark) return true;
+    auto itr = bits.find(seq / 64);
+    if(itr == bits.end()) return false;
+    return (itr->second >> (seq % 64)) & 1;
+}
+
+int64_t
+notificationInbox::readState::readAbove(void) const
+{
+    int64_t count = 0;
+    for(auto &word : bits){
+        uint64_t w = word.second;
+        int64_t base = word.first * 64;
+        if(base + 63 <= watermark || base > head) continue;
+        //mask off the sequence numbers outside of (watermark, head].
+        if(watermark >= base) w &= ~0ULL << (watermark - base + 1);
+        if(head < base + 63) w &= ~(~0ULL << (head - base + 1));
+        count += __builtin_popcountll(w);
+    }
+    return count;
+}
+
+notificationInbox::notificationInbox(std::string entryNs, std::string stateNs, std::string notifNs) :
+    _entryNs(entryNs), _stateNs(stateNs), _notifNs(notifNs)
+{
+    return;
+}
+
+std::string
+notificationInbox::boxName(int uid, int gid, const std::string &category)
+{
+    return std::to_string(uid) + "." + std::to_string(gid) + "." + category;
+}
+
+notificationInbox::readState
+notificationInbox::getState(mongo::DBClientBase &conn, const std::string &box)
+{
+    readState state;
+    mongo::BSONObj o = conn.findOne(_stateNs, QUERY("box" << box));
+    if(o.isEmpty()) return state;
+    state.head = o["head"].numberLong();
+    state.watermark = o["watermark"].numberLong();
+    if(o["bits"].isABSONObj()){
+        mongo::BSONObjIterator itr(o["bits"].embeddedObject());
+        while(itr.more()){
+            mongo::BSONElement e = itr.next();
+            state.bits[atoll(e.fieldName())] = e.numberLong();
+        }
+    }
+    return state;
+}
+
+int64_t
+notificationInbox::allocSeq(mongo::DBClientBase &conn, const std::string &box)
+{
+    std::string db = _stateNs.substr(0, _stateNs.find('.'));
+    std::string coll = _stateNs.substr(_stateNs.find('.') + 1);
+    mongo::BSONObj info;
+    mongo::BSONObj cmd = BSON("findAndModify" << coll
+            << "query" << BSON("box" << box)
+            << "update" << BSON("$inc" << BSON("head" << 1LL) << "$setOnInsert" << BSON("watermark" << 0LL))
+            << "new" << true
+            << "upsert" << true);
+    if(!conn.runCommand(db, cmd, info) || !info["value"].isABSONObj())
+        throw std::runtime_error("notificationInbox::allocSeq() findAndModify failed:" + info.toString());
+    return info["value"].embeddedObject()["head"].numberLong();
+}
+
+void
+notificationInbox::setRead(mongo::DBClientBase &conn, const std::string &box, int64_t seq)
+{
+    std::string word = "bits." + std::to_string(seq / 64);
+    long long mask = (long long)(1ULL << (seq % 64));
+    conn.update(_stateNs, QUERY("box" << box), BSON("$bit" << BSON(word << BSON("or" << mask))));
+    compact(conn, box);
+    return;
+}
+
+//move the watermark over the read sequence numbers right above it and drop the
+//bitmap words it passed. the update is conditional on the watermark we read, if
+//someone else moved it meanwhile their compaction covers ours.
+void
+notificationInbox::compact(mongo::DBClientBase &conn, const std::string &box)
+{
+    readState state = getState(conn, box);
+    int64_t watermark = state.watermark;
+    while(watermark < state.head && state.isRead(watermark + 1)) watermark++;
+    mongo::BSONObjBuilder unset;
+    for(auto &word : state.bits)
+        if(word.first * 64 + 63 <= watermark) unset.append("bits." + std::to_string(word.first), "");
+    mongo::BSONObj unsetObj = unset.obj();
+    if(watermark == state.watermark && unsetObj.isEmpty()) return;
+    mongo::BSONObjBuilder update;
+    update.append("$set", BSON("watermark" << (long long)watermark));
+    if(!unsetObj.isEmpty()) update.append("$unset", unsetObj);
+    conn.update(_stateNs, QUERY("box" << box << "watermark" << (long long)state.watermark), update.obj());
+    return;
+}
+
+int64_t
+notificationInbox::append(mongo::DBClientBase &conn, int uid, int gid,
+        const std::string &category, const std::string &notif, int64_t timestamp)
+{
+    try{
+        std::string box = boxName(uid, gid, category);
+        mongo::BSONObj old = conn.findOne(_entryNs, QUERY("notif" << notif << "uid" << uid << "box" << box));
+        if(!old.isEmpty()){
+            //renotified, the old entry is retired as read so that it is not counted twice.
+            setRead(conn, box, old["seq"].numberLong());
+            conn.remove(_entryNs, QUERY("_id" << old["_id"]), true);
+        }
+        int64_t seq = allocSeq(conn, box);
+        conn.insert(_entryNs, BSON("box" << box
+                    << "uid" << uid
+                    << "seq" << (long long)seq
+                    << "timestamp" << (long long)timestamp
+                    << "notif" << notif));
+        return seq;
+    }catch(std::exception &ex){
+        _error<<__FUNCTION__<<" failed with error:"<<ex.what();
+        throw;
+    }
+}
+
+bool
+notificationInbox::markRead(mongo::DBClientBase &conn, int uid, const std::string &notif)
+{
+    try{
+        mongo::BSONObj entry = conn.findOne(_entryNs, QUERY("notif" << notif << "uid" << uid));
+        if(entry.isEmpty()) return false;
+        setRead(conn, entry["box"].str(), entry["seq"].numberLong());
+        return true;
+    }catch(std::exception &ex){
+        _error<<__FUNCTION__<<" failed with error:"<<ex.what();
+        throw;
+    }
+}
+
+void
+notificationInbox::markAllRead(mongo::DBClientBase &conn, int uid, int gid, const std::string &category)
+{
+    try{
+        std::string box = boxName(uid, gid, category);
+        readState state = getState(conn, box);
+        if(state.watermark >= state.head) return;
+        //entries appended after the state was read stay unread, as they should.
+        mongo::BSONObjBuilder unset;
+        for(auto &word : state.bits)
+            if(word.first * 64 + 63 <= state.head) unset.append("bits." + std::to_string(word.first), "");
+        mongo::BSONObj unsetObj = unset.obj();
+        mongo::BSONObjBuilder update;
+        update.append("$set", BSON("watermark" << (long long)state.head));
+        if(!unsetObj.isEmpty()) update.append("$unset", unsetObj);
+        conn.update(_stateNs,
+                QUERY("box" << box << "watermark" << BSON("$lt" << (long long)state.head)),
+                update.obj());
+    }catch(std::exception &ex){
+        _error<<__FUNCTION__<<" failed with error:"<<ex.what();
+        throw;
+    }
+    return;
+}
+
+int64_t
+notificationInbox::unread(mongo::DBClientBase &conn, int uid, int gid, const std::string &category)
+{
+    try{
+        readState state = getState(conn, boxName(uid, gid, category));
+        return state.head - state.watermark - state.readAbove();
+    }catch(std::exception &ex){
+        _error<<__FUNCTION__<<" failed with error:"<<ex.what();
+        throw;
+    }
+}
+
+std::vector<mongo::BSONObj>
+notificationInbox::page(mongo::DBClientBase &conn, int uid, int gid,
+        const std::string &category, int64_t before, int limit)
+{
+    std::vector<mongo::BSONObj> page;
+    try{
+        std::string box = boxName(uid, gid, category);
+        mongo::BSONObj query = before ?
+            BSON("box" << box << "timestamp" << BSON("$lt" << (long long)before)) :
+            BSON("box" << box);
+        std::auto_ptr<mongo::DBClientCursor> cursor = conn.query(_entryNs,
+                mongo::Query(query).sort("seq", -1), limit);
+        if(!cursor.get()) throw std::runtime_error("query did not return a cursor");
+        std::vector<std::pair<std::string, int64_t>> entries;
+        mongo::BSONArrayBuilder ids;
+        while(cursor->more()){
+            mongo::BSONObj e = cursor->next();
+            entries.push_back(std::make_pair(e["notif"].str(), e["seq"].numberLong()));
+            ids.append(e["notif"].str());
+        }
+        if(entries.empty()) return page;
+
+        std::map<std::string, mongo::BSONObj> notifs;
+        cursor = conn.query(_notifNs, QUERY("id" << BSON("$in" << ids.arr())));
+        if(!cursor.get()) throw std::runtime_error("query did not return a cursor");
+        while(cursor->more()){
+            mongo::BSONObj n = cursor->next().getOwned();
+            notifs[n["id"].str()] = n;
+        }
+
+        readState state = getState(conn, box);
+        for(auto &entry : entries){
+            auto itr = notifs.find(entry.first);
+            if(itr == notifs.end()) continue; //notification deleted under us.
+            mongo::BSONObjBuilder b;
+            b.appendElements(itr->second.removeField("active"));
+            b.append("active", !state.isRead(entry.second));
+            page.push_back(b.obj());
+        }
+    }catch(std::exception &ex){
+        _error<<__FUNCTION__<<" failed with error:"<<ex.what();
+        throw;
+    }
+    return page;
+}
+
+int
+notificationInbox::retract(mongo::DBClientBase &conn, const mongo::BSONObj &notifQuery)
+{
+    int count = 0;
+    try{
+        mongo::BSONObj fields = BSON("id" << 1);
+        std::auto_ptr<mongo::DBClientCursor> cursor = conn.query(_notifNs,
+                mongo::Query(notifQuery), 0, 0, &fields);
+        if(!cursor.get()) throw std::runtime_error("query did not return a cursor");
+        mongo::BSONArrayBuilder ids;
+        while(cursor->more()){
+            mongo::BSONObj n = cursor->next();
+            if(n["id"].type() == mongo::String) ids.append(n["id"].str());
+        }
+        mongo::BSONObj inIds = BSON("notif" << BSON("$in" << ids.arr()));
+        cursor = conn.query(_entryNs, mongo::Query(inIds));
+        if(!cursor.get()) throw std::runtime_error("query did not return a cursor");
+        std::vector<std::pair<std::string, int64_t>> entries;
+        while(cursor->more()){
+            mongo::BSONObj e = cursor->next();
+            entries.push_back(std::make_pair(e["box"].str(), e["seq"].numberLong()));
+        }
+        //retired as read before they go so that the unread counts stay right.
+        for(auto &entry : entries) setRead(conn, entry.first, entry.second);
+        count = entries.size();
+        conn.remove(_entryNs, mongo::Query(inIds));
+    }catch(std::exception &ex){
+        _error<<__FUNCTION__<<" failed with error:"<<ex.what();
+        throw;
+    }
+    return count;
+}
+
+//recipients of a legacy notification are in one of its lists, the entries go
+//in oldest notification first so that the sequence numbers follow the time. an
+//entry already there is the inbox being ahead of the lists and is left alone,
+//which also makes an interrupted run safe to repeat.
+int
+notificationInbox::backfill(mongo::DBClientBase &conn)
+{
+    int count = 0;
+    try{
+        if(!conn.findOne(_stateNs, QUERY("box" << INBOX_BACKFILL_MARKER)).isEmpty()) return 0;
+        std::auto_ptr<mongo::DBClientCursor> cursor = conn.query(_notifNs,
+                mongo::Query(BSON("$or" << BSON_ARRAY(BSON("unchecked.0" << BSON("$exists" << true))
+                            << BSON("checked.0" << BSON("$exists" << true))))).sort("timestamp", 1));
+        if(!cursor.get()) throw std::runtime_error("query did not return a cursor");
+        while(cursor->more()){
+            mongo::BSONObj n = cursor->next();
+            if(n["id"].type() != mongo::String) continue;
+            std::string notif = n["id"].str();
+            int gid = n["owner_gid"].numberInt();
+            std::string category = n["category"].str();
+            int64_t timestamp = n["timestamp"].numberLong();
+            for(const char *list : {"unchecked", "checked"}){
+                if(n[list].type() != mongo::Array) continue;
+                bool read = !strcmp(list, "checked");
+                std::vector<mongo::BSONElement> uids = n[list].Array();
+                for(auto &u : uids){
+                    int uid = u.numberInt();
+                    std::string box = boxName(uid, gid, category);
+                    if(!conn.findOne(_entryNs, QUERY("notif" << notif << "uid" << uid << "box" << box)).isEmpty())
+                        continue;
+                    int64_t seq = append(conn, uid, gid, category, notif, timestamp);
+                    if(read) setRead(conn, box, seq);
+                    count++;
+                }
+            }
+        }
+        conn.update(_stateNs, QUERY("box" << INBOX_BACKFILL_MARKER),
+                BSON("$set" << BSON("box" << INBOX_BACKFILL_MARKER << "entries" << count)), true);
+        _info<<"notification inbox backfilled with entries:"<<count;
+    }catch(std::exception &ex){
+        _error<<__FUNCTION__<<" failed with error:"<<ex.what();
+        throw;
+    }
+    return count;
+}
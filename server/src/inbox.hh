@@ -0,0 +1,78 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//per user notification inbox.
+//a notification is shared by all its recipients, the inbox keeps one small
+//entry per recipient instead, keyed by the box (uid, gid, category) and a
+//sequence number allocated from the box. the read state of a box is a watermark
+//below which everything is read and a bitmap of the sequence numbers above the
+//watermark that were read out of order. unread count and mark all read touch
+//only the state document of the box, paging is a range over the box entries.
+#ifndef __INC_INBOX_HH
+#define __INC_INBOX_HH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "mongo/client/dbclient.h"
+
+#define INBOX_ENTRY_NS  "akorpdb.inbox"
+#define INBOX_STATE_NS  "akorpdb.inbox_state"
+#define INBOX_NOTIF_NS  "akorpdb.notif"
+#define INBOX_BACKFILL_MARKER "#backfill" //box of the state document marking the migration done.
+
+class notificationInbox
+{
+    std::string _entryNs;
+    std::string _stateNs;
+    std::string _notifNs;
+
+    typedef struct readState
+    {
+        int64_t head = 0;
+        int64_t watermark = 0;
+        std::map<int64_t, uint64_t> bits; //word index to bitmap word.
+        bool isRead(int64_t seq) const;
+        int64_t readAbove(void) const; //count of read sequence numbers in (watermark, head].
+    }readState;
+
+    readState getState(mongo::DBClientBase &conn, const std::string &box);
+    int64_t allocSeq(mongo::DBClientBase &conn, const std::string &box);
+    void setRead(mongo::DBClientBase &conn, const std::string &box, int64_t seq);
+    void compact(mongo::DBClientBase &conn, const std::string &box);
+
+    public:
+    notificationInbox(std::string entryNs = INBOX_ENTRY_NS,
+            std::string stateNs = INBOX_STATE_NS,
+            std::string notifNs = INBOX_NOTIF_NS);
+
+    static std::string boxName(int uid, int gid, const std::string &category);
+    //returns the sequence number of the entry, an entry already present for the
+    //notification is moved to the head of the box.
+    int64_t append(mongo::DBClientBase &conn, int uid, int gid,
+            const std::string &category, const std::string &notif, int64_t timestamp);
+    bool markRead(mongo::DBClientBase &conn, int uid, const std::string &notif);
+    void markAllRead(mongo::DBClientBase &conn, int uid, int gid, const std::string &category);
+    int64_t unread(mongo::DBClientBase &conn, int uid, int gid, const std::string &category);
+    //notification documents newest first, older than the timestamp if it is not
+    //0, each carries the read status of the user in the field active.
+    std::vector<mongo::BSONObj> page(mongo::DBClientBase &conn, int uid, int gid,
+            const std::string &category, int64_t before, int limit);
+    //drop the entries of the notifications matching the query from all the boxes.
+    int retract(mongo::DBClientBase &conn, const mongo::BSONObj &notifQuery);
+    //one time migration of the notifications kept in the unchecked and checked
+    //lists of the notification documents, returns the entries added. a no-op
+    //once it has run to the end.
+    int backfill(mongo::DBClientBase &conn);
+};
+
+#endif
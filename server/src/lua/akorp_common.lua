@@ -21,6 +21,56 @@ require ('luabridge')
 local stp = require ('stack_trace_plus');
 debug.traceback = stp.stacktrace;
 
+--[[
+once a service has a database pool (luabridge.dbpool) its handlers run as 
+coroutines. pooled_db() wraps the luamongo connection so the db:query, 
+db:find_one, db:insert, db:update and db:remove calls of the handlers and of 
+the objects below go to the pool and suspend the handler instead of the 
+service. they take the arguments and return what luamongo does, the rest of 
+the connection methods are passed on to it.
+]]
+function
+pooled_db(conn)
+local pdb = {};
+function pdb:query(ns, query, limit)
+    local results, err = luabridge.dbquery(ns, query, limit or 0);
+    if not results then return nil, err; end
+    local cursor = {};
+    function cursor:results()
+        local i = 0;
+        return function() i = i + 1; return results[i]; end
+    end
+    return cursor;
+end
+function pdb:find_one(ns, query) return luabridge.dbfindone(ns, query); end
+function pdb:insert(ns, obj) return luabridge.dbinsert(ns, obj); end
+function pdb:update(ns, query, obj, upsert, multi) return luabridge.dbupdate(ns, query, obj, upsert, multi); end
+function pdb:remove(ns, query, justone) return luabridge.dbremove(ns, query, justone); end
+function pdb:count(ns, query) return luabridge.dbcount(ns, query); end
+return setmetatable(pdb, { __index = function(t, method)
+    local f = conn[method];
+    if type(f) ~= "function" then return f; end
+    return function(self, ...) return f(conn, ...); end
+end });
+end
+
+--[[
+the cookie of the request a handler is serving. handlers suspended on the 
+database interleave, so it is kept per handler coroutine and not in a global.
+]]
+local request_cookies = setmetatable({}, { __mode = "k" });
+
+function
+set_request_cookie(cookie)
+request_cookies[coroutine.running() or request_cookies] = cookie;
+return;
+end
+
+function
+request_cookie()
+return request_cookies[coroutine.running() or request_cookies];
+end
+
 --[[
 Takes the org id and gives the name space of the organization. 
 ]]
@@ -106,6 +156,19 @@ akorp_activity_ns()
 return "akorpdb.activity";
 end
 
+--[[
+per user notification inbox entries and read state, maintained by luabridge.
+]]
+function 
+akorp_inbox_ns()
+return "akorpdb.inbox";
+end
+
+function 
+akorp_inbox_state_ns()
+return "akorpdb.inbox_state";
+end
+
 --[[ 
 object representing the user, all the information pertaining to the user will be
 held by this object.
@@ -411,6 +474,19 @@ end
 return notif;
 end
 
+--[[
+remove the notifications matching the query, their inbox entries go first so 
+that the unread counts of the recipients stay right.
+]]
+function
+remove_notifications(querystr)
+local count, err = luabridge.inboxretract(querystr);
+if not count then
+    error(string.format("inboxretract failed with err=%s", err));
+end
+return db:remove(akorp_notif_ns(), querystr);
+end
+
 function 
 getnotifobjbyquery(querystr)
 local notif = db:find_one(akorp_notif_ns(), querystr);
@@ -458,12 +534,27 @@ konv_object.new()
     self.favouriters = {}; -- list of users who have favourited this konversation.
     self.trackers = {}; -- list of users who are tracking this, only those users will be sent nofications on any activity.
     self.attached_object = 0; -- object which we are attached to, it can be a file, vevent or a task.
+    --[[ ancestors (ids from the root down to the immediate parent) and path 
+         ("root/.../parent/id", a subtree is a prefix range on it) are set by the
+         creator: a new thread starts them, a reply derives them from its parent.
+         replies in threads from before them have neither and are walked. ]]
+    self.ancestors = nil;
+    self.path = nil;
 	return self; 
 end 
 
+--[[
+name of the shared memory activity counter, written back to the kons document 
+by akorp_kons.
+]]
+function
+activity_counter(id)
+return "kons." .. id .. ".activity";
+end
+
 function
 konv_object:update()
-self.activity = self.activity + 1;
+self.activity = luabridge.counterincr(activity_counter(self.id), 1, self.activity) or (self.activity + 1);
 local ok, err = db:update(akorp_kons_ns(), { id = self.id }, self, true, false);
 if not ok then
 	error(string.format("db:update failed with :%s",err));
@@ -702,6 +793,25 @@ end
 return vevent;
 end
 
+--[[
+the calendar service keeps an index of the vevents, the other services tell it
+what they wrote so it can load it again. a note can be lost, the index is also
+rebuilt every cron.vevent_reindex_secs.
+]]
+function
+vevent_changed(eid)
+local err = luabridge.notifyservice("calendar", "vevent", tostring(eid));
+if err then error(string.format("notifyservice failed with err:%s", err)); end
+return;
+end
+
+function
+group_vevents_changed(gid)
+local err = luabridge.notifyservice("calendar", "group_vevents", tostring(gid));
+if err then error(string.format("notifyservice failed with err:%s", err)); end
+return;
+end
+
 function
 vevent_object_delete(oid)
 local ok, err = db:remove(akorp_events_ns(), { id = oid });
@@ -725,6 +835,7 @@ if old then
         info("notifier added to the list");
         table.insert(old.notifiers, notifier);
     end
+    old.timestamp = luabridge.currenttime();
     for i,uid in ipairs(old.notifiers) do 
         info(uid);
     --[[ move all the old notifiers in the list other than the current notifier 
@@ -735,8 +846,13 @@ if old then
             if not item_present(old.unchecked, uid) then table.insert(old.unchecked, uid); end
         end
     end
-    old.timestamp = luabridge.currenttime();
     old:update();
+    --[[ renotifying moves the entry to the head of the inbox as unread. ]]
+    for i,uid in ipairs(old.notifiers) do 
+        if uid ~= notifier then
+            luabridge.inboxappend(uid, old.owner_gid, old.category, old.id, old.timestamp);
+        end
+    end
     return old;
 end
 local notif = nil;
@@ -761,6 +877,9 @@ if notif then
     notif.unchecked = listcopy(recievers);
     remove_item(notif.unchecked, notifier);
     notif:update();
+    for i,uid in ipairs(notif.unchecked) do
+        luabridge.inboxappend(uid, group, category, notif.id, notif.timestamp);
+    end
     --info("allocating new notification success");
     return notif;
 end
@@ -32,6 +32,7 @@ CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_DEPARTURE = 2;
 CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_DISCONNECT = 3;
 CONTROL_CHANNEL_MESSAGE_TYPE_CHANNEL_ADD = 4;
 CONTROL_CHANNEL_MESSAGE_TYPE_CHANNEL_DELETE = 5;
+CONTROL_CHANNEL_MESSAGE_TYPE_SERVICE_NOTE = 12;
 
 signature = "not_set";
 function openlog(sign, logfile)
@@ -49,12 +49,21 @@ db:insert(akorp_user_ns, user);
 
 --Create the kons collection 
 db:insert(akorp_kons_ns, {});
+--ancestry path of the konv threads, subtree operations are prefix ranges on it.
+db:ensure_index(akorp_kons_ns, { path = 1 });
 
 --Create the docs collection 
 db:insert(akorp_doc_ns, {});
 
 --create the notification collection. 
 db:insert(akorp_notif_ns, {});
+db:ensure_index(akorp_notif_ns, { hierarchy = 1 });
+db:ensure_index(akorp_notif_ns, { id = 1 });
+
+--create the notification inbox collections.
+db:ensure_index(akorp_inbox_ns, { box = 1, seq = -1 });
+db:ensure_index(akorp_inbox_ns, { notif = 1, uid = 1 });
+db:ensure_index(akorp_inbox_state_ns, { box = 1 }, true);
 
 --create the notification collection. 
 db:insert(akorp_im_ns, {});
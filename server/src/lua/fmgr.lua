@@ -135,7 +135,7 @@ for i,child in ipairs(kons.children) do
         end
         --delete all the notifications related to this konv.
         local querystr = "{".. "\"".."category".."\""..":".."\"".."file".."\""..",".."\"".."kons".."\""..":".."\""..ckons.id.."\"".."}";
-        ok, err = db:remove(akorp_notif_ns(), querystr);
+        ok, err = remove_notifications(querystr);
         if not ok and err then
             error("Unable to delete the notifications for the deleted konv object.");
         end
@@ -156,27 +156,26 @@ Delete any activity object for this file.
 ]]
 function
 cleanupDbForFile(fname)
-local querystr = "{".. "\"".."category".."\""..":".."\"".."file".."\""..",".."\"".."attached_object".."\""..":".."\""..fname.."\"".."}";
-info(querystr);
-local kons, err = db:find_one(akorp_kons_ns(), querystr);
+local kons, err = luabridge.dbexec(kons_for_file_stmt, {fname});
+if err then
+    error(string.format("Unable to look up the kons object for the file err: %s", err));
+end
 if kons then
     del_children_dfs(kons); -- delete children
-    querystr = "{".. "\"".."category".."\""..":".."\"".."kons".."\""..",".."\"".."kons".."\""..":".."\""..kons.id.."\"".."}";
-    ok, err = db:remove(akorp_notif_ns(), querystr);
+    local querystr = "{".. "\"".."category".."\""..":".."\"".."kons".."\""..",".."\"".."kons".."\""..":".."\""..kons.id.."\"".."}";
+    ok, err = remove_notifications(querystr);
     if not ok and err then
         error(string.format("Unable to delete the notifications for the deleted konv object err: %s", err));
     end
     konv_object_delete(kons.id); -- delete self
 end
-querystr = "{" .. "\"" .. "category" .. "\"" .. " : " .. "\"" .. "file" .. "\"" .. "," .. "file :" .. "\"" .. fname .. "\"" .. "}";
+local querystr = "{" .. "\"" .. "category" .. "\"" .. " : " .. "\"" .. "file" .. "\"" .. "," .. "file :" .. "\"" .. fname .. "\"" .. "}";
 info(querystr);
-ok, err = db:remove(akorp_notif_ns(), querystr);
+ok, err = remove_notifications(querystr);
 if not ok and err then
     error(string.format("Unable to delete the notifications for the file object err: %s", err));
 end
-querystr = "{" .. "id" .. ":" .. "/" .. luabridge.sanitizepath(fname) .. "/".. "}";
-info(querystr);
-ok, err = db:remove(akorp_activity_ns(), querystr);
+ok, err = luabridge.dbexec(activity_for_file_stmt, {fname});
 if not ok and err then
     error(string.format("Unable to delete the activity object for the file err: %s", err));
 end
@@ -187,3 +186,13 @@ readconfig();
 db = assert(mongo.Connection.New())
 assert(db:connect(mongo_server_addr))
 info("connected to mongodb");
+--[[ the notification inbox runs on the luabridge database pool. ]]
+local estr = luabridge.dbpool(mongo_server_addr, 2);
+if estr then
+    error(string.format("Failed to create the database pool:%s", estr));
+end
+--[[ statements of the file cleanup, the file name is bound per call. ]]
+kons_for_file_stmt = assert(luabridge.dbprepare("findone", akorp_kons_ns(), 
+    '{"category" : "file", "attached_object" : "$1:string"}'));
+activity_for_file_stmt = assert(luabridge.dbprepare("remove", akorp_activity_ns(), 
+    '{"id" : "$1:substr"}'));
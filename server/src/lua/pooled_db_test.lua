@@ -0,0 +1,101 @@
+--[[
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+]]
+
+--[[
+pooled database test.
+a document with an object id, a date and the other special bson types is
+read through pooled_db() the way handle_replay_log in akorp_rtc does it,
+modified and written back with db:update. the values must come back as the
+luamongo type tables and survive the write.
+run from server/src/lua against a test mongo: lua pooled_db_test.lua [addr]
+]]
+
+package.cpath = package.cpath .. ";../obj/?.so";
+mongo = require ('mongo')
+require ('akorp_common')
+
+local addr = arg[1] or "localhost";
+local ns = "akorp_test.pooled_db";
+local failed = false;
+
+function
+check(cond, reason)
+if not cond then
+    io.stderr:write(reason .. "\n");
+    failed = true;
+end
+return cond;
+end
+
+local conn = assert(mongo.Connection.New());
+assert(conn:connect(addr));
+conn:remove(ns, {});
+
+local estr = luabridge.dbpool(addr, 2);
+assert(not estr, estr);
+local db = pooled_db(conn);
+
+local now = os.time() * 1000;
+assert(conn:insert(ns, {
+    name = "replay",
+    sent = mongo.Date(now),
+    tag = mongo.Symbol("im"),
+    blob = mongo.BinData("\0\1\2"),
+    pattern = mongo.RegEx("^a", "i"),
+    count = mongo.NumberInt(3),
+    gone = mongo.NULL(),
+    checked = { alice = false }
+}));
+
+--the read, as a cursor and as find_one.
+local result = nil;
+local q = db:query(ns, { name = "replay" });
+if check(q, "pooled query failed") then
+    for r in q:results() do result = r; end
+end
+check(result, "pooled query found nothing");
+local one = db:find_one(ns, { name = "replay" });
+check(one and (mongo.type(one._id) == "mongo.ObjectID"), "find_one _id is not an ObjectID");
+
+if result then
+    check(mongo.type(result._id) == "mongo.ObjectID", "_id is " .. mongo.type(result._id));
+    check(mongo.type(result.sent) == "mongo.Date", "sent is " .. mongo.type(result.sent));
+    check(result.sent[1] == now, "date value changed");
+    check(mongo.type(result.tag) == "mongo.Symbol", "tag is " .. mongo.type(result.tag));
+    check(mongo.type(result.blob) == "mongo.BinData", "blob is " .. mongo.type(result.blob));
+    check(mongo.type(result.pattern) == "mongo.RegEx", "pattern is " .. mongo.type(result.pattern));
+    check(mongo.type(result.gone) == "mongo.NULL", "gone is " .. mongo.type(result.gone));
+
+    --the update, as handle_replay_log makes it.
+    local id = result._id[1];
+    result.checked.alice = true;
+    local qstr = "{\"_id\": ObjectId(\"".. id .."\")}";
+    local ok, err = db:update(ns, qstr, result, false, false);
+    check(ok or not err, "pooled update failed: " .. tostring(err));
+
+    local after = conn:find_one(ns, { name = "replay" });
+    check(after and (conn:count(ns, {}) == 1), "update did not replace the document");
+    if after then
+        check(mongo.type(after._id) == "mongo.ObjectID" and after._id[1] == id, "_id not kept");
+        check(mongo.type(after.sent) == "mongo.Date" and after.sent[1] == now, "date not kept");
+        check(mongo.type(after.tag) == "mongo.Symbol", "symbol not kept");
+        check(mongo.type(after.blob) == "mongo.BinData" and after.blob[1] == "\0\1\2", "bindata not kept");
+        check(mongo.type(after.pattern) == "mongo.RegEx" and after.pattern[2] == "i", "regex not kept");
+        check(mongo.type(after.count) == "number" and after.count == 3, "count not kept");
+        check(after.checked.alice == true, "checked not updated");
+    end
+end
+
+conn:remove(ns, {});
+print("pooled_db_test, " .. (failed and "FAIL" or "PASS"));
+os.exit(failed and -1 or 0);
@@ -48,6 +48,8 @@
 #include "JSON_Base64.h"
 #include <time.h>
 #include <chrono>
+#include <sstream>
+#include <climits>
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/uuid/uuid.hpp>
@@ -58,12 +60,23 @@
 #include <openssl/sha.h>
 #include "config.hh"
 #include "nfmgr.hh"
+#include "tpool.hh"
+#include "mongo/client/dbclient.h"
+#include "inbox.hh"
+#include "metrics.hh"
+#include <thread>
+#include <atomic>
+#include <set>
+#include <memory>
 
 static service *svc = nullptr;
 static int dataRecvFuncIdx;
 static int bigDataRecvFuncIdx;
-static int ctrlRecvFuncIdx; 
+static int ctrlRecvFuncIdx = LUA_NOREF; 
 static int sigFuncIdx; 
+static std::mutex configLock; //shards read the configuration on their threads.
+static void callLuaHandler(lua_State *l, int nargs, const char *caller);
+static void handleControlMesg(lua_State *l, service *svc, service::controlMessage &cmsg);
 
 __attribute__((constructor))
 static void
@@ -81,6 +94,185 @@ unloadLibrary(void)
     return;
 }
 
+/*
+   sharded lua runtime.
+   a service is one lua state driven by svc->run() on one thread and tops out at 
+   a core. lb.createshards() starts N more lua states each on its own thread and 
+   event loop, the main state keeps the gateway channels and routes every request 
+   to a shard by hashing an affinity field of the message (uid, gid or the object 
+   id) so that requests for the same user/group/object are served in order by 
+   the same shard. shards share no lua state, shared state must go through the 
+   ocache or the database. the shard runs the service script with the global 
+   akorp_shard_index set, the script is expected to install its data handler and 
+   not create the service again.
+   what a shard may call from its thread: the sends (serialized by the send lock 
+   of the service), the gateway and service notes (one mq_send each), the ocache 
+   and counters (interprocess locks), the configuration getters (configLock), 
+   the database and inbox calls (run on the pool, the inbox keeps no state) and 
+   the timers (handed to the main loop). setting up the service, the process, 
+   the logger and the pool is for the main state only and fails in a shard. 
+   every control message is passed on to the control handler of each shard on 
+   the shard's loop.
+*/
+typedef struct luaShard
+{
+    int index = 0;
+    lua_State *l = nullptr;
+    int dataRecvFuncIdx = LUA_NOREF;
+    int ctrlRecvFuncIdx = LUA_NOREF;
+    boost::asio::io_service loop;
+    boost::asio::io_service::work *work = nullptr;
+    std::thread *thr = nullptr;
+}luaShard;
+
+static std::vector<luaShard*> shards;
+static std::string shardAffinityField = "uid";
+
+//shard owning the lua state, nullptr for the main state.
+static luaShard*
+getShard(lua_State *l)
+{
+    __GROW_LUA_STACK(l, 1);
+    lua_getfield(l, LUA_REGISTRYINDEX, "akorp_shard");
+    luaShard *shard = static_cast<luaShard*>(lua_touserdata(l, -1));
+    lua_pop(l, 1);
+    return shard;
+}
+
+//setting up the service or the process is for the main state only.
+static void
+checkMainState(lua_State *l)
+{
+    if(getShard(l)) throw std::logic_error("not allowed in a shard, the main state does it");
+    return;
+}
+
+//event loop the lua state is driven by.
+static boost::asio::io_service*
+getLoop(lua_State *l)
+{
+    luaShard *shard = getShard(l);
+    return shard ? &shard->loop : svc->getAsioSvcRef();
+}
+
+//the service timers and fd table belong to the main event loop, shards hand 
+//over the work to it.
+static void
+runOnServiceLoop(lua_State *l, std::function<void()> work)
+{
+    if(getShard(l)) svc->getAsioSvcRef()->post(work);
+    else work();
+    return;
+}
+
+static void
+handleShardRequest(luaShard *shard, int clientid, int channelid, std::string data)
+{
+    lua_State *l = shard->l;
+    if(shard->dataRecvFuncIdx == LUA_NOREF){
+        _error<<"luabridge.cc::handleShardRequest() shard "<<shard->index
+            <<" has no data handler, dropping request.";
+        return;
+    }
+    __LUA_RAWGETI(l, LUA_REGISTRYINDEX, shard->dataRecvFuncIdx);
+    __LUA_PUSHNUMBER(l, clientid);
+    __LUA_PUSHNUMBER(l, channelid);
+    __LUA_PUSHSTRING(l, data.c_str());
+    callLuaHandler(l, 3, __FUNCTION__);
+    lua_settop(l, 0);
+    return;
+}
+
+//pick the shard by the affinity field of the request, requests missing the 
+//field stay with the client so that they are at least ordered per client.
+static void
+routeToShard(int clientid, int channelid, std::string &data)
+{
+    std::string key;
+    try{
+        JSONNode n = libjson::parse(data);
+        JSONNode::iterator i = n.find(shardAffinityField);
+        if(i != n.end()) key = i->as_string();
+    }catch(std::exception &ex){
+        _warn<<"luabridge.cc::routeToShard() unable to parse request:"<<ex.what();
+    }
+    if(key.empty()) key = std::to_string(clientid);
+    luaShard *shard = shards[std::hash<std::string>()(key) % shards.size()];
+    shard->loop.post(std::bind(handleShardRequest, shard, clientid, channelid, data));
+    return;
+}
+
+static void
+runShard(luaShard *shard)
+{
+    try{
+        shard->loop.run();
+    }catch(std::exception &ex){
+        _error<<"luabridge.cc::runShard() shard "<<shard->index
+            <<" exited with exception:"<<ex.what();
+    }
+    return;
+}
+
+//arguments: shard count, service script and the affinity field (uid, gid or id).
+static int
+createshards(lua_State *l)
+{
+    try{
+        int count = lua_tonumber(l, 1);
+        const char *script = lua_tostring(l, 2);
+        const char *field = lua_tostring(l, 3);
+        if(!svc) throw std::invalid_argument("no service: create service first");
+        if(getShard(l)) throw std::invalid_argument("shards cannot create shards");
+        if((count <= 0) || !script) throw std::invalid_argument("shard count or script missing");
+        if(shards.size()) throw std::invalid_argument("shards already created");
+        if(field) shardAffinityField = field;
+        //the shards get the control messages through the main state's handler.
+        if(ctrlRecvFuncIdx == LUA_NOREF)
+            svc->setControlRecvHandler(std::bind(handleControlMesg, 
+                        l, 
+                        std::placeholders::_1, 
+                        std::placeholders::_2));
+        for(int i = 0; i < count; i++){
+            luaShard *shard = new luaShard;
+            shard->index = i;
+            shard->l = luaL_newstate();
+            luaL_openlibs(shard->l);
+            lua_pushlightuserdata(shard->l, shard);
+            lua_setfield(shard->l, LUA_REGISTRYINDEX, "akorp_shard");
+            lua_pushnumber(shard->l, i);
+            lua_setglobal(shard->l, "akorp_shard_index");
+            //the script is loaded here so that errors surface to the caller, 
+            //the state is handed over to the shard thread afterwards.
+            if(luaL_dofile(shard->l, script)){
+                std::string error = lua_tostring(shard->l, -1);
+                lua_close(shard->l);
+                delete shard;
+                throw std::runtime_error("shard script failed:" + error);
+            }
+            shard->work = new boost::asio::io_service::work(shard->loop);
+            shard->thr = new std::thread(runShard, shard);
+            shards.push_back(shard);
+            _info<<"luabridge.cc::createshards() started shard: "<<i;
+        }
+    }catch(std::exception &ex){
+        std::string error = "luabridge.cc::createshards() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+static int
+getshardindex(lua_State *l)
+{
+    luaShard *shard = getShard(l);
+    if(shard) __LUA_PUSHNUMBER(l, shard->index);
+    else __LUA_PUSHNIL(l);
+    return 1;
+}
+
 //gimme a new uuid.
 static int
 generateUuid(lua_State *l)
@@ -137,6 +329,7 @@ createservice(lua_State *l)
 {
     try 
     {
+        checkMainState(l);
         const char *svcname = lua_tostring(l, 1);
         int len = strlen(svcname);
         if (!len){
@@ -166,6 +359,7 @@ deleteservice(lua_State *l)
 {
     try 
     {
+        checkMainState(l);
         if(svc){
             svc->stop();
             delete svc;
@@ -191,6 +385,7 @@ run(lua_State *l)
 {
     try 
     {
+        checkMainState(l);
         if(svc) svc->run();
         else{
             __LUA_PUSHSTRING(l, "luabridge.cc::run() no service to run: create \
@@ -213,6 +408,7 @@ dispatch(lua_State *l)
 {
     try 
     {
+        checkMainState(l);
         if(svc) svc->dispatch();
         else{
             __LUA_PUSHSTRING(l, "luabridge.cc::dispatch() no service to call \
@@ -364,17 +560,14 @@ handleRequest(lua_State *l, service *svc, int clientid, int channelid, std::stri
 {
     //std::cerr<<"handleRequest invoked.";
     //std::cerr<<"recv data from the client.";
+    if(shards.size()){ routeToShard(clientid, channelid, data); return; }
     __LUA_RAWGETI(l, LUA_REGISTRYINDEX, dataRecvFuncIdx);
     __LUA_PUSHNUMBER(l, clientid);
     __LUA_PUSHNUMBER(l, channelid);
     __LUA_PUSHSTRING(l, data.c_str()); //on expensive string copy is done here this is done 
                                      //to copy the data from C++ to lua data system so 
                                      //that lua can do automatic garbage collection.
-    int err = lua_pcall(l, 3, LUA_MULTRET, 0);
-    if(err){
-        std::string error = std::string(__FUNCTION__) + "()" + " error calling lua function.";
-        error.append(lua_tostring(l, -1));
-    }
+    callLuaHandler(l, 3, __FUNCTION__);
     lua_settop(l, 0);
     return;
 }
@@ -414,7 +607,12 @@ setdatarecvhandler(lua_State *l)
 {
     try 
     {
-        if(svc){
+        luaShard *shard = getShard(l);
+        if(shard){
+            //shards get their requests routed from the main state.
+            luaL_checktype(l, 1, LUA_TFUNCTION);
+            shard->dataRecvFuncIdx = luaL_ref(l, LUA_REGISTRYINDEX);
+        }else if(svc){
             svc->setDataRecvHandler(std::bind(handleRequest, 
                                     l,
                                     std::placeholders::_1,
@@ -450,6 +648,7 @@ setbigdatarecvhandler(lua_State *l)
 {
     try 
     {
+        checkMainState(l);
         if(svc){
             svc->setDataRecvHandler(std::bind(handleBigDataRequest, 
                                     l,
@@ -480,10 +679,10 @@ setbigdatarecvhandler(lua_State *l)
 }
 
 static void
-handleControlMesg(lua_State *l, service *svc, service::controlMessage &cmsg)
+callControlHandler(lua_State *l, int funcIdx, service::controlMessage &cmsg)
 {
     //std::cerr<<"recvd control message:";
-    __LUA_RAWGETI(l, LUA_REGISTRYINDEX, ctrlRecvFuncIdx);
+    __LUA_RAWGETI(l, LUA_REGISTRYINDEX, funcIdx);
     //a c structure translates to a table in lua. we have to dynamically construct the table here
     //depending on the type of the structure. and invoke the handler with the table.
     lua_newtable(l);
@@ -517,8 +716,28 @@ handleControlMesg(lua_State *l, service *svc, service::controlMessage &cmsg)
         case service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_HEART_BEAT:
                 break;
 
+        case service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_SERVICE_NOTE:
+            {
+                std::string sender(cmsg.sender, strnlen(cmsg.sender, sizeof(cmsg.sender)));
+                std::string topic(cmsg.serviceNote.topic, strnlen(cmsg.serviceNote.topic, sizeof(cmsg.serviceNote.topic)));
+                std::string key(cmsg.serviceNote.key, strnlen(cmsg.serviceNote.key, sizeof(cmsg.serviceNote.key)));
+                __LUA_PUSHSTRING(l, "sender");
+                __LUA_PUSHSTRING(l, sender.c_str());
+                lua_settable(l, -3);
+
+                __LUA_PUSHSTRING(l, "topic");
+                __LUA_PUSHSTRING(l, topic.c_str());
+                lua_settable(l, -3);
+
+                __LUA_PUSHSTRING(l, "key");
+                __LUA_PUSHSTRING(l, key.c_str());
+                lua_settable(l, -3);
+            }
+                break;
+
         default:
         std::cerr<<"Unknown control message type:";
+        lua_settop(l, 0);
         return;
     }
     //call the lua function using lua_pcall.
@@ -532,6 +751,25 @@ handleControlMesg(lua_State *l, service *svc, service::controlMessage &cmsg)
     return;
 }
 
+static void
+handleShardControlMesg(luaShard *shard, service::controlMessage cmsg)
+{
+    if(shard->ctrlRecvFuncIdx == LUA_NOREF) return;
+    callControlHandler(shard->l, shard->ctrlRecvFuncIdx, cmsg);
+    return;
+}
+
+//every shard gets a copy of the message on its own loop, the clients of a 
+//shard are not known here.
+static void
+handleControlMesg(lua_State *l, service *svc, service::controlMessage &cmsg)
+{
+    for(auto shard : shards)
+        shard->loop.post(std::bind(handleShardControlMesg, shard, cmsg));
+    if(ctrlRecvFuncIdx != LUA_NOREF) callControlHandler(l, ctrlRecvFuncIdx, cmsg);
+    return;
+}
+
 static void
 handleSignals(lua_State *l, service *svc, int sig)
 {
@@ -553,7 +791,12 @@ setcontrolrecvhandler(lua_State *l)
 {
     try
     {
-        if(svc){ 
+        luaShard *shard = getShard(l);
+        if(shard){
+            //shards get the control messages passed on by the main state.
+            luaL_checktype(l, 1, LUA_TFUNCTION);
+            shard->ctrlRecvFuncIdx = luaL_ref(l, LUA_REGISTRYINDEX);
+        }else if(svc){ 
             svc->setControlRecvHandler(std::bind(handleControlMesg, 
                         l, 
                         std::placeholders::_1, 
@@ -586,6 +829,7 @@ setsignalhandler(lua_State *l)
 {
     try
     {
+        checkMainState(l);
         if(svc){
             svc->setSignalHandler(std::bind(handleSignals, 
                         l, 
@@ -731,6 +975,34 @@ getuidforclientid(lua_State *l)
 //send a message to a particular user, the message is a json object. 
 //the arguments are just a userid and the message and the length of 
 //the message.
+//events which are json objects get the epoch and sequence number of the 
+//user event log as their first fields, the client remembers the last ones 
+//to resume from.
+static std::string
+stampEvent(int64_t epoch, int64_t seq, const std::string &event)
+{
+    size_t open = event.find_first_not_of(" \t\r\n");
+    if((open == std::string::npos) || (event[open] != '{')) return event;
+    size_t next = event.find_first_not_of(" \t\r\n", open + 1);
+    std::string stamp = "\"evepoch\":" + std::to_string(epoch) + 
+        ",\"evseq\":" + std::to_string(seq);
+    if((next != std::string::npos) && (event[next] != '}')) stamp += ",";
+    return event.substr(0, open + 1) + stamp + event.substr(open + 1);
+}
+
+//only events and notifications are logged and stamped, the responses to a 
+//request go to the connection which asked and are of no use to replay.
+static bool
+isEvent(const std::string &msg)
+{
+    size_t key = msg.find("\"mesgtype\"");
+    if(key == std::string::npos) return false;
+    size_t value = msg.find_first_not_of(" \t\r\n:", key + strlen("\"mesgtype\""));
+    if(value == std::string::npos) return false;
+    return !msg.compare(value, strlen("\"event\""), "\"event\"") || 
+        !msg.compare(value, strlen("\"notification\""), "\"notification\"");
+}
+
 static int
 send2user(lua_State *l)
 {
@@ -738,13 +1010,16 @@ send2user(lua_State *l)
     {
         int uid = lua_tonumber(l, 1);
         const char *msg = lua_tostring(l, 2);
-        int msgLen = strlen(msg);
-        if(uid){
+        int msgLen = msg ? strlen(msg) : 0;
+        if(uid && msgLen && svc){
+            //logged first so that a user offline or on a dropping connection 
+            //can pick it up later with replayevents().
+            std::string event(msg, msgLen);
+            if(isEvent(event)) event = logEvent(uid, svc->getName(), event, stampEvent);
             int clientid = getClientIdForUid(uid);
-            if (clientid && msgLen){
-                svc->sendToClient(clientid, -1, nonconst(msg), msgLen);
-                return 0;
-            }
+            if (clientid) svc->sendToClient(clientid, -1, event.data(), event.length());
+            else svc->sendToUser(uid, event.data(), event.length()); //may be on another gateway.
+            return 0;
         }
         __LUA_PUSHSTRING(l, "luabridge.cc::send2user() invalid parameters given");
         return 1;
@@ -758,6 +1033,68 @@ send2user(lua_State *l)
     }
 }
 
+//notifyservice(svcname, topic, key), the instances of the service get a control
+//message with the topic and the key. nothing on success, the error otherwise.
+static int
+notifyservice(lua_State *l)
+{
+    try
+    {
+        const char *svcname = lua_tostring(l, 1);
+        const char *topic = lua_tostring(l, 2);
+        const char *key = lua_tostring(l, 3);
+        if(svcname && topic && key && svc){
+            svc->notifyService(svcname, topic, key);
+            return 0;
+        }
+        __LUA_PUSHSTRING(l, "luabridge.cc::notifyservice() invalid parameters given");
+        return 1;
+    }
+    catch(std::exception &ex)
+    {
+        std::string error = "luabridge.cc::notifyservice() failed with:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 1;
+    }
+}
+
+//send the events logged for the user after the sequence number to the client, 
+//each one as the service which sent it. returns true, the head and epoch to 
+//resume from next time and the count of events sent. returns false, head and 
+//epoch if the events cannot be replayed and the client has to reload.
+static int
+replayevents(lua_State *l)
+{
+    try
+    {
+        int uid = lua_tonumber(l, 1);
+        int clientid = lua_tonumber(l, 2);
+        int64_t epoch = lua_tonumber(l, 3);
+        int64_t seq = lua_tonumber(l, 4);
+        if(!svc) throw std::invalid_argument("no service: create service first");
+        if(!uid || !clientid) throw std::invalid_argument("invalid uid or clientid");
+        std::vector<loggedEvent> events;
+        int64_t head = 0, curEpoch = 0;
+        bool ok = getEventsSince(uid, epoch, seq, events, head, curEpoch);
+        for(auto &e : events)
+            svc->sendToClient(clientid, -1, e.svcname, e.event.data(), e.event.length());
+        lua_pushboolean(l, ok);
+        lua_pushnumber(l, head);
+        lua_pushnumber(l, curEpoch);
+        lua_pushnumber(l, events.size());
+        return 4;
+    }
+    catch(std::exception &ex)
+    {
+        lua_pushnil(l);
+        std::string error = "luabridge.cc::replayevents() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+}
+
 //a client tuple contains the uid and gid and the clientid.
 static int
 putclienttuple(lua_State *l)
@@ -769,6 +1106,7 @@ putclienttuple(lua_State *l)
         int gid = lua_tonumber(l, 3);
         if (uid && clientid && gid){
             putSession(uid, clientid, gid);
+            if(svc) svc->announceLogin(uid, clientid);
             return 0;
         }
         __LUA_PUSHSTRING(l, "invalid clientid or uid or gid, cannot be 0 or -ve");
@@ -792,6 +1130,7 @@ remclienttuple(lua_State *l)
         int uid = lua_tonumber(l, 1);
         if(uid){
             delSession(uid);
+            if(svc) svc->announceLogout(uid);
             return 0;
         }
         __LUA_PUSHSTRING(l, "invalid clientid or uid or gid, cannot be 0 or -ve");
@@ -1008,6 +1347,7 @@ static int
 openlog(lua_State *l)
 {
     try {
+        checkMainState(l);
         openLog(lua_tostring(l, 1));
         __LUA_PUSHNUMBER(l, 1);
         return 1;
@@ -1024,6 +1364,7 @@ static int
 setlevel(lua_State *l)
 {
     try {
+        checkMainState(l);
         setLogLevel(lua_tonumber(l, 1));
     }catch(std::exception& ex){
         std::string error = "luabridge.cc::setlevel() Unable to set the severity:";
@@ -1219,6 +1560,7 @@ getintconfig(lua_State *l)
     try {
         const char *key = lua_tostring(l, 1);
         assert(key);
+        std::lock_guard<std::mutex> lock(configLock);
         __LUA_PUSHNUMBER(l, getConfigValue<int>(key));
     }catch(std::exception& ex){
         __LUA_PUSHNIL(l);
@@ -1236,7 +1578,11 @@ getstrconfig(lua_State *l)
     try {
         const char *key = lua_tostring(l, 1);
         assert(key);
-        std::string value = getConfigValue<std::string>(key);
+        std::string value;
+        {
+            std::lock_guard<std::mutex> lock(configLock);
+            value = getConfigValue<std::string>(key);
+        }
         __LUA_PUSHSTRING(l, value.c_str());
     }catch(std::exception& ex){
         __LUA_PUSHNIL(l);
@@ -1255,6 +1601,7 @@ loadconfig(lua_State *l)
     try {
         const char *fname = lua_tostring(l, 1);
         assert(fname);
+        std::lock_guard<std::mutex> lock(configLock);
         loadConfig(fname);
     }catch(std::exception& ex){
         std::string error = "luabridge.cc::loadconfig() Unable to put the string config:";
@@ -1272,6 +1619,7 @@ daemonize(lua_State *l)
 {
     try
     {
+        checkMainState(l);
         _except(daemon(0, 1)); //dont change directory and then dont close the stderr and stdout.
     }
     catch(std::exception &ex)
@@ -1369,15 +1717,26 @@ luaTimerCallback(service *svc, std::string cookie, lua_State *l, int timerFuncId
     //call the lua callback.
     __LUA_RAWGETI(l, LUA_REGISTRYINDEX, timerFuncIdx);
     __LUA_PUSHSTRING(l, cookie.c_str());
-    int err = lua_pcall(l, 1, LUA_MULTRET, 0);
-    if(err){
-        std::string error = std::string("luabridge.cc::luaTimerCallback(): error calling lua function:");
-        error.append(lua_tostring(l, -1));
-    }
+    callLuaHandler(l, 1, __FUNCTION__);
     lua_settop(l, 0);
     return;
 }
 
+//timer callbacks of a shard are run on the shard's event loop.
+static std::function<void(service*, std::string)>
+luaTimerHandler(lua_State *l, int timerFuncIdx)
+{
+    luaShard *shard = getShard(l);
+    if(!shard) 
+        return std::bind(luaTimerCallback, 
+                std::placeholders::_1, 
+                std::placeholders::_2, 
+                l, 
+                timerFuncIdx);
+    return [shard, l, timerFuncIdx](service *s, std::string cookie){ 
+        shard->loop.post(std::bind(luaTimerCallback, s, cookie, l, timerFuncIdx)); };
+}
+
 static int
 addoneshottimer(lua_State *l)
 {
@@ -1385,13 +1744,9 @@ addoneshottimer(lua_State *l)
         int count = lua_tonumber(l, 2);
         std::string cookie = lua_tostring(l, 1);
         luaL_checktype(l, 3, LUA_TFUNCTION);
-        svc->addOneShotTimer(cookie, 
-                count, 
-                std::bind(luaTimerCallback, 
-                    svc, 
-                    cookie, 
-                    l, 
-                    luaL_ref(l, LUA_REGISTRYINDEX)));
+        auto callback = luaTimerHandler(l, luaL_ref(l, LUA_REGISTRYINDEX));
+        runOnServiceLoop(l, [cookie, count, callback](){ 
+                svc->addOneShotTimer(cookie, count, callback); });
     }catch(std::exception& ex){
         __LUA_PUSHNUMBER(l, -1);
         std::string error = "service::addoneshottimer() failed with error:";
@@ -1409,14 +1764,9 @@ addperiodictimer(lua_State *l)
         int count = lua_tonumber(l, 2);
         std::string cookie = lua_tostring(l, 1);
         luaL_checktype(l, 3, LUA_TFUNCTION);
-        svc->addPeriodicTimer(cookie, 
-                count, 
-                std::bind(luaTimerCallback, 
-                    svc, 
-                    cookie, 
-                    l, 
-                    luaL_ref(l, 
-                        LUA_REGISTRYINDEX)));
+        auto callback = luaTimerHandler(l, luaL_ref(l, LUA_REGISTRYINDEX));
+        runOnServiceLoop(l, [cookie, count, callback](){ 
+                svc->addPeriodicTimer(cookie, count, callback); });
     }catch(std::exception& ex){
         __LUA_PUSHNUMBER(l, -1);
         std::string error = "service::addperiodictimer() failed with error:";
@@ -1432,7 +1782,7 @@ starttimer(lua_State *l)
 {
     try {
         std::string cookie = lua_tostring(l, 1);
-        svc->startTimer(cookie);
+        runOnServiceLoop(l, [cookie](){ svc->startTimer(cookie); });
     }catch(std::exception& ex){
         __LUA_PUSHNUMBER(l, -1);
         std::string error = "service::startimer() failed with error:";
@@ -1448,7 +1798,7 @@ deletetimer(lua_State *l)
 {
     try {
         std::string cookie = lua_tostring(l, 1);
-        svc->deleteTimer(cookie);
+        runOnServiceLoop(l, [cookie](){ svc->deleteTimer(cookie); });
     }catch(std::exception& ex){
         __LUA_PUSHNUMBER(l, -1);
         std::string error = "service::deletetimer() failed with error:";
@@ -1464,7 +1814,7 @@ stoptimer(lua_State *l)
 {
     try {
         std::string cookie = lua_tostring(l, 1);
-        svc->stopTimer(cookie);
+        runOnServiceLoop(l, [cookie](){ svc->stopTimer(cookie); });
     }catch(std::exception& ex){
         __LUA_PUSHNUMBER(l, -1);
         std::string error = "service::stoptimer() failed with error:";
@@ -1569,6 +1919,120 @@ deluidgidmapping(lua_State *l)
     return 0;
 }
 
+//shared memory counters, see ocache.cc. 
+//returns the value or nil if the counter is not cached.
+static int
+counterget(lua_State *l)
+{
+    try{
+        const char *key = lua_tostring(l, 1);
+        if(!key) throw std::invalid_argument("counter key missing");
+        int64_t value = 0;
+        if(getCounter(key, value)) __LUA_PUSHNUMBER(l, value);
+        else __LUA_PUSHNIL(l);
+    }catch(std::exception &ex){
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::counterget() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return 1;
+}
+
+//arguments: key, delta and an optional seed. with a seed a missing counter is 
+//created with the seed value, without it a missing counter is left alone and 
+//nil is returned.
+static int
+counterincr(lua_State *l)
+{
+    try{
+        const char *key = lua_tostring(l, 1);
+        if(!key) throw std::invalid_argument("counter key missing");
+        int64_t delta = lua_tonumber(l, 2);
+        int64_t value = 0;
+        if(lua_isnumber(l, 3)){
+            value = seedAndIncrCounter(key, lua_tonumber(l, 3), delta);
+        }else if(!incrCounter(key, delta, value)){
+            __LUA_PUSHNIL(l);
+            return 1;
+        }
+        __LUA_PUSHNUMBER(l, value);
+    }catch(std::exception &ex){
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::counterincr() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return 1;
+}
+
+static int
+counterset(lua_State *l)
+{
+    try{
+        const char *key = lua_tostring(l, 1);
+        if(!key) throw std::invalid_argument("counter key missing");
+        setCounter(key, lua_tonumber(l, 2));
+    }catch(std::exception &ex){
+        std::string error = "luabridge.cc::counterset() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+//returns the value if it changed since the last flush, the caller writes it
+//back as it is gone from the cache now.
+static int
+counterdel(lua_State *l)
+{
+    try{
+        const char *key = lua_tostring(l, 1);
+        if(!key) throw std::invalid_argument("counter key missing");
+        int64_t unflushed = 0;
+        if(delCounter(key, unflushed)) __LUA_PUSHNUMBER(l, unflushed);
+        else __LUA_PUSHNIL(l);
+    }catch(std::exception &ex){
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::counterdel() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return 1;
+}
+
+//returns a table of key, value for the counters under the prefix which 
+//changed since the last flush, to be written back to the database before the
+//next flush. an optional idle time in seconds evicts the clean counters under
+//the prefix not updated for that long.
+static int
+counterflush(lua_State *l)
+{
+    try{
+        const char *prefix = lua_tostring(l, 1);
+        int idle = lua_isnumber(l, 2) ? lua_tonumber(l, 2) : 0;
+        auto dirty = collectDirtyCounters(prefix ? prefix : "", idle);
+        __GROW_LUA_STACK(l, 3);
+        lua_newtable(l);
+        for(auto &kv : dirty){
+            __LUA_PUSHSTRING(l, kv.first.c_str());
+            __LUA_PUSHNUMBER(l, kv.second);
+            lua_settable(l, -3);
+        }
+    }catch(std::exception &ex){
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::counterflush() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return 1;
+}
+
 //perform a bind mount requires 2 filesystem paths.
 static int
 bindmount(lua_State *l)
@@ -1591,58 +2055,1438 @@ bindmount(lua_State *l)
     return 0;
 }
 
-extern "C" 
-{
-	int
-		luaopen_luabridge(lua_State *L)
-		{
-			static const luaL_Reg bridgeMap [] = 
-			{ 
-				{"privchange", privchange},
-				{"getclientid", getclientid},
-				{"putclienttuple", putclienttuple},
-				{"remclienttuple", remclienttuple},
-				{"getuidforclientid", getuidforclientid},
-				{"printsessiontbl", printsessiontbl},
-				{"delsessiontbl", delsessiontbl},
-                {"createservice", createservice},
-                {"run", run},
-                {"dispatch", dispatch},
-                {"send2client", send2client},
-				{"send2user", send2user},
-                {"send2gw", send2gw},
-                {"isgroupmember", isgroupmember},
-                {"adduidgidmapping", adduidgidmapping},
-                {"deluidgidmapping", deluidgidmapping},
-
-                {"setdatarecvhandler", setdatarecvhandler},
-                {"setbigdatarecvhandler", setbigdatarecvhandler},
-                {"setcontrolrecvhandler", setcontrolrecvhandler},
-                {"setsignalhandler", setsignalhandler},
+/*
+   asynchronous database access for the lua services. 
+   the mongodb driver is blocking, one slow query or lock wait on the event loop 
+   thread stalls every other client of the daemon. once lb.dbpool() is called the 
+   data and timer handlers run as lua coroutines, the db* functions below hand 
+   the request to a bounded pool of worker threads each borrowing a connection 
+   from the pool and suspend the handler, the handler is resumed from the event 
+   loop when the result arrives. independent requests overlap and the service is 
+   bound by the concurrency of the database instead of the sum of query latencies.
+   a db* call made outside of a handler coroutine (main chunk, user coroutine or 
+   across a pcall(), lua 5.1 cannot yield across a pcall) runs synchronously on a 
+   pooled connection.
+*/
+class dbConnectionPool
+{
+    std::vector<mongo::DBClientConnection*> _free;
+    std::mutex _lock;
+    std::condition_variable _available;
+
+    public:
+    dbConnectionPool(std::string addr, size_t count)
+    {
+        for(size_t i = 0; i < count; i++){
+            std::string errmsg;
+            mongo::DBClientConnection *conn = new mongo::DBClientConnection(true, nullptr);
+            if(!conn->connect(addr, errmsg)){
+                delete conn;
+                for(auto c : _free) delete c;
+                throw std::runtime_error("dbConnectionPool() unable to connect to " + addr + ":" + errmsg);
+            }
+            _free.push_back(conn);
+        }
+        return;
+    }
 
-                {"addoneshottimer", addoneshottimer},
-                {"addperiodictimer", addperiodictimer},
-                {"starttimer", starttimer},
-                {"stoptimer", stoptimer},
-                {"deletetimer", deletetimer},
+    //borrow a connection, blocks till one is returned if all are in use.
+    mongo::DBClientConnection* checkout()
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _available.wait(lock, [this]{ return !_free.empty(); });
+        mongo::DBClientConnection *conn = _free.back();
+        _free.pop_back();
+        return conn;
+    }
 
-                {"getcopyofbigdata", getcopyofbigdata},
-                {"destroybigdata", destroybigdata},
-                {"setservicehandle", setservicehandle},
+    void checkin(mongo::DBClientConnection *conn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _free.push_back(conn);
+        }
+        _available.notify_one();
+        return;
+    }
 
-                {"broadcast", broadcast},
-                {"deleteservice", deleteservice},
-                {"currenttime", currenttime},
-                {"gensitethumbnail", gensitethumbnail},
-                {"genuuid", generateUuid},
+    ~dbConnectionPool() { for(auto conn : _free) delete conn; }
+};
 
-                {"openlog", openlog},
-                {"setlevel", setlevel},
-                {"getlevel", getlevel},
+struct dbCursor;
 
-                {"info", info},
-                {"warn", warn},
-                {"error", error},
+typedef struct dbRequest
+{
+    enum
+    {
+        DB_QUERY,
+        DB_FINDONE,
+        DB_COUNT,
+        DB_INSERT,
+        DB_UPDATE,
+        DB_REMOVE,
+        DB_CALL,
+        DB_CURSOR, //a query whose results are handed out through a cursor.
+        DB_GETMORE, //the next batch of a cursor.
+    };
+    int op = DB_QUERY;
+    int resultOp = DB_QUERY; //DB_CALL results are returned like the results of this op.
+    std::function<void(mongo::DBClientBase&, dbRequest*)> call;
+    std::string ns;
+    mongo::BSONObj query;
+    mongo::BSONObj obj;
+    int limit = 0; //of a cursor, the documents still to fetch. 0 for all.
+    long long cursorId = 0; //server side cursor of a DB_CURSOR/DB_GETMORE, 0 once exhausted.
+    dbCursor *cursor = nullptr; //lua cursor a DB_GETMORE refills.
+    bool upsert = false;
+    bool multi = false;
+    std::vector<mongo::BSONObj> results; //owned copies, safe to hand across threads.
+    long long count = 0;
+    std::string error;
+    lua_State *co = nullptr; //handler coroutine suspended on this request.
+    boost::asio::io_service *loop = nullptr; //event loop driving the coroutine.
+}dbRequest;
+
+static dbConnectionPool *dbPool = nullptr;
+static ThreadPool *dbWorkers = nullptr;
+static std::map<lua_State*, int> handlerThreads; //running handler coroutines and their registry refs.
+static std::mutex handlerThreadsLock; //shards run handlers on their own threads.
+static std::mutex dbPoolLock;
+static std::atomic<int> dbOutstanding(0);
+static int dbMaxOutstanding = 1024;
+static const int dbCursorBatch = 100; //documents a cursor fetches at a time.
+
+static metricHistogram &handlerLatency = metrics().histogram("lua_handler_us"); //a handler ran till it returned or yielded.
+static metricCounter &handlerErrors = metrics().counter("lua_handler_errors");
+static metricHistogram &dbLatency = metrics().histogram("lua_db_request_us"); //pool checkout included.
+
+//take the batch at hand, the server keeps the cursor of the rest till the next
+//DB_GETMORE. it is dropped once the limit is reached.
+static void
+fetchCursorBatch(mongo::DBClientBase *conn, mongo::DBClientCursor &cursor, dbRequest *req)
+{
+    if(cursor.more()){
+        while(cursor.moreInCurrentBatch()) req->results.push_back(cursor.next().getOwned());
+    }
+    req->cursorId = cursor.getCursorId();
+    cursor.decouple();
+    if(req->cursorId && req->limit && ((req->limit -= (int)req->results.size()) <= 0)){
+        conn->killCursor(req->cursorId);
+        req->cursorId = 0;
+    }
+    return;
+}
+
+//worker side, runs the request on a pooled connection. 
+static void
+runDbRequest(dbRequest *req)
+{
+    metricTimer timer(dbLatency);
+    mongo::DBClientConnection *conn = dbPool->checkout();
+    try{
+        switch(req->op)
+        {
+            case dbRequest::DB_QUERY:
+                {
+                    std::auto_ptr<mongo::DBClientCursor> cursor = conn->query(req->ns, 
+                            mongo::Query(req->query), 
+                            req->limit);
+                    if(!cursor.get()) throw std::runtime_error("query did not return a cursor");
+                    while(cursor->more()) req->results.push_back(cursor->next().getOwned());
+                }
+                break;
+
+            case dbRequest::DB_CURSOR:
+                {
+                    std::auto_ptr<mongo::DBClientCursor> cursor = conn->query(req->ns, 
+                            mongo::Query(req->query), 
+                            req->limit, 0, nullptr, 0, dbCursorBatch);
+                    if(!cursor.get()) throw std::runtime_error("query did not return a cursor");
+                    fetchCursorBatch(conn, *cursor, req);
+                }
+                break;
+
+            case dbRequest::DB_GETMORE:
+                {
+                    mongo::DBClientCursor cursor(conn, req->ns, req->cursorId, 
+                            req->limit ? std::min(req->limit, dbCursorBatch) : dbCursorBatch, 0);
+                    fetchCursorBatch(conn, cursor, req);
+                }
+                break;
+
+            case dbRequest::DB_FINDONE:
+                {
+                    mongo::BSONObj o = conn->findOne(req->ns, mongo::Query(req->query));
+                    if(!o.isEmpty()) req->results.push_back(o.getOwned());
+                }
+                break;
+
+            case dbRequest::DB_COUNT:
+                req->count = conn->count(req->ns, req->query);
+                break;
+
+            case dbRequest::DB_INSERT:
+                conn->insert(req->ns, req->obj);
+                req->error = conn->getLastError();
+                break;
+
+            case dbRequest::DB_UPDATE:
+                conn->update(req->ns, mongo::Query(req->query), req->obj, req->upsert, req->multi);
+                req->error = conn->getLastError();
+                break;
+
+            case dbRequest::DB_REMOVE:
+                conn->remove(req->ns, mongo::Query(req->query), !req->multi);
+                req->error = conn->getLastError();
+                break;
+
+            case dbRequest::DB_CALL:
+                req->call(*conn, req);
+                break;
+        }
+    }
+    catch(std::exception &ex){
+        req->error = ex.what();
+    }
+    dbPool->checkin(conn);
+    return;
+}
+
+static void pushBsonObj(lua_State *l, const mongo::BSONObj &o, bool isArray);
+
+//t() of a bson type table gives its value as luamongo does.
+static int
+bsonTypeValue(lua_State *l)
+{
+    luaL_checktype(l, 1, LUA_TTABLE);
+    __LUA_RAWGETI(l, 1, 1);
+    __LUA_RAWGETI(l, 1, 2);
+    return 2;
+}
+
+static int
+bsonTypeToString(lua_State *l)
+{
+    luaL_checktype(l, 1, LUA_TTABLE);
+    __LUA_RAWGETI(l, 1, 1);
+    if(lua_isnil(l, -1)) __LUA_PUSHSTRING(l, "null");
+    else lua_pushstring(l, lua_tostring(l, -1));
+    return 1;
+}
+
+//special values come as the tables luamongo makes for them, the value at [1]
+//and the type in the __bsontype of the metatable, so that a document read 
+//from the pool is written back as it was read. the metatable of a type is
+//made once in every lua state.
+static void
+pushBsonTypeTable(lua_State *l, int type)
+{
+    __GROW_LUA_STACK(l, 3);
+    lua_newtable(l);
+    std::string name = "luabridge.bsontype." + std::to_string(type);
+    if(luaL_newmetatable(l, name.c_str())){
+        __LUA_PUSHNUMBER(l, type);
+        lua_setfield(l, -2, "__bsontype");
+        lua_pushcfunction(l, bsonTypeValue);
+        lua_setfield(l, -2, "__call");
+        lua_pushcfunction(l, bsonTypeToString);
+        lua_setfield(l, -2, "__tostring");
+    }
+    lua_setmetatable(l, -2);
+    return;
+}
+
+static void
+pushBsonElement(lua_State *l, const mongo::BSONElement &e)
+{
+    switch(e.type())
+    {
+        case mongo::NumberDouble:
+        case mongo::NumberInt:
+        case mongo::NumberLong:
+            __LUA_PUSHNUMBER(l, e.numberDouble());
+            break;
+        case mongo::String:
+        case mongo::Code:
+            __LUA_PUSHSTRING(l, e.valuestr());
+            break;
+        case mongo::Bool:
+            __LUA_PUSHBOOLEAN(l, e.boolean());
+            break;
+        case mongo::jstOID:
+            pushBsonTypeTable(l, mongo::jstOID);
+            __LUA_PUSHSTRING(l, e.__oid().str().c_str());
+            lua_rawseti(l, -2, 1);
+            break;
+        case mongo::Date:
+            pushBsonTypeTable(l, mongo::Date);
+            __LUA_PUSHNUMBER(l, e.date().millis);
+            lua_rawseti(l, -2, 1);
+            break;
+        case mongo::Timestamp:
+            //luamongo hands a timestamp over as a date.
+            pushBsonTypeTable(l, mongo::Date);
+            __LUA_PUSHNUMBER(l, e.timestampTime().millis);
+            lua_rawseti(l, -2, 1);
+            break;
+        case mongo::Symbol:
+            pushBsonTypeTable(l, mongo::Symbol);
+            __LUA_PUSHSTRING(l, e.valuestr());
+            lua_rawseti(l, -2, 1);
+            break;
+        case mongo::BinData:
+            {
+                int len = 0;
+                const char *data = e.binData(len);
+                pushBsonTypeTable(l, mongo::BinData);
+                lua_pushlstring(l, data, len);
+                lua_rawseti(l, -2, 1);
+            }
+            break;
+        case mongo::RegEx:
+            pushBsonTypeTable(l, mongo::RegEx);
+            __LUA_PUSHSTRING(l, e.regex());
+            lua_rawseti(l, -2, 1);
+            __LUA_PUSHSTRING(l, e.regexFlags());
+            lua_rawseti(l, -2, 2);
+            break;
+        case mongo::jstNULL:
+            pushBsonTypeTable(l, mongo::jstNULL);
+            break;
+        case mongo::Object:
+            pushBsonObj(l, e.embeddedObject(), false);
+            break;
+        case mongo::Array:
+            pushBsonObj(l, e.embeddedObject(), true);
+            break;
+        default:
+            __LUA_PUSHNIL(l);
+    }
+    return;
+}
+
+//documents translate to tables, arrays to tables indexed from 1 like luamongo does.
+static void
+pushBsonObj(lua_State *l, const mongo::BSONObj &o, bool isArray)
+{
+    __GROW_LUA_STACK(l, 3);
+    lua_newtable(l);
+    int index = 1;
+    mongo::BSONObjIterator itr(o);
+    while(itr.more()){
+        mongo::BSONElement e = itr.next();
+        if(isArray) __LUA_PUSHNUMBER(l, index++);
+        else __LUA_PUSHSTRING(l, e.fieldName());
+        pushBsonElement(l, e);
+        lua_settable(l, -3);
+    }
+    return;
+}
+
+/*
+   query results of a prepared statement are handed to lua as a cursor, it holds
+   one batch of documents at a time and a document becomes a table only when the 
+   handler asks for it. the documents stay in their compact bson form till then.
+   the next batch is fetched when this one runs out, the handler waits on it like
+   on any other database request.
+     cursor:next()  : the next document or nil at the end.
+     cursor:count() : number of documents of the batch not yet returned.
+*/
+typedef struct dbCursor
+{
+    std::vector<mongo::BSONObj> docs;
+    size_t next = 0;
+    std::string ns;
+    long long id = 0; //server side cursor of the rest, 0 once all are fetched.
+    int limit = 0; //documents still to fetch, 0 for all.
+}dbCursor;
+
+#define DB_CURSOR_METATABLE "luabridge.cursor"
+
+static dbCursor*
+checkDbCursor(lua_State *l)
+{
+    return static_cast<dbCursor*>(luaL_checkudata(l, 1, DB_CURSOR_METATABLE));
+}
+
+static int submitDbRequest(lua_State *l, dbRequest *req);
+
+static int
+cursornext(lua_State *l)
+{
+    dbCursor *cursor = checkDbCursor(l);
+    if(cursor->next < cursor->docs.size()){
+        pushBsonObj(l, cursor->docs[cursor->next], false);
+        cursor->docs[cursor->next++] = mongo::BSONObj(); //done with it, let it go.
+        return 1;
+    }
+    if(!cursor->id){
+        __LUA_PUSHNIL(l);
+        return 1;
+    }
+    //the cursor is on our stack, it outlives the request.
+    dbRequest *req = new dbRequest;
+    req->op = dbRequest::DB_GETMORE;
+    req->ns = cursor->ns;
+    req->cursorId = cursor->id;
+    req->limit = cursor->limit;
+    req->cursor = cursor;
+    cursor->id = 0; //till the request hands it back.
+    return submitDbRequest(l, req);
+}
+
+static int
+cursorcount(lua_State *l)
+{
+    dbCursor *cursor = checkDbCursor(l);
+    __LUA_PUSHNUMBER(l, cursor->docs.size() - cursor->next);
+    return 1;
+}
+
+//a cursor dropped before its end still holds the rest on the server.
+static int
+cursorgc(lua_State *l)
+{
+    dbCursor *cursor = checkDbCursor(l);
+    long long id = cursor->id;
+    if(id && dbWorkers){
+        dbWorkers->enqueue([id](){
+                mongo::DBClientConnection *conn = dbPool->checkout();
+                try{
+                    conn->killCursor(id);
+                }catch(std::exception &ex){
+                    _error<<"luabridge.cc::cursorgc() unable to kill the cursor:"<<ex.what();
+                }
+                dbPool->checkin(conn);
+                });
+    }
+    cursor->~dbCursor();
+    return 0;
+}
+
+//the first batch is moved into the cursor, the metatable is made on first use
+//in every lua state.
+static void
+pushDbCursor(lua_State *l, dbRequest *req)
+{
+    __GROW_LUA_STACK(l, 4);
+    dbCursor *cursor = new (lua_newuserdata(l, sizeof(dbCursor))) dbCursor;
+    cursor->docs.swap(req->results);
+    cursor->ns = req->ns;
+    cursor->id = req->cursorId;
+    cursor->limit = req->limit;
+    if(luaL_newmetatable(l, DB_CURSOR_METATABLE)){
+        static const luaL_Reg cursorMap [] = 
+        {
+            {"next", cursornext},
+            {"count", cursorcount},
+            { nullptr, nullptr}
+        };
+        lua_newtable(l);
+        luaL_register(l, nullptr, cursorMap);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, cursorgc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_setmetatable(l, -2);
+    return;
+}
+
+//results are returned as value or nil, error like the rest of luabridge.
+static int
+pushDbResult(lua_State *l, dbRequest *req)
+{
+    if(!req->error.empty()){
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::pushDbResult() database request failed:";
+        error += req->error;
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    switch((req->op == dbRequest::DB_CALL) ? req->resultOp : req->op)
+    {
+        case dbRequest::DB_QUERY:
+            __GROW_LUA_STACK(l, 2);
+            lua_newtable(l);
+            for(size_t i = 0; i < req->results.size(); i++){
+                pushBsonObj(l, req->results[i], false);
+                lua_rawseti(l, -2, i + 1);
+            }
+            break;
+        case dbRequest::DB_FINDONE:
+            if(req->results.size()) pushBsonObj(l, req->results[0], false);
+            else __LUA_PUSHNIL(l);
+            break;
+        case dbRequest::DB_COUNT:
+            __LUA_PUSHNUMBER(l, req->count);
+            break;
+        case dbRequest::DB_CURSOR:
+            pushDbCursor(l, req);
+            break;
+        case dbRequest::DB_GETMORE:
+            req->cursor->docs.swap(req->results);
+            req->cursor->next = 0;
+            req->cursor->id = req->cursorId;
+            req->cursor->limit = req->limit;
+            if(req->cursor->docs.empty()){
+                __LUA_PUSHNIL(l);
+                break;
+            }
+            pushBsonObj(l, req->cursor->docs[0], false);
+            req->cursor->docs[req->cursor->next++] = mongo::BSONObj();
+            break;
+        default:
+            __LUA_PUSHBOOLEAN(l, true);
+    }
+    return 1;
+}
+
+//resume a handler coroutine, drop our reference once it runs to completion.
+static void
+resumeLuaHandler(lua_State *co, int nargs)
+{
+    int rc = 0;
+    {
+        metricTimer timer(handlerLatency);
+        rc = lua_resume(co, nargs);
+    }
+    if(rc == LUA_YIELD) return; //waiting on another database request.
+    if(rc){
+        handlerErrors.add();
+        _error<<"luabridge.cc::resumeLuaHandler() error in lua handler:"<<lua_tostring(co, -1);
+    }
+    std::lock_guard<std::mutex> lock(handlerThreadsLock);
+    auto itr = handlerThreads.find(co);
+    if(itr != handlerThreads.end()){
+        luaL_unref(co, LUA_REGISTRYINDEX, itr->second);
+        handlerThreads.erase(itr);
+    }
+    return;
+}
+
+//event loop side, hand the result to the suspended handler.
+static void
+completeDbRequest(dbRequest *req)
+{
+    dbOutstanding--;
+    lua_State *co = req->co;
+    int nres = pushDbResult(co, req);
+    delete req;
+    resumeLuaHandler(co, nres);
+    return;
+}
+
+//function and arguments are on the top of the stack. 
+static void
+callLuaHandler(lua_State *l, int nargs, const char *caller)
+{
+    if(!dbPool){
+        int err = 0;
+        {
+            metricTimer timer(handlerLatency);
+            err = lua_pcall(l, nargs, LUA_MULTRET, 0);
+        }
+        if(err){
+            handlerErrors.add();
+            _error<<"luabridge.cc::"<<caller<<"() error calling lua function:"<<lua_tostring(l, -1);
+        }
+        return;
+    }
+    lua_State *co = lua_newthread(l);
+    {
+        std::lock_guard<std::mutex> lock(handlerThreadsLock);
+        handlerThreads[co] = luaL_ref(l, LUA_REGISTRYINDEX); //anchor the coroutine till it finishes.
+    }
+    lua_xmove(l, co, nargs + 1);
+    resumeLuaHandler(co, nargs);
+    return;
+}
+
+//lua 5.1 cannot yield across a C function (pcall, a callback of table.sort
+//...) or a for iterator between the handler and the db call, it raises 
+//"attempt to yield across metamethod/C-call boundary" instead.
+static bool
+canYield(lua_State *l)
+{
+    lua_Debug ar;
+    for(int level = 1; lua_getstack(l, level, &ar); level++){
+        if(!lua_getinfo(l, "Sn", &ar)) return false;
+        if(!strcmp(ar.what, "C")) return false;
+        if(ar.namewhat && !strcmp(ar.namewhat, "for iterator")) return false;
+    }
+    return true;
+}
+
+static int
+submitDbRequest(lua_State *l, dbRequest *req)
+{
+    bool suspendable = false;
+    {
+        std::lock_guard<std::mutex> lock(handlerThreadsLock);
+        suspendable = (handlerThreads.find(l) != handlerThreads.end());
+    }
+    suspendable = suspendable && canYield(l);
+    //not in a handler coroutine, under a pcall or too much outstanding work, run
+    //in place. the latter also stops us reading new requests till the database
+    //catches up.
+    if(!suspendable || (dbOutstanding >= dbMaxOutstanding)){
+        runDbRequest(req);
+        int nres = pushDbResult(l, req);
+        delete req;
+        return nres;
+    }
+    req->co = l;
+    req->loop = getLoop(l);
+    dbOutstanding++;
+    dbWorkers->enqueue([req](){
+            runDbRequest(req);
+            req->loop->post(std::bind(completeDbRequest, req));
+            });
+    return lua_yield(l, 0);
+}
+
+static void appendLuaValue(lua_State *l, const char *key, int idx, mongo::BSONObjBuilder &b, int depth);
+
+//a table of consecutive integer keys from 1 is an array, as luamongo sees it.
+static bool
+isLuaArray(lua_State *l, int idx)
+{
+    int len = 0;
+    for(lua_pushnil(l); lua_next(l, idx); lua_pop(l, 1)){
+        ++len;
+        if((lua_type(l, -2) != LUA_TNUMBER) || (lua_tointeger(l, -2) != len)){
+            lua_pop(l, 2);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+appendLuaTable(lua_State *l, int idx, mongo::BSONObjBuilder &b, int depth)
+{
+    if(depth > 64) throw std::invalid_argument("table nested too deep");
+    __GROW_LUA_STACK(l, 4);
+    if(isLuaArray(l, idx)){
+        size_t len = lua_objlen(l, idx);
+        for(size_t i = 1; i <= len; i++){
+            __LUA_RAWGETI(l, idx, i);
+            appendLuaValue(l, std::to_string(i - 1).c_str(), lua_gettop(l), b, depth + 1);
+            lua_pop(l, 1);
+        }
+        return;
+    }
+    for(lua_pushnil(l); lua_next(l, idx); lua_pop(l, 1)){
+        std::string key;
+        if(lua_type(l, -2) == LUA_TSTRING) key = lua_tostring(l, -2);
+        else if(lua_type(l, -2) == LUA_TNUMBER){
+            std::stringstream ss; //no lua_tostring, it would change the key under lua_next.
+            ss<<lua_tonumber(l, -2);
+            key = ss.str();
+        }else continue;
+        appendLuaValue(l, key.c_str(), lua_gettop(l), b, depth + 1);
+    }
+    return;
+}
+
+//values are stored as luamongo stores them, whole numbers as integers and the
+//tables with a __bsontype (mongo.ObjectId(), mongo.Date() ...) as that type.
+static void
+appendLuaValue(lua_State *l, const char *key, int idx, mongo::BSONObjBuilder &b, int depth)
+{
+    switch(lua_type(l, idx))
+    {
+        case LUA_TNUMBER:
+            {
+                double num = lua_tonumber(l, idx);
+                if(num != floor(num)) b.append(key, num);
+                else if((num >= INT_MIN) && (num <= INT_MAX)) b.append(key, (int)num);
+                else b.append(key, (long long)num);
+            }
+            break;
+        case LUA_TSTRING:
+            {
+                size_t len = 0;
+                const char *str = lua_tolstring(l, idx, &len);
+                b.append(key, std::string(str, len));
+            }
+            break;
+        case LUA_TBOOLEAN:
+            b.appendBool(key, lua_toboolean(l, idx));
+            break;
+        case LUA_TNIL:
+            b.appendNull(key);
+            break;
+        case LUA_TTABLE:
+            if(luaL_getmetafield(l, idx, "__bsontype")){
+                int type = lua_tointeger(l, -1);
+                lua_pop(l, 1);
+                __LUA_RAWGETI(l, idx, 1);
+                switch(type)
+                {
+                    case mongo::jstOID:
+                        {
+                            mongo::OID oid;
+                            oid.init(lua_tostring(l, -1) ? lua_tostring(l, -1) : "");
+                            b.appendOID(key, &oid);
+                        }
+                        break;
+                    case mongo::Date:
+                        b.appendDate(key, (long long)lua_tonumber(l, -1));
+                        break;
+                    case mongo::NumberInt:
+                        b.append(key, (int)lua_tointeger(l, -1));
+                        break;
+                    case mongo::NumberLong:
+                        b.append(key, (long long)lua_tonumber(l, -1));
+                        break;
+                    case mongo::jstNULL:
+                        b.appendNull(key);
+                        break;
+                    case mongo::Symbol:
+                        if(lua_tostring(l, -1)) b.appendSymbol(key, lua_tostring(l, -1));
+                        break;
+                    case mongo::BinData:
+                        {
+                            size_t len = 0;
+                            const char *data = lua_tolstring(l, -1, &len);
+                            if(data) b.appendBinData(key, len, mongo::BinDataGeneral, data);
+                        }
+                        break;
+                    case mongo::RegEx:
+                        {
+                            __LUA_RAWGETI(l, idx, 2);
+                            const char *regex = lua_tostring(l, -2), *options = lua_tostring(l, -1);
+                            if(regex) b.appendRegex(key, regex, options ? options : "");
+                            lua_pop(l, 1);
+                        }
+                        break;
+                    default:
+                        lua_pop(l, 1);
+                        throw std::invalid_argument(std::string("unsupported bson type for field ") + key);
+                }
+                lua_pop(l, 1);
+                break;
+            }
+            {
+                bool array = isLuaArray(l, idx);
+                mongo::BSONObjBuilder sub(array ? b.subarrayStart(key) : b.subobjStart(key));
+                appendLuaTable(l, idx, sub, depth);
+                sub.done();
+            }
+            break;
+        default:
+            break; //functions and the like are not stored, as in luamongo.
+    }
+    return;
+}
+
+//a query or object is given as json text or as a lua table.
+static mongo::BSONObj
+getBsonArg(lua_State *l, int idx)
+{
+    if(lua_istable(l, idx)){
+        mongo::BSONObjBuilder b;
+        appendLuaTable(l, (idx < 0) ? (lua_gettop(l) + idx + 1) : idx, b, 0);
+        return b.obj();
+    }
+    const char *json = lua_tostring(l, idx);
+    if(!json) return mongo::BSONObj();
+    return mongo::fromjson(json);
+}
+
+static std::string
+getStringArg(lua_State *l, int idx, const char *what)
+{
+    const char *str = lua_tostring(l, idx);
+    if(!str) throw std::invalid_argument(std::string(what) + " argument missing");
+    return str;
+}
+
+static dbRequest*
+newDbRequest(lua_State *l, int op)
+{
+    if(!dbPool) 
+        throw std::invalid_argument("no database pool: call dbpool() first");
+    const char *ns = lua_tostring(l, 1);
+    if(!ns) throw std::invalid_argument("namespace argument missing");
+    dbRequest *req = new dbRequest;
+    req->op = op;
+    req->ns = ns;
+    return req;
+}
+
+//create the connection pool, arguments are the server address and the pool size.
+//the pool is created once by the main state and sized by that call, the shards 
+//use it as it is.
+static int
+dbpool(lua_State *l)
+{
+    try{
+        checkMainState(l);
+        const char *addr = lua_tostring(l, 1);
+        int count = lua_tonumber(l, 2);
+        if(!addr || (count <= 0)) throw std::invalid_argument("address or pool size missing");
+        std::lock_guard<std::mutex> lock(dbPoolLock);
+        if(dbPool) throw std::logic_error("database pool already created");
+        if(lua_isnumber(l, 3)) dbMaxOutstanding = lua_tonumber(l, 3);
+        dbPool = new dbConnectionPool(addr, count);
+        dbWorkers = new ThreadPool(count);
+    }catch(std::exception &ex){
+        std::string error = "luabridge.cc::dbpool() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+static int
+dbquery(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        req = newDbRequest(l, dbRequest::DB_QUERY);
+        req->query = getBsonArg(l, 2);
+        req->limit = lua_tonumber(l, 3);
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::dbquery() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+static int
+dbfindone(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        req = newDbRequest(l, dbRequest::DB_FINDONE);
+        req->query = getBsonArg(l, 2);
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::dbfindone() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+static int
+dbcount(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        req = newDbRequest(l, dbRequest::DB_COUNT);
+        req->query = getBsonArg(l, 2);
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::dbcount() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+static int
+dbinsert(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        req = newDbRequest(l, dbRequest::DB_INSERT);
+        req->obj = getBsonArg(l, 2);
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::dbinsert() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+//arguments: namespace, query, object, upsert, multi.
+static int
+dbupdate(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        req = newDbRequest(l, dbRequest::DB_UPDATE);
+        req->query = getBsonArg(l, 2);
+        req->obj = getBsonArg(l, 3);
+        req->upsert = lua_toboolean(l, 4);
+        req->multi = lua_toboolean(l, 5);
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::dbupdate() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+//arguments: namespace, query, justone.
+static int
+dbremove(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        req = newDbRequest(l, dbRequest::DB_REMOVE);
+        req->query = getBsonArg(l, 2);
+        req->multi = !lua_toboolean(l, 3);
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::dbremove() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+/*
+   prepared statements. the query (and the update object) json is parsed once 
+   into a bson template and dbexec() only binds the parameters into it, so the 
+   handlers neither build query strings nor pay for parsing them per call, and a
+   string parameter can never change the shape of the query. a string value of 
+   the form "$<n>[:<type>]" in the template is the placeholder of the n'th 
+   (from 1) parameter, types:
+     string, int, long, double, bool : the parameter must be of that lua type.
+     substr : a string matched anywhere in the field, regex characters escaped.
+     prefix : a string the field starts with, escaped the same. the anchored 
+              regex is served as a range scan on an index of the field.
+     any    : the default, numbers go as doubles like luamongo stores them.
+   statements are kept for the life of the process and shared by the shards, 
+   preparing the same statement twice returns the same handle.
+*/
+typedef struct dbPlaceholder
+{
+    enum
+    {
+        PH_ANY,
+        PH_STRING,
+        PH_INT,
+        PH_LONG,
+        PH_DOUBLE,
+        PH_BOOL,
+        PH_SUBSTR,
+        PH_PREFIX,
+    };
+    int index = 0;
+    int type = PH_ANY;
+}dbPlaceholder;
+
+typedef struct dbStatement
+{
+    int op = dbRequest::DB_QUERY;
+    std::string ns;
+    mongo::BSONObj query;
+    mongo::BSONObj obj;
+    std::map<const char*, dbPlaceholder> placeholders; //keyed by the element data in the templates.
+    std::set<const char*> containers; //objects and arrays holding placeholders.
+    int nparams = 0;
+}dbStatement;
+
+static std::vector<dbStatement*> dbStatements;
+static std::map<std::string, int> dbStatementIds;
+static std::mutex dbStatementsLock;
+
+static bool
+parsePlaceholder(const mongo::BSONElement &e, dbPlaceholder &ph)
+{
+    static const std::map<std::string, int> types = 
+    {
+        {"any", dbPlaceholder::PH_ANY},
+        {"string", dbPlaceholder::PH_STRING},
+        {"int", dbPlaceholder::PH_INT},
+        {"long", dbPlaceholder::PH_LONG},
+        {"double", dbPlaceholder::PH_DOUBLE},
+        {"bool", dbPlaceholder::PH_BOOL},
+        {"substr", dbPlaceholder::PH_SUBSTR},
+        {"prefix", dbPlaceholder::PH_PREFIX},
+    };
+    if(e.type() != mongo::String) return false;
+    const char *str = e.valuestr();
+    if((str[0] != '$') || !isdigit(str[1])) return false;
+    char *end = nullptr;
+    long index = strtol(str + 1, &end, 10);
+    if((*end != '\0') && (*end != ':')) return false;
+    if((index <= 0) || (index > 64)) 
+        throw std::invalid_argument(std::string("placeholder index out of range: ") + str);
+    ph.index = index;
+    if(*end == ':'){
+        auto itr = types.find(end + 1);
+        if(itr == types.end()) 
+            throw std::invalid_argument(std::string("unknown placeholder type: ") + str);
+        ph.type = itr->second;
+    }
+    return true;
+}
+
+//record the placeholders of the template, returns true if it has any.
+static bool
+compileTemplate(dbStatement *stmt, const mongo::BSONObj &tmpl)
+{
+    bool found = false;
+    mongo::BSONObjIterator itr(tmpl);
+    while(itr.more()){
+        mongo::BSONElement e = itr.next();
+        dbPlaceholder ph;
+        if((e.type() == mongo::Object) || (e.type() == mongo::Array)){
+            if(compileTemplate(stmt, e.embeddedObject())){
+                stmt->containers.insert(e.rawdata());
+                found = true;
+            }
+        }else if(parsePlaceholder(e, ph)){
+            stmt->placeholders[e.rawdata()] = ph;
+            stmt->nparams = std::max(stmt->nparams, ph.index);
+            found = true;
+        }
+    }
+    return found;
+}
+
+static std::string
+escapeRegex(const std::string &str)
+{
+    static const char *special = "\\^$.|?*+()[]{}/";
+    std::string escaped;
+    for(char c : str){
+        if(strchr(special, c)) escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+//parameter table is at params on the stack.
+static void
+bindParam(lua_State *l, int params, const char *name, const dbPlaceholder &ph, 
+        mongo::BSONObjBuilder &b)
+{
+    __LUA_RAWGETI(l, params, ph.index);
+    int type = lua_type(l, -1);
+    bool ok = false;
+    switch(ph.type)
+    {
+        case dbPlaceholder::PH_ANY:
+            ok = true;
+            if(type == LUA_TNUMBER) b.append(name, (double)lua_tonumber(l, -1));
+            else if(type == LUA_TSTRING) b.append(name, lua_tostring(l, -1));
+            else if(type == LUA_TBOOLEAN) b.append(name, (bool)lua_toboolean(l, -1));
+            else ok = false;
+            break;
+        case dbPlaceholder::PH_STRING:
+            if((ok = (type == LUA_TSTRING))) b.append(name, lua_tostring(l, -1));
+            break;
+        case dbPlaceholder::PH_INT:
+            if((ok = (type == LUA_TNUMBER))) b.append(name, (int)lua_tonumber(l, -1));
+            break;
+        case dbPlaceholder::PH_LONG:
+            if((ok = (type == LUA_TNUMBER))) b.append(name, (long long)lua_tonumber(l, -1));
+            break;
+        case dbPlaceholder::PH_DOUBLE:
+            if((ok = (type == LUA_TNUMBER))) b.append(name, (double)lua_tonumber(l, -1));
+            break;
+        case dbPlaceholder::PH_BOOL:
+            if((ok = (type == LUA_TBOOLEAN))) b.append(name, (bool)lua_toboolean(l, -1));
+            break;
+        case dbPlaceholder::PH_SUBSTR:
+            if((ok = (type == LUA_TSTRING))) b.appendRegex(name, escapeRegex(lua_tostring(l, -1)));
+            break;
+        case dbPlaceholder::PH_PREFIX:
+            if((ok = (type == LUA_TSTRING))) b.appendRegex(name, "^" + escapeRegex(lua_tostring(l, -1)));
+            break;
+    }
+    lua_pop(l, 1);
+    if(!ok) 
+        throw std::invalid_argument("parameter " + std::to_string(ph.index) + 
+                " missing or of the wrong type for field " + name);
+    return;
+}
+
+static void
+bindTemplate(lua_State *l, int params, const dbStatement *stmt, const mongo::BSONObj &tmpl, 
+        mongo::BSONObjBuilder &b)
+{
+    mongo::BSONObjIterator itr(tmpl);
+    while(itr.more()){
+        mongo::BSONElement e = itr.next();
+        if(stmt->containers.count(e.rawdata())){
+            mongo::BSONObjBuilder sub((e.type() == mongo::Array) ? 
+                    b.subarrayStart(e.fieldName()) : b.subobjStart(e.fieldName()));
+            bindTemplate(l, params, stmt, e.embeddedObject(), sub);
+            sub.done();
+            continue;
+        }
+        auto pitr = stmt->placeholders.find(e.rawdata());
+        if(pitr != stmt->placeholders.end()) bindParam(l, params, e.fieldName(), pitr->second, b);
+        else b.append(e);
+    }
+    return;
+}
+
+static mongo::BSONObj
+bindStatement(lua_State *l, int params, const dbStatement *stmt, const mongo::BSONObj &tmpl)
+{
+    mongo::BSONObjBuilder b;
+    bindTemplate(l, params, stmt, tmpl, b);
+    return b.obj();
+}
+
+//arguments: operation (query, findone, count, update or remove), namespace, 
+//query template and for updates the object template. returns the handle.
+static int
+dbprepare(lua_State *l)
+{
+    static const std::map<std::string, int> ops = 
+    {
+        {"query", dbRequest::DB_CURSOR},
+        {"findone", dbRequest::DB_FINDONE},
+        {"count", dbRequest::DB_COUNT},
+        {"update", dbRequest::DB_UPDATE},
+        {"remove", dbRequest::DB_REMOVE},
+    };
+    try{
+        std::string op = getStringArg(l, 1, "operation");
+        std::string ns = getStringArg(l, 2, "namespace");
+        std::string query = getStringArg(l, 3, "query");
+        std::string obj = lua_tostring(l, 4) ? lua_tostring(l, 4) : "";
+        auto oitr = ops.find(op);
+        if(oitr == ops.end()) throw std::invalid_argument("unknown operation: " + op);
+        if((oitr->second == dbRequest::DB_UPDATE) && obj.empty())
+            throw std::invalid_argument("update object argument missing");
+
+        std::string key = op + '\0' + ns + '\0' + query + '\0' + obj;
+        std::lock_guard<std::mutex> lock(dbStatementsLock);
+        auto itr = dbStatementIds.find(key);
+        if(itr != dbStatementIds.end()){
+            __LUA_PUSHNUMBER(l, itr->second);
+            return 1;
+        }
+        std::unique_ptr<dbStatement> stmt(new dbStatement);
+        stmt->op = oitr->second;
+        stmt->ns = ns;
+        stmt->query = mongo::fromjson(query).getOwned();
+        compileTemplate(stmt.get(), stmt->query);
+        if(!obj.empty()){
+            stmt->obj = mongo::fromjson(obj).getOwned();
+            compileTemplate(stmt.get(), stmt->obj);
+        }
+        dbStatements.push_back(stmt.release());
+        dbStatementIds[key] = dbStatements.size();
+        __LUA_PUSHNUMBER(l, dbStatements.size());
+    }catch(std::exception &ex){
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::dbprepare() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return 1;
+}
+
+//arguments: statement handle, parameter table and by operation
+//  query  : limit, returns a cursor.
+//  update : upsert, multi.
+//  remove : justone.
+static int
+dbexec(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        if(!dbPool) 
+            throw std::invalid_argument("no database pool: call dbpool() first");
+        size_t handle = lua_tonumber(l, 1);
+        const dbStatement *stmt = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(dbStatementsLock);
+            if(!handle || (handle > dbStatements.size())) 
+                throw std::invalid_argument("invalid statement handle");
+            stmt = dbStatements[handle - 1];
+        }
+        if(stmt->nparams && !lua_istable(l, 2)) 
+            throw std::invalid_argument("parameter table missing");
+        req = new dbRequest;
+        req->op = stmt->op;
+        req->ns = stmt->ns;
+        req->query = stmt->nparams ? bindStatement(l, 2, stmt, stmt->query) : stmt->query;
+        switch(stmt->op)
+        {
+            case dbRequest::DB_CURSOR:
+                req->limit = lua_tonumber(l, 3);
+                break;
+            case dbRequest::DB_UPDATE:
+                req->obj = stmt->nparams ? bindStatement(l, 2, stmt, stmt->obj) : stmt->obj;
+                req->upsert = lua_toboolean(l, 3);
+                req->multi = lua_toboolean(l, 4);
+                break;
+            case dbRequest::DB_REMOVE:
+                req->multi = !lua_toboolean(l, 3);
+                break;
+        }
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::dbexec() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+/*
+   notification inbox, see inbox.hh. the operations run on the database pool 
+   like the db* functions above and suspend the handler while they run.
+*/
+static notificationInbox inbox;
+
+static dbRequest*
+newInboxRequest(int resultOp)
+{
+    if(!dbPool) 
+        throw std::invalid_argument("no database pool: call dbpool() first");
+    dbRequest *req = new dbRequest;
+    req->op = dbRequest::DB_CALL;
+    req->resultOp = resultOp;
+    return req;
+}
+
+//arguments: uid, gid, category, notification id, timestamp. returns the sequence number.
+static int
+inboxappend(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        int uid = lua_tonumber(l, 1);
+        int gid = lua_tonumber(l, 2);
+        std::string category = getStringArg(l, 3, "category");
+        std::string notif = getStringArg(l, 4, "notification id");
+        int64_t timestamp = lua_tonumber(l, 5);
+        req = newInboxRequest(dbRequest::DB_COUNT);
+        req->call = [=](mongo::DBClientBase &conn, dbRequest *r){
+            r->count = inbox.append(conn, uid, gid, category, notif, timestamp);
+        };
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::inboxappend() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+//arguments: uid, notification id.
+static int
+inboxread(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        int uid = lua_tonumber(l, 1);
+        std::string notif = getStringArg(l, 2, "notification id");
+        req = newInboxRequest(dbRequest::DB_UPDATE);
+        req->call = [=](mongo::DBClientBase &conn, dbRequest *r){
+            inbox.markRead(conn, uid, notif);
+        };
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::inboxread() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+//arguments: uid, gid, category.
+static int
+inboxreadall(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        int uid = lua_tonumber(l, 1);
+        int gid = lua_tonumber(l, 2);
+        std::string category = getStringArg(l, 3, "category");
+        req = newInboxRequest(dbRequest::DB_UPDATE);
+        req->call = [=](mongo::DBClientBase &conn, dbRequest *r){
+            inbox.markAllRead(conn, uid, gid, category);
+        };
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::inboxreadall() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+//arguments: uid, gid, category. returns the unread count.
+static int
+inboxunread(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        int uid = lua_tonumber(l, 1);
+        int gid = lua_tonumber(l, 2);
+        std::string category = getStringArg(l, 3, "category");
+        req = newInboxRequest(dbRequest::DB_COUNT);
+        req->call = [=](mongo::DBClientBase &conn, dbRequest *r){
+            r->count = inbox.unread(conn, uid, gid, category);
+        };
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::inboxunread() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+//arguments: uid, gid, category, timestamp marker (0 for the newest), limit.
+//returns the notification objects newest first with the field active set.
+static int
+inboxpage(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        int uid = lua_tonumber(l, 1);
+        int gid = lua_tonumber(l, 2);
+        std::string category = getStringArg(l, 3, "category");
+        int64_t before = lua_tonumber(l, 4);
+        int limit = lua_tonumber(l, 5);
+        req = newInboxRequest(dbRequest::DB_QUERY);
+        req->call = [=](mongo::DBClientBase &conn, dbRequest *r){
+            r->results = inbox.page(conn, uid, gid, category, before, limit);
+        };
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::inboxpage() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+//argument: query on the notifications about to be removed. returns the number 
+//of inbox entries dropped.
+static int
+inboxretract(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        mongo::BSONObj query = getBsonArg(l, 1).getOwned();
+        req = newInboxRequest(dbRequest::DB_COUNT);
+        req->call = [=](mongo::DBClientBase &conn, dbRequest *r){
+            r->count = inbox.retract(conn, query);
+        };
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::inboxretract() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+//no arguments, migrates the notifications of before the inbox once. returns 
+//the number of inbox entries added.
+static int
+inboxbackfill(lua_State *l)
+{
+    dbRequest *req = nullptr;
+    try{
+        req = newInboxRequest(dbRequest::DB_COUNT);
+        req->call = [=](mongo::DBClientBase &conn, dbRequest *r){
+            r->count = inbox.backfill(conn);
+        };
+    }catch(std::exception &ex){
+        delete req;
+        __LUA_PUSHNIL(l);
+        std::string error = "luabridge.cc::inboxbackfill() failed with error:";
+        error += ex.what();
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return submitDbRequest(l, req);
+}
+
+extern "C" 
+{
+	int
+		luaopen_luabridge(lua_State *L)
+		{
+			static const luaL_Reg bridgeMap [] = 
+			{ 
+				{"privchange", privchange},
+				{"getclientid", getclientid},
+				{"putclienttuple", putclienttuple},
+				{"remclienttuple", remclienttuple},
+				{"getuidforclientid", getuidforclientid},
+				{"printsessiontbl", printsessiontbl},
+				{"delsessiontbl", delsessiontbl},
+                {"createservice", createservice},
+                {"run", run},
+                {"dispatch", dispatch},
+                {"send2client", send2client},
+				{"send2user", send2user},
+				{"replayevents", replayevents},
+                {"send2gw", send2gw},
+                {"isgroupmember", isgroupmember},
+                {"adduidgidmapping", adduidgidmapping},
+                {"deluidgidmapping", deluidgidmapping},
+
+                {"setdatarecvhandler", setdatarecvhandler},
+                {"setbigdatarecvhandler", setbigdatarecvhandler},
+                {"setcontrolrecvhandler", setcontrolrecvhandler},
+                {"setsignalhandler", setsignalhandler},
+
+                {"addoneshottimer", addoneshottimer},
+                {"addperiodictimer", addperiodictimer},
+                {"starttimer", starttimer},
+                {"stoptimer", stoptimer},
+                {"deletetimer", deletetimer},
+
+                {"getcopyofbigdata", getcopyofbigdata},
+                {"destroybigdata", destroybigdata},
+                {"setservicehandle", setservicehandle},
+
+                {"broadcast", broadcast},
+                {"notifyservice", notifyservice},
+                {"deleteservice", deleteservice},
+                {"currenttime", currenttime},
+                {"gensitethumbnail", gensitethumbnail},
+                {"genuuid", generateUuid},
+
+                {"openlog", openlog},
+                {"setlevel", setlevel},
+                {"getlevel", getlevel},
+
+                {"info", info},
+                {"warn", warn},
+                {"error", error},
                 {"fatal", fatal},
                 {"trace", trace},
                 {"debug", debug},
@@ -1664,6 +3508,33 @@ extern "C"
                 {"daemonize", daemonize},
                 {"parsecmdopt", parsecmdopt},
                 {"bindmount", bindmount},
+
+                {"dbpool", dbpool},
+                {"dbquery", dbquery},
+                {"dbfindone", dbfindone},
+                {"dbcount", dbcount},
+                {"dbinsert", dbinsert},
+                {"dbupdate", dbupdate},
+                {"dbremove", dbremove},
+                {"dbprepare", dbprepare},
+                {"dbexec", dbexec},
+
+                {"inboxappend", inboxappend},
+                {"inboxread", inboxread},
+                {"inboxreadall", inboxreadall},
+                {"inboxunread", inboxunread},
+                {"inboxpage", inboxpage},
+                {"inboxretract", inboxretract},
+                {"inboxbackfill", inboxbackfill},
+
+                {"counterget", counterget},
+                {"counterincr", counterincr},
+                {"counterset", counterset},
+                {"counterdel", counterdel},
+                {"counterflush", counterflush},
+
+                {"createshards", createshards},
+                {"getshardindex", getshardindex},
         		{ nullptr, nullptr}
 			};
 
@@ -36,6 +36,7 @@
 #include <time.h>
 #include <chrono>
 #include <boost/lexical_cast.hpp>
+#include "calindex.hh"
 
 using namespace boost::gregorian;
 using namespace boost::local_time; 
@@ -391,6 +392,233 @@ humanReadable(lua_State *l)
     return 1;
 }
 
+/*
+   event index of the cron service, see calindex.hh. the service fills it from 
+   the database on start, keeps it up to date with calput() on every add, edit 
+   and delete of an event and rebuilds it with calreplace() periodically.
+*/
+static calendarIndex calIndex;
+
+static void
+getIntSet(lua_State *l, int idx, const char *field, std::set<int> &out)
+{
+    lua_getfield(l, idx, field);
+    if(lua_istable(l, -1)){
+        int n = lua_objlen(l, -1);
+        for(int i = 1; i <= n; i++){
+            lua_rawgeti(l, -1, i);
+            if(lua_isnumber(l, -1)) out.insert(lua_tonumber(l, -1));
+            lua_pop(l, 1);
+        }
+    }
+    lua_pop(l, 1);
+    return;
+}
+
+static void
+pushOccurrences(lua_State *l, const std::vector<calOccurrence> &occurrences)
+{
+    __GROW_LUA_STACK(l, 3);
+    lua_newtable(l);
+    for(size_t i = 0; i < occurrences.size(); i++){
+        const calOccurrence &o = occurrences[i];
+        lua_newtable(l);
+        __LUA_PUSHSTRING(l, o.id.c_str());
+        lua_setfield(l, -2, "id");
+        __LUA_PUSHNUMBER(l, o.tstart);
+        lua_setfield(l, -2, "tstart_unix_time");
+        __LUA_PUSHNUMBER(l, o.tend);
+        lua_setfield(l, -2, "tend_unix_time");
+        __LUA_PUSHSTRING(l, to_iso_extended_string(from_time_t(o.tstart)).c_str());
+        lua_setfield(l, -2, "tstart");
+        __LUA_PUSHSTRING(l, to_iso_extended_string(from_time_t(o.tend)).c_str());
+        lua_setfield(l, -2, "tend");
+        __LUA_PUSHBOOLEAN(l, o.expanded);
+        lua_setfield(l, -2, "expanded");
+        lua_rawseti(l, -2, i + 1);
+    }
+    return;
+}
+
+//the vevent object at idx as the index keeps it. a recurring event is expanded 
+//past its clones only while it still has clones, deleting all the occurrences 
+//of a series empties the clone list.
+static calEvent
+getCalEvent(lua_State *l, int idx)
+{
+    if(!lua_istable(l, idx)) throw std::invalid_argument("vevent object missing");
+    __GROW_LUA_STACK(l, 10);
+    calEvent e;
+    lua_getfield(l, idx, "id");
+    if(lua_isstring(l, -1)) e.id = lua_tostring(l, -1);
+    lua_getfield(l, idx, "owner_uid");
+    e.ownerUid = lua_tonumber(l, -1);
+    lua_getfield(l, idx, "owner_gid");
+    e.ownerGid = lua_tonumber(l, -1);
+    lua_getfield(l, idx, "personal");
+    e.personal = lua_toboolean(l, -1);
+    lua_getfield(l, idx, "tstart_unix_time");
+    e.tstart = lua_tonumber(l, -1);
+    lua_getfield(l, idx, "tend_unix_time");
+    e.tend = lua_tonumber(l, -1);
+    lua_getfield(l, idx, "recurring");
+    std::string recurring = lua_isstring(l, -1) ? lua_tostring(l, -1) : "none";
+    lua_getfield(l, idx, "clone");
+    bool clone = lua_toboolean(l, -1);
+    lua_getfield(l, idx, "clones");
+    bool hasClones = lua_istable(l, -1) && lua_objlen(l, -1);
+    lua_pop(l, 9);
+    if(e.id.empty()) throw std::invalid_argument("vevent object without an id");
+    if(!clone && hasClones){
+        if(recurring == "daily") e.recurring = CAL_RECUR_DAILY;
+        else if(recurring == "weekly") e.recurring = CAL_RECUR_WEEKLY;
+        else if(recurring == "monthly") e.recurring = CAL_RECUR_MONTHLY;
+    }
+    getIntSet(l, idx, "invited", e.invited);
+    getIntSet(l, idx, "denied", e.denied);
+    return e;
+}
+
+//index or reindex a vevent object.
+static int
+calput(lua_State *l)
+{
+    try{
+        calIndex.put(getCalEvent(l, 1));
+    }catch(std::exception &ex){
+        std::string error = "luacal.cc::calput() Unable to index the event:";
+        error += ex.what();
+        __LUA_PUSHBOOLEAN(l, false);
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    __LUA_PUSHBOOLEAN(l, true);
+    return 1;
+}
+
+//argument: list of all the vevent objects. the index is built anew from them
+//and replaces the current one, for the writes of the other services to the 
+//events (group membership, kons) which cron never sees.
+static int
+calreplace(lua_State *l)
+{
+    try{
+        if(!lua_istable(l, 1)) throw std::invalid_argument("list of vevent objects missing");
+        calendarIndex index;
+        int n = lua_objlen(l, 1);
+        __GROW_LUA_STACK(l, 2);
+        for(int i = 1; i <= n; i++){
+            lua_rawgeti(l, 1, i);
+            index.put(getCalEvent(l, lua_gettop(l)));
+            lua_pop(l, 1);
+        }
+        calIndex = std::move(index);
+    }catch(std::exception &ex){
+        std::string error = "luacal.cc::calreplace() Unable to rebuild the event index:";
+        error += ex.what();
+        __LUA_PUSHBOOLEAN(l, false);
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    __LUA_PUSHBOOLEAN(l, true);
+    return 1;
+}
+
+static int
+calremove(lua_State *l)
+{
+    const char *id = lua_tostring(l, 1);
+    if(id) calIndex.remove(id);
+    return 0;
+}
+
+static int
+calsize(lua_State *l)
+{
+    __LUA_PUSHNUMBER(l, calIndex.size());
+    return 1;
+}
+
+//arguments: gid, uid, personal, range start, range end in unix time.
+static int
+calrange(lua_State *l)
+{
+    try{
+        pushOccurrences(l, calIndex.range(lua_tonumber(l, 1), lua_tonumber(l, 2), 
+                    lua_toboolean(l, 3), lua_tonumber(l, 4), lua_tonumber(l, 5)));
+    }catch(std::exception &ex){
+        std::string error = "luacal.cc::calrange() Unable to query the event index:";
+        error += ex.what();
+        __LUA_PUSHBOOLEAN(l, false);
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return 1;
+}
+
+//arguments: gid, uid, personal, start in unix time, limit.
+static int
+calupcoming(lua_State *l)
+{
+    try{
+        pushOccurrences(l, calIndex.upcoming(lua_tonumber(l, 1), lua_tonumber(l, 2), 
+                    lua_toboolean(l, 3), lua_tonumber(l, 4), lua_tonumber(l, 5)));
+    }catch(std::exception &ex){
+        std::string error = "luacal.cc::calupcoming() Unable to query the event index:";
+        error += ex.what();
+        __LUA_PUSHBOOLEAN(l, false);
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return 1;
+}
+
+//arguments: gid, list of uids, range start, range end in unix time. returns a 
+//list of { uid, busy = { { tstart, tend }, ... } }.
+static int
+calfreebusy(lua_State *l)
+{
+    try{
+        std::vector<int> uids;
+        if(lua_istable(l, 2)){
+            int n = lua_objlen(l, 2);
+            for(int i = 1; i <= n; i++){
+                lua_rawgeti(l, 2, i);
+                if(lua_isnumber(l, -1)) uids.push_back(lua_tonumber(l, -1));
+                lua_pop(l, 1);
+            }
+        }
+        std::map<int, calBusyList> busy = calIndex.freeBusy(lua_tonumber(l, 1), uids, 
+                lua_tonumber(l, 3), lua_tonumber(l, 4));
+        __GROW_LUA_STACK(l, 5);
+        lua_newtable(l);
+        int i = 1;
+        for(auto &b : busy){
+            lua_newtable(l);
+            __LUA_PUSHNUMBER(l, b.first);
+            lua_setfield(l, -2, "uid");
+            lua_newtable(l);
+            for(size_t j = 0; j < b.second.size(); j++){
+                lua_newtable(l);
+                __LUA_PUSHNUMBER(l, b.second[j].first);
+                lua_setfield(l, -2, "tstart");
+                __LUA_PUSHNUMBER(l, b.second[j].second);
+                lua_setfield(l, -2, "tend");
+                lua_rawseti(l, -2, j + 1);
+            }
+            lua_setfield(l, -2, "busy");
+            lua_rawseti(l, -2, i++);
+        }
+    }catch(std::exception &ex){
+        std::string error = "luacal.cc::calfreebusy() Unable to query the event index:";
+        error += ex.what();
+        __LUA_PUSHBOOLEAN(l, false);
+        __LUA_PUSHSTRING(l, error.c_str());
+        return 2;
+    }
+    return 1;
+}
+
 extern "C" 
 {
 	int luaopen_luacal(lua_State *L)
@@ -408,6 +636,13 @@ extern "C"
                 {"todaystart", todayStart},
                 {"todayend", todayEnd},
                 {"humanreadable", humanReadable},
+                {"calput", calput},
+                {"calreplace", calreplace},
+                {"calremove", calremove},
+                {"calsize", calsize},
+                {"calrange", calrange},
+                {"calupcoming", calupcoming},
+                {"calfreebusy", calfreebusy},
         		{ nullptr, nullptr}
 			};
 
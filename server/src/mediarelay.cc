@@ -0,0 +1,223 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <string.h>
+#include <random>
+#include <vector>
+#include <stdexcept>
+#include <boost/bind.hpp>
+#include "mediarelay.hh"
+#include "log.hh"
+
+mediaRelay::mediaRelay(boost::asio::io_service &io, std::string address, unsigned short port,
+        size_t maxRoomSize) :
+    _socket(io, boost::asio::ip::udp::endpoint(boost::asio::ip::address::from_string(address), port)),
+    _maxRoomSize(maxRoomSize)
+{
+    //the forwarding sends never wait, a datagram the kernel cannot take is
+    //dropped like the network would.
+    _socket.non_blocking(true);
+    readAsync();
+    return;
+}
+
+mediaRelay::~mediaRelay()
+{
+    for(auto &t : _tokens) delete t.second;
+    return;
+}
+
+unsigned short
+mediaRelay::getPort(void)
+{
+    return _socket.local_endpoint().port();
+}
+
+std::string
+mediaRelay::newToken(void)
+{
+    static std::random_device rd;
+    static const char hex[] = "0123456789abcdef";
+    std::string token;
+    while(token.length() < MEDIA_RELAY_TOKEN_LEN){
+        uint32_t r = rd();
+        for(int i = 0; i < 8; i++, r >>= 4) token += hex[r & 0xf];
+    }
+    return token;
+}
+
+void
+mediaRelay::drop(participant *p)
+{
+    auto ritr = _rooms.find(p->room);
+    if(ritr != _rooms.end()){
+        ritr->second.erase(p->uid);
+        if(ritr->second.empty()) _rooms.erase(ritr);
+    }
+    if(p->bound) _bindings.erase(p->ep);
+    _tokens.erase(p->token);
+    _info<<"uid: "<<p->uid<<" left room: "<<p->room<<" packets in: "<<p->packetsIn
+        <<" out: "<<p->packetsOut;
+    delete p;
+    return;
+}
+
+std::string
+mediaRelay::join(const std::string &room, int uid, int clientid)
+{
+    roomT &r = _rooms[room];
+    auto itr = r.find(uid);
+    if(itr != r.end()){
+        drop(itr->second); //rejoin from a new media socket.
+        return join(room, uid, clientid);
+    }
+    if(r.size() >= _maxRoomSize){
+        if(r.empty()) _rooms.erase(room);
+        throw std::runtime_error("room is full");
+    }
+    participant *p = new participant;
+    p->room = room;
+    p->uid = uid;
+    p->clientid = clientid;
+    p->token = newToken();
+    p->lastSeen = time(nullptr);
+    r[uid] = p;
+    _tokens[p->token] = p;
+    _info<<"uid: "<<uid<<" joined room: "<<room<<" participants: "<<r.size();
+    return p->token;
+}
+
+void
+mediaRelay::leave(const std::string &room, int uid)
+{
+    auto ritr = _rooms.find(room);
+    if(ritr == _rooms.end()) return;
+    auto itr = ritr->second.find(uid);
+    if(itr != ritr->second.end()) drop(itr->second);
+    return;
+}
+
+void
+mediaRelay::leaveAll(int clientid)
+{
+    std::vector<participant*> gone;
+    for(auto &t : _tokens) if(t.second->clientid == clientid) gone.push_back(t.second);
+    for(auto p : gone) drop(p);
+    return;
+}
+
+void
+mediaRelay::expire(time_t idle)
+{
+    time_t now = time(nullptr);
+    std::vector<participant*> gone;
+    for(auto &t : _tokens) if((now - t.second->lastSeen) > idle) gone.push_back(t.second);
+    for(auto p : gone) drop(p);
+    return;
+}
+
+size_t
+mediaRelay::roomSize(const std::string &room)
+{
+    auto ritr = _rooms.find(room);
+    return (ritr == _rooms.end()) ? 0 : ritr->second.size();
+}
+
+uint64_t
+mediaRelay::forwarded(const std::string &room, int uid)
+{
+    auto ritr = _rooms.find(room);
+    if(ritr == _rooms.end()) return 0;
+    auto itr = ritr->second.find(uid);
+    return (itr == ritr->second.end()) ? 0 : itr->second->packetsOut;
+}
+
+//tie the source address of the datagram to the participant holding the token,
+//the bind datagram is echoed back as the acknowledgement.
+void
+mediaRelay::bind(const char *data, size_t len)
+{
+    const size_t magicLen = strlen(MEDIA_RELAY_BIND_MAGIC);
+    if((len != magicLen + MEDIA_RELAY_TOKEN_LEN) || memcmp(data, MEDIA_RELAY_BIND_MAGIC, magicLen)){
+        _dropped++;
+        return;
+    }
+    auto itr = _tokens.find(std::string(data + magicLen, MEDIA_RELAY_TOKEN_LEN));
+    if(itr == _tokens.end()){
+        _dropped++;
+        return;
+    }
+    participant *p = itr->second;
+    auto bitr = _bindings.find(_sender);
+    if((bitr != _bindings.end()) && (bitr->second != p)){
+        _error<<"media address of uid: "<<bitr->second->uid<<" claimed by uid: "<<p->uid;
+        _dropped++;
+        return;
+    }
+    if(p->bound) _bindings.erase(p->ep);
+    p->ep = _sender;
+    p->bound = true;
+    p->lastSeen = time(nullptr);
+    _bindings[_sender] = p;
+    boost::system::error_code ec;
+    _socket.send_to(boost::asio::buffer(data, len), _sender, 0, ec);
+    return;
+}
+
+//one received datagram, one send per other participant out of the same buffer.
+void
+mediaRelay::forward(participant *p, const char *data, size_t len)
+{
+    p->packetsIn++;
+    p->bytesIn += len;
+    p->lastSeen = time(nullptr);
+    auto ritr = _rooms.find(p->room);
+    if(ritr == _rooms.end()) return;
+    boost::system::error_code ec;
+    for(auto &m : ritr->second){
+        participant *rcpt = m.second;
+        if((rcpt == p) || !rcpt->bound) continue;
+        _socket.send_to(boost::asio::buffer(data, len), rcpt->ep, 0, ec);
+        if(ec) _dropped++;
+        else rcpt->packetsOut++;
+    }
+    return;
+}
+
+void
+mediaRelay::readAsync(void)
+{
+    _socket.async_receive_from(boost::asio::buffer(_data), _sender,
+            boost::bind(&mediaRelay::readComplete, this,
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+    return;
+}
+
+void
+mediaRelay::readComplete(const boost::system::error_code &ec, size_t bytesRecvd)
+{
+    if(ec == boost::asio::error::operation_aborted) return;
+    if(ec){
+        _error<<"mediaRelay::readComplete() error: "<<ec.message();
+        readAsync();
+        return;
+    }
+    const char *data = _data.data();
+    if((bytesRecvd >= 12) && (((unsigned char)data[0] >> 6) == 2)){
+        auto itr = _bindings.find(_sender);
+        if(itr != _bindings.end()) forward(itr->second, data, bytesRecvd);
+        else _dropped++;
+    }else
+        bind(data, bytesRecvd);
+    readAsync();
+    return;
+}
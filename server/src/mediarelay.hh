@@ -0,0 +1,87 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//selective forwarding relay for the media of group calls.
+//every participant of a room sends one upstream of rtp/rtcp (muxed on one udp
+//port) to the relay and the relay forwards each packet to the other
+//participants of the room, the packets are not decoded or rewritten. a
+//participant joins over the signaling channel and gets a token, the first
+//datagram it sends from its media socket is a bind datagram carrying the token
+//which ties the source address to the participant, datagrams from unbound
+//addresses are dropped.
+//  bind datagram : "AKSFU001" | token (32 hex characters)
+//rtp and rtcp datagrams are recognised by the version bits (2) of the first
+//byte, a bind datagram starts with 'A' whose version bits are 1.
+#ifndef __INC_MEDIARELAY_HH
+#define __INC_MEDIARELAY_HH
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <map>
+#include <boost/array.hpp>
+#include <boost/asio.hpp>
+
+#define MEDIA_RELAY_BIND_MAGIC   "AKSFU001"
+#define MEDIA_RELAY_TOKEN_LEN    (32)
+#define MEDIA_RELAY_MAX_DATAGRAM (1500)
+
+class mediaRelay
+{
+    typedef struct participant
+    {
+        std::string room;
+        int uid = 0;
+        int clientid = 0;
+        std::string token;
+        boost::asio::ip::udp::endpoint ep;
+        bool bound = false;
+        time_t lastSeen = 0;
+        uint64_t packetsIn = 0;
+        uint64_t packetsOut = 0;
+        uint64_t bytesIn = 0;
+    }participant;
+
+    typedef std::map<int, participant*> roomT; //uid to participant.
+
+    boost::asio::ip::udp::socket _socket;
+    boost::asio::ip::udp::endpoint _sender;
+    boost::array<char, MEDIA_RELAY_MAX_DATAGRAM> _data;
+    size_t _maxRoomSize;
+    std::map<std::string, roomT> _rooms;
+    std::map<std::string, participant*> _tokens;
+    std::map<boost::asio::ip::udp::endpoint, participant*> _bindings;
+    uint64_t _dropped = 0;
+
+    std::string newToken(void);
+    void drop(participant *p);
+    void bind(const char *data, size_t len);
+    void forward(participant *p, const char *data, size_t len);
+    void readAsync(void);
+    void readComplete(const boost::system::error_code &ec, size_t bytesRecvd);
+
+    public:
+    mediaRelay(boost::asio::io_service &io, std::string address, unsigned short port,
+            size_t maxRoomSize);
+    ~mediaRelay();
+    unsigned short getPort(void);
+    //returns the token the participant binds its media socket with, a second
+    //join of the same user in the room gets a fresh token.
+    std::string join(const std::string &room, int uid, int clientid);
+    void leave(const std::string &room, int uid);
+    void leaveAll(int clientid); //client went away, leave all its rooms.
+    void expire(time_t idle); //drop the participants not heard for idle seconds.
+    size_t roomSize(const std::string &room);
+    uint64_t forwarded(const std::string &room, int uid); //packets sent to the participant.
+    uint64_t dropped(void) { return _dropped; }
+};
+
+#endif
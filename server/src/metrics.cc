@@ -0,0 +1,222 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include "common.hh"
+#include "log.hh"
+#include "metrics.hh"
+#include "config.hh"
+
+uint64_t
+metricsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+metricHistogram::metricHistogram() :
+    _count(0),
+    _sum(0),
+    _max(0)
+{
+    for(auto &b : _buckets) b.store(0, std::memory_order_relaxed);
+    return;
+}
+
+//values below METRIC_SUB_BUCKETS get a bucket each, above that every power 
+//of 2 is split in METRIC_SUB_BUCKETS by the bits following the leading one.
+size_t
+metricHistogram::bucketOf(uint64_t value)
+{
+    if(value < METRIC_SUB_BUCKETS) return value;
+    int msb = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (msb - METRIC_SUB_BUCKET_BITS)) & (METRIC_SUB_BUCKETS - 1);
+    return (msb - METRIC_SUB_BUCKET_BITS + 1) * METRIC_SUB_BUCKETS + sub;
+}
+
+uint64_t
+metricHistogram::bucketHigh(size_t bucket)
+{
+    if(bucket < METRIC_SUB_BUCKETS) return bucket;
+    int msb = bucket / METRIC_SUB_BUCKETS + METRIC_SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % METRIC_SUB_BUCKETS;
+    uint64_t low = (1ull << msb) | (sub << (msb - METRIC_SUB_BUCKET_BITS));
+    return low + ((1ull << (msb - METRIC_SUB_BUCKET_BITS)) - 1);
+}
+
+void
+metricHistogram::record(uint64_t value)
+{
+    _buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t seen = _max.load(std::memory_order_relaxed);
+    while((value > seen) && 
+            !_max.compare_exchange_weak(seen, value, std::memory_order_relaxed));
+    return;
+}
+
+//read while others record, the buckets may add up to a little more than the 
+//count read before them.
+uint64_t
+metricHistogram::quantile(double q) const
+{
+    uint64_t total = count();
+    if(!total) return 0;
+    uint64_t rank = (uint64_t)(q * total);
+    if(rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for(size_t i = 0; i < METRIC_BUCKETS; i++){
+        seen += _buckets[i].load(std::memory_order_relaxed);
+        if(seen > rank) return std::min(bucketHigh(i), max());
+    }
+    return max();
+}
+
+metricCounter&
+metricsRegistry::counter(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    auto &m = _counters[name];
+    if(!m) m.reset(new metricCounter());
+    return *m;
+}
+
+metricGauge&
+metricsRegistry::gauge(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    auto &m = _gauges[name];
+    if(!m) m.reset(new metricGauge());
+    return *m;
+}
+
+metricHistogram&
+metricsRegistry::histogram(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    auto &m = _histograms[name];
+    if(!m) m.reset(new metricHistogram());
+    return *m;
+}
+
+//name{labels} with a suffix on the name and one more label.
+static std::string
+seriesName(const std::string &name, const char *suffix, const std::string &label)
+{
+    size_t brace = name.find('{');
+    std::string base = name.substr(0, brace);
+    std::string labels = (brace == std::string::npos) ? "" : 
+        name.substr(brace + 1, name.length() - brace - 2);
+    if(!labels.empty() && !label.empty()) labels += ",";
+    labels += label;
+    return base + suffix + (labels.empty() ? "" : "{" + labels + "}");
+}
+
+std::string
+metricsRegistry::render(void)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    std::stringstream out;
+    std::lock_guard<std::mutex> lock(_lock);
+    for(auto &m : _counters) out<<m.first<<" "<<m.second->value()<<"\n";
+    for(auto &m : _gauges) out<<m.first<<" "<<m.second->value()<<"\n";
+    for(auto &m : _histograms){
+        metricHistogram &h = *m.second;
+        out<<seriesName(m.first, "_count", "")<<" "<<h.count()<<"\n";
+        out<<seriesName(m.first, "_sum", "")<<" "<<h.sum()<<"\n";
+        out<<seriesName(m.first, "_max", "")<<" "<<h.max()<<"\n";
+        for(double q : quantiles){
+            std::stringstream label;
+            label<<"quantile=\""<<q<<"\"";
+            out<<seriesName(m.first, "", label.str())<<" "<<h.quantile(q)<<"\n";
+        }
+    }
+    return out.str();
+}
+
+metricsRegistry&
+metrics(void)
+{
+    static metricsRegistry registry;
+    return registry;
+}
+
+//a thread of its own answers the connections, the daemon loop is not 
+//disturbed and a stuck loop can still be looked at. the endpoint is in the
+//runtime directory of the gateway, which only our user can enter.
+void
+startMetricsEndpoint(const std::string &name)
+{
+    std::string dname = getConfigValue<std::string>("ngw.runtime_dir", AKORP_NGW_RUNTIME_DIR);
+    if(!privateDir(dname)){
+        _error<<"runtime directory: "<<dname<<" is not a directory private to us, no metrics endpoint.";
+        return;
+    }
+    std::string path = dname + "/" + AKORP_METRICS_ENDPOINT_PREFIX + name;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.length() >= sizeof(addr.sun_path)){
+        _error<<"metrics endpoint: "<<path<<" is too long.";
+        return;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        _error<<"unable to open the metrics endpoint: "<<strerror(errno);
+        return;
+    }
+    ::unlink(path.c_str());
+    //the socket is created with its final mode, there is no chmod after it.
+    mode_t mask = ::umask(0117);
+    int rc = ::bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    ::umask(mask);
+    if((rc < 0) || (::listen(fd, 8) < 0)){
+        _error<<"unable to listen on the metrics endpoint: "<<path<<" "<<strerror(errno);
+        _eintr(::close(fd));
+        return;
+    }
+    std::thread([fd](){
+        for(;;){
+            int conn = _eintr(::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC));
+            if(conn < 0){
+                //out of descriptors or memory, give the daemon time to free some.
+                if(errno != ECONNABORTED){
+                    _error<<"metrics endpoint accept failed: "<<strerror(errno);
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                }
+                continue;
+            }
+            std::string text = metrics().render();
+            size_t sent = 0;
+            while(sent < text.length()){
+                ssize_t rc = _eintr(::send(conn, text.data() + sent, text.length() - sent, MSG_NOSIGNAL));
+                if(rc <= 0) break;
+                sent += rc;
+            }
+            _eintr(::close(conn));
+        }
+    }).detach();
+    _info<<"metrics served on: "<<path;
+    return;
+}
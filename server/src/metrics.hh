@@ -0,0 +1,101 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//counters, gauges and latency histograms of a daemon. the metrics are created
+//by name once, usually at startup, and kept by reference; updating one is a 
+//relaxed atomic operation and takes no lock. a name may carry labels in the 
+//prometheus way, "fmgr_request_us{request=\"read\"}".
+//the histograms are log linear like hdr histograms, 16 buckets per power of 
+//2 so a recorded value is off by at most 1/16th.
+//startMetricsEndpoint() serves the registry as text on the unix socket
+//AKORP_METRICS_ENDPOINT_PREFIX<name> in ngw.runtime_dir, one dump per connection:
+//  socat - UNIX-CONNECT:/var/run/antkorp/akorp_metrics.ngw
+#ifndef __INC_METRICS_HH
+#define __INC_METRICS_HH
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#define METRIC_SUB_BUCKET_BITS (4)
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BUCKET_BITS)
+#define METRIC_BUCKETS ((64 - METRIC_SUB_BUCKET_BITS + 1) * METRIC_SUB_BUCKETS)
+
+class metricCounter
+{
+    std::atomic<uint64_t> _value;
+
+    public:
+    metricCounter() : _value(0) {}
+    void add(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value(void) const { return _value.load(std::memory_order_relaxed); }
+};
+
+class metricGauge
+{
+    std::atomic<int64_t> _value;
+
+    public:
+    metricGauge() : _value(0) {}
+    void set(int64_t v) { _value.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { _value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value(void) const { return _value.load(std::memory_order_relaxed); }
+};
+
+class metricHistogram
+{
+    std::atomic<uint64_t> _buckets[METRIC_BUCKETS];
+    std::atomic<uint64_t> _count, _sum, _max;
+
+    public:
+    metricHistogram();
+    void record(uint64_t value);
+    uint64_t count(void) const { return _count.load(std::memory_order_relaxed); }
+    uint64_t sum(void) const { return _sum.load(std::memory_order_relaxed); }
+    uint64_t max(void) const { return _max.load(std::memory_order_relaxed); }
+    uint64_t quantile(double q) const; //highest value of the bucket holding the quantile.
+    static size_t bucketOf(uint64_t value);
+    static uint64_t bucketHigh(size_t bucket);
+};
+
+class metricsRegistry
+{
+    std::mutex _lock; //taken to create a metric and to render, never to update one.
+    std::map<std::string, std::unique_ptr<metricCounter>> _counters;
+    std::map<std::string, std::unique_ptr<metricGauge>> _gauges;
+    std::map<std::string, std::unique_ptr<metricHistogram>> _histograms;
+
+    public:
+    metricCounter& counter(const std::string &name);
+    metricGauge& gauge(const std::string &name);
+    metricHistogram& histogram(const std::string &name);
+    std::string render(void);
+};
+
+metricsRegistry& metrics(void); //the registry of the process.
+void startMetricsEndpoint(const std::string &name);
+uint64_t metricsNow(void); //microseconds, monotonic.
+
+//records the microseconds it lived in to the histogram.
+class metricTimer
+{
+    metricHistogram &_histogram;
+    uint64_t _start;
+
+    public:
+    metricTimer(metricHistogram &h) : _histogram(h), _start(metricsNow()) {}
+    ~metricTimer() { _histogram.record(metricsNow() - _start); }
+};
+
+#endif
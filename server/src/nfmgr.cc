@@ -64,10 +64,14 @@
 #include <algorithm>
 #include <map>
 #include <list>
+#include <deque>
+#include <set>
 #include <tuple>
 #include <cassert>
 #include <iostream>
 #include <chrono>
+#include <atomic>
+#include <memory>
 #include "mime_types.hh"
 #include "trie.hh"
 #include "svclib.hh"
@@ -87,6 +91,11 @@
 #include "log.hh"
 #include "config.hh"
 #include "nfmgr.hh"
+#include "metrics.hh"
+#include "delta.hh"
+#include "cstore.hh"
+#include "trash.hh"
+#include "uring.hh"
 #include <pthread.h>
 #include "dtl/dtl.hpp"
 extern "C" {
@@ -100,6 +109,13 @@ static std::string debug_level = "error";
 static std::string log_file = "/var/log/antkorp/fmgr";
 static int thread_count = 100;
 static std::string storage_base;
+static int trash_retention = 7*24*3600; //seconds a deleted file can be brought back.
+static int reclaim_batch = 256; //unlinks of the reclaimer between two pauses.
+static int reclaim_pause_ms = 50;
+static int history_versions = 100; //versions kept of a file, 0 keeps all of them.
+static int history_grace = 3600; //seconds an unreferenced chunk is kept for a commit in flight.
+static int uring_entries = 256; //of the io_uring for the transfers, 0 leaves their i/o on the thread pool.
+static int uring_buffers = 64; //transfer blocks registered with the io_uring.
 static bool cloudDeployment = true;
 static Trie<statRecord> *statCache = nullptr; //cache storing the stat records in the user land.
 using namespace boost::archive::iterators;
@@ -108,6 +124,9 @@ typedef binary_from_base64<transform_width<const char *, 8, 6>> base64ToBin;
 
 static const int kPageSize = 4096;
 static const int diskBlockSize = 64*kPageSize;
+static const int readAheadBlocks = 4; //blocks of a download the kernel reads ahead of the client.
+static const int signaturesPerReply = 4096; //signatures of a file go in parts of these many blocks.
+static const int maxRangesInFlight = 8; //ranged writes of an upload not yet acked.
 
 class fileXfer;
 static void add2XferTbl(fileXfer *xfer);
@@ -125,8 +144,10 @@ static void delFromSrchTbl(fileSearch *srch);
 static std::vector<int> getGroupMemberList(int groupId);
 static void writeFmgrReply(int, const char *, size_t);
 static void readResponse(int, std::string, size_t, std::string);
+static bool checkAuthorization(int, int, std::string &);
 static service *svc = nullptr;
 static ThreadPool *tPool = nullptr;
+static fileRing *fRing = nullptr; //file i/o of the transfers, completes on the service loop.
 static int signalFd = -1;
 static int inotifyFd = -1;
 static lua_State *L = nullptr;
@@ -184,15 +205,113 @@ static watchListT watchList;
 static std::string
 getDirForWatchDescriptor(int wd)
 {
-    for(auto &kv : watchList){
-        auto tpl = kv.second;
-        if (std::get<0>(tpl) == wd)
-            for(auto &itr : std::get<1>(tpl))
-                return kv.first;
-    }
+    for(auto &kv : watchList)
+        if (std::get<0>(kv.second) == wd) return kv.first;
     return "";
 }
 
+//the listings of the watched directories are versioned, a client that sends
+//the version it has gets only what changed since then. versions are unique 
+//for the life of the process and the boot id in the token makes the ones of
+//an earlier process unknown.
+struct dirChange
+{
+    uint64_t version;
+    std::string fname;
+};
+
+struct dirListing
+{
+    uint64_t since = 0; //every change after this version is in the log.
+    uint64_t version = 0;
+    std::deque<dirChange> changes;
+};
+
+static std::map<std::string, dirListing> dirListings;
+static std::mutex dirListingsLock;
+static uint64_t dirVersions = 0;
+static const std::string bootId = std::to_string(time(nullptr));
+static const size_t kMaxDirChanges = 256;
+static const size_t kMaxIdleWatches = 1024; 
+static std::list<std::string> idleWatches; //watched directories no client is viewing, oldest first.
+
+static std::string
+dirVersionToken(uint64_t version)
+{
+    return bootId + "." + std::to_string(version);
+}
+
+static void
+openDirListing(const std::string &dname)
+{
+    std::unique_lock<std::mutex> lock(dirListingsLock);
+    dirListing &listing = dirListings[dname];
+    listing.since = listing.version = ++dirVersions;
+    return;
+}
+
+static void
+closeDirListing(const std::string &dname)
+{
+    std::unique_lock<std::mutex> lock(dirListingsLock);
+    dirListings.erase(dname);
+    return;
+}
+
+//the entry fname of the directory dname was created, changed or removed.
+static void
+bumpDirVersion(const std::string &dname, const std::string &fname)
+{
+    std::unique_lock<std::mutex> lock(dirListingsLock);
+    auto itr = dirListings.find(dname);
+    if(itr == dirListings.end()) return; //nobody has a listing of it.
+    dirListing &listing = itr->second;
+    listing.version = ++dirVersions;
+    listing.changes.push_back({listing.version, fname});
+    if(listing.changes.size() > kMaxDirChanges){
+        listing.since = listing.changes.front().version;
+        listing.changes.pop_front();
+    }
+    return;
+}
+
+//same as above given the path of the entry, for the changes fmgr makes 
+//itself so they show before inotify gets to them.
+static void
+dirEntryChanged(const std::string &path)
+{
+    size_t pos = path.find_last_of('/');
+    if(pos != std::string::npos) bumpDirVersion(path.substr(0, pos), path.substr(pos + 1));
+    return;
+}
+
+static std::string
+currentDirVersion(const std::string &dname)
+{
+    std::unique_lock<std::mutex> lock(dirListingsLock);
+    auto itr = dirListings.find(dname);
+    return (itr != dirListings.end()) ? dirVersionToken(itr->second.version) : "";
+}
+
+//the entries changed since the version the client has, false if the client
+//needs the whole listing.
+static bool
+dirChangesSince(const std::string &dname, const std::string &known, std::set<std::string> &changed)
+{
+    std::unique_lock<std::mutex> lock(dirListingsLock);
+    auto itr = dirListings.find(dname);
+    size_t dot = known.find_last_of('.');
+    if((itr == dirListings.end()) || (dot == std::string::npos) || 
+            (known.compare(0, dot, bootId) != 0))
+        return false;
+    dirListing &listing = itr->second;
+    uint64_t version = strtoull(known.c_str() + dot + 1, nullptr, 10);
+    if((version < listing.since) || (version > listing.version)) return false;
+    for(auto &change : listing.changes) 
+        if(change.version > version) changed.insert(change.fname);
+    return true;
+}
+
 //print the watch list 
 //used for debugging purposes.
 static void 
@@ -412,40 +531,58 @@ trackDir(std::string fqpn, int client)
 {
     watchListT::iterator itr = watchList.find(fqpn);
     if (itr != watchList.end()){
-        auto tpl = (*itr).second;
-        std::get<1>(tpl).push_back(client);
+        auto &clients = std::get<1>((*itr).second);
+        if(clients.empty()) idleWatches.remove(fqpn);
+        if(std::find(clients.begin(), clients.end(), client) == clients.end()) 
+            clients.push_back(client);
         _info<<"Tracker added for directory:"<<fqpn
             <<" client:"<<client
-            <<" watch desciptor:"<<std::get<0>(tpl);
+            <<" watch desciptor:"<<std::get<0>((*itr).second);
         return;
     }
     int wd = _except(inotify_add_watch(inotifyFd, 
                 fqpn.c_str(), 
                 IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | \
-                IN_CLOSE_WRITE));
-    watchList.insert(std::make_pair(fqpn, std::make_tuple(wd, std::list<int>())));
-    std::get<1>((*watchList.begin()).second).push_back(client);
+                IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO));
+    watchList.insert(std::make_pair(fqpn, std::make_tuple(wd, std::list<int>(1, client))));
+    openDirListing(fqpn);
     _info<<"Tracker added for directory:"<<fqpn
         <<" client:"<<client
         <<" watch desciptor:"<<wd;
     return;
 }
 
+//forget a watched directory along with the version of its listing.
+static void
+dropWatch(std::string fqpn, bool removeWatch = true)
+{
+    watchListT::iterator itr = watchList.find(fqpn);
+    if (itr == watchList.end()) return;
+    //the watch is already gone if the directory was.
+    if(removeWatch) _eintr(inotify_rm_watch(inotifyFd, std::get<0>((*itr).second)));
+    watchList.erase(itr);
+    idleWatches.remove(fqpn);
+    closeDirListing(fqpn);
+    _info<<"Watch dropped for directory:"<<fqpn;
+    return;
+}
+
 //delete a watch from the watch list , decrement the reference count if the reference count becomes 0 
-//then do the actual deletion.
+//the watch is kept so that the version of the listing outlives the visit, the 
+//idle watches beyond kMaxIdleWatches are deleted oldest first.
 static void 
 unTrackDir(std::string fqpn, int client) 
 {
     watchListT::iterator itr = watchList.find(fqpn);
     if (itr != watchList.end()){
-        auto tpl = (*itr).second;
-        std::get<1>(tpl).remove(client);
-        if (std::get<1>(tpl).size() == 0){
-            _except(inotify_rm_watch(inotifyFd, std::get<0>(tpl)));
-            watchList.erase(itr);
-            _info<<"Tracker removed for directory:"<<fqpn<<" client:"<<client;
-        }else
-            _info<<"Tracker removed for directory:"<<fqpn<<" client:"<<client;
+        auto &clients = std::get<1>((*itr).second);
+        size_t count = clients.size();
+        clients.remove(client);
+        if (count && clients.empty()){
+            idleWatches.push_back(fqpn);
+            if(idleWatches.size() > kMaxIdleWatches) dropWatch(idleWatches.front());
+        }
+        _info<<"Tracker removed for directory:"<<fqpn<<" client:"<<client;
         return;
     }
     return; 
@@ -610,6 +747,13 @@ class fileSearch : public boost::intrusive::set_base_hook<boost::intrusive::opti
         while (_walker != boost::filesystem::recursive_directory_iterator())
         {
             //std::cerr<<"\n"<<_walker->path().string();
+            //the content store and the trash are not part of the tree the users see.
+            if((_walker->path().filename() == CSTORE_DIR) || 
+                    (_walker->path().filename() == TRASH_DIR)){
+                _walker.no_push();
+                ++_walker;
+                continue;
+            }
             if (!_askedToStop && !(fnmatch(needle, _walker->path().string().c_str(),
                             FNM_CASEFOLD))){
                 struct stat sb = {0};
@@ -704,6 +848,32 @@ getFileSrch(std::string uuid)
 	return nullptr;
 }
 
+//attributes of an entry of a directory listing.
+static void
+putDirElement(const std::string &dname, const std::string &fname, bool isDir, JSONNode &elemNode)
+{
+    //more attribs will come in future on demand 
+    std::string path = dname + "/" + fname;
+    std::string extension;
+    size_t pos = fname.find_last_of(".");
+    if(pos != std::string::npos) 
+        extension.assign(fname.begin()+ pos + 1, \
+                fname.end());
+    std::string filetype = extension.size() ? \
+        getMimeType(extension) : "unknown";
+    uint64_t fileSize = getFileSize(path);
+    tupl dirAttribs[] = {
+        {"fname", fname},
+        {"isdir", std::string(isDir ? "true" : "false")},
+        {"size",  fileSize},
+        {"type", filetype}
+    };
+    putJsonVal(dirAttribs, 
+            sizeof(dirAttribs)/sizeof(tupl), 
+            elemNode);
+    return;
+}
+
 //run the event loop for all the stream sockets sent by the 
 //gw server.
 class relayDirectory
@@ -712,17 +882,20 @@ class relayDirectory
     std::string _cookie = "";
     DIR *_dir = nullptr;
     std::string _dirName = "";
+    std::string _version = ""; //version of the listing as of before it is read.
     volatile bool _working = false;
 
     public:
     relayDirectory(int client,
             std::string cookie,
             DIR *dir,
-            std::string dname) :
+            std::string dname,
+            std::string version) :
         _client(client),
         _cookie(cookie), 
         _dir(dir),
-        _dirName(dname) { return; }
+        _dirName(dname),
+        _version(version) { return; }
 
     void _relay()
     {
@@ -754,7 +927,7 @@ class relayDirectory
                 //format the list of dents and send them to the client
                 std::string response("response");
                 tupl tv[] = {{"mesgtype", response}, {"cookie", _cookie}, \
-                    {"lastaccess", lastaccess}};
+                    {"lastaccess", lastaccess}, {"version", _version}};
                 JSONNode getDirResp(JSON_NODE);
                 putJsonVal(tv, sizeof(tv)/sizeof(tupl), getDirResp);
                 JSONNode dirElements(JSON_ARRAY);
@@ -763,31 +936,10 @@ class relayDirectory
                 while(idx){
                     {
                         JSONNode elemNode(JSON_NODE);
-                        //more attribs will come in future on demand 
-                        struct dirent element = {0};
-                        memcpy(&element, &darray[elemCount++], sizeof(struct dirent));
-                        struct stat sbuf = {0};
-                        char path[PATH_MAX + 256] = {'\0'};
-                        sprintf(path, "%s/%s", _dirName.c_str(), element.d_name);
-                        _except(stat(path, &sbuf));
-                        std::string filename = element.d_name;
-                        std::string extension;
-                        size_t pos = filename.find_last_of(".");
-                        if(pos != std::string::npos) 
-                            extension.assign(filename.begin()+ pos + 1, \
-                                    filename.end());
-                        std::string filetype = extension.size() ? \
-                            getMimeType(extension) : "unknown";
-                        uint64_t fileSize = getFileSize(path);
-                        tupl dirAttribs[] = {
-                            {"fname", std::string(element.d_name)},
-                            {"isdir", std::string(element.d_type == DT_DIR ?\
-                                    "true" : "false")},
-                            {"size",  fileSize},
-                            {"type", filetype}
-                        };
-                        putJsonVal(dirAttribs, 
-                                sizeof(dirAttribs)/sizeof(tupl), 
+                        struct dirent &element = darray[elemCount++];
+                        putDirElement(_dirName, 
+                                element.d_name, 
+                                element.d_type == DT_DIR, 
                                 elemNode);
                         dirElements.push_back(elemNode);
                     }
@@ -984,15 +1136,19 @@ class fsCommand : public boost::intrusive::set_base_hook<boost::intrusive::optim
                                     S_IWGRP | S_IXGRP | S_IXUSR )));
                     //initialize the info record for the new directory.
                     initializeInfoRecord(_argv[0], _uid, _gid);
+                    dirEntryChanged(_argv[0]);
                     logFileActivity(_uid, _gid, std::string(_argv[0]), "created directory");
                     break;
                 case CREATE_FILE:
                     _except(::open(_argv[0], O_CREAT | O_RDWR, 0));
                     //initialize the info record for the new file.
                     initializeInfoRecord(_argv[0], _uid, _gid);
+                    dirEntryChanged(_argv[0]);
                     logFileActivity(_uid, _gid, std::string(_argv[0]), "created file");
                     break;
                 case REMOVE:
+                    if(trashSources()) break;
+                    //what could not go to the trash is left to rm.
                 case MOVE:
                 case COPY:
                 case ZIP:
@@ -1014,7 +1170,8 @@ class fsCommand : public boost::intrusive::set_base_hook<boost::intrusive::optim
                                 std::placeholders::_2));
             }
             //send back a response to the client about command complete 
-            if((_ctype == CREATE_DIR) || (_ctype == CREATE_FILE)){
+            if((_ctype == CREATE_DIR) || (_ctype == CREATE_FILE) || 
+                    ((_ctype == REMOVE) && !childSpawned)){
                 std::string status = (_childExitCode == 0) ? "success" : "fail"; 
                 std::string response("response");
                 tupl tv[] = {{"mesgtype", response}, {"cookie", _clientCookie}, {"status", status}};
@@ -1035,6 +1192,31 @@ class fsCommand : public boost::intrusive::set_base_hook<boost::intrusive::optim
         return 0;
     }
 
+    //a delete is a rename of the sources in to the trash of their organization.
+    //returns false with the sources that could not be moved (another file 
+    //system under the organization) left in the argv.
+    bool trashSources()
+    {
+        unsigned int left = 2;
+        for(unsigned int i = 2; i < _argvCount; i++){
+            std::string source(_argv[i]);
+            try{
+                std::string id = moveToTrash(deriveRoot(source), source, _uid, _gid);
+                _info<<"moved to trash:"<<source<<" as:"<<id;
+                dirEntryChanged(source);
+                delete _argv[i];
+            }
+            catch(std::exception &ex){
+                _error<<"fsCommand::trashSources() unable to move:"<<source<<
+                    " to trash:"<<ex.what();
+                _argv[left++] = _argv[i];
+            }
+        }
+        _argvCount = left;
+        _argv[_argvCount] = nullptr;
+        return _argvCount == 2;
+    }
+
     void answerQuestion(std::string answer)
     {  
         const char *resp = nullptr;
@@ -1186,6 +1368,134 @@ getFsCommand(pid_t child)
 	return nullptr;
 }
 
+//positioned write of the whole buffer.
+static void
+pwriteAll(int fd, const unsigned char *data, size_t len, off_t offset)
+{
+    while(len){
+        ssize_t rc = _except(::pwrite(fd, data, len, offset));
+        data += rc;
+        len -= rc;
+        offset += rc;
+    }
+    return;
+}
+
+//text files are of mimetype "text/", only those are diffed.
+static bool
+isTextFile(const std::string &fname)
+{
+    std::string extension;
+    size_t pos = fname.find_last_of(".");
+    if(pos != std::string::npos) 
+        extension.assign(fname.begin()+ pos + 1, 
+                fname.end());
+    std::string filetype = extension.size() ? \
+                           getMimeType(extension) : \
+                           "unknown";
+    return filetype.find("text/") != std::string::npos;
+}
+
+//commits to the same file go one at a time, else both would read the same
+//version and write the next one.
+static std::mutex commitLocks[64];
+
+//move the new version of the file in tmpName over fname and record it in the
+//content store of the organization. known is the manifest of the new version
+//when its chunks are already in the store. returns the new version number.
+static int
+commitNewVersion(const std::string &tmpName, std::string fname, int uid, int gid,
+        const versionManifest *known = nullptr)
+{
+    std::unique_lock<std::mutex> lock(commitLocks[std::hash<std::string>()(fname) % 64]);
+    bool fileExisting = false;
+    struct stat sb = {0};
+    if(stat(fname.c_str(), &sb) == 0) fileExisting = true;
+    //make a copy of old attributes and rewrite them back as new.
+    //after creating a new version of the file move the temp path to the original path.
+    fileAttribRecord oldAttrib;
+    if(fileExisting) oldAttrib = getFileAttribCopy(fname);
+    contentStore store(deriveRoot(fname));
+    //files from before the history get their current version recorded first.
+    if(fileExisting && !store.hasVersion(oldAttrib.oid, oldAttrib.version)){
+        int fd = _except(::open(fname.c_str(), O_RDONLY));
+        SCOPE_EXIT{ _eintr(::close(fd)); };
+        versionManifest prev;
+        store.ingest(fd, prev);
+        prev.version = oldAttrib.version;
+        prev.uid = oldAttrib.ownerUid;
+        prev.time = sb.st_mtime;
+        store.writeManifest(oldAttrib.oid, prev);
+    }
+    versionManifest m;
+    if(known) m = *known;
+    else{
+        int fd = _except(::open(tmpName.c_str(), O_RDONLY));
+        SCOPE_EXIT{ _eintr(::close(fd)); };
+        store.ingest(fd, m);
+    }
+    m.uid = uid;
+    m.time = time(nullptr);
+    //generate diff before throwing away old file.
+    //if the file is less than 1 MB and is a text file.
+    //else paste an error saying we cannot generate diff due to size constraints.
+    std::stringstream ss;
+    std::string diffResult;
+    if(fileExisting){
+        if((getFileSize(tmpName) < (1024*1024*1024)) && 
+                (getFileSize(fname) < (1024*1024*1024))){
+            if(isTextFile(fname)){
+                _info<<"generating diff for file:"<<fname;
+                unifiedDiff(fname, tmpName, ss);
+                if(ss.str().size() < (1024*1024)) diffResult = ss.str();
+                else diffResult = "Note: Diff was too large, so not displaying";
+            }
+        }else
+            diffResult = "Note: File size too large, not generating diff";
+    }
+    _except(::rename(tmpName.c_str(), fname.c_str()));
+    dirEntryChanged(fname);
+    //if this is a new file.
+    //initialize the info record for the file with the default attributes.
+    if(!fileExisting){
+        initializeInfoRecord(fname, uid, gid);
+        oldAttrib = getFileAttribCopy(fname);
+    }
+    //a version that is already there came from a commit that lost the race
+    //to the attributes, take the next one instead of overwriting it.
+    m.version = oldAttrib.version + 1;
+    while(!store.writeManifest(oldAttrib.oid, m)) m.version++;
+    oldAttrib.version = m.version;
+    setFileAttrib(fname, oldAttrib);
+    if(history_versions > 0) store.pruneVersions(oldAttrib.oid, history_versions);
+    std::string notiftype = "newversion";
+    std::string description = "created a new version of file";
+    logFileActivity(uid, gid, fname, description + diffResult);
+    //FIXME: If this is a personal directory and the followers are more than 
+    //user then only send notification.
+    //notify from the second version on wards.
+    if(fileExisting) notify(uid, gid, fname, notiftype, description);
+    return m.version;
+}
+
+//encode a block read by the ring and send it, on the thread pool.
+static void
+sendReadBlock(int client, std::string cookie, std::shared_ptr<unsigned char> buffer, size_t len)
+{
+    try{
+        std::string encodedBuf = JSONBase64::json_encode64(buffer.get(), len);
+        memset(buffer.get(), 0, len);
+        readResponse(client, encodedBuf, encodedBuf.length(), cookie);
+    }
+    catch(std::exception &ex){
+        _error<<"sendReadBlock() caught exception:"<<ex.what();
+        error2Client(client, 
+                cookie, 
+                "There was some internal error in downloading the file, Please retry.");
+    }
+    return;
+}
+
 //A file transfer operation can be write or read depending on whether 
 //the file is being downloaded or uploaded.
 class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimize_size<true>>
@@ -1195,8 +1505,14 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
 	std::string _clientCookie = ""; //128 bit uuid is generated by the client and used as a cookie 
 	int _client = -1; // network connection identifier in the gw daemon
     bool isRead = true;
+    //a registered buffer of the ring when there is one free, the ops in flight
+    //hold on to it past the xfer.
+    std::shared_ptr<unsigned char> _bufferHold;
     unsigned char *_buffer = nullptr;
+    int _bufferIndex = -1;
+    std::shared_ptr<bool> _alive = std::make_shared<bool>(true); //for the ring completions.
     unsigned int  _bufferSize = 0; //amount of valid data in the buffer
+    off_t _offset = 0; //where the next block is read from or written to.
     volatile bool _working = false;
     int _fileSize = 0;
     std::string _tmpName = ""; //temporary name of the file, after the xfer the file will be moved 
@@ -1204,6 +1520,18 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
                                //for the upload operation.
     int _uid = -1; 
     int _gid = -1;
+    //delta upload, the messages carry the ops and the blocks come from the 
+    //current version of the file.
+    bool _delta = false;
+    int _basisFd = -1;
+    uint32_t _blockSize = 0;
+    std::vector<unsigned char> _block;
+    MD5_CTX _digest;
+    std::string _expectedDigest = ""; //md5 of the new version in hex.
+    uint64_t _deltaSize = 0; //declared size of the new version.
+    uint64_t _deltaWritten = 0;
+    //ranged writes not yet on disk, shared with them as they may outlive the xfer.
+    std::shared_ptr<std::atomic<int>> _rangesInFlight = std::make_shared<std::atomic<int>>(0);
 
 	public:
     fileXfer(const char *fname, 
@@ -1222,9 +1550,13 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
         _gid(gid),
         _fileSize(fileSize)
 	{
-        bool allOk = false;
-        _except(posix_memalign(reinterpret_cast<void**>(&_buffer), kPageSize, diskBlockSize));
-        SCOPE_EXIT{ if(!allOk) free(_buffer); };
+        if(fRing){
+            _bufferHold = fRing->buffer(_bufferIndex);
+        }else{
+            _except(posix_memalign(reinterpret_cast<void**>(&_buffer), kPageSize, diskBlockSize));
+            _bufferHold.reset(_buffer, free);
+        }
+        _buffer = _bufferHold.get();
 		int flags = isRead ? (O_RDONLY) : (O_RDWR | O_CREAT | O_TRUNC);
         _tmpName = _fname;
         //turn on metering if this is not a download.
@@ -1235,8 +1567,9 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
         }
         _fd = _except(::open(_tmpName.c_str(), flags, (S_IRUSR | S_IWUSR | \
                         S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP)));
+        //a download is read front to back, let the kernel read ahead wider.
+        if (_isRead) posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 		add2XferTbl(this);//add to the xfer table NOTE: There is no possibility of exceptions beyond this point
-        allOk = true;
 		return;
 	}
     catch(std::exception &ex)
@@ -1248,8 +1581,12 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
     {
         unsigned int sleepCount = 10;
         while(_working && (--sleepCount)) usleep(100); //just wait until it comes back.
-        if (_buffer) free(_buffer);
+        *_alive = false;
+        //an op of the ring still in flight keeps its file, a prepared one
+        //only has the number which must not be closed before it goes in.
+        if (fRing) fRing->submit();
         if (_fd > 0) _eintr(::close(_fd));//close the file descriptor
+        if (_basisFd >= 0) _eintr(::close(_basisFd));
         delFromXferTbl(this);
         return;
     }
@@ -1259,7 +1596,11 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
     {
         try{
             SCOPE_EXIT{ _working = false; };
-            int rc = _except(::read(_fd, _buffer, diskBlockSize)); 
+            int rc = _except(::pread(_fd, _buffer, diskBlockSize, _offset)); 
+            _offset += rc;
+            //the next blocks come off the disk while this one is on its way
+            //to the client and the ack on its way back.
+            if (rc) posix_fadvise(_fd, _offset, readAheadBlocks * diskBlockSize, POSIX_FADV_WILLNEED);
             if (rc){
                 std::string encodedBuf = JSONBase64::json_encode64(_buffer, rc);
                 memset(_buffer, 0, rc);
@@ -1291,69 +1632,31 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
         try{
             SCOPE_EXIT{ _working = false; };
             if(_bufferSize){
-                _except(::write(_fd, _buffer, _bufferSize));
-                //send back an ack to the client so that it can 
-                //send additional blocks.
-                std::string response("ack");
-                std::string request("write");
-                tupl tv[] = {{"mesgtype", response}, {"request", request}, \
-                    {"cookie", _clientCookie}};
-                size_t size = sizeof(tv)/sizeof(tupl);
-                {
-                    string writeAck = putJsonVal(tv, size);
-                    writeFmgrReply(_client, writeAck.c_str(), writeAck.length());
+                if(_delta){
+                    if(!applyDelta(_basisFd, _fd, _buffer, _bufferSize, _blockSize, 
+                                _block.data(), &_digest, _deltaWritten, _deltaSize))
+                        throw std::runtime_error("malformed delta for file: " + _fname);
+                }else{
+                    pwriteAll(_fd, _buffer, _bufferSize, _offset);
+                    //start the writeback now rather than all of it at the rename.
+                    sync_file_range(_fd, _offset, _bufferSize, SYNC_FILE_RANGE_WRITE);
+                    _offset += _bufferSize;
                 }
+                sendWriteAck();
             }else{
-                //if there is already a file existing 
                 _info<<"fileXfer::writeAsync() trailer packet recvd for file:"<<_fname;
-                bool fileExisting = false;
-                struct stat sb = {0};
-                if(stat(_fname.c_str(), &sb) == 0) fileExisting = true;
-                //make a copy of old attributes and rewrite them back as new.
-                //after creating a new version of the file move the temp path to the original path.
-                fileAttribRecord oldAttrib;
-                if(fileExisting) oldAttrib = getFileAttribCopy(_fname);
-                //generate diff before throwing away old file.
-                //if the file is less than 1 MB and is a text file.
-                //else paste an error saying we cannot generate diff due to size constraints.
-                std::stringstream ss;
-                std::string diffResult;
-                if(fileExisting){
-                    if((getFileSize(_tmpName) < (1024*1024*1024)) && 
-                            (getFileSize(_fname) < (1024*1024*1024))){
-                        std::string extension;
-                        size_t pos = _fname.find_last_of(".");
-                        if(pos != std::string::npos) 
-                            extension.assign(_fname.begin()+ pos + 1, 
-                                    _fname.end());
-                        std::string filetype = extension.size() ? \
-                                               getMimeType(extension) : \
-                                               "unknown";
-                        //text files are of mimetype "text/";
-                        unsigned found = filetype.find("text/");
-                        if(found != std::string::npos){
-                            _info<<"generating diff for file:"<<_fname;
-                            unifiedDiff(_fname, _tmpName, ss);
-                            if(ss.str().size() < (1024*1024)) diffResult = ss.str();
-                            else diffResult = "Note: Diff was too large, so not displaying";
-                        }
-                    }else
-                        diffResult = "Note: File size too large, not generating diff";
+                if(_delta){
+                    //the file may have changed since the client got the signatures.
+                    if(_deltaWritten != _deltaSize)
+                        throw std::runtime_error("delta upload is short for file: " + _fname);
+                    unsigned char md5[MD5_DIGEST_LENGTH];
+                    MD5_Final(md5, &_digest);
+                    std::stringstream hex;
+                    for(auto c : md5) hex<<std::hex<<std::setw(2)<<std::setfill('0')<<(int)c;
+                    if(hex.str() != _expectedDigest)
+                        throw std::runtime_error("delta upload did not reproduce file: " + _fname);
                 }
-                _except(::rename(_tmpName.c_str(), _fname.c_str()));
-                //if this is a new file.
-                //initialize the info record for the file with the default attributes.
-                if(!fileExisting)
-                    initializeInfoRecord(_fname, _uid, _gid);
-                else
-                    setFileAttrib(_fname, oldAttrib);
-                std::string notiftype = "newversion";
-                std::string description = "created a new version of file";
-                logFileActivity(_uid, _gid, _fname, description + diffResult);
-                //FIXME: If this is a personal directory and the followers are more than 
-                //user then only send notification.
-                //notify from the second version on wards.
-                if(fileExisting) notify(_uid, _gid, _fname, notiftype, description);
+                commitNewVersion(_tmpName, _fname, _uid, _gid);
                 die();
             }
         }
@@ -1376,21 +1679,127 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
         return;
     }
 
+    //send back an ack to the client so that it can 
+    //send additional blocks.
+    void
+    sendWriteAck()
+    {
+        std::string response("ack");
+        std::string request(_delta ? "delta" : "write");
+        tupl tv[] = {{"mesgtype", response}, {"request", request}, \
+            {"cookie", _clientCookie}};
+        size_t size = sizeof(tv)/sizeof(tupl);
+        string writeAck = putJsonVal(tv, size);
+        writeFmgrReply(_client, writeAck.c_str(), writeAck.length());
+        return;
+    }
+
+    //the block is read by the kernel and completes on the service loop, only
+    //the encoding is left to the pool.
+    void
+    ringRead()
+    {
+        std::shared_ptr<bool> alive = _alive;
+        std::shared_ptr<unsigned char> buffer = _bufferHold;
+        fRing->read(_fd, _buffer, diskBlockSize, _offset, _bufferIndex, 
+                [this, alive, buffer](int rc){
+                    if(!*alive) return;
+                    if(rc < 0){
+                        _error<<"fileXfer::ringRead() read failed:"<<strerror(-rc); 
+                        error2Client(_client, 
+                                _clientCookie, 
+                                "There was some internal error in downloading the file, Please retry.");
+                        return;
+                    }
+                    if(!rc){
+                        readResponse(_client, "", 0, _clientCookie);
+                        die();
+                        return;
+                    }
+                    _offset += rc;
+                    fRing->fadvise(_fd, _offset, readAheadBlocks * diskBlockSize, POSIX_FADV_WILLNEED);
+                    tPool->enqueue(std::bind(sendReadBlock, _client, _clientCookie, buffer, rc));
+                });
+        return;
+    }
+
+    //write what is left of the block from done on, a short write goes in
+    //again for the rest. the ack goes out once all of it is written.
+    void
+    ringWrite(size_t done)
+    {
+        std::shared_ptr<bool> alive = _alive;
+        std::shared_ptr<unsigned char> buffer = _bufferHold;
+        fRing->write(_fd, _buffer + done, _bufferSize - done, _offset + done, _bufferIndex, 
+                [this, alive, buffer, done](int rc){
+                    if(!*alive) return;
+                    if(rc <= 0){
+                        _error<<"fileXfer::ringWrite() write failed:"<<
+                            (rc ? strerror(-rc) : "nothing written"); 
+                        ::unlink(_tmpName.c_str());
+                        error2Client(_client, 
+                                _clientCookie, 
+                                "There was some internal error in uploading the file, Please retry.");
+                        return;
+                    }
+                    if(done + rc < _bufferSize){
+                        ringWrite(done + rc);
+                        return;
+                    }
+                    //start the writeback now rather than all of it at the rename.
+                    fRing->syncRange(_fd, _offset, _bufferSize, SYNC_FILE_RANGE_WRITE);
+                    _offset += _bufferSize;
+                    sendWriteAck();
+                });
+        return;
+    }
+
     void Read()
     { 
+        if(fRing){
+            ringRead();
+            return;
+        }
         _working = true;
         tPool->enqueue(std::bind(&fileXfer::readAsync, this)); 
         return; 
     }
 
+    //deltas and the trailer, which commits the file, stay on the pool.
     void Write(const char *data, size_t dataSize)
     {
         copy2Buffer(data, dataSize);
+        if(fRing && dataSize && !_delta){
+            ringWrite(0);
+            return;
+        }
         _working = true;
         tPool->enqueue(std::bind(&fileXfer::writeAsync, this));
         return;
     }
 
+    //the upload carries a delta against the current version of the file, the
+    //result must come out at size bytes with md5 as its digest.
+    void
+    setDelta(uint32_t blockSize, uint64_t size, const std::string &md5)
+    {
+        if((blockSize < DELTA_MIN_BLOCK) || (blockSize > DELTA_MAX_BLOCK))
+            throw std::runtime_error("invalid delta block size");
+        if(md5.length() != MD5_DIGEST_LENGTH * 2)
+            throw std::runtime_error("delta upload without md5");
+        _deltaSize = size;
+        _expectedDigest = md5;
+        _basisFd = ::open(_fname.c_str(), O_RDONLY);
+        if((_basisFd < 0) && (errno != ENOENT)) THROW_ERRNO_EXCEPTION;
+        _blockSize = blockSize;
+        _block.resize(blockSize);
+        MD5_Init(&_digest);
+        _delta = true;
+        return;
+    }
+
+    bool isDelta() { return _delta; }
+    std::shared_ptr<std::atomic<int>> rangesInFlight() { return _rangesInFlight; }
     bool isBusy() { return _working == true; }
     bool isWrite() { return !isRead; };
     std::string getFileName() { return _fname; }
@@ -1421,6 +1830,7 @@ class fileXfer : public boost::intrusive::set_base_hook<boost::intrusive::optimi
     }
 	std::string& getClientCookie() { return _clientCookie; }
 	int getFileDesc() { return _fd; }
+    const std::string& getTmpName() { return _tmpName; }
 	int getClient() { return _client; }
     friend bool operator < (const fileXfer &a, const fileXfer &b) 
     { return a._fd < b._fd; }
@@ -1548,16 +1958,127 @@ handleRead(int client, char *jsonData)
 	return;
 }
 
+//read of a range of a file, ranges of a file can be fetched in parallel.
+static void
+readRange(int client, std::string cookie, int fd, off_t offset, size_t size)
+{
+    SCOPE_EXIT{ _eintr(::close(fd)); };
+    try{
+        std::vector<unsigned char> buf(size);
+        size_t len = 0;
+        while(len < size){
+            ssize_t rc = _except(::pread(fd, buf.data() + len, size - len, offset + len));
+            if(!rc) break;
+            len += rc;
+        }
+        std::string encodedBuf = JSONBase64::json_encode64(buf.data(), len);
+        readResponse(client, encodedBuf, encodedBuf.length(), cookie);
+    }
+    catch(std::exception &ex){
+        _error<<"readRange() caught exception:"<<ex.what();
+        error2Client(client, 
+                cookie, 
+                "There was some internal error in downloading the file, Please retry.");
+    }
+    return;
+}
+
+//the same read on the ring, len bytes of the range are in so far.
+static void
+ringReadRange(int client, std::string cookie, int fd, off_t offset, size_t size,
+        std::shared_ptr<unsigned char> buffer, int index, size_t len)
+{
+    fRing->read(fd, buffer.get() + len, size - len, offset + len, index, 
+            [=](int rc) mutable {
+                if(rc < 0){
+                    _error<<"ringReadRange() read failed:"<<strerror(-rc);
+                    _eintr(::close(fd));
+                    error2Client(client, 
+                            cookie, 
+                            "There was some internal error in downloading the file, Please retry.");
+                    return;
+                }
+                if(rc && (len + rc < size)){
+                    ringReadRange(client, cookie, fd, offset, size, buffer, index, len + rc);
+                    return;
+                }
+                _eintr(::close(fd));
+                tPool->enqueue(std::bind(sendReadBlock, client, cookie, buffer, len + rc));
+            });
+    return;
+}
+
+static void
+ackRange(int client, std::string cookie, off_t offset)
+{
+    std::string response("ack");
+    std::string request("put_offset");
+    tupl tv[] = {
+        {"mesgtype", response}, 
+        {"request", request},
+        {"cookie", cookie},
+        {"offset", (long)offset}
+    };
+    std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl));
+    writeFmgrReply(client, json.c_str(), json.length());
+    return;
+}
+
+//write of a range of an upload, acked with its offset.
+static void
+writeRange(int client, std::string cookie, int fd, off_t offset, std::string data,
+        std::shared_ptr<std::atomic<int>> inFlight)
+{
+    SCOPE_EXIT{ _eintr(::close(fd)); };
+    try{
+        {
+            SCOPE_EXIT{ (*inFlight)--; }; //before the ack, the trailer may follow it at once.
+            pwriteAll(fd, reinterpret_cast<const unsigned char*>(data.data()), data.length(), offset);
+        }
+        ackRange(client, cookie, offset);
+    }
+    catch(std::exception &ex){
+        _error<<"writeRange() caught exception:"<<ex.what();
+        error2Client(client, 
+                cookie, 
+                "There was some internal error in uploading the file, Please retry.");
+    }
+    return;
+}
+
+//the same write on the ring, len bytes of the range are out so far.
+static void
+ringWriteRange(int client, std::string cookie, int fd, off_t offset, 
+        std::shared_ptr<std::string> data, size_t len, std::shared_ptr<std::atomic<int>> inFlight)
+{
+    fRing->write(fd, data->data() + len, data->length() - len, offset + len, -1, 
+            [=](int rc) mutable {
+                if((rc > 0) && (len + rc < data->length())){
+                    ringWriteRange(client, cookie, fd, offset, data, len + rc, inFlight);
+                    return;
+                }
+                _eintr(::close(fd));
+                (*inFlight)--; //before the ack, the trailer may follow it at once.
+                if((rc < 0) || (!rc && (len < data->length()))){
+                    _error<<"ringWriteRange() write failed:"<<(rc ? strerror(-rc) : "nothing written");
+                    error2Client(client, 
+                            cookie, 
+                            "There was some internal error in uploading the file, Please retry.");
+                    return;
+                }
+                ackRange(client, cookie, offset);
+            });
+    return;
+}
+
 //send requested amount of data from the offset provided.
-//XXX: use pread to read from the offset.
 static void
 handleReadOffset(int client, char *jsonData) 
 {
 	std::string cookie, fname;
-	int size, uid, gid, offset;
+	int size, uid, gid;
 	tupl t[] = {
 		{"cookie"  , &cookie},
-		{"offset"  , &offset},
 		{"fname"   , &fname},
 		{"size"	   , &size},
 		{"uid"	   , &uid},
@@ -1566,7 +2087,26 @@ handleReadOffset(int client, char *jsonData)
 	unsigned int sz = sizeof(t)/sizeof(tupl);
     try{
         JSONNode n = libjson::parse(jsonData);
-        if(getJsonVal(n, t, sz)){
+        auto offsetNode = n.find("offset"); //a json_int_t, files go past 2GB.
+        if(getJsonVal(n, t, sz) && (offsetNode != n.end())){
+            off_t offset = offsetNode->as_int();
+            if((offset < 0) || (size <= 0) || (size > diskBlockSize)){
+                error2Client(client, cookie, "invalid range requested");
+                return;
+            }
+            if(!checkAuthorization(uid, gid, fname)){
+                error2Client(client, cookie, 
+                        "You are not authorized access to this file/folder");
+                return;
+            }
+            int fd = _except(::open(fname.c_str(), O_RDONLY));
+            if(fRing){
+                int index;
+                std::shared_ptr<unsigned char> buffer = fRing->buffer(index);
+                ringReadRange(client, cookie, fd, offset, size, buffer, index, 0);
+            }else{
+                tPool->enqueue(std::bind(readRange, client, cookie, fd, offset, size));
+            }
         }else{
             _error<<""<<__FUNCTION__<<"() Not enough data to perform operation requested.";
         }
@@ -1652,8 +2192,9 @@ handleCancelOp(int client, char *jsonData)
                 while(xfr->isBusy() && (--sleepCount)) usleep(100);
                 assert(sleepCount); //sleep count 0 means some thing wrong.
                 //if this is a partial write then delete the partially written file.
-                //dont bother about exceptions this is a best effort.
-                if (xfr->isWrite()) _eintr(::close(xfr->getFd())); 
+                //dont bother about exceptions this is a best effort. the
+                //destructor closes the file.
+                if (xfr->isWrite()) ::unlink(xfr->getTmpName().c_str()); 
 				delete xfr;
                 _info<<"handleCancelOp() fileXfer with cookie: "<<cookie<<
                     " cancelled.";
@@ -1724,9 +2265,54 @@ checkAuthorization(int uid, int gid, std::string &file)
     return true; //FIXME: only for testing remove afterwards.
 }
 
+//the client has an earlier version of the listing, send the entries that 
+//changed since then. an unchanged listing costs no directory io at all.
+static void
+sendDirChanges(int client, std::string &cookie, std::string &dname, 
+        std::set<std::string> &changed)
+{
+    std::string version = currentDirVersion(dname);
+    std::string response("response");
+    std::string notModified(changed.empty() ? "true" : "false");
+    tupl tv[] = {
+        {"mesgtype", response}, 
+        {"cookie", cookie},
+        {"version", version},
+        {"incremental", std::string("true")},
+        {"notmodified", notModified}
+    };
+    JSONNode getDirResp(JSON_NODE);
+    putJsonVal(tv, sizeof(tv)/sizeof(tupl), getDirResp);
+    JSONNode dirElements(JSON_ARRAY);
+    dirElements.set_name("direlements");
+    JSONNode removed(JSON_ARRAY);
+    removed.set_name("removed");
+    for(auto &fname : changed){
+        struct stat sbuf = {0};
+        std::string path = dname + "/" + fname;
+        if(stat(path.c_str(), &sbuf) < 0){
+            if(errno != ENOENT) THROW_ERRNO_EXCEPTION;
+            removed.push_back(JSONNode("", fname));
+            continue;
+        }
+        //only display regular files and directories
+        if(!S_ISREG(sbuf.st_mode) && !S_ISDIR(sbuf.st_mode)) continue;
+        JSONNode elemNode(JSON_NODE);
+        putDirElement(dname, fname, S_ISDIR(sbuf.st_mode), elemNode);
+        dirElements.push_back(elemNode);
+    }
+    getDirResp.push_back(dirElements);
+    getDirResp.push_back(removed);
+    std::string json = getDirResp.write_formatted();
+    writeFmgrReply(client, json.c_str(), json.length());
+    return;
+}
+
 //add a inotify_watch on this directory to watch it, send events 
 //to the UI accordingly to sync the view of the client with the 
 //directory contents.
+//a client that sends the version of the listing it has gets the changes
+//since then or just a notmodified.
 static void
 handleGetDir(int client, char *jsonData)
 {
@@ -1748,14 +2334,25 @@ handleGetDir(int client, char *jsonData)
                 return;
             }
 
-			DIR *dir = opendir(dname.c_str());
-            if(dir){
-                relayDirectory *rdir = new relayDirectory(client, 
-                        cookie, 
-                        dir, 
-                        dname);
-                rdir->relay();
+            std::set<std::string> changed;
+            auto known = n.find("version");
+            bool incremental = (known != n.end()) && 
+                dirChangesSince(dname, known->as_string(), changed);
+			DIR *dir = incremental ? nullptr : opendir(dname.c_str());
+            if(incremental || dir){
+                //the watch goes first so no change made while the listing 
+                //is read gets missed by the next version.
                 trackDir(dname, client); //Add tracker for the current directory.
+                if(incremental)
+                    sendDirChanges(client, cookie, dname, changed);
+                else{
+                    relayDirectory *rdir = new relayDirectory(client, 
+                            cookie, 
+                            dir, 
+                            dname,
+                            currentDirVersion(dname));
+                    rdir->relay();
+                }
                 //derive the parent dir of the directory
                 std::string parentDir;
                 size_t pos = dname.find_last_of("/");
@@ -1828,6 +2425,10 @@ handleWrite(int client, char *jsonData)
                         uid, 
                         gid, 
                         bytesleft);
+            }else if(decodedBuf.empty() && *xfer->rangesInFlight()){
+                //the file would be committed without the ranges still being written.
+                error2Client(client, cookie, "ranged writes still in flight, resend the trailer after their acks");
+                return;
             }
             xfer->Write(decodedBuf.c_str(), decodedBuf.length());
         }
@@ -1853,42 +2454,691 @@ handleWrite(int client, char *jsonData)
 	return;
 }
 
-//write requested amount of data to the offset provided.
-//XXX: use pwrite to write at the offset.
-static void 
-handleWriteOffset(int client, char *jsonData) 
+//send the block signatures of the current version of the file, the client
+//diffs its copy against them and uploads a delta. a file that does not exist
+//yet has no signatures, the delta is then all literals.
+static void
+sendSignatures(int client, std::string cookie, std::string fname)
+{
+    try{
+        std::string sigs;
+        uint64_t fileSize = 0;
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if((fd < 0) && (errno != ENOENT)) THROW_ERRNO_EXCEPTION;
+        SCOPE_EXIT{ if(fd >= 0) _eintr(::close(fd)); };
+        if(fd >= 0){
+            struct stat sb = {0};
+            _except(fstat(fd, &sb));
+            fileSize = sb.st_size;
+        }
+        uint32_t blockSize = deltaBlockSize(fileSize);
+        if(fd >= 0) computeSignatures(fd, blockSize, sigs);
+        int count = sigs.length() / DELTA_SIGNATURE_LEN;
+        int first = 0;
+        do{
+            int last = std::min(first + signaturesPerReply, count);
+            std::string encoded = JSONBase64::json_encode64(
+                    reinterpret_cast<const unsigned char*>(sigs.data()) + first * DELTA_SIGNATURE_LEN, 
+                    (last - first) * DELTA_SIGNATURE_LEN);
+            std::string response("response");
+            std::string request("signature");
+            tupl tv[] = {
+                {"mesgtype", response}, 
+                {"request", request},
+                {"cookie", cookie},
+                {"blocksize", (int)blockSize},
+                {"size", (long)fileSize},
+                {"first", first},
+                {"last", last},
+                {"signatures", encoded}
+            };
+            std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl));
+            writeFmgrReply(client, json.c_str(), json.length());
+            first = last;
+        }while(first < count);
+    }
+    catch(std::exception &ex){
+        _error<<"sendSignatures() fname:"<<fname<<" caught exception:"<<ex.what();
+        error2Client(client, 
+                cookie, 
+                "There was some internal error in reading the file, Please retry.");
+    }
+    return;
+}
+
+//client wants to upload a new version of a file as a delta.
+static void
+handleSignature(int client, char *jsonData)
 {
 	std::string cookie, fname;
-	int size, uid, gid, offset;
-	json_string data;
-    int bytesleft = 0;
+	int uid, gid;
 	tupl t[] = {
 		{"cookie"  , &cookie},
-		{"offset"  , &offset},
 		{"fname"   , &fname},
-		{"size"	   , &size},
-		{"data"    , &data},
-		{"uid"    , &uid},
-		{"gid"    , &gid},
-		{"bytesleft", &bytesleft}
+		{"uid"	   , &uid},
+		{"gid"	   , &gid}
 	};
 	unsigned int sz = sizeof(t)/sizeof(tupl);
-	try {
-		JSONNode n = libjson::parse(jsonData);
+    try{
+        JSONNode n = libjson::parse(jsonData);
         if(getJsonVal(n, t, sz)){
+            if(!checkAuthorization(uid, gid, fname)){
+                error2Client(client, cookie, 
+                        "You are not authorized access to this file/folder");
+                return;
+            }
+            tPool->enqueue(std::bind(sendSignatures, client, cookie, fname));
+        }else{
+            _error<<""<<__FUNCTION__<<"() Not enough data to perform operation requested.";
         }
-		else{
-			_error<<""<<__FUNCTION__<<"() Not enough data to perform operation requested.";
-		}
-	}
-    catch(syscallException &ex){ 
-        _error<<"handleWriteOffset() fname:"<<fname<<
-            " failed with : syscall exception:"<<ex.what(); 
-        throw(ex); 
     }
-    catch(std::exception &ex){ 
-        _error<<"handleWriteOffset() fname:"<< fname <<
-            " Exited with standard exception:"<<ex.what(); 
+    catch(std::exception &ex){
+        _error<<
+            __FUNCTION__<<
+            "() caught: standard exception:"<<
+            ex.what(); 
+        throw(ex); 
+    }
+	return;
+}
+
+//a block of delta ops for an upload, same flow as write with the file
+//rebuilt from the current version and the literals of the client.
+//the first message declares the size and md5 of the new version, the
+//ops may not write past the size and an empty data (the trailer) only
+//replaces the old version if both came out right.
+static void 
+handleDelta(int client, char *jsonData) 
+{
+	std::string cookie, fname;
+	int uid, gid, blockSize;
+	json_string data;
+	tupl t[] = {
+		{"cookie"  , &cookie},
+		{"fname"   , &fname},
+		{"data"    , &data},
+		{"uid"    , &uid},
+		{"gid"    , &gid},
+		{"blocksize", &blockSize}
+	};
+	unsigned int sz = sizeof(t)/sizeof(tupl);
+	try {
+		JSONNode n = libjson::parse(jsonData);
+        if(getJsonVal(n, t, sz)){
+            std::string decodedBuf = JSONBase64::json_decode64(data);
+            if(decodedBuf.length() > (size_t)diskBlockSize){
+                error2Client(client, cookie, "delta message too large");
+                return;
+            }
+            fileXfer *xfer = getFileXfer(cookie);
+            if (!xfer){
+                auto md5 = n.find("md5");
+                auto size = n.find("size");
+                if((md5 == n.end()) || (size == n.end()) || (size->as_int() < 0)){
+                    error2Client(client, cookie, "delta upload needs the size and md5 of the file");
+                    return;
+                }
+                _info<<"new delta xfer started: cookie: "<<cookie
+                    <<" name: "<<fname;
+                xfer = new fileXfer(fname.c_str(), 
+                        cookie.c_str(), 
+                        client, 
+                        false, 
+                        uid, 
+                        gid);
+                try{
+                    xfer->setDelta(blockSize, size->as_int(), md5->as_string());
+                }
+                catch(std::exception &ex){
+                    ::unlink(xfer->getTmpName().c_str());
+                    delete xfer;
+                    throw;
+                }
+            }
+            if(!xfer->isDelta()){
+                error2Client(client, cookie, "cookie belongs to a plain upload");
+                return;
+            }
+            xfer->Write(decodedBuf.c_str(), decodedBuf.length());
+        }
+		else{
+			_error<<""<<__FUNCTION__<<"() Not enough data to perform operation requested.";
+		}
+	}
+    catch(syscallException &ex){ 
+        _error<<"handleDelta() fname:"<<fname<<
+            " failed with : syscall exception:"<<ex.what(); 
+        throw(ex); 
+    }
+    catch(std::exception &ex){ 
+        _error<<"handleDelta() fname:"<< fname <<
+            " Exited with standard exception:"<<ex.what(); 
+        throw(ex); 
+    }
+	return;
+}
+
+//reply carrying the version of a file an operation ended up at.
+static void
+versionReply(int client, std::string cookie, std::string request, int version)
+{
+    std::string response("response");
+    tupl tv[] = {
+        {"mesgtype", response}, 
+        {"request", request},
+        {"cookie", cookie},
+        {"version", version}
+    };
+    std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl));
+    writeFmgrReply(client, json.c_str(), json.length());
+    return;
+}
+
+//write the given version of the file to a temporary file next to it.
+static std::string
+materializeVersion(contentStore &store, std::string &fname, const versionManifest &m)
+{
+    std::string tmpName = getDirName(fname) + "/" + "." + genuuid();
+    int fd = _except(::open(tmpName.c_str(), O_RDWR | O_CREAT | O_EXCL, (S_IRUSR | S_IWUSR | \
+                    S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP)));
+    bool allOk = false;
+    SCOPE_EXIT{ 
+        _eintr(::close(fd)); 
+        if(!allOk) ::unlink(tmpName.c_str());
+    };
+    store.materialize(m, fd);
+    allOk = true;
+    return tmpName;
+}
+
+//the history of the file as recorded in its manifests.
+static void
+sendVersions(int client, std::string cookie, std::string fname)
+{
+    try{
+        fileAttribRecord attrib(getFileAttribCopy(fname));
+        contentStore store(deriveRoot(fname));
+        std::vector<versionManifest> versions;
+        store.listVersions(attrib.oid, versions);
+        JSONNode versionsResp(JSON_NODE);
+        JSONNode versionArray(JSON_ARRAY);
+        versionArray.set_name("versions");
+        for(auto &v : versions){
+            JSONNode entry(JSON_NODE);
+            entry.push_back(JSONNode("version", v.version));
+            entry.push_back(JSONNode("size", (long)v.size));
+            entry.push_back(JSONNode("uid", v.uid));
+            entry.push_back(JSONNode("time", (long)v.time));
+            entry.push_back(JSONNode("current", v.version == attrib.version));
+            versionArray.push_back(entry);
+        }
+        versionsResp.push_back(versionArray);
+        std::string response("response");
+        std::string request("versions");
+        tupl tv[] = {
+            {"mesgtype", response}, 
+            {"request", request},
+            {"cookie", cookie}
+        };
+        std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl), versionsResp);
+        writeFmgrReply(client, json.c_str(), json.length());
+    }
+    catch(std::exception &ex){
+        _error<<"sendVersions() fname:"<<fname<<" caught exception:"<<ex.what();
+        error2Client(client, cookie, "Unable to read the history of the file, Please retry.");
+    }
+    return;
+}
+
+//bring back an old version, it becomes the newest version of the file.
+static void
+restoreVersion(int client, std::string cookie, std::string fname, int uid, int gid, int version)
+{
+    std::string tmpName;
+    try{
+        fileAttribRecord attrib(getFileAttribCopy(fname));
+        contentStore store(deriveRoot(fname));
+        versionManifest m;
+        if(!store.readManifest(attrib.oid, version, m)){
+            error2Client(client, cookie, "The requested version of the file does not exist");
+            return;
+        }
+        tmpName = materializeVersion(store, fname, m);
+        int restored = commitNewVersion(tmpName, fname, uid, gid, &m);
+        _info<<"restored version:"<<version<<" of file:"<<fname<<" as version:"<<restored;
+        versionReply(client, cookie, "restore", restored);
+    }
+    catch(std::exception &ex){
+        _error<<"restoreVersion() fname:"<<fname<<" caught exception:"<<ex.what();
+        if(tmpName.length()) ::unlink(tmpName.c_str());
+        error2Client(client, cookie, "Unable to restore the version of the file, Please retry.");
+    }
+    return;
+}
+
+//unified diff between two versions of a text file.
+static void
+diffVersions(int client, std::string cookie, std::string fname, int from, int to)
+{
+    std::string fromName, toName;
+    SCOPE_EXIT{
+        if(fromName.length()) ::unlink(fromName.c_str());
+        if(toName.length()) ::unlink(toName.c_str());
+    };
+    try{
+        fileAttribRecord attrib(getFileAttribCopy(fname));
+        contentStore store(deriveRoot(fname));
+        versionManifest a, b;
+        if(!store.readManifest(attrib.oid, from, a) || !store.readManifest(attrib.oid, to, b)){
+            error2Client(client, cookie, "The requested version of the file does not exist");
+            return;
+        }
+        std::string diffResult;
+        if(!isTextFile(fname))
+            diffResult = "Note: Not a text file, not generating diff";
+        else if((a.size >= (1024*1024*1024)) || (b.size >= (1024*1024*1024)))
+            diffResult = "Note: File size too large, not generating diff";
+        else{
+            fromName = materializeVersion(store, fname, a);
+            toName = materializeVersion(store, fname, b);
+            std::stringstream ss;
+            unifiedDiff(fromName, toName, ss);
+            if(ss.str().size() < (1024*1024)) diffResult = ss.str();
+            else diffResult = "Note: Diff was too large, so not displaying";
+        }
+        std::string response("response");
+        std::string request("diffversions");
+        tupl tv[] = {
+            {"mesgtype", response}, 
+            {"request", request},
+            {"cookie", cookie},
+            {"from", from},
+            {"to", to},
+            {"diff", diffResult}
+        };
+        std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl));
+        writeFmgrReply(client, json.c_str(), json.length());
+    }
+    catch(std::exception &ex){
+        _error<<"diffVersions() fname:"<<fname<<" caught exception:"<<ex.what();
+        error2Client(client, cookie, "Unable to compare the versions of the file, Please retry.");
+    }
+    return;
+}
+
+//the chunks of a dedup upload the store does not have yet, the client sends
+//only those.
+static void
+sendMissingChunks(int client, std::string cookie, std::string fname, std::string hashes)
+{
+    try{
+        contentStore store(deriveRoot(fname));
+        std::string missing;
+        for(size_t off = 0; (off + CSTORE_HASH_LEN) <= hashes.length(); off += CSTORE_HASH_LEN){
+            const unsigned char *hash = reinterpret_cast<const unsigned char*>(hashes.data()) + off;
+            if(!store.hasChunk(hash2Hex(hash))) missing.append(hashes, off, CSTORE_HASH_LEN);
+        }
+        std::string encoded = JSONBase64::json_encode64(
+                reinterpret_cast<const unsigned char*>(missing.data()), missing.length());
+        std::string response("response");
+        std::string request("haschunks");
+        tupl tv[] = {
+            {"mesgtype", response}, 
+            {"request", request},
+            {"cookie", cookie},
+            {"missing", encoded}
+        };
+        std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl));
+        writeFmgrReply(client, json.c_str(), json.length());
+    }
+    catch(std::exception &ex){
+        _error<<"sendMissingChunks() fname:"<<fname<<" caught exception:"<<ex.what();
+        error2Client(client, cookie, "There was some internal error in uploading the file, Please retry.");
+    }
+    return;
+}
+
+static void
+storeChunk(int client, std::string cookie, std::string fname, std::string chunk)
+{
+    try{
+        contentStore store(deriveRoot(fname));
+        store.putChunk(reinterpret_cast<const unsigned char*>(chunk.data()), chunk.length());
+        std::string response("ack");
+        std::string request("putchunk");
+        tupl tv[] = {
+            {"mesgtype", response}, 
+            {"request", request},
+            {"cookie", cookie}
+        };
+        std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl));
+        writeFmgrReply(client, json.c_str(), json.length());
+    }
+    catch(std::exception &ex){
+        _error<<"storeChunk() fname:"<<fname<<" caught exception:"<<ex.what();
+        error2Client(client, cookie, "There was some internal error in uploading the file, Please retry.");
+    }
+    return;
+}
+
+//the client has sent the chunks the store was missing, the file is put
+//together from the store. a file identical to its current version is left
+//alone. the lengths the client gives must be those of the stored chunks, the
+//size of the file is taken from the store.
+static void
+commitChunks(int client, std::string cookie, std::string fname, int uid, int gid, 
+        std::string chunks)
+{
+    static const size_t entryLen = CSTORE_HASH_LEN + sizeof(uint32_t);
+    std::string tmpName;
+    try{
+        contentStore store(deriveRoot(fname));
+        versionManifest m;
+        if(chunks.length() % entryLen){
+            error2Client(client, cookie, "invalid chunk list");
+            return;
+        }
+        for(size_t off = 0; (off + entryLen) <= chunks.length(); off += entryLen){
+            const unsigned char *entry = reinterpret_cast<const unsigned char*>(chunks.data()) + off;
+            chunkRef c;
+            c.hash = hash2Hex(entry);
+            uint32_t len;
+            memcpy(&len, entry + CSTORE_HASH_LEN, sizeof(len));
+            if(!store.statChunk(c.hash, c.len)){
+                error2Client(client, cookie, "Chunks of the file are missing, Please retry.");
+                return;
+            }
+            if(!c.len || (c.len > CSTORE_MAX_CHUNK) || (c.len != ntohl(len))){
+                _error<<"commitChunks() fname:"<<fname<<" chunk:"<<c.hash<<
+                    " length given:"<<ntohl(len)<<" stored:"<<c.len;
+                error2Client(client, cookie, "Chunk lengths do not match the stored chunks.");
+                return;
+            }
+            m.chunks.push_back(c);
+            m.size += c.len;
+        }
+        struct stat sb = {0};
+        if(stat(fname.c_str(), &sb) == 0){
+            fileAttribRecord attrib(getFileAttribCopy(fname));
+            versionManifest current;
+            if(store.readManifest(attrib.oid, attrib.version, current) && 
+                    (current.size == m.size) && 
+                    (current.size == (uint64_t)sb.st_size) &&
+                    (current.chunks.size() == m.chunks.size()) &&
+                    std::equal(m.chunks.begin(), m.chunks.end(), current.chunks.begin(), 
+                        [](const chunkRef &a, const chunkRef &b){ 
+                        return (a.hash == b.hash) && (a.len == b.len); })){
+                versionReply(client, cookie, "commitchunks", attrib.version);
+                return;
+            }
+        }
+        tmpName = materializeVersion(store, fname, m);
+        int version = commitNewVersion(tmpName, fname, uid, gid, &m);
+        versionReply(client, cookie, "commitchunks", version);
+    }
+    catch(std::exception &ex){
+        _error<<"commitChunks() fname:"<<fname<<" caught exception:"<<ex.what();
+        if(tmpName.length()) ::unlink(tmpName.c_str());
+        error2Client(client, cookie, "There was some internal error in uploading the file, Please retry.");
+    }
+    return;
+}
+
+//requests on the version history and the dedup upload of a file, they all
+//name the file and the user. the work is done in the thread pool.
+static void
+handleHistory(int client, char *jsonData, std::string request) 
+{
+	std::string cookie, fname;
+	int uid, gid;
+	tupl t[] = {
+		{"cookie"  , &cookie},
+		{"fname"   , &fname},
+		{"uid"    , &uid},
+		{"gid"    , &gid}
+	};
+	unsigned int sz = sizeof(t)/sizeof(tupl);
+	try {
+		JSONNode n = libjson::parse(jsonData);
+        if(!getJsonVal(n, t, sz)){
+			_error<<""<<__FUNCTION__<<"() Not enough data to perform operation requested.";
+            return;
+        }
+        if(!checkAuthorization(uid, gid, fname)){
+            error2Client(client, cookie, 
+                    "You are not authorized access to this file/folder");
+            return;
+        }
+        //optional arguments of the individual requests.
+        auto intArg = [&n](const char *name) -> int {
+            auto itr = n.find(name);
+            return (itr != n.end()) ? itr->as_int() : -1;
+        };
+        auto binaryArg = [&n](const char *name) -> std::string {
+            auto itr = n.find(name);
+            return (itr != n.end()) ? JSONBase64::json_decode64(itr->as_string()) : "";
+        };
+        if(request == "versions")
+            tPool->enqueue(std::bind(sendVersions, client, cookie, fname));
+        else if(request == "restore")
+            tPool->enqueue(std::bind(restoreVersion, client, cookie, fname, uid, gid, 
+                        intArg("version")));
+        else if(request == "diffversions")
+            tPool->enqueue(std::bind(diffVersions, client, cookie, fname, 
+                        intArg("from"), intArg("to")));
+        else if(request == "haschunks")
+            tPool->enqueue(std::bind(sendMissingChunks, client, cookie, fname, 
+                        binaryArg("chunks")));
+        else if(request == "putchunk"){
+            std::string chunk = binaryArg("data");
+            if(chunk.empty() || (chunk.length() > CSTORE_MAX_CHUNK)){
+                error2Client(client, cookie, "invalid chunk size");
+                return;
+            }
+            tPool->enqueue(std::bind(storeChunk, client, cookie, fname, chunk));
+        }
+        else if(request == "commitchunks")
+            tPool->enqueue(std::bind(commitChunks, client, cookie, fname, uid, gid, 
+                        binaryArg("chunks")));
+	}
+    catch(syscallException &ex){ 
+        _error<<"handleHistory() fname:"<<fname<<
+            " failed with : syscall exception:"<<ex.what(); 
+        throw(ex); 
+    }
+    catch(std::exception &ex){ 
+        _error<<"handleHistory() fname:"<< fname <<
+            " Exited with standard exception:"<<ex.what(); 
+        throw(ex); 
+    }
+	return;
+}
+
+//a user sees and undoes their own deletes. those of others only when they own
+//the directory the item was deleted from, or it is shared with them or their
+//group, as the attributes of the directory say.
+static bool
+mayRestore(int uid, int gid, const trashEntry &entry)
+{
+    if(uid <= 0) return false;
+    if(entry.uid == uid) return true;
+    try{
+        fileAttribRecord attrib(getFileAttribCopy(getDirName(entry.origin)));
+        if(attrib.ownerUid == uid) return true;
+        for(auto &itr : attrib.usersSharedWith){ if(itr == uid) return true; }
+        if(gid > 0) for(auto &itr : attrib.groupsSharedWith){ if(itr == gid) return true; }
+    }
+    catch(std::exception &ex){
+        //the directory is gone or has no attributes, nobody else may have it.
+    }
+    return false;
+}
+
+//list the deletes of the organization of fname the user can undo, or undo
+//one of them while it is still in the trash.
+static void
+handleTrash(int client, char *jsonData, std::string request) 
+{
+	std::string cookie, fname;
+	int uid, gid;
+	tupl t[] = {
+		{"cookie"  , &cookie},
+		{"fname"   , &fname},
+		{"uid"    , &uid},
+		{"gid"    , &gid}
+	};
+	unsigned int sz = sizeof(t)/sizeof(tupl);
+	try {
+		JSONNode n = libjson::parse(jsonData);
+        if(!getJsonVal(n, t, sz)){
+			_error<<""<<__FUNCTION__<<"() Not enough data to perform operation requested.";
+            return;
+        }
+        if(!checkAuthorization(uid, gid, fname)){
+            error2Client(client, cookie, 
+                    "You are not authorized access to this file/folder");
+            return;
+        }
+        std::string root = deriveRoot(fname);
+        std::string response("response");
+        if(request == "trash"){
+            std::vector<trashEntry> entries;
+            listTrash(root, entries);
+            JSONNode trashResp(JSON_NODE);
+            JSONNode entryArray(JSON_ARRAY);
+            entryArray.set_name("entries");
+            for(auto &e : entries){
+                if(!mayRestore(uid, gid, e)) continue;
+                JSONNode entry(JSON_NODE);
+                entry.push_back(JSONNode("trashid", e.id));
+                entry.push_back(JSONNode("fname", e.origin));
+                entry.push_back(JSONNode("uid", e.uid));
+                entry.push_back(JSONNode("time", (long)e.time));
+                entryArray.push_back(entry);
+            }
+            trashResp.push_back(entryArray);
+            tupl tv[] = {
+                {"mesgtype", response}, 
+                {"request", request},
+                {"cookie", cookie}
+            };
+            std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl), trashResp);
+            writeFmgrReply(client, json.c_str(), json.length());
+            return;
+        }
+        auto itr = n.find("trashid");
+        trashEntry entry;
+        if((itr == n.end()) || !readTrashEntry(root, itr->as_string(), entry) || 
+                !mayRestore(uid, gid, entry)){
+            error2Client(client, cookie, "The deleted file is no longer in the trash");
+            return;
+        }
+        if(!restoreFromTrash(root, entry)){
+            error2Client(client, cookie, "A file with the same name exists in its place");
+            return;
+        }
+        _info<<"restored from trash:"<<entry.origin;
+        dirEntryChanged(entry.origin);
+        std::string status("success");
+        tupl tv[] = {
+            {"mesgtype", response}, 
+            {"request", request},
+            {"cookie", cookie},
+            {"fname", entry.origin},
+            {"status", status}
+        };
+        std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl));
+        writeFmgrReply(client, json.c_str(), json.length());
+	}
+    catch(syscallException &ex){ 
+        _error<<"handleTrash() fname:"<<fname<<
+            " failed with : syscall exception:"<<ex.what(); 
+        throw(ex); 
+    }
+    catch(std::exception &ex){ 
+        _error<<"handleTrash() fname:"<< fname <<
+            " Exited with standard exception:"<<ex.what(); 
+        throw(ex); 
+    }
+	return;
+}
+
+//write requested amount of data to the offset provided.
+//the ranges go in to the temporary file of the upload with the same cookie, 
+//which is committed by the trailer of a write as usual once all of them are
+//acked. at most maxRangesInFlight ranges of an upload are in flight.
+static void 
+handleWriteOffset(int client, char *jsonData) 
+{
+	std::string cookie, fname;
+	int size, uid, gid;
+	json_string data;
+    int bytesleft = 0;
+	tupl t[] = {
+		{"cookie"  , &cookie},
+		{"fname"   , &fname},
+		{"size"	   , &size},
+		{"data"    , &data},
+		{"uid"    , &uid},
+		{"gid"    , &gid},
+		{"bytesleft", &bytesleft}
+	};
+	unsigned int sz = sizeof(t)/sizeof(tupl);
+	try {
+		JSONNode n = libjson::parse(jsonData);
+        //the offset is read as a json_int_t, an int would stop ranges at 2GB.
+        auto offsetNode = n.find("offset");
+        if(getJsonVal(n, t, sz) && (offsetNode != n.end())){
+            off_t offset = offsetNode->as_int();
+            std::string decodedBuf = JSONBase64::json_decode64(data);
+            if((offset < 0) || (decodedBuf.length() > (size_t)diskBlockSize)){
+                error2Client(client, cookie, "invalid range written");
+                return;
+            }
+            fileXfer *xfer = getFileXfer(cookie);
+            if (!xfer){
+                _info<<"new ranged write xfer started: cookie: "<<cookie
+                    <<" name: "<<fname
+                    <<" size: "<<bytesleft;
+                xfer = new fileXfer(fname.c_str(), 
+                        cookie.c_str(), 
+                        client, 
+                        false, 
+                        uid, 
+                        gid, 
+                        bytesleft);
+            }
+            if(!xfer->isWrite() || xfer->isDelta()){
+                error2Client(client, cookie, "cookie belongs to another transfer");
+                return;
+            }
+            //the ranges are written independently of the xfer so they can be
+            //in flight together, the fd stays valid whatever becomes of it.
+            auto inFlight = xfer->rangesInFlight();
+            if(*inFlight >= maxRangesInFlight){
+                error2Client(client, cookie, "too many ranges in flight, wait for an ack");
+                return;
+            }
+            int fd = _except(::dup(xfer->getFd()));
+            (*inFlight)++;
+            if(fRing)
+                ringWriteRange(client, cookie, fd, offset, 
+                        std::make_shared<std::string>(std::move(decodedBuf)), 0, inFlight);
+            else
+                tPool->enqueue(std::bind(writeRange, client, cookie, fd, offset, decodedBuf, inFlight));
+        }
+		else{
+			_error<<""<<__FUNCTION__<<"() Not enough data to perform operation requested.";
+		}
+	}
+    catch(syscallException &ex){ 
+        _error<<"handleWriteOffset() fname:"<<fname<<
+            " failed with : syscall exception:"<<ex.what(); 
+        throw(ex); 
+    }
+    catch(std::exception &ex){ 
+        _error<<"handleWriteOffset() fname:"<< fname <<
+            " Exited with standard exception:"<<ex.what(); 
         throw(ex); 
     }
 	return;
@@ -2543,6 +3793,21 @@ handleUnlock(int client, char *jsonData)
     return;
 }
 
+static metricCounter &requestErrors = metrics().counter("fmgr_request_errors");
+
+//latency of the requests by name, the histogram is looked up once per name.
+//names we do not handle go together so a client cannot grow the registry.
+static metricHistogram&
+requestLatency(const std::string &request)
+{
+    static std::map<std::string, metricHistogram*> byName;
+    auto itr = byName.find(request);
+    if(itr != byName.end()) return *(itr->second);
+    metricHistogram &h = metrics().histogram("fmgr_request_us{request=\"" + request + "\"}");
+    byName[request] = &h;
+    return h;
+}
+
 //process the websocket input
 static void 
 processRequest (int clientid, char *rbuf, unsigned int bufSz) 
@@ -2550,6 +3815,8 @@ processRequest (int clientid, char *rbuf, unsigned int bufSz)
 	int client = clientid;
 	char *jsonData = rbuf;
     std::string cookie, msgType, request;
+    uint64_t start = metricsNow();
+    bool known = true;
 	try {
         if(!libjson::is_valid(jsonData)){
             _error<<"Client sent invalid json format or data not in json format:\
@@ -2574,6 +3841,14 @@ processRequest (int clientid, char *rbuf, unsigned int bufSz)
 			else if (request == "get_offset") 	handleReadOffset(client, jsonData);
 			else if (request == "write") 		handleWrite(client, jsonData);
 			else if (request == "put_offset") 	handleWriteOffset(client, jsonData);
+			else if (request == "signature") 	handleSignature(client, jsonData);
+			else if (request == "delta") 		handleDelta(client, jsonData);
+			else if ((request == "versions") || (request == "restore") ||
+					(request == "diffversions") || (request == "haschunks") ||
+					(request == "putchunk") || (request == "commitchunks"))
+												handleHistory(client, jsonData, request);
+			else if ((request == "trash") || (request == "undelete"))
+												handleTrash(client, jsonData, request);
 			else if (request == "search") 		handleFileSearch(client, jsonData);
 			else if (request == "getdir") 		handleGetDir(client, jsonData);
 			else if (request == "cancel") 		handleCancelOp(client, jsonData);
@@ -2590,16 +3865,20 @@ processRequest (int clientid, char *rbuf, unsigned int bufSz)
 					(request == "move") || (request == "rename") || 
 					(request == "create_file") || (request == "create_dir")) 
 												handleCommand(client, jsonData);
+            else known = false;
+            requestLatency(known ? request : "other").record(metricsNow() - start);
 		} else if (msgType == "ack") 			handleClientAck(client, jsonData);
 		else if (msgType == "answer") 			handleClientAnswer(client, jsonData);
 	}
     catch(syscallException &ex){
+        requestErrors.add();
         _error<<__FUNCTION__<<"() ;caught: syscall exception:"<<ex.what(); 
         error2Client(client, 
                 cookie, 
                 "There was some internal error performing the operation, Please retry.");
     }
     catch(std::exception &ex){ 
+        requestErrors.add();
         _error<<__FUNCTION__<<"() ;caught: standard exception:"<<ex.what(); 
         error2Client(client, 
                 cookie, 
@@ -2836,6 +4115,40 @@ cleanupMongodbForRemovedDirectory(std::string dname)
     return;
 }
 
+//the history of the files of a trash item goes with it. the history of a
+//whole organization is inside the item.
+static void
+reapHistory(const std::string &root, const std::string &item)
+{
+    if(root == storage_base) return;
+    contentStore store(root);
+    auto drop = [&store](const std::string &fname){
+        try{
+            store.dropHistory(getFileAttribCopy(fname).oid);
+        }
+        catch(std::exception &ex){
+            _error<<"reapHistory() no history dropped for:"<<fname<<" error:"<<ex.what();
+        }
+    };
+    boost::system::error_code ec;
+    if(boost::filesystem::is_regular_file(boost::filesystem::symlink_status(item, ec))){
+        drop(item);
+        return;
+    }
+    boost::filesystem::recursive_directory_iterator itr(item, ec), end;
+    for(; !ec && (itr != end); itr.increment(ec))
+        if(boost::filesystem::is_regular_file(itr->symlink_status())) drop(itr->path().string());
+    return;
+}
+
+static void
+collectHistory(const std::string &root)
+{
+    size_t removed = contentStore(root).collect(history_grace, reclaim_batch, reclaim_pause_ms);
+    if(removed) _info<<"collected "<<removed<<" unreferenced chunks of:"<<root;
+    return;
+}
+
 static void
 handleChildDeath(struct signalfd_siginfo *fdsi)
 {
@@ -2944,6 +4257,11 @@ watchFilesystem(service *svc, int fd)
         int i = 0;
         while (i < length){
             struct inotify_event *event = (struct inotify_event *) &buf[i];     
+            if(event->mask & IN_IGNORED){
+                //the directory is gone or its watch was dropped.
+                std::string directory = getDirForWatchDescriptor(event->wd);
+                if(directory.length()) dropWatch(directory, false);
+            }
             if (event->len){
                 std::string fname(event->name);
                 if(fname.at(0) == '.'){
@@ -2951,7 +4269,10 @@ watchFilesystem(service *svc, int fd)
                     continue; //no need to inform clients about "." files.
                 }
                 std::string directory = getDirForWatchDescriptor(event->wd);
+                bumpDirVersion(directory, fname);
                 fname = directory + "/" + fname;
+                //names moved in only change the version of the listing.
+                notiftype = "";
                 if (event->mask & IN_CREATE){
                     if (event->mask & IN_ISDIR){
                         _info<<"New directory created:"<<event->name;
@@ -2962,7 +4283,7 @@ watchFilesystem(service *svc, int fd)
                         notiftype = "file_created";
                     }
                 }
-                else if(event->mask & IN_DELETE){
+                else if(event->mask & (IN_DELETE | IN_MOVED_FROM)){
                     if (event->mask & IN_ISDIR){
                         _info<<"Directory deleted:"<<event->name;
                         notiftype = "directory_deleted";
@@ -3072,6 +4393,13 @@ readConfig()
     log_file = getConfigValue<std::string>("fmgr.log_file");
     thread_count = getConfigValue<int>("fmgr.thread_count");
     storage_base = getConfigValue<std::string>("fmgr.folder_dir");
+    trash_retention = getConfigValue<int>("fmgr.trash_retention", trash_retention);
+    history_versions = getConfigValue<int>("fmgr.history_versions", history_versions);
+    history_grace = getConfigValue<int>("fmgr.history_grace", history_grace);
+    reclaim_batch = getConfigValue<int>("fmgr.reclaim_batch", reclaim_batch);
+    reclaim_pause_ms = getConfigValue<int>("fmgr.reclaim_pause_ms", reclaim_pause_ms);
+    uring_entries = getConfigValue<int>("fmgr.uring_entries", uring_entries);
+    uring_buffers = getConfigValue<int>("fmgr.uring_buffers", uring_buffers);
     return;
 }
 
@@ -3084,6 +4412,13 @@ dumpConfig()
     _trace<<"log_file: "<<log_file;
     _trace<<"thread_count: "<<thread_count;
     _trace<<"storage_base: "<<storage_base;
+    _trace<<"trash_retention: "<<trash_retention;
+    _trace<<"history_versions: "<<history_versions;
+    _trace<<"history_grace: "<<history_grace;
+    _trace<<"reclaim_batch: "<<reclaim_batch;
+    _trace<<"reclaim_pause_ms: "<<reclaim_pause_ms;
+    _trace<<"uring_entries: "<<uring_entries;
+    _trace<<"uring_buffers: "<<uring_buffers;
     return;
 }
 
@@ -3152,6 +4487,23 @@ main(int ac, char **av)
         svc->setSignalHandler(processSignals);
 		tPool = new ThreadPool(thread_count);
 		_info<<"Thread pool created with "<<thread_count<<" batch count.";
+        if(uring_entries > 0){
+            try{
+                fRing = new fileRing(*svc->getAsioSvcRef(), uring_entries, uring_buffers, diskBlockSize);
+            }
+            catch(std::exception &ex){
+                _error<<"io_uring not available, transfers stay on the thread pool:"<<ex.what();
+            }
+        }
+        (new trashReclaimer(storage_base, 
+                            trash_retention, 
+                            reclaim_batch, 
+                            reclaim_pause_ms, 
+                            reapHistory,
+                            [](const trashEntry &entry){ 
+                            _cleanupMongodbForRemovedDirectory(entry.origin); },
+                            collectHistory))->start();
+		_info<<"Trash reclaimer started with retention of "<<trash_retention<<" seconds.";
 		_info<<"Blocking on the service::run() till eternity ...";
         svc->run();
 	}
@@ -76,6 +76,9 @@ class fileAttribRecord
                 {"folderUsageMsb", fattr.folderUsageMsb},
                 {"folderUsageLsb", fattr.folderUsageLsb}
             };
+            //the oid names the version history of the file, kept as is.
+            fileAttribNode.push_back(JSONNode("oid", fattr.oid));
+
             JSONNode followersArray(JSON_ARRAY);
             followersArray.set_name("followers");
             for(auto &itr : fattr.followers) followersArray.push_back(JSONNode("", itr));
@@ -131,6 +134,7 @@ class fileAttribRecord
                 if((i->type() == JSON_ARRAY) && (i->name() == "followers")) fItr = i;
                 if((i->type() == JSON_ARRAY) && (i->name() == "userssharedwith")) uItr = i;
                 if((i->type() == JSON_ARRAY) && (i->name() == "groupssharedwith")) gItr = i;
+                if((i->type() == JSON_STRING) && (i->name() == "oid")) fattr.oid = i->as_string();
             }
 
             if(tItr != n.end()){
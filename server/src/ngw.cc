@@ -11,6 +11,9 @@
 
 #include <string>
 #include <queue>
+#include <set>
+#include <sstream>
+#include <chrono>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
@@ -21,6 +24,7 @@
 #include <sys/resource.h>        /* For mode constants */
 #include <sys/stat.h>        /* For mode constants */
 #include <sys/socket.h>        /* For mode constants */
+#include <sys/un.h>
 #include <mqueue.h>
 #include <cstring>
 #include <arpa/inet.h>
@@ -31,6 +35,10 @@
 #include "log.hh"
 #include "config.hh"
 #include "tpool.hh"
+#include "ocache.hh"
+#include "gwcluster.hh"
+#include "admission.hh"
+#include "handoff.hh"
 
 #ifdef AKORP_SSL_CAPABLE
 #warning("+-----------Building Secure version of network gateway------------------------------------+");
@@ -48,33 +56,71 @@ static void
 startServiceAccept(boost::asio::io_service *, 
 boost::asio::local::stream_protocol::acceptor *);
 static void 
-startPeerConnAccept(boost::asio::io_service *, 
-boost::asio::ip::tcp::acceptor *);
-static void 
 handleServiceAccept(boost::asio::io_service *, 
 boost::asio::local::stream_protocol::acceptor *, 
 const boost::system::error_code&);
-static void 
-handlePeerAccept(boost::asio::io_service *, 
-boost::asio::ip::tcp::acceptor *, 
-const boost::system::error_code&);
 static void add2SvcConnList(serviceConnection *);
 static void delFromSvcConnList(serviceConnection *);
 static bool isSvcActive(std::string );
-static serviceConnection* getServiceConnObj(std::string);
+static servicePool* getServicePool(int);
+static int internSvcName(const std::string &);
 static void add2NtwConnList(networkConnection *);
 static void delFromNtwConnList(networkConnection *);
 static void handleMqRead(boost::system::error_code ec);
+static void deliverToUser(int, const char *, size_t, bool);
 static boost::asio::io_service gIoSvc;
+static con_msg_man_type::ptr frameMsgMngr(new con_msg_man_type()); //messages built from frames.
 static server *gw = nullptr;
 static ntwConnListT ntwConnList;
 static svcConnListT svcConnList;
 static std::vector<std::string> svclist; //temporary to hold the list of services between validate_handler and open.
 static boost::asio::ip::udp::socket multicast_socket(gIoSvc);
 static boost::asio::ip::udp::endpoint multicast_sender_endpoint;
-static boost::asio::ip::tcp::socket *gPeerAcceptSocket = nullptr;
+static gatewayCluster *cluster = nullptr; //peer gateways, null when not clustered.
+static boost::asio::deadline_timer *announceTimer = nullptr;
+static admissionControl *admission = nullptr;
+static boost::asio::deadline_timer *admissionTimer = nullptr;
+static std::map<int, int> localUsers; //uid to the clientid the user is logged in on.
+static metricGauge &clientsConnected = metrics().gauge("ngw_clients");
+static metricCounter &clientBytesIn = metrics().counter("ngw_client_bytes_in");
+static metricCounter &requestsTurnedAway = metrics().counter("ngw_requests_turned_away");
+static metricHistogram &clientFrameLatency = metrics().histogram("ngw_client_frame_us"); //client frame to the service.
+static metricHistogram &serviceFrameLatency = metrics().histogram("ngw_service_frame_us"); //service frame to the clients.
+static boost::asio::local::stream_protocol::acceptor *svcAcceptor = nullptr;
+//service handoff (see handoff.hh), the running gateway hands its listeners, 
+//service connections and plain websocket clients to the new one. the clients
+//it keeps are closed over the drain period and reconnect to the new gateway.
+enum
+{
+    HANDOFF_IDLE = 0,
+    HANDOFF_QUIESCING = 1, //the service connections are being stopped.
+    HANDOFF_DRAINING = 2, //handed over, the clients left are being closed.
+    HANDOFF_SENDING = 3, //the services and clients are stopped, their records are on the way.
+    HANDOFF_PAUSING = 4, //the services are stopped, the clients are coming to a message boundary.
+};
+#define HANDOFF_QUIESCE_TIMEOUT (2000) //milliseconds the services get to reach a frame boundary.
+#define HANDOFF_PAUSE_TIMEOUT (1000) //milliseconds the clients get to reach a message boundary.
+#define HANDOFF_SEND_TIMEOUT (5000) //milliseconds the new gateway gets to take the records.
+#define HANDOFF_DRAIN_GRACE (5) //seconds past the drain period for the close handshakes.
+static int handoffPhase = HANDOFF_IDLE;
+static boost::asio::local::stream_protocol::acceptor *handoffAcceptor = nullptr;
+static boost::asio::local::stream_protocol::socket *handoffPeer = nullptr;
+static boost::asio::deadline_timer *handoffTimer = nullptr;
+static boost::posix_time::ptime handoffDeadline;
+static handoffWriter *handoffOut = nullptr;
+static std::vector<serviceConnection*> handoffHanded;
+static std::map<int, server::connection_ptr> handoffPausing; //clients asked to stop at a message boundary.
+static std::vector<std::pair<server::connection_ptr, networkConnection*>> handoffClients; //on their way.
+static bool handoffMqHeld = false; //the gateway queue is left for the new gateway.
+static int inheritedClientFd = -1; //listeners handed over by the previous gateway.
+static int inheritedSvcFd = -1;
+static std::vector<handoffRecord> inheritedServices;
+typedef struct inheritedClient : public handoffClient
+{
+    std::vector<int> svcIds;
+}inheritedClient;
+static std::vector<inheritedClient> inheritedClients;
 static unsigned char recvBuf[OPTIMAL_BUF_SIZE] = {'\0'};
-static unsigned char sendBuf[OPTIMAL_BUF_SIZE] = {'\0'};
 
 #ifdef  HTTP_TUNNEL_SUPPORT 
 #warning("+------------Building  network gateway with HTTP Tunneling support ------------------------+");
@@ -89,9 +135,23 @@ static std::string log_file = "/var/log/antkorp/ngw";
 static std::string peer_multicast_address = "224.0.0.1";
 static int peer_multicast_port = 23456;
 static int peer_connection_port = 23457;
+static bool cluster_enabled = false; //join the other gateways of the installation.
+static std::string cluster_address = ""; //address the peers reach us on, defaults to the interface address.
+static std::string cluster_peers = ""; //comma separated <address>:<port> of gateways not reachable by multicast.
+static std::string cluster_secret = ""; //shared by the gateways of the cluster, peers without it are refused.
+static int cluster_announce_interval = 5; //seconds between the announcements and redials.
+static bool admission_enabled = true; //admission control of the client requests.
+static double admission_user_rate = 200; //requests per second of a user, 0 is no limit.
+static double admission_user_burst = 400;
+static int admission_max_inflight = 64; //requests of a client waiting on the services, 0 is no limit.
+static int admission_report_interval = 60; //seconds between the sweeps and the counters in the log.
+static int admission_inflight_timeout = 30; //seconds after which an unanswered request stops counting.
+static int handoff_drain = 20; //seconds over which the clients are closed after a handoff.
+static std::string runtime_dir = AKORP_NGW_RUNTIME_DIR; //holds the handoff endpoint.
 static std::string ssl_certificate = ""; //full path of the security certificate.
 static std::string ssl_certificate_key = ""; //full path of the security certificate.
 static bool cloudDeployment = false;
+static std::string relay_policy = "group"; //any, group or none.
 static sigset_t mask;
 static boost::asio::posix::stream_descriptor signalChannel(gIoSvc);
 
@@ -112,16 +172,132 @@ validServiceList =
     "rtc",
     "ngw",
     "auth",
-    "calendar"
+    "calendar",
+    "sfu"
 }; 
 
+//service names are interned to small ids, the valid services when the gateway
+//starts and any other when it registers. the routing table is indexed by the 
+//id. a frame names its service either by the space padded name or compactly 
+//as "#<id>", the ids go to the clients in the services_list of the handshake.
+//the name of a frame is hashed in place so no string is built per frame.
+#define SVC_ID_SLOTS (64) //power of 2, twice the services we intern at most.
+typedef struct svcIdSlot
+{
+    char name[MAX_SERVICE_NAME_LEN];
+    size_t len;
+    int id;
+}svcIdSlot;
+static svcIdSlot svcIdTable[SVC_ID_SLOTS];
+static std::vector<std::string> svcNames = {""}; //id to name, id 0 is no service.
+static std::vector<servicePool*> svcPools = {nullptr}; //id to the instances of the service.
+static int validServiceCount = 0; //ids of the valid services are 1 to validServiceCount.
+static int relaySvcId = 0;
+
+//lanes of the services unless configured otherwise, the rest go in the normal lane.
+static std::map<std::string, std::string> 
+defaultLanes = 
+{
+    {"fmgr", "bulk"},
+    {"tunneld", "bulk"},
+    {"rtc", "interactive"},
+    {"sfu", "interactive"},
+    {"kons", "interactive"},
+    {"auth", "interactive"},
+    {"ngw", "interactive"},
+};
+static int laneQuantum[LANE_COUNT] = {64*1024, 16*1024, 4*1024}; //bytes per round.
+
+static inline size_t
+svcNameLen(const char *name)
+{
+    size_t len = 0;
+    while((len < MAX_SERVICE_NAME_LEN) && (name[len] != ' ') && (name[len] != '\0')) len++;
+    return len;
+}
+
+static inline uint32_t
+svcNameHash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u; //fnv-1a
+    for(size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
+
+static int
+lookupSvcId(const char *name, size_t len)
+{
+    uint32_t hash = svcNameHash(name, len);
+    for(uint32_t i = 0; i < SVC_ID_SLOTS; i++){
+        svcIdSlot &slot = svcIdTable[(hash + i) & (SVC_ID_SLOTS - 1)];
+        if(!slot.id) return 0;
+        if((slot.len == len) && !memcmp(slot.name, name, len)) return slot.id;
+    }
+    return 0;
+}
+
+static int
+internSvcName(const std::string &name)
+{
+    size_t len = svcNameLen(name.c_str());
+    int id = lookupSvcId(name.data(), len);
+    if(id) return id;
+    if(svcNames.size() > (SVC_ID_SLOTS / 2)) 
+        throw std::runtime_error("too many services to intern: " + name);
+    id = svcNames.size();
+    svcNames.push_back(name.substr(0, len));
+    std::string policy = getConfigValue<std::string>("ngw.routing." + svcNames[id], "hash");
+    svcPools.push_back(new servicePool(svcNames[id], 
+                (policy == "least") ? servicePool::ROUTE_LEAST_OUTSTANDING : servicePool::ROUTE_HASH));
+    auto dl = defaultLanes.find(svcNames[id]);
+    std::string lane = getConfigValue<std::string>("ngw.lane." + svcNames[id], 
+            (dl != defaultLanes.end()) ? dl->second : "normal");
+    if(lane == "interactive") svcPools[id]->lane = LANE_INTERACTIVE;
+    else if(lane == "bulk") svcPools[id]->lane = LANE_BULK;
+    //rtc passes the signaling on to the other party, the sender gets no answer.
+    svcPools[id]->answers = !getConfigValue<bool>("ngw.admission.no_reply." + svcNames[id], 
+            svcNames[id] == "rtc");
+    if(admission){
+        double rate = getConfigValue<double>("ngw.admission.service_rate." + svcNames[id], 0);
+        admission->setServiceRate(id, rate, 
+                getConfigValue<double>("ngw.admission.service_burst." + svcNames[id], 2 * rate));
+    }
+    uint32_t hash = svcNameHash(name.data(), len);
+    for(uint32_t i = 0; ; i++){
+        svcIdSlot &slot = svcIdTable[(hash + i) & (SVC_ID_SLOTS - 1)];
+        if(slot.id) continue;
+        memcpy(slot.name, name.data(), len);
+        slot.len = len;
+        slot.id = id;
+        break;
+    }
+    return id;
+}
+
+static void
+internValidServices()
+{
+    for(std::string& itr : validServiceList) internSvcName(itr);
+    validServiceCount = svcNames.size() - 1;
+    relaySvcId = internSvcName(RELAY_SERVICE_TAG);
+    return;
+}
+
+//id of the service named in a frame, 0 if it is not one we know of.
+static inline int
+parseSvcId(const char *hayStack)
+{
+    if(hayStack[0] != '#') return lookupSvcId(hayStack, svcNameLen(hayStack));
+    int id = 0;
+    for(int i = 1; (i < 4) && isdigit(hayStack[i]); i++) id = (id * 10) + (hayStack[i] - '0');
+    return (id < (int)svcNames.size()) ? id : 0;
+}
+
 static bool
 isSvcValid(std::string sname)
 {
-    for(std::string& itr2 : validServiceList){
-        if(itr2 == sname) return true;
-    }
-    return false;
+    int id = lookupSvcId(sname.data(), svcNameLen(sname.c_str()));
+    return id && (id <= validServiceCount);
 }
 
 // we also use boost asio to listen and process the control channel requests on 
@@ -180,7 +356,8 @@ parseChannelId(const char *hayStack)
 static void 
 add2NtwConnList(networkConnection *nconn) 
 { 
-    ntwConnList.push_back(*nconn); 
+    ntwConnList.insert(*nconn); 
+    clientsConnected.set(ntwConnList.size());
     return; 
 }
 
@@ -188,33 +365,147 @@ static void
 delFromNtwConnList(networkConnection *nconn) 
 { 
     ntwConnList.erase(ntwConnListT::s_iterator_to(*nconn)); 
+    clientsConnected.set(ntwConnList.size());
     return; 
 }
 
+//the list is ordered on the descriptor, looked up without walking it.
+struct connIdCompare
+{
+    bool operator()(int connid, const networkConnection &n) const { return connid > n.getConnId(); }
+    bool operator()(const networkConnection &n, int connid) const { return n.getConnId() > connid; }
+};
+
 static networkConnection*
 getNetworkConnObj(int connid, int channelId = -1)
 {
-    ntwConnListT::iterator itr;
-	for(networkConnection& itr : ntwConnList) 
-		if(itr.getConnId() == connid) 
-            return &itr;
-    return nullptr;
+    ntwConnListT::iterator itr = ntwConnList.find(connid, connIdCompare());
+    return (itr != ntwConnList.end()) ? &(*itr) : nullptr;
+}
+
+//lane of a client frame, by the service named in it. relay frames are call 
+//signaling.
+static int
+frameLane(const char *frame, size_t len)
+{
+    if(len < MAX_SERVICE_NAME_LEN) return LANE_NORMAL;
+    int svcid = lookupSvcId(frame, svcNameLen(frame));
+    if(svcid && (svcid == relaySvcId)) return LANE_INTERACTIVE;
+    servicePool *pool = getServicePool(svcid);
+    return pool ? pool->lane : LANE_NORMAL;
+}
+
+static void
+sendFrame(networkConnection *nconn, const char *frame, size_t len, int lane)
+{
+    message_ptr msg = frameMsgMngr->get_message(websocketpp::frame::opcode::BINARY, len);
+    msg->append_payload(frame, len);
+    nconn->nq(msg, lane);
+    nconn->send();
+    return;
+}
+
+//connections with messages held back till their websocket drains. websocketpp
+//does not tell us when a write completes so they are looked at on a short tick
+//while there are any.
+static std::set<int> pumpList;
+static boost::asio::deadline_timer *pumpTimer = nullptr;
+#define PUMP_INTERVAL (2) //milliseconds
+
+static void
+pumpConnections(const boost::system::error_code &error)
+{
+    if(error) return;
+    std::set<int> conns;
+    conns.swap(pumpList);
+    for(int connid : conns){
+        networkConnection *nconn = getNetworkConnObj(connid);
+        if(!nconn) continue; //gone in the meantime.
+        nconn->pumped();
+        nconn->send();
+    }
+    if(!pumpList.empty()){
+        pumpTimer->expires_from_now(boost::posix_time::milliseconds(PUMP_INTERVAL));
+        pumpTimer->async_wait(&pumpConnections);
+    }
+    return;
+}
+
+static void
+schedulePump(int connid)
+{
+    if(!pumpTimer) pumpTimer = new boost::asio::deadline_timer(gIoSvc);
+    bool idle = pumpList.empty();
+    pumpList.insert(connid);
+    if(idle){
+        pumpTimer->expires_from_now(boost::posix_time::milliseconds(PUMP_INTERVAL));
+        pumpTimer->async_wait(&pumpConnections);
+    }
+    return;
+}
+
+//a frame for a user goes to the client the user is logged in on, if the user
+//is on another gateway of the cluster the frame is forwarded there. a frame 
+//which came from a peer is never forwarded again.
+static void
+deliverToUser(int uid, const char *frame, size_t len, bool forward)
+{
+    auto itr = localUsers.find(uid);
+    networkConnection *nconn = (itr != localUsers.end()) ? getNetworkConnObj(itr->second) : nullptr;
+    if(nconn) sendFrame(nconn, frame, len, frameLane(frame, len));
+    else if(!(forward && cluster && cluster->sendToUser(uid, frame, len)))
+        _info<<"user: "<<uid<<" is not logged in on the cluster, message dropped.";
+    return;
+}
+
+//a broadcast of a service on a peer gateway, to the clients of the service here.
+static void
+deliverBroadcast(const std::string &svcname, const char *frame, size_t len)
+{
+    servicePool *pool = getServicePool(lookupSvcId(svcname.data(), svcname.length()));
+    if(!pool) return;
+    for(auto &c : pool->clientList){
+        networkConnection *nconn = getNetworkConnObj(c.first);
+        if(nconn) sendFrame(nconn, frame, len, pool->lane);
+    }
+    return;
+}
+
+static void
+userLoggedOut(int uid, int clientid = 0)
+{
+    auto itr = localUsers.find(uid);
+    if(itr == localUsers.end()) return;
+    if(clientid && (itr->second != clientid)) return; //logged in again on another client.
+    networkConnection *nconn = getNetworkConnObj(itr->second);
+    if(nconn) nconn->uid = 0;
+    localUsers.erase(itr);
+    if(cluster) cluster->userOffline(uid);
+    return;
+}
+
+static void
+userLoggedIn(int uid, int clientid)
+{
+    networkConnection *nconn = getNetworkConnObj(clientid);
+    if(!nconn) return; //gone before the login came through.
+    if(nconn->uid && (nconn->uid != uid)) userLoggedOut(nconn->uid, clientid);
+    nconn->uid = uid;
+    localUsers[uid] = clientid;
+    if(cluster) cluster->userOnline(uid);
+    return;
 }
 
 static networkConnection*
 getNetworkConnObj(websocketpp::connection_hdl chdl)
 {
     websocketpp::lib::error_code ec;
-	for(networkConnection& itr : ntwConnList){
-        server::connection_ptr cptr = gw->get_con_from_hdl(chdl, ec);
-        if(ec){
-            _error<<"unable to get connection pointer from connection handle.";
-            return nullptr;
-        }
-        if(itr.getConnId() == cptr->get_raw_socket().native_handle()) 
-            return &itr;
+    server::connection_ptr cptr = gw->get_con_from_hdl(chdl, ec);
+    if(ec){
+        _error<<"unable to get connection pointer from connection handle.";
+        return nullptr;
     }
-    return nullptr;
+    return getNetworkConnObj(cptr->get_raw_socket().native_handle());
 }
 
 void
@@ -271,58 +562,172 @@ delFromSvcConnList(serviceConnection *sconn)
     return; 
 }
 
+static servicePool*
+getServicePool(int id)
+{
+    return ((id > 0) && (id < (int)svcPools.size())) ? svcPools[id] : nullptr;
+}
+
 static bool
 isSvcActive(std::string svcName) 
 { 
-    return getServiceConnObj(svcName) ? true : false; 
+    servicePool *pool = getServicePool(lookupSvcId(svcName.data(), svcNameLen(svcName.c_str())));
+    return pool && pool->isUp(); 
+}
+
+#define SERVICE_POOL_VNODES (64) //points of an instance on the hash ring.
+
+servicePool::servicePool(std::string _name, int policy) :
+    _policy(policy),
+    name(_name),
+    requests(metrics().counter("ngw_service_requests{service=\"" + _name + "\"}")),
+    frames(metrics().counter("ngw_service_frames{service=\"" + _name + "\"}"))
+{
+    return;
+}
+
+void
+servicePool::rebuildRing()
+{
+    _ring.clear();
+    for(serviceConnection *sc : _instances){
+        for(int i = 0; i < SERVICE_POOL_VNODES; i++){
+            std::string point = sc->getTag() + "#" + std::to_string(i);
+            _ring[svcNameHash(point.data(), point.length())] = sc;
+        }
+    }
+    return;
+}
+
+void
+servicePool::add(serviceConnection *sc)
+{
+    _instances.push_back(sc);
+    rebuildRing();
+    _info<<"service: "<<name<<" instance: "<<sc->getTag()<<" joined, instances: "<<_instances.size();
+    return;
+}
+
+void
+servicePool::remove(serviceConnection *sc)
+{
+    auto itr = std::find(_instances.begin(), _instances.end(), sc);
+    if(itr == _instances.end()) return;
+    _instances.erase(itr);
+    rebuildRing();
+    //what the instance had will not be answered, the clients cannot tell which
+    //instance had their requests and let go of all of them to the service.
+    for(auto &client : clientList){
+        networkConnection *nconn = getNetworkConnObj(client.first);
+        if(nconn) nconn->requestsLost(sc->getId());
+    }
+    _info<<"service: "<<name<<" instance: "<<sc->getTag()<<" left, instances: "<<_instances.size();
+    return;
 }
 
-static serviceConnection*
-getServiceConnObj(std::string svcname)
+serviceConnection*
+servicePool::route(int clientid)
 {
-    for(serviceConnection& itr : svcConnList) 
-        if(itr.getName() == svcname) 
-            return &itr;
+    if(_instances.empty()) return nullptr;
+    if(_instances.size() == 1) return _instances.front();
+    if(_policy == ROUTE_LEAST_OUTSTANDING){
+        serviceConnection *least = _instances.front();
+        for(serviceConnection *sc : _instances) 
+            if(sc->getOutstanding() < least->getOutstanding()) least = sc;
+        return least;
+    }
+    auto itr = _ring.lower_bound(svcNameHash(reinterpret_cast<char*>(&clientid), sizeof(clientid)));
+    return (itr == _ring.end()) ? _ring.begin()->second : itr->second;
+}
+
+serviceConnection*
+servicePool::findByTag(const std::string &tag)
+{
+    for(serviceConnection *sc : _instances) if(sc->getTag() == tag) return sc;
     return nullptr;
 }
 
+std::vector<serviceConnection*>&
+servicePool::instances()
+{
+    return _instances;
+}
+
+bool
+servicePool::isUp()
+{
+    return !_instances.empty();
+}
+
+void
+servicePool::addClient(int clientid)
+{
+    clientList[clientid].push_back(-1);
+    return;
+}
+
+void
+servicePool::remClient(int clientid)
+{
+    clientList.erase(clientid);
+    return;
+}
+
+//arrivals and departures are queued on the service connections and flushed 
+//once the handlers run so far are done, a connect storm costs a service a few
+//batched writes instead of a write per client. the writes never block, if the
+//queue of a service is full its deltas are dropped and it gets a snapshot of
+//its clients as soon as there is room, retried every CONTROL_RETRY_INTERVAL.
+#define CONTROL_RETRY_INTERVAL (100) //milliseconds
+static bool ctlFlushPosted = false;
+static bool ctlRetryArmed = false;
+static boost::asio::deadline_timer ctlRetryTimer(gIoSvc);
+
+static void
+flushControlPlane()
+{
+    ctlFlushPosted = false;
+    bool pending = false;
+    for(servicePool *pool : svcPools){
+        if(!pool) continue;
+        for(serviceConnection *sc : pool->instances()){
+            sc->flushClientStatus();
+            if(sc->hasControlWork()) pending = true;
+        }
+    }
+    if(pending && !ctlRetryArmed){
+        ctlRetryArmed = true;
+        ctlRetryTimer.expires_from_now(boost::posix_time::milliseconds(CONTROL_RETRY_INTERVAL));
+        ctlRetryTimer.async_wait([](const boost::system::error_code &ec){
+                ctlRetryArmed = false;
+                if(!ec) flushControlPlane();
+                });
+    }
+    return;
+}
+
+static void
+scheduleControlFlush()
+{
+    if(ctlFlushPosted) return;
+    ctlFlushPosted = true;
+    gIoSvc.post(flushControlPlane);
+    return;
+}
+
 //send arrival or departure status of clients to the services.
 void
 networkConnection::informClientStatus2AllServices(bool arrival)
 {
-    service::controlMessage cmsg;
-    memset(&cmsg, 0, sizeof(cmsg));
-    memcpy(cmsg.sender, "ngw", strlen("ngw"));
-    if (arrival){
-        cmsg.messageType = service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_ARRIVAL;
-        cmsg.clientArrival.clientid = _fd;
-    }else{
-        cmsg.messageType = service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_DEPARTURE;
-        cmsg.clientDeparture.clientid = _fd;
-    }
     std::string svclist;
     if(arrival){
-        for(std::string& itr : _svcList) { svclist += itr; svclist += ", "; }
+        forEachSvc([&svclist](int id){ svclist += svcNames[id]; svclist += ", "; });
         _info<<"service list negotiated by connection:"<<svclist;
     }
-    for(std::string& itr : _svcList){
-        serviceConnection *sc = getServiceConnObj(itr);
-        if(!sc){ _error<<"connection missing for service: "<<itr; continue; }
-        if (!sc->isUp()) continue;
-        int mqfd = sc->getMqFd();
-        if (mqfd){
-            struct timespec ts = {0, 10000000}; //10 milliseconds
-            clock_gettime(CLOCK_REALTIME, &ts);
-            int rc = _eintr(::mq_timedsend(mqfd, 
-                    reinterpret_cast<char*>(&cmsg), 
-                    sizeof(cmsg), 
-                    0, 
-                    &ts));
-            if (rc < 0) _error<<"Unable to send control message to service:"<<itr;
-        }else{
-            _error<<"invalid message queue identifier for the service:";
-        }
-    }
+    forEachSvc([this, arrival](int id){
+        for(serviceConnection *sc : getServicePool(id)->instances())
+            if (sc->isUp()) sc->queueClientStatus(_fd, arrival);
+    });
     return;
 }
 
@@ -332,11 +737,21 @@ networkConnection::informClientStatus2AllServices(bool arrival)
 //send to the service as one batch.
 serviceConnection::serviceConnection(boost::asio::io_service *iosvc, 
         std::string name, 
+        std::string tag, 
         int mqfd) :
     _mqfd(mqfd),
     _name(name),
+    _id(internSvcName(name)),
+    _tag(tag),
+    _pool(getServicePool(_id)),
     _socket(*iosvc),
-    _connMngr(new con_msg_man_type())
+    _connMngr(new con_msg_man_type()),
+    _ctl(tag,
+            [this](service::controlMessage &cmsg){ return sendControl(&cmsg, sizeof(cmsg)); },
+            [this](std::vector<int> &clients){
+                for(auto &itr : clientList) if(itr.first) clients.push_back(itr.first);
+            }),
+    clientList(_pool->clientList)
 {
     addToList();
     return;
@@ -346,6 +761,10 @@ serviceConnection::~serviceConnection()
 {
     delFromSvcConnList(this);
     _eintr(::close(_mqfd));
+    if(_ringDoorbell) delete _ringDoorbell;
+    if(_ringDownFd >= 0) _eintr(::close(_ringDownFd));
+    if(_ringShmFd >= 0) _eintr(::close(_ringShmFd));
+    svcRingUnmap(_ringBase, _ringSize);
     return;
 }
 
@@ -363,6 +782,10 @@ serviceConnection::readAsync() //trigger an asynchronous read.
         _error<<"service: "<<_name<<" not available.";
         return;
     }
+    if(_handoff){
+        _readQuiet = true;
+        return;
+    }
     if (_newSvcMsg){
         _svcmsg = _connMngr->get_message(websocketpp::frame::opcode::BINARY, 
                 sizeof(serviceHeader));
@@ -382,13 +805,24 @@ void
 serviceConnection::readComplete(const boost::system::error_code& error, 
         size_t bytesRecvd)
 {
+    if(_handoff && (error == boost::asio::error::operation_aborted)){
+        //cancelled for the handoff, the bytes not read stay in the socket.
+        _readQuiet = true;
+        return;
+    }
     if (error){
-        _error<<"service ["<<_name<<
+        _error<<"service ["<<_name<<"] instance ["<<_tag<<
             "] seems to be down, closing connection."<<error.message();
-        //inform all the clients about the death of the service.
-        informSvcStatus2AllClients("down");
         this->markDown();
+        _pool->remove(this);
+        //the clients move to the other instances, they are told only when none is left.
+        if(!_pool->isUp()) informSvcStatus2AllClients("down");
         _error<<"serviceConnection::readAsync() returned error:"<<error.message();
+        //the handlers of the operations still pending on the socket run before the delete.
+        boost::system::error_code ec;
+        _socket.close(ec);
+        if(_ringDoorbell) _ringDoorbell->close(ec);
+        gIoSvc.post([this](){ delete this; });
         return;
     }
 
@@ -400,30 +834,15 @@ serviceConnection::readComplete(const boost::system::error_code& error,
     _info<<"serviceConnection::readComplete() from svc: "<<_name<<
         " bytesRecvd: "<<bytesRecvd;
     if(_newSvcMsg){
-        //check if this is a broadcast message. if yes then we need to send it
-        //to the clients of the service.
         char *ptr = _data.data();
-        int clientid = parseClientId(ptr);
-        if(clientid == -1) _isBroadcast = true; //if the client id is -1 then its a service level broadcast message.
+        _clientid = parseClientId(ptr);
         ptr += sizeof(int32_t);
-        int32_t channelId = parseChannelId(ptr);
+        _channelid = parseChannelId(ptr);
         ptr += sizeof(int32_t);
-        std::string svcname = parseSvcName(ptr);
-        ptr += MAX_SERVICE_NAME_LEN;
+        ptr += MAX_SERVICE_NAME_LEN; //the frame is from this service, the name adds nothing.
         _totalSvcMsgLen = parseSvcMsgLen(ptr);
         _bytes2Recv = _totalSvcMsgLen;
-        _nconn = getNetworkConnObj(clientid, channelId); //_nconn can be null if the message is a broadcast.
-        if(!_nconn){ //A service can by mistake send a message to a client gone down after we informed the 
-                     //service. This is not a serious offence though.
-            _error<<"Unable to find connection object for clientid: "<<clientid;
-            _svcmsg.reset();
-            _nconn = nullptr;
-            _totalSvcBytesRecvd = _totalSvcMsgLen = 0;
-            _newSvcMsg = true;
-            readAsync();
-            return;
-        }
-        _info<<"new message to client: "<<clientid<<" from svc: "<<svcname;
+        _info<<"new message to client: "<<_clientid<<" from svc: "<<_name;
         _newSvcMsg = false;
         payloadRecvd = bytesRecvd - (2*sizeof(int32_t)); //leave the channelid and the clientid.
         payload = _data.data() + (2*sizeof(int32_t));
@@ -434,36 +853,12 @@ serviceConnection::readComplete(const boost::system::error_code& error,
         payloadRecvd = bytesRecvd;
     }
 
-    //append the payload data to the message buffer and enqueue it in the 
-    //network connection queue if all the data has arrived.
+    //append the payload data to the message buffer and hand it over if all 
+    //the data has arrived.
     _svcmsg->append_payload(payload, payloadRecvd);
     if(_svcmsg && (_totalSvcBytesRecvd == _totalSvcMsgLen)){
-        if(!_isBroadcast){
-            _nconn->nq(_svcmsg);
-            _nconn->send(); //trigger a send on the network connection.
-        }else{
-            //walk through all the clients and channels the service is serving.
-            //make a copy of the message and enqueue it to all the network
-            //connections and trigger a send.
-            for(std::map<int, std::vector<int>>::iterator itr = \
-                    clientList.begin();
-                    itr != clientList.end();
-                    itr++){
-                networkConnection *nconn = getNetworkConnObj((*itr).first);
-                assert(nconn);
-                message_ptr clone = _connMngr->get_message(
-                        websocketpp::frame::opcode::BINARY, 
-                        _svcmsg->get_payload().size());
-                clone->append_payload(_svcmsg->get_payload());
-                nconn->nq(clone);
-                nconn->send();
-                nconn->nq_broadcast(); //FIXME: fill this once channels are supported.
-                nconn->broadcast(); //xmit the message on all the channels of the client.
-            }
-            _isBroadcast = false;
-        }
+        dispatchSvcFrame(_clientid, _channelid, _svcmsg);
         _svcmsg.reset();
-        _nconn = nullptr;
         _totalSvcBytesRecvd = _totalSvcMsgLen = 0;
         _newSvcMsg = true;
         readAsync();
@@ -474,6 +869,295 @@ serviceConnection::readComplete(const boost::system::error_code& error,
     return;
 }
 
+//a complete frame from the service, whichever transport it came over. the 
+//message holds the frame as the client gets it, svcname | len | payload.
+void
+serviceConnection::dispatchSvcFrame(int clientid, int channelid, message_ptr msg)
+{
+    metricTimer timer(serviceFrameLatency);
+    int lane = _pool ? _pool->lane : LANE_NORMAL;
+    if(_pool) _pool->frames.add();
+    if(clientid == SVC_USER_CLIENTID){
+        //services answer with send2user too, a frame to the user is taken as
+        //the answer to a request of the user.
+        auto itr = localUsers.find(channelid);
+        networkConnection *uconn = (itr != localUsers.end()) ? getNetworkConnObj(itr->second) : nullptr;
+        if(uconn) uconn->requestAnswered(_id);
+        const std::string &frame = msg->get_payload();
+        deliverToUser(channelid, frame.data(), frame.length(), true);
+        return;
+    }
+    if(clientid == -1){ //service level broadcast.
+        //walk through all the clients and channels the service is serving.
+        //make a copy of the message and enqueue it to all the network
+        //connections and trigger a send.
+        for(std::map<int, std::vector<int>>::iterator itr = \
+                clientList.begin();
+                itr != clientList.end();
+                itr++){
+            networkConnection *nconn = getNetworkConnObj((*itr).first);
+            assert(nconn);
+            message_ptr clone = _connMngr->get_message(
+                    websocketpp::frame::opcode::BINARY, 
+                    msg->get_payload().size());
+            clone->append_payload(msg->get_payload());
+            nconn->nq(clone, lane);
+            nconn->send();
+            nconn->nq_broadcast(); //FIXME: fill this once channels are supported.
+            nconn->broadcast(); //xmit the message on all the channels of the client.
+        }
+        //the clients of the service on the other gateways.
+        if(cluster) cluster->broadcast(_name, msg->get_payload().data(), 
+                msg->get_payload().length());
+        return;
+    }
+    networkConnection *nconn = getNetworkConnObj(clientid, channelid);
+    if(!nconn){ //A service can by mistake send a message to a client gone down after we informed the 
+                //service. This is not a serious offence though.
+        _error<<"Unable to find connection object for clientid: "<<clientid;
+        return;
+    }
+    if(_outstanding) _outstanding--;
+    nconn->requestAnswered(_id);
+    nconn->nq(msg, lane);
+    nconn->send(); //trigger a send on the network connection.
+    return;
+}
+
+//the service offered a shared memory segment with the rings and the eventfd 
+//doorbells when it connected. the descriptors are ours now, closed on failure.
+bool
+serviceConnection::attachRing(int shmfd, int downfd, int upfd)
+{
+    struct stat st;
+    bool ok = false;
+    //the segment is kept open to hand it over to the next gateway.
+    SCOPE_EXIT{ if(!ok){ _eintr(::close(shmfd)); _eintr(::close(downfd)); _eintr(::close(upfd)); } };
+    if((::fstat(shmfd, &st) < 0) || (st.st_size <= (off_t)(2 * sizeof(ringControl)))){
+        _error<<"service: "<<_tag<<" offered an unusable ring segment.";
+        return false;
+    }
+    uint32_t capacity = (st.st_size - 2 * sizeof(ringControl)) / 2;
+    try{
+        _ringBase = svcRingMap(shmfd, capacity);
+    }catch(std::exception &e){
+        _error<<"unable to map the rings of service: "<<_tag<<" "<<e.what();
+        return false;
+    }
+    if(!_ringDown.attach(svcRingControl(_ringBase, 0), svcRingData(_ringBase, capacity, 0), capacity) ||
+            !_ringUp.attach(svcRingControl(_ringBase, 1), svcRingData(_ringBase, capacity, 1), capacity)){
+        _error<<"service: "<<_tag<<" offered rings of a bad layout.";
+        svcRingUnmap(_ringBase, capacity);
+        _ringBase = nullptr;
+        return false;
+    }
+    _ringSize = capacity;
+    _ringDownFd = downfd;
+    _ringShmFd = shmfd;
+    _ringDoorbell = new boost::asio::posix::stream_descriptor(gIoSvc, upfd);
+    ok = true;
+    _info<<"service: "<<_tag<<" talks over rings of "<<capacity<<" bytes.";
+    //frames the service wrote before we attached.
+    readRing(boost::system::error_code());
+    return true;
+}
+
+bool
+serviceConnection::hasRing()
+{
+    return _ringBase;
+}
+
+bool
+serviceConnection::ringPut(int clientid, int channelid, message_ptr &msg)
+{
+    int32_t label[2] = {(int32_t)htonl(clientid), (int32_t)htonl(channelid)};
+    const std::string &payload = msg->get_payload();
+    return _ringDown.write(reinterpret_cast<char*>(label), sizeof(label), 
+            payload.data(), payload.length());
+}
+
+//a client message goes straight in to the ring, behind the ones waiting for 
+//room. the doorbell is rung only if the service went to sleep.
+void
+serviceConnection::ringSend(networkConnection *nconn, message_ptr msg)
+{
+    if(!_ringBacklog.empty() || !ringPut(nconn->getConnId(), nconn->getChannelId(), msg)){
+        ringPending p = {nconn->getConnId(), nconn->getChannelId(), msg};
+        _ringBacklog.push_back(p);
+        flushRingBacklog();
+        return;
+    }
+    if(_ringDown.needsDoorbell()){
+        uint64_t one = 1;
+        if(::write(_ringDownFd, &one, sizeof(one)) < 0)
+            _error<<"unable to ring the doorbell of service: "<<_tag;
+    }
+    return;
+}
+
+//the service rings our doorbell once it drained a ring we found full.
+void
+serviceConnection::flushRingBacklog()
+{
+    while(!_ringBacklog.empty()){
+        if(!ringPut(_ringBacklog.front().clientid, _ringBacklog.front().channelid, 
+                    _ringBacklog.front().msg)){
+            _ringDown.markProducerWaiting();
+            //it may have drained before it could see the flag.
+            if(!ringPut(_ringBacklog.front().clientid, _ringBacklog.front().channelid, 
+                        _ringBacklog.front().msg))
+                break;
+        }
+        _ringBacklog.pop_front();
+    }
+    if(_ringDown.needsDoorbell()){
+        uint64_t one = 1;
+        if(::write(_ringDownFd, &one, sizeof(one)) < 0)
+            _error<<"unable to ring the doorbell of service: "<<_tag;
+    }
+    return;
+}
+
+void
+serviceConnection::armRingDoorbell()
+{
+    _ringDoorbell->async_read_some(boost::asio::null_buffers(),
+            boost::bind(&serviceConnection::readRing, this,
+                boost::asio::placeholders::error));
+    return;
+}
+
+//drain the up ring, a busy service gets its frames handled in batches with
+//no syscall in between. after a while we ring our own doorbell to let the 
+//other handlers of the loop run.
+void
+serviceConnection::readRing(const boost::system::error_code &error)
+{
+    if(error || _handoff) return; //closed with the service or handed over.
+    uint64_t count;
+    if(::read(_ringDoorbell->native_handle(), &count, sizeof(count)) < 0) count = 0;
+    size_t frames = 0;
+    auto handler = [this](const char *frame, size_t len){
+        if(len < sizeof(serviceHeader)) return;
+        int clientid = parseClientId(frame);
+        int channelid = parseChannelId(frame + sizeof(int32_t));
+        message_ptr msg = _connMngr->get_message(websocketpp::frame::opcode::BINARY, 
+                len - 2 * sizeof(int32_t));
+        msg->append_payload(frame + 2 * sizeof(int32_t), len - 2 * sizeof(int32_t));
+        dispatchSvcFrame(clientid, channelid, msg);
+    };
+    for(;;){
+        size_t n = _ringUp.read(handler, 256);
+        frames += n;
+        if(_ringUp.producerWaiting()){
+            //the service has frames for the room we made.
+            uint64_t one = 1;
+            if(::write(_ringDownFd, &one, sizeof(one)) < 0)
+                _error<<"unable to ring the doorbell of service: "<<_tag;
+        }
+        if(!_ringBacklog.empty()) flushRingBacklog();
+        if(n){
+            if(frames < 4096) continue;
+            uint64_t one = 1;
+            if(::write(_ringDoorbell->native_handle(), &one, sizeof(one)) < 0)
+                _error<<"unable to ring our own doorbell for service: "<<_tag;
+            break;
+        }
+        if(_ringUp.prepareSleep()) break;
+    }
+    armRingDoorbell();
+    return;
+}
+
+//stop the connection at a frame boundary on the way out to the next gateway.
+//the client messages queued are written first, their clients may be carried
+//on by the next gateway. the reads are cancelled and whatever the service 
+//wrote stays in the socket or the ring for the next gateway to read.
+bool
+serviceConnection::quiesce()
+{
+    _handoff = true;
+    if(!_ringBacklog.empty()) flushRingBacklog();
+    if(_marker || !_mq.empty() || !_ringBacklog.empty()) return false;
+    if(!_handoffCancelled){
+        boost::system::error_code ec;
+        _socket.cancel(ec);
+        if(_ringDoorbell) _ringDoorbell->cancel(ec);
+        _handoffCancelled = true;
+    }
+    return _readQuiet;
+}
+
+//the next gateway did not take the connection, carry on reading.
+void
+serviceConnection::abortHandoff()
+{
+    if(!_handoff) return;
+    bool rearm = _handoffCancelled;
+    _handoff = _handoffCancelled = false;
+    if(_readQuiet){
+        _readQuiet = false;
+        readAsync();
+    }
+    if(rearm && _ringDoorbell) readRing(boost::system::error_code());
+    return;
+}
+
+//what the next gateway needs to carry on from the byte we stopped at, the 
+//descriptors go along with the record.
+std::string
+serviceConnection::handoffState(std::vector<int> &fds)
+{
+    std::string state;
+    packBytes(state, _name);
+    packBytes(state, _tag);
+    packU32(state, _ctl.seq());
+    packU32(state, _newSvcMsg);
+    packU32(state, _clientid);
+    packU32(state, _channelid);
+    packU32(state, _totalSvcMsgLen);
+    packU32(state, _totalSvcBytesRecvd);
+    packU32(state, _bytes2Recv);
+    packBytes(state, (!_newSvcMsg && _svcmsg) ? _svcmsg->get_payload() : std::string());
+    packBytes(state, _ringUp.partial());
+    fds.push_back(_socket.native_handle());
+    if(_ringBase){
+        fds.push_back(_ringShmFd);
+        fds.push_back(_ringDownFd);
+        fds.push_back(_ringDoorbell->native_handle());
+    }
+    return state;
+}
+
+//the counterpart of handoffState, name and tag were taken from the record 
+//already. call before the rings are attached.
+bool
+serviceConnection::resumeState(const std::string &state, size_t off)
+{
+    uint32_t seq, fresh, clientid, channelid, total, recvd, toRecv;
+    std::string partial, ringPartial;
+    if(!unpackU32(state, off, seq) || !unpackU32(state, off, fresh) ||
+            !unpackU32(state, off, clientid) || !unpackU32(state, off, channelid) ||
+            !unpackU32(state, off, total) || !unpackU32(state, off, recvd) ||
+            !unpackU32(state, off, toRecv) || !unpackBytes(state, off, partial) ||
+            !unpackBytes(state, off, ringPartial))
+        return false;
+    _ctl.resume(seq);
+    _newSvcMsg = fresh;
+    _clientid = clientid;
+    _channelid = channelid;
+    _totalSvcMsgLen = total;
+    _totalSvcBytesRecvd = recvd;
+    _bytes2Recv = toRecv;
+    if(!_newSvcMsg){
+        _svcmsg = _connMngr->get_message(websocketpp::frame::opcode::BINARY, partial.length());
+        _svcmsg->append_payload(partial.data(), partial.length());
+    }
+    _ringUp.setPartial(ringPartial);
+    return true;
+}
+
 void
 serviceConnection::writeAsync(networkConnection *nconn) //trigger an asynchronous write.
 {
@@ -572,7 +1256,7 @@ int
 serviceConnection::openSvcMessageQueue(std::string svcName)
 {
     std::string mqName = "/" + svcName + ".mq";
-    int mq = _except(::mq_open(mqName.c_str(), O_WRONLY));
+    int mq = _except(::mq_open(mqName.c_str(), O_WRONLY | O_NONBLOCK));
     _info<<"mq opened successfully mqname: "<<mqName;
     return mq;
 }
@@ -610,6 +1294,37 @@ serviceConnection::getName()
     return _name; 
 }
 
+int
+serviceConnection::getId()
+{
+    return _id;
+}
+
+std::string
+serviceConnection::getTag()
+{
+    return _tag;
+}
+
+servicePool*
+serviceConnection::getPool()
+{
+    return _pool;
+}
+
+unsigned int
+serviceConnection::getOutstanding()
+{
+    return _outstanding;
+}
+
+void
+serviceConnection::requestSent()
+{
+    _outstanding++;
+    return;
+}
+
 void 
 serviceConnection::nq(message_ptr msg) 
 { 
@@ -690,31 +1405,51 @@ serviceConnection::mqSize()
 }
 
 //FIXME: send channelid as well once we have the support for multiplexing extension.
+//the service came back, whatever it knew of the clients is replaced by a snapshot.
 void
 serviceConnection::relayClientAndChannel2Service()
 {
     _info<<"relaying client channels and clients to the service.";
-    for(std::map<int, std::vector<int>>::iterator itr = clientList.begin();
-            itr != clientList.end();
-            itr++){
-        int clientid = (*itr).first;
-        if(clientid){
-            service::controlMessage cmsg;
-            memset(&cmsg, 0, sizeof(cmsg));
-            memcpy(cmsg.sender, "ngw", strlen("ngw"));
-            cmsg.messageType = service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_ARRIVAL;
-            cmsg.clientArrival.clientid = clientid;
-            cmsg.clientArrival.channelid = -1;
-            struct timespec ts = {0, 10000000}; //10 milliseconds
-            clock_gettime(CLOCK_REALTIME, &ts);
-            int rc = _eintr(::mq_timedsend(_mqfd, 
-                    reinterpret_cast<char*>(&cmsg), 
-                    sizeof(cmsg), 
-                    0, 
-                    &ts));
-            if (rc < 0) _error<<"Unable to send control message to service:"<<_name;
-        }
+    _ctl.resync();
+    _ctl.flush();
+    if(_ctl.pending()) scheduleControlFlush();
+    return;
+}
+
+bool
+serviceConnection::sendControl(void *cmsg, size_t len)
+{
+    int rc = _eintr(::mq_send(_mqfd, reinterpret_cast<char*>(cmsg), len, 0));
+    if(rc < 0){
+        if(errno != EAGAIN) _error<<"Unable to send control message to service:"<<_name<<" "<<strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void
+serviceConnection::queueClientStatus(int clientid, bool arrival)
+{
+    _ctl.queue(clientid, arrival);
+    scheduleControlFlush();
+    return;
+}
+
+bool
+serviceConnection::hasControlWork()
+{
+    return _ctl.pending();
+}
+
+void
+serviceConnection::flushClientStatus()
+{
+    if(!isUp()){
+        //it gets a snapshot when it registers again.
+        _ctl.reset();
+        return;
     }
+    _ctl.flush();
     return;
 }
 
@@ -808,20 +1543,17 @@ on_open(server *s, websocketpp::connection_hdl conn)
     else _info<<"Enabling keep alive for the connection.";
     //send the initial information like services available and the clientid to 
     //use in further communication.
-    networkConnection *nconn = new networkConnection(conn, ipstr, "");
+    networkConnection *nconn = new networkConnection(conn, ipstr);
     if (!nconn){
         _fatal<<"Server out of memory, no new connections can be created.";
         cptr->close(websocketpp::error::bad_connection, 
                 "Server low on resources, Please re-connect.");
         return;
     }
-    nconn->origin = cptr->get_origin();
-    nconn->requestedSubProtocols = cptr->get_requested_subprotocols();
-    nconn->subProtocol = cptr->get_subprotocol();
     _info<<"New connection opened. clientip: "<<std::string(ipstr)<<
         " port: "<<port<<
-        " origin: "<<nconn->origin<<
-        " subProtococol: "<<nconn->subProtocol;
+        " origin: "<<cptr->get_origin()<<
+        " subProtococol: "<<cptr->get_subprotocol();
     //Form the initial registration message which returns the service health 
     // so that client can choose to 
     //use which services can be requested.
@@ -835,13 +1567,15 @@ on_open(server *s, websocketpp::connection_hdl conn)
     c.set_name("services_list");
     //Add the connection to all the services requested.
     for(std::string& itr1 : svclist){
-        serviceConnection *sc = getServiceConnObj(itr1);
-        if(sc) sc->addClient(nconn->getConnId());
-        nconn->registerSvc(itr1); //Add it to the network connection as well.
+        int id = internSvcName(itr1);
+        servicePool *pool = getServicePool(id);
+        pool->addClient(nconn->getConnId());
+        nconn->registerSvc(id); //Add it to the network connection as well.
         JSONNode snode(JSON_NODE);
         tupl tv[] = {
             {"service", itr1}, 
-            {"status", ((sc) && (sc->isUp())) ? std::string("up") : std::string("down")}
+            {"status", pool->isUp() ? std::string("up") : std::string("down")},
+            {"id", id}
         };
         putJsonVal(tv, sizeof(tv)/sizeof(tupl), snode);
         c.push_back(snode);
@@ -877,6 +1611,7 @@ on_close(server *s, websocketpp::connection_hdl conn)
     server::connection_ptr cptr = gw->get_con_from_hdl(conn, ec);
     if(ec) _error<<"unable to get connection pointer from connection handle.";
     networkConnection *nobj = getNetworkConnObj(conn);
+    if(!nobj) return; //a client not carried on after a handoff.
     _info<<"Connection closed ip: "<<nobj->_ipAddress<<
         " close_code:"<<cptr->get_remote_close_code()<<
         " close_reason:"<<cptr->get_remote_close_reason();
@@ -890,6 +1625,7 @@ on_fail(server *s, websocketpp::connection_hdl conn)
 {
     _info<<"connection failure.";
     networkConnection *nobj = getNetworkConnObj(conn);
+    if(!nobj) return;
     nobj->informClientStatus2AllServices(false);
     delete nobj;
     return;
@@ -993,6 +1729,161 @@ validate_handler(server *s, websocketpp::connection_hdl conn)
     return true;
 }
 
+//relay frames carry the call signaling of one user to another through the
+//gateway alone instead of going through the rtc service.
+//  client -> ngw : "relay"[32] | len | rcpt uid | payload
+//  ngw -> client : "relay"[32] | len | sndr uid | payload
+//len covers the uid and the payload. the gateway only swaps the uid, the
+//payload is opaque to it. the sender is always the user logged in on the
+//connection the frame arrived on, never what the payload claims. the policy is
+//checked by the gateway of the sender, the recipient may be logged in on any
+//gateway of the cluster.
+typedef std::function<bool(int sndr, int rcpt)> relayPolicyT;
+static relayPolicyT relayPolicy;
+
+static relayPolicyT
+getRelayPolicy(std::string name)
+{
+    if(name == "any") 
+        return [](int sndr, int rcpt){ return true; };
+    if(name == "none") 
+        return [](int sndr, int rcpt){ return false; };
+    if(name == "group") 
+        return [](int sndr, int rcpt){
+            int gid = getGidForUid(sndr);
+            return gid && ((getGidForUid(rcpt) == gid) || isGroupMember(rcpt, gid));
+        };
+    throw std::runtime_error("invalid relay policy: " + name);
+}
+
+//tell the sender that the frame could not be delivered.
+//the client is told which request was turned away by its cookie, the request
+//is parsed only then.
+static void
+sendBusy(networkConnection *nptr, int svcid, const char *reason, uint64_t retryAfter, 
+        const std::string &payload)
+{
+    JSONNode n(JSON_NODE);
+    n.push_back(JSONNode("mesgtype", std::string("event")));
+    n.push_back(JSONNode("eventtype", std::string("busy")));
+    n.push_back(JSONNode("service", svcNames[svcid]));
+    n.push_back(JSONNode("reason", std::string(reason)));
+    n.push_back(JSONNode("retry_after", (long)retryAfter));
+    const size_t hdrlen = MAX_SERVICE_NAME_LEN + sizeof(int32_t);
+    if(payload.length() > hdrlen){
+        try{
+            JSONNode req = libjson::parse(payload.substr(hdrlen));
+            JSONNode::iterator itr = req.find("cookie");
+            if(itr != req.end()) n.push_back(JSONNode("cookie", itr->as_string()));
+        }catch(std::exception &e){} //not json, the client goes without the cookie.
+    }
+    std::string json = n.write();
+    std::string frame(MAX_SERVICE_NAME_LEN, ' ');
+    memcpy(nonconst(frame.data()), "ngw", strlen("ngw"));
+    uint32_t dataSize = htonl(json.length());
+    frame.append((char*)&dataSize, sizeof(dataSize));
+    frame.append(json);
+    sendFrame(nptr, frame.data(), frame.length(), LANE_INTERACTIVE);
+    return;
+}
+
+//a relayed message and a request to a service which does not answer are not
+//counted in flight.
+static bool
+admitRequest(networkConnection *nptr, int svcid, const std::string &payload, bool answered)
+{
+    if(!admission) return true;
+    uint64_t retryAfter = 0;
+    int userKey = nptr->uid ? nptr->uid : -nptr->getConnId();
+    int verdict = admission->admit(userKey, svcid, 
+            answered ? nptr->inflight(admission_inflight_timeout) : 0, retryAfter);
+    if(verdict == admissionControl::ADMIT){
+        if(answered) nptr->requestSent(svcid);
+        return true;
+    }
+    requestsTurnedAway.add();
+    _info<<"request of conn: "<<nptr->getConnId()<<" to: "<<svcNames[svcid]<<" turned away, "
+        <<admissionControl::reason(verdict);
+    sendBusy(nptr, svcid, admissionControl::reason(verdict), retryAfter, payload);
+    return false;
+}
+
+//log the counters and let go of the buckets of the quiet users.
+static void
+admissionReport(const boost::system::error_code &error)
+{
+    if(error) return;
+    for(size_t id = 1; id < admission->services(); id++){
+        const admissionCounters &c = admission->counters(id);
+        if(!(c.admitted || c.userRate || c.serviceRate || c.inflight)) continue;
+        _info<<"admission service: "<<svcNames[id]<<" admitted: "<<c.admitted
+            <<" user_rate: "<<c.userRate<<" service_rate: "<<c.serviceRate
+            <<" inflight: "<<c.inflight;
+    }
+    admission->sweep();
+    admissionTimer->expires_from_now(boost::posix_time::seconds(admission_report_interval));
+    admissionTimer->async_wait(&admissionReport);
+    return;
+}
+
+static void
+relayFailed(server::connection_ptr cptr, int rcpt, std::string reason)
+{
+    JSONNode n(JSON_NODE);
+    n.push_back(JSONNode("mesgtype", std::string("event")));
+    n.push_back(JSONNode("eventtype", std::string("relay_failed")));
+    n.push_back(JSONNode("rcpt", rcpt));
+    n.push_back(JSONNode("reason", reason));
+    std::string json = n.write();
+    std::string frame(MAX_SERVICE_NAME_LEN, ' ');
+    memcpy(nonconst(frame.data()), "ngw", strlen("ngw"));
+    uint32_t dataSize = htonl(json.length());
+    frame.append((char*)&dataSize, sizeof(dataSize));
+    frame.append(json);
+    cptr->send(frame.data(), frame.length());
+    return;
+}
+
+static void
+relayMessage(networkConnection *nptr, const std::string &payload)
+{
+    websocketpp::lib::error_code ec;
+    server::connection_ptr cptr = gw->get_con_from_hdl(nptr->getConnHdl(), ec);
+    if(ec){
+        _error<<"unable to get connection pointer from connection handle.";
+        return;
+    }
+    const size_t hdrlen = MAX_SERVICE_NAME_LEN + sizeof(int32_t) + sizeof(int32_t);
+    if((payload.length() < hdrlen) || 
+            (parseSvcMsgLen(payload.data() + MAX_SERVICE_NAME_LEN) != 
+             (int)(payload.length() - MAX_SERVICE_NAME_LEN - sizeof(int32_t)))){
+        _error<<"malformed relay frame on conn: "<<nptr->getConnId();
+        return;
+    }
+    int rcpt = parseClientId(payload.data() + MAX_SERVICE_NAME_LEN + sizeof(int32_t));
+    int sndr = getUidForClientId(nptr->getConnId());
+    if(!sndr){
+        relayFailed(cptr, rcpt, "not_logged_in");
+        return;
+    }
+    if(!relayPolicy(sndr, rcpt)){
+        _info<<"relay from uid: "<<sndr<<" to uid: "<<rcpt<<" denied by policy.";
+        relayFailed(cptr, rcpt, "denied");
+        return;
+    }
+    std::string frame(payload);
+    int32_t uid = htonl(sndr);
+    memcpy(nonconst(frame.data()) + MAX_SERVICE_NAME_LEN + sizeof(int32_t), &uid, sizeof(uid));
+    //a user on another gateway of the cluster gets it from there, the peers are
+    //authenticated and deliver the stamped sender as is.
+    auto itr = localUsers.find(rcpt);
+    networkConnection *rptr = (itr != localUsers.end()) ? getNetworkConnObj(itr->second) : nullptr;
+    if(rptr) sendFrame(rptr, frame.data(), frame.length(), LANE_INTERACTIVE);
+    else if(!(cluster && cluster->sendToUser(rcpt, frame.data(), frame.length())))
+        relayFailed(cptr, rcpt, "offline");
+    return;
+}
+
 //we are gauranteed that we will be woken up only when we recieve a
 //complete websocket frame. so we dont need to be worried about the 
 //framing issues any more. most of the times a complete service message
@@ -1017,28 +1908,52 @@ on_message(server *s, websocketpp::connection_hdl conn, message_ptr msg)
         return;
     }
     nptr->_inputByteCount += (msg->get_header().size() + msg->get_payload().size());
+    clientBytesIn.add(msg->get_header().size() + msg->get_payload().size());
+    metricTimer timer(clientFrameLatency);
+    if(handoffPhase == HANDOFF_DRAINING){
+        //the client reconnects to the new gateway right away.
+        server::connection_ptr cptr = gw->get_con_from_hdl(conn, ec);
+        if(!ec) cptr->close(websocketpp::close::status::service_restart, "gateway restarting", ec);
+        return;
+    }
     const char *ptr = payload.data(); //pointer to the raw buffer.
-    std::string svcname = parseSvcName(ptr);
-    serviceConnection *sconn = getServiceConnObj(svcname);
+    int svcid = parseSvcId(ptr);
+    if((handoffPhase == HANDOFF_QUIESCING) || (handoffPhase == HANDOFF_PAUSING) || 
+            (handoffPhase == HANDOFF_SENDING)){
+        sendBusy(nptr, svcid, "restarting", HANDOFF_QUIESCE_TIMEOUT, payload);
+        return;
+    }
+    if(svcid && (svcid == relaySvcId)){
+        if(admitRequest(nptr, svcid, payload, false)) relayMessage(nptr, payload);
+        return;
+    }
+    servicePool *pool = getServicePool(svcid);
+    serviceConnection *sconn = pool ? pool->route(nptr->getConnId()) : nullptr;
     //check if the message is destined for the network gateway itself.
     //this can be the heart beat message.
     if((!sconn) || (sconn && !(sconn->isUp()))){
         //FIXME: return back an error to the client as service is down.
-        _error<<"service seems to be down. svcname:"<<svcname; 
+        _error<<"service seems to be down. svcname:"<<parseSvcName(ptr); 
+        return;
+    }
+    if(!admitRequest(nptr, svcid, payload, pool->answers)) return;
+    pool->requests.add();
+    if(sconn->hasRing()){
+        sconn->requestSent();
+        sconn->ringSend(nptr, msg);
         return;
     }
     bool trigger = (sconn->mqSize()) ? false : true;//Trigger a write only if the queue is empty.
+    sconn->requestSent();
     sconn->nq(msg);
     if(trigger) sconn->writeAsync(nptr);
     return;
 }
 
 networkConnection::networkConnection(websocketpp::connection_hdl wsppconn, 
-        std::string ipaddress, 
-        std::string useragent) :
+        std::string ipaddress) :
     _wsppconn(wsppconn),
-    _ipAddress(ipaddress),
-    _userAgent(useragent)
+    _ipAddress(ipaddress)
 {
     websocketpp::lib::error_code ec;
     server::connection_ptr cptr = gw->get_con_from_hdl(wsppconn, ec);
@@ -1050,21 +1965,67 @@ networkConnection::networkConnection(websocketpp::connection_hdl wsppconn,
 
 networkConnection::~networkConnection()
 {
+    if(_handedOver) return; //carried on by the new gateway.
     _eintr(::close(_fd));
     delFromNtwConnList(this);
     _wsppconn.reset();
     //delete the clientid from all the service connection objects which the 
     //client has registered with.
-    for(std::string& itr : _svcList){
-        serviceConnection *sc = getServiceConnObj(itr);
-        if(!sc){ _error<<"connection missing for service: "<<itr; continue; }
-        sc->remClient(_fd);
-    }
+    forEachSvc([this](int id){ getServicePool(id)->remClient(_fd); });
+    if(uid) userLoggedOut(uid, _fd);
+    if(admission) admission->forgetUser(-_fd);
+    return;
+}
+
+static time_t
+monotonicSecs(void)
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void
+networkConnection::requestSent(int svcid)
+{
+    if(!_inflight) _inflight.reset(new std::deque<inflightRequest>);
+    _inflight->push_back(inflightRequest{svcid, monotonicSecs()});
     return;
 }
 
+void
+networkConnection::requestAnswered(int svcid)
+{
+    if(!_inflight) return;
+    auto itr = std::find_if(_inflight->begin(), _inflight->end(), 
+            [svcid](const inflightRequest &r){ return r.svcid == svcid; });
+    if(itr != _inflight->end()) _inflight->erase(itr);
+    if(_inflight->empty()) _inflight.reset();
+    return;
+}
+
+void
+networkConnection::requestsLost(int svcid)
+{
+    if(!_inflight) return;
+    _inflight->erase(std::remove_if(_inflight->begin(), _inflight->end(), 
+                [svcid](const inflightRequest &r){ return r.svcid == svcid; }), _inflight->end());
+    if(_inflight->empty()) _inflight.reset();
+    return;
+}
+
+unsigned int
+networkConnection::inflight(int timeout)
+{
+    if(!_inflight) return 0;
+    time_t expired = monotonicSecs() - timeout;
+    while(!_inflight->empty() && (_inflight->front().sent <= expired)) _inflight->pop_front();
+    unsigned int count = _inflight->size();
+    if(!count) _inflight.reset();
+    return count;
+}
+
 int 
-networkConnection::getConnId() 
+networkConnection::getConnId() const
 { 
     return _fd; 
 }
@@ -1081,10 +2042,18 @@ networkConnection::getConnHdl()
     return _wsppconn;
 }
 
+//a message in an empty interactive lane is served next, the round resumes
+//after it with the deficits of the other lanes kept.
 void 
-networkConnection::nq(message_ptr msg) 
+networkConnection::nq(message_ptr msg, int lane) 
 { 
-    _mq.push(msg); 
+    if(!_out) _out.reset(new outLanes());
+    if((lane == LANE_INTERACTIVE) && _out->lanes[lane].empty()){
+        _out->lane = LANE_INTERACTIVE;
+        _out->credited = false;
+    }
+    _out->lanes[lane].push(msg); 
+    _out->queued++;
     return; 
 }
 
@@ -1101,56 +2070,103 @@ networkConnection::broadcast()
     return;
 }
 
-message_ptr 
-networkConnection::dq() 
-{ 
-    message_ptr m = _mq.front(); 
-    _mq.pop(); 
-    return m; 
-}
-
+//deficit round robin over the lanes. only a little is handed to websocketpp
+//at a time, whatever it queues goes out in order and would delay an 
+//interactive message queued after it. a message is never split, a websocket
+//can not interleave the fragments of two messages.
 void
 networkConnection::send()
 {
+    if(_pumping || !_out) return;
     websocketpp::lib::error_code ec;
     server::connection_ptr cptr = gw->get_con_from_hdl(_wsppconn, ec);
-    if (!ec){
-        ec = cptr->send(_mq.front());
-        _info<<"network message put on wire.";
-        if(!ec){
-            _outputByteCount += (_mq.front()->get_header().size() + \
-                    _mq.front()->get_payload().size());
-            _mq.pop();
-        }else{
+    if(ec){
+        _error<<"There was an error getting connection ptr from connection handle.";
+        return;
+    }
+    outLanes &o = *_out;
+    while(o.queued){
+        if(cptr->get_buffered_amount() >= NGW_WS_LOW_WATER){
+            _pumping = true;
+            schedulePump(_fd);
+            return;
+        }
+        std::queue<message_ptr> &q = o.lanes[o.lane];
+        if(q.empty()){ 
+            o.deficit[o.lane] = 0; //an idle lane does not save up.
+            o.lane = (o.lane + 1) % LANE_COUNT;
+            o.credited = false;
+            continue;
+        }
+        if(!o.credited){
+            o.deficit[o.lane] += laneQuantum[o.lane];
+            o.credited = true;
+        }
+        int size = q.front()->get_payload().size();
+        if(o.deficit[o.lane] < size){
+            o.lane = (o.lane + 1) % LANE_COUNT;
+            o.credited = false;
+            continue;
+        }
+        ec = cptr->send(q.front());
+        if(ec){
             _error<<"There was an error sending message to client";
+            return;
         }
-    }else
-        _error<<"There was an error getting connection ptr from connection handle.";
+        _outputByteCount += (q.front()->get_header().size() + size);
+        o.deficit[o.lane] -= size;
+        q.pop();
+        o.queued--;
+    }
+    _out.reset(); //drained, an idle connection keeps no queues.
     return;
 }
 
 bool 
-networkConnection::operator < (const networkConnection &b) 
+networkConnection::operator < (const networkConnection &b) const
 { 
     return _fd < b._fd; 
 }
 
 bool 
-networkConnection::operator > (const networkConnection &b) 
+networkConnection::operator > (const networkConnection &b) const
 { 
     return _fd > b._fd; 
 }
 
 bool 
-networkConnection::operator == (const networkConnection &b) 
+networkConnection::operator == (const networkConnection &b) const
 { 
     return _fd == b._fd; 
 }
 
+//the socket goes to the new gateway, the client carries on there so neither
+//the services nor the cluster are told it left.
+void
+networkConnection::handOver()
+{
+    delFromNtwConnList(this);
+    auto itr = uid ? localUsers.find(uid) : localUsers.end();
+    if((itr != localUsers.end()) && (itr->second == _fd)) localUsers.erase(itr);
+    _handedOver = true;
+    return;
+}
+
+//the handoff did not go through, the client is ours again.
+void
+networkConnection::takeBack()
+{
+    if(!_handedOver) return;
+    _handedOver = false;
+    add2NtwConnList(this);
+    if(uid) localUsers.emplace(uid, _fd);
+    return;
+}
+
 void 
-networkConnection::registerSvc(std::string svc)
+networkConnection::registerSvc(int svc)
 {
-    _svcList.push_back(svc);
+    _svcMask |= (1ull << svc);
     return;
 }
 
@@ -1175,77 +2191,70 @@ startServiceAccept(boost::asio::io_service *iosvc,
     return;
 }
 
-static void
-startPeerConnAccept(boost::asio::io_service *iosvc,
-                   boost::asio::ip::tcp::acceptor *_acceptor)
-{
-    //XXX: this is a little confusing here how boost asio returns the new 'connected' socket.
-    //we are preallocating a new socket here to hold the connected socket. This new socket 
-    //will be a dummy one and becomes valid only when the accept handler (handlePeerAccept) is 
-    //invoked.
-    if(!gPeerAcceptSocket) gPeerAcceptSocket = \
-     new boost::asio::ip::tcp::socket(*iosvc);
-    _acceptor->async_accept(*gPeerAcceptSocket,
-                            boost::bind(handlePeerAccept,
-                                        iosvc,
-                                        _acceptor,
-                                        boost::asio::placeholders::error));
-    return;
-}
-
-static void
-handlePeerAccept(boost::asio::io_service *iosvc,
-                    boost::asio::ip::tcp::acceptor *_acceptor,
-                    const boost::system::error_code &error)
-{
-    _info<<"New peer connection from :";
-    startPeerConnAccept(iosvc, _acceptor);
-    return;
-}
-
 static void
 handleServiceAccept(boost::asio::io_service *iosvc,
                     boost::asio::local::stream_protocol::acceptor *_acceptor,
                     const boost::system::error_code &error)
 {
+    if(error == boost::asio::error::operation_aborted) return; //the endpoint was handed over.
     //do a synchronous read and then read the service name from the 
     //connection.
     char sbuf[32] = {'\0'};
     _info<<"native handle of the connection: "<<
         serviceConnection::_gSvcAcceptSocket->native_handle();
-    size_t rc = serviceConnection::_gSvcAcceptSocket->read_some(
-            boost::asio::buffer(sbuf, 
-                32));
-    std::string sname(sbuf, rc);
-    _info<<"New service connection from service:"<<sname;
-    //if the service is not present in the list then create a new one and 
-    //mark it initialized.
-    bool _new = false;
-    serviceConnection *sobj = getServiceConnObj(sname), *old = nullptr;
-    if (sobj){
-        //send a error message on control channel to the service and close the
-        //connection.
-        _error<<"Stale service handle already present for the service, \
+    //a service using the shared memory rings passes the segment and the 
+    //doorbells along with the tag.
+    int ringFds[3] = {-1, -1, -1};
+    char cbuf[CMSG_SPACE(sizeof(ringFds))];
+    struct iovec iov = {sbuf, sizeof(sbuf)};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    ssize_t rc = _eintr(::recvmsg(serviceConnection::_gSvcAcceptSocket->native_handle(), &mh, 0));
+    if(rc <= 0){
+        _error<<"service connection closed before it told its name.";
+        delete serviceConnection::_gSvcAcceptSocket;
+        serviceConnection::_gSvcAcceptSocket = nullptr;
+        startServiceAccept(iosvc, _acceptor);
+        return;
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    bool ring = cm && (cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_RIGHTS) &&
+        (cm->cmsg_len == CMSG_LEN(sizeof(ringFds)));
+    if(ring) memcpy(ringFds, CMSG_DATA(cm), sizeof(ringFds));
+    //instances register as <name>.<pid>, a tag without the pid is the only 
+    //instance of the service.
+    std::string tag(sbuf, rc);
+    std::string sname = tag.substr(0, tag.find('.'));
+    _info<<"New service connection from service:"<<sname<<" instance:"<<tag;
+    servicePool *pool = getServicePool(internSvcName(sname));
+    serviceConnection *old = pool->findByTag(tag);
+    if (old){
+        _error<<"Stale service handle already present for the instance, \
             reinitializing the service handle.";
-        old = sobj;
-        sobj = nullptr;
-    }
-    if(!sobj){
-        _new = true;
-        sobj = new serviceConnection(iosvc, sname, -1);
-        //copy the client list from the old service object to the new object.
-        if (old){
-            sobj->clientList.insert(old->clientList.begin(), old->clientList.end());
-            delete old;
-        }
+        pool->remove(old);
+        delete old;
     }
-    sobj->setMqFd(serviceConnection::openSvcMessageQueue(sname));
+    bool first = !pool->isUp();
+    serviceConnection *sobj = new serviceConnection(iosvc, sname, tag, -1);
+    sobj->setMqFd(serviceConnection::openSvcMessageQueue(tag));
     sobj->setSocket(serviceConnection::_gSvcAcceptSocket);
+    if(ring && !sobj->attachRing(ringFds[0], ringFds[1], ringFds[2])){
+        //the service writes nothing but the rings, it has to come back without them.
+        _error<<"refusing service instance: "<<tag<<" whose rings cannot be used.";
+        delete sobj;
+        startServiceAccept(iosvc, _acceptor);
+        return;
+    }
     sobj->markUp();
-    sobj->informSvcStatus2AllClients("up");
-    //relay a series of clientArrival for all the existing channels and connections. 
-    //already in the service connection object.
-    if(!_new) sobj->relayClientAndChannel2Service();
+    pool->add(sobj);
+    if(first) sobj->informSvcStatus2AllClients("up");
+    //the instance gets all the clients of the service, whichever instance 
+    //they were talking to.
+    sobj->relayClientAndChannel2Service();
     sobj->readAsync();
     startServiceAccept(iosvc, _acceptor);
     return;
@@ -1254,6 +2263,12 @@ handleServiceAccept(boost::asio::io_service *iosvc,
 static void
 handleMqRead(boost::system::error_code ec)
 {
+    if(ec == boost::asio::error::operation_aborted) return; //handed over.
+    if((handoffPhase == HANDOFF_PAUSING) || (handoffPhase == HANDOFF_SENDING)){
+        //logins and departures of the clients being handed over are for the new gateway.
+        handoffMqHeld = true;
+        return;
+    }
     _info<<"control message from service.";
     service::controlMessage cmsg;
     networkConnection *nobj = nullptr;
@@ -1269,10 +2284,41 @@ handleMqRead(boost::system::error_code ec)
             _info<<"recvd disconnect message from service for client:"<<
                 cmsg.clientDisconnect.clientid;
             nobj = getNetworkConnObj(cmsg.clientDisconnect.clientid);
-            assert(nobj);
+            if(!nobj) break; //gone already, or kept by the gateway before a handoff.
             nobj->informClientStatus2AllServices(false);
             delete nobj;
             break;
+        case service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_RESYNC_REQUEST:
+            {
+                std::string tag(cmsg.sender, svcNameLen(cmsg.sender));
+                std::string sname = tag.substr(0, tag.find('.'));
+                servicePool *pool = getServicePool(lookupSvcId(sname.data(), sname.length()));
+                serviceConnection *sc = pool ? pool->findByTag(tag) : nullptr;
+                _info<<"resync requested by service instance: "<<tag;
+                if(sc) sc->relayClientAndChannel2Service();
+            }
+            break;
+        case service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_LOGIN:
+            _info<<"user: "<<cmsg.userSession.uid<<" logged in on client: "<<cmsg.userSession.clientid;
+            userLoggedIn(cmsg.userSession.uid, cmsg.userSession.clientid);
+            break;
+        case service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_LOGOUT:
+            _info<<"user: "<<cmsg.userSession.uid<<" logged out";
+            userLoggedOut(cmsg.userSession.uid);
+            break;
+        case service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_SERVICE_NOTE:
+            {
+                size_t len = svcNameLen(cmsg.serviceNote.service);
+                servicePool *pool = getServicePool(lookupSvcId(cmsg.serviceNote.service, len));
+                if(!pool){
+                    _error<<"note for unknown service: "<<std::string(cmsg.serviceNote.service, len);
+                    break;
+                }
+                for(serviceConnection *sc : pool->instances())
+                    if(sc->isUp() && !sc->passNote(cmsg))
+                        _error<<"control queue of service: "<<sc->getTag()<<" is full, note dropped.";
+            }
+            break;
         default:
             _error<<"unknown message type from the service.";
             break;
@@ -1290,6 +2336,7 @@ newPeerArrival(const boost::system::error_code& error,
     if (!error)
     {
         _info<<"new peer arrived";
+        if(cluster) cluster->handleAnnouncement(reinterpret_cast<char*>(recvBuf), bytes_recvd);
         multicast_socket.async_receive_from(
                 boost::asio::buffer(recvBuf, sizeof(recvBuf)), 
                 multicast_sender_endpoint,
@@ -1300,6 +2347,25 @@ newPeerArrival(const boost::system::error_code& error,
     return;
 }
 
+//tell the gateways listening on the multicast group that we are here and 
+//redial the known ones we lost the link to.
+static void
+announceToPeers(const boost::system::error_code &error)
+{
+    if(error) return;
+    boost::system::error_code ec;
+    std::string hello = cluster->announcement();
+    multicast_socket.send_to(boost::asio::buffer(hello), 
+            boost::asio::ip::udp::endpoint(
+                boost::asio::ip::address::from_string(peer_multicast_address), 
+                peer_multicast_port), 0, ec);
+    if(ec) _error<<"unable to announce on the multicast channel: "<<ec.message();
+    cluster->maintain();
+    announceTimer->expires_from_now(boost::posix_time::seconds(cluster_announce_interval));
+    announceTimer->async_wait(&announceToPeers);
+    return;
+}
+
 //invoked when normal http requests arrive on the port.
 //these are forwarded to the http server as is and the response from the http server is 
 //sent back to the client.
@@ -1376,6 +2442,21 @@ readConfig()
     ssl_certificate = getConfigValue<std::string>("ngw.server_certificate");
     ssl_certificate_key = getConfigValue<std::string>("ngw.server_certificate_key");
     stun_server = getConfigValue<std::string>("rtc.stun_server");
+    relay_policy = getConfigValue<std::string>("ngw.relay_policy", relay_policy);
+    relayPolicy = getRelayPolicy(relay_policy);
+    cluster_enabled = getConfigValue<bool>("ngw.cluster", cluster_enabled);
+    cluster_address = getConfigValue<std::string>("ngw.cluster_address", interface_address);
+    cluster_peers = getConfigValue<std::string>("ngw.cluster_peers", cluster_peers);
+    cluster_secret = getConfigValue<std::string>("ngw.cluster_secret", cluster_secret);
+    cluster_announce_interval = getConfigValue<int>("ngw.cluster_announce_interval", cluster_announce_interval);
+    admission_enabled = getConfigValue<bool>("ngw.admission", admission_enabled);
+    admission_user_rate = getConfigValue<double>("ngw.admission.user_rate", admission_user_rate);
+    admission_user_burst = getConfigValue<double>("ngw.admission.user_burst", admission_user_burst);
+    admission_max_inflight = getConfigValue<int>("ngw.admission.max_inflight", admission_max_inflight);
+    admission_report_interval = getConfigValue<int>("ngw.admission.report_interval", admission_report_interval);
+    admission_inflight_timeout = getConfigValue<int>("ngw.admission.inflight_timeout", admission_inflight_timeout);
+    handoff_drain = getConfigValue<int>("ngw.handoff_drain", handoff_drain);
+    runtime_dir = getConfigValue<std::string>("ngw.runtime_dir", runtime_dir);
     return;
 }
 
@@ -1391,6 +2472,17 @@ dumpConfig()
     _trace<<"peer_connection_port: "<<peer_connection_port;
     _trace<<"server ssl certificate: "<<ssl_certificate;
     _trace<<"server ssl certificate key: "<<ssl_certificate_key;
+    _trace<<"relay policy: "<<relay_policy;
+    _trace<<"cluster: "<<cluster_enabled;
+    _trace<<"cluster_address: "<<cluster_address;
+    _trace<<"cluster_peers: "<<cluster_peers;
+    _trace<<"cluster_secret: "<<(cluster_secret.empty() ? "not set" : "set");
+    _trace<<"cluster_announce_interval: "<<cluster_announce_interval;
+    _trace<<"admission: "<<admission_enabled<<" user_rate: "<<admission_user_rate
+        <<" user_burst: "<<admission_user_burst<<" max_inflight: "<<admission_max_inflight
+        <<" inflight_timeout: "<<admission_inflight_timeout;
+    _trace<<"handoff_drain: "<<handoff_drain;
+    _trace<<"runtime_dir: "<<runtime_dir;
     return;
 }
 
@@ -1401,16 +2493,21 @@ get_password()
     return "";
 }
 
+//one context for all the connections, the certificate is loaded once. the 
+//buffers of openssl are given back while a connection is idle.
 static context_ptr 
 negotiate_tls(websocketpp::connection_hdl hdl)
 {
-    _info<< "negotiate_tls() called with hdl: " << hdl.lock().get();
-    context_ptr ctx(new boost::asio::ssl::context(boost::asio::ssl::context::tlsv1));
+    static context_ptr ctx;
+    if(ctx) return ctx;
+    _info<< "negotiate_tls() creating the tls context with hdl: " << hdl.lock().get();
+    ctx.reset(new boost::asio::ssl::context(boost::asio::ssl::context::tlsv1));
     try 
     {
         ctx->set_options(boost::asio::ssl::context::default_workarounds |
                 //boost::asio::ssl::context::no_sslv2 |
                 boost::asio::ssl::context::single_dh_use);
+        SSL_CTX_set_mode(ctx->native_handle(), SSL_MODE_RELEASE_BUFFERS);
         ctx->set_password_callback(bind(&get_password));
         ctx->use_certificate_chain_file(ssl_certificate);
         ctx->use_private_key_file(ssl_certificate_key, boost::asio::ssl::\
@@ -1473,15 +2570,557 @@ handleSignal(boost::system::error_code error)
     return;
 }
 
+//close the clients over the drain period so that they do not all reconnect 
+//to the new gateway at once, a client that sends meanwhile is closed at once.
+static void
+drainClients(const boost::system::error_code &error)
+{
+    if(error) return;
+    bool late = boost::posix_time::microsec_clock::universal_time() > handoffDeadline;
+    if(ntwConnList.empty() || late){
+        _info<<"drained, "<<ntwConnList.size()<<" clients left, exiting.";
+        exit(0);
+    }
+    boost::posix_time::ptime drainEnd = handoffDeadline - 
+        boost::posix_time::seconds(HANDOFF_DRAIN_GRACE);
+    long ticks = (drainEnd - boost::posix_time::microsec_clock::universal_time()).total_milliseconds() / 100;
+    size_t batch = (ticks > 1) ? ((ntwConnList.size() + ticks - 1) / ticks) : ntwConnList.size();
+    for(auto itr = ntwConnList.begin(); batch && (itr != ntwConnList.end()); itr++){
+        websocketpp::lib::error_code ec;
+        server::connection_ptr cptr = gw->get_con_from_hdl(itr->getConnHdl(), ec);
+        if(ec || (cptr->get_state() != websocketpp::session::state::open)) continue;
+        cptr->close(websocketpp::close::status::service_restart, "gateway restarting", ec);
+        batch--;
+    }
+    handoffTimer->expires_from_now(boost::posix_time::milliseconds(100));
+    handoffTimer->async_wait(&drainClients);
+    return;
+}
+
+static void startHandoffAccept();
+
+//the new gateway went away before it took over, we carry on.
+static void
+abortHandoff(const std::string &why)
+{
+    _error<<"handoff aborted, "<<why;
+    for(auto &sconn : svcConnList) sconn.abortHandoff();
+    for(auto &c : handoffClients){
+        c.second->takeBack();
+        c.first->resume_after_handoff();
+    }
+    for(auto &c : handoffPausing) c.second->resume_after_handoff();
+    boost::system::error_code ec;
+    handoffPeer->close(ec);
+    handoffTimer->cancel(ec);
+    delete handoffOut;
+    handoffOut = nullptr;
+    handoffHanded.clear();
+    handoffClients.clear();
+    handoffPausing.clear();
+    handoffPhase = HANDOFF_IDLE;
+    if(handoffMqHeld){
+        handoffMqHeld = false;
+        gwMqFd->async_read_some(boost::asio::null_buffers(),
+                boost::bind(&handleMqRead,
+                    boost::asio::placeholders::error));
+    }
+    startHandoffAccept();
+    return;
+}
+
+//the new gateway has the listeners and the connections, let go of them and
+//of whatever it binds again, the word that we did goes last.
+static void
+releaseHandoff()
+{
+    boost::system::error_code ec;
+    websocketpp::lib::error_code wec;
+    gw->stop_listening(wec);
+    svcAcceptor->close(ec);
+    handoffAcceptor->close(ec);
+    for(auto sconn : handoffHanded){
+        sconn->getPool()->remove(sconn);
+        sconn->markDown();
+        gIoSvc.post([sconn](){ delete sconn; });
+    }
+    for(auto &c : handoffClients){
+        //the new gateway holds the socket, only our descriptor of it goes.
+        c.first->get_raw_socket().close(ec);
+        delete c.second;
+    }
+    gwMqFd->close(ec);
+    if(cluster){
+        //the peer port is bound again by the new gateway.
+        delete cluster;
+        cluster = nullptr;
+        announceTimer->cancel(ec);
+        multicast_socket.close(ec);
+    }
+    _info<<"handed over "<<handoffHanded.size()<<" service connections and "<<handoffClients.size()
+        <<" clients, closing "<<ntwConnList.size()<<" clients over "<<handoff_drain
+        <<" seconds to reconnect to the new gateway.";
+    handoffHanded.clear();
+    handoffClients.clear();
+    handoffOut->queue(HANDOFF_DONE, std::string(), nullptr, 0);
+    handoffPhase = HANDOFF_DRAINING;
+    handoffDeadline = boost::posix_time::microsec_clock::universal_time() + 
+        boost::posix_time::seconds(handoff_drain + HANDOFF_DRAIN_GRACE);
+    return;
+}
+
+//the records go out as the socket takes them, the loop carries on serving the
+//clients meanwhile. a new gateway that does not take them in time is given up
+//on, after the release nothing is left to go back to and only the word is lost.
+static void
+writeHandoff(const boost::system::error_code &error)
+{
+    if((error == boost::asio::error::operation_aborted) || !handoffOut) return;
+    bool sent = false;
+    std::string why;
+    try{
+        if(!error) sent = handoffOut->flush(handoffPeer->native_handle());
+        else why = error.message();
+    }catch(std::exception &e){
+        why = e.what();
+    }
+    if(!why.empty() && (handoffPhase == HANDOFF_SENDING)){
+        abortHandoff(why);
+        return;
+    }
+    if(sent && (handoffPhase == HANDOFF_SENDING)){
+        releaseHandoff();
+        writeHandoff(boost::system::error_code());
+        return;
+    }
+    if(sent || !why.empty()){
+        //nothing is listening any more, the new gateway has all it needs but the word.
+        if(!why.empty()) _error<<"unable to complete the handoff: "<<why;
+        boost::system::error_code ec;
+        handoffPeer->close(ec);
+        delete handoffOut;
+        handoffOut = nullptr;
+        drainClients(boost::system::error_code());
+        return;
+    }
+    handoffPeer->async_write_some(boost::asio::null_buffers(), &writeHandoff);
+    return;
+}
+
+static void
+handoffSendExpired(const boost::system::error_code &error)
+{
+    if(error || !handoffOut) return;
+    writeHandoff(boost::asio::error::timed_out);
+    return;
+}
+
+//the client of the pausing list if it is still the one on its descriptor.
+static networkConnection*
+pausingClient(int clientid, server::connection_ptr &cptr)
+{
+    networkConnection *nconn = getNetworkConnObj(clientid);
+    if(!nconn) return nullptr;
+    websocketpp::lib::error_code ec;
+    server::connection_ptr cur = gw->get_con_from_hdl(nconn->getConnHdl(), ec);
+    return (!ec && (cur == cptr)) ? nconn : nullptr;
+}
+
+//a client that stopped at a message boundary with nothing left to send goes
+//with its socket, the opening request and what we know of it.
+static std::string
+clientState(networkConnection *nconn, server::connection_ptr &cptr)
+{
+    handoffClient c;
+    c.clientid = nconn->getConnId();
+    c.uid = nconn->uid;
+    c.ipAddress = nconn->_ipAddress;
+    c.request = cptr->get_handoff_request();
+    nconn->forEachSvc([&c](int id){ c.svcs.push_back(svcNames[id]); });
+    return packHandoffClient(c);
+}
+
+//every service connection is at a frame boundary, queue the clients that
+//stopped, the listeners and the connections for the new gateway. the clients
+//that did not stop read again and are closed after the release.
+static void
+completeHandoff()
+{
+    handoffOut = new handoffWriter();
+    handoffHanded.clear();
+    handoffClients.clear();
+    try{
+        for(auto &c : handoffPausing){
+            networkConnection *nconn = pausingClient(c.first, c.second);
+            if(!nconn) continue;
+            if(!nconn->idle() || !c.second->ready_for_handoff()){
+                c.second->resume_after_handoff();
+                continue;
+            }
+            int fd = nconn->getConnId();
+            handoffOut->queue(HANDOFF_CLIENT, clientState(nconn, c.second), &fd, 1);
+            nconn->handOver();
+            handoffClients.push_back(std::make_pair(c.second, nconn));
+        }
+        handoffPausing.clear();
+        int listeners[2] = {gw->get_listen_handle(), svcAcceptor->native_handle()};
+        handoffOut->queue(HANDOFF_LISTENERS, std::string(), listeners, 2);
+        for(auto &sconn : svcConnList){
+            if(!sconn.isUp()) continue; //on its way out.
+            std::vector<int> fds;
+            std::string state = sconn.handoffState(fds);
+            handoffOut->queue(HANDOFF_SERVICE, state, fds.data(), fds.size());
+            handoffHanded.push_back(&sconn);
+        }
+    }catch(std::exception &e){
+        abortHandoff(e.what());
+        return;
+    }
+    handoffPhase = HANDOFF_SENDING;
+    //covers the word after the release too, the drain takes the timer over.
+    handoffTimer->expires_from_now(boost::posix_time::milliseconds(HANDOFF_SEND_TIMEOUT));
+    handoffTimer->async_wait(&handoffSendExpired);
+    writeHandoff(boost::system::error_code());
+    return;
+}
+
+//the clients stop reading at a message boundary and send what they have 
+//queued, those that do not get there in time stay with us.
+static void
+pauseClients(const boost::system::error_code &error)
+{
+    if(error) return;
+    bool paused = true;
+    for(auto itr = handoffPausing.begin(); itr != handoffPausing.end();){
+        networkConnection *nconn = pausingClient(itr->first, itr->second);
+        if(!nconn){
+            itr = handoffPausing.erase(itr); //closed meanwhile.
+            continue;
+        }
+        itr->second->pause_for_handoff();
+        if(!nconn->idle() || !itr->second->ready_for_handoff()) paused = false;
+        itr++;
+    }
+    if(paused || (boost::posix_time::microsec_clock::universal_time() > handoffDeadline)){
+        completeHandoff();
+        return;
+    }
+    handoffTimer->expires_from_now(boost::posix_time::milliseconds(10));
+    handoffTimer->async_wait(&pauseClients);
+    return;
+}
+
+static void
+quiesceServices(const boost::system::error_code &error)
+{
+    if(error) return;
+    bool quiet = true;
+    for(auto &sconn : svcConnList)
+        if(sconn.isUp() && !sconn.quiesce()) quiet = false;
+    if(quiet){
+        handoffPhase = HANDOFF_PAUSING;
+        handoffDeadline = boost::posix_time::microsec_clock::universal_time() + 
+            boost::posix_time::milliseconds(HANDOFF_PAUSE_TIMEOUT);
+#ifndef AKORP_SSL_CAPABLE
+        //a tls session can not be picked up from its socket, those clients stay.
+        for(auto &nconn : ntwConnList){
+            websocketpp::lib::error_code ec;
+            server::connection_ptr cptr = gw->get_con_from_hdl(nconn.getConnHdl(), ec);
+            if(ec || (cptr->get_state() != websocketpp::session::state::open)) continue;
+            handoffPausing[nconn.getConnId()] = cptr;
+        }
+#endif
+        pauseClients(boost::system::error_code());
+        return;
+    }
+    if(boost::posix_time::microsec_clock::universal_time() > handoffDeadline){
+        abortHandoff("the services did not come to a frame boundary in time.");
+        return;
+    }
+    handoffTimer->expires_from_now(boost::posix_time::milliseconds(10));
+    handoffTimer->async_wait(&quiesceServices);
+    return;
+}
+
+//the endpoint lives in a directory only our user can enter, a directory that
+//is not ours or is open to others is not used and there is no handoff.
+static std::string
+handoffEndpoint()
+{
+    if(!privateDir(runtime_dir)){
+        _error<<"runtime directory: "<<runtime_dir<<" is not a directory private to us, no handoff.";
+        return std::string();
+    }
+    std::string path = runtime_dir + "/" + AKORP_NGW_HANDOFF_ENDPOINT;
+    if(path.length() >= sizeof(((struct sockaddr_un*)0)->sun_path)){
+        _error<<"handoff endpoint: "<<path<<" is too long, no handoff.";
+        return std::string();
+    }
+    return path;
+}
+
+//the other end runs as our user or it gets nothing.
+static bool
+peerIsUs(int sock)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if(::getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0){
+        _error<<"unable to get the credentials of the handoff peer: "<<strerror(errno);
+        return false;
+    }
+    if(cred.uid != ::geteuid()){
+        _error<<"handoff peer pid: "<<cred.pid<<" runs as uid: "<<cred.uid<<", not as us.";
+        return false;
+    }
+    return true;
+}
+
+static void
+handleHandoffAccept(const boost::system::error_code &error)
+{
+    if(error == boost::asio::error::operation_aborted) return;
+    if(error){
+        _error<<"handoff accept failed: "<<error.message();
+        startHandoffAccept();
+        return;
+    }
+    if(!peerIsUs(handoffPeer->native_handle())){
+        startHandoffAccept();
+        return;
+    }
+    _info<<"a new gateway is taking over, stopping the service connections.";
+    handoffPhase = HANDOFF_QUIESCING;
+    handoffDeadline = boost::posix_time::microsec_clock::universal_time() + 
+        boost::posix_time::milliseconds(HANDOFF_QUIESCE_TIMEOUT);
+    quiesceServices(boost::system::error_code());
+    return;
+}
+
+static void
+startHandoffAccept()
+{
+    if(!handoffTimer) handoffTimer = new boost::asio::deadline_timer(gIoSvc);
+    if(!handoffAcceptor){
+        std::string path = handoffEndpoint();
+        if(path.empty()) return;
+        ::unlink(path.c_str());
+        boost::asio::local::stream_protocol::endpoint ep(path);
+        handoffAcceptor = new boost::asio::local::stream_protocol::acceptor(gIoSvc, ep);
+    }
+    delete handoffPeer;
+    handoffPeer = new boost::asio::local::stream_protocol::socket(gIoSvc);
+    handoffAcceptor->async_accept(*handoffPeer, &handleHandoffAccept);
+    return;
+}
+
+//a client handed over, false if the record is not usable.
+static bool
+inheritClient(handoffRecord &rec, inheritedClient &c)
+{
+    if(!unpackHandoffClient(rec, c)) return false;
+    for(auto &name : c.svcs) c.svcIds.push_back(internSvcName(name));
+    return true;
+}
+
+//connect to the running gateway and take its listeners, service connections
+//and clients, false if there is none. once the old gateway sent its first 
+//record it no longer listens, failing after that leaves us no way to boot.
+static bool
+receiveHandoff()
+{
+    std::string path = handoffEndpoint();
+    if(path.empty()) return false;
+    int sock = _except(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    SCOPE_EXIT{ _eintr(::close(sock)); };
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if(_eintr(::connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))) < 0){
+        _info<<"no running gateway to take the services from, booting afresh.";
+        return false;
+    }
+    if(!peerIsUs(sock)) return false;
+    bool done = false;
+    std::vector<int> received;
+    try{
+        handoffRecord rec;
+        while(!done && recvHandoffRecord(sock, rec)){
+            received.insert(received.end(), rec.fds.begin(), rec.fds.end());
+            if((rec.type == HANDOFF_LISTENERS) && (rec.fds.size() == 2)){
+                inheritedClientFd = rec.fds[0];
+                inheritedSvcFd = rec.fds[1];
+            }else if((rec.type == HANDOFF_CLIENT) && (rec.fds.size() == 1)){
+                inheritedClient c;
+                if(inheritClient(rec, c)) inheritedClients.push_back(c);
+                else{
+                    _error<<"unusable handoff record of client: "<<c.clientid;
+                    received.pop_back();
+                    _eintr(::close(c.fd));
+                }
+            }else if((rec.type == HANDOFF_SERVICE) && !rec.fds.empty())
+                inheritedServices.push_back(rec);
+            else if(rec.type == HANDOFF_DONE)
+                done = true;
+            else
+                _error<<"dropping handoff record of type: "<<rec.type;
+        }
+    }catch(std::exception &e){
+        _error<<"handoff failed: "<<e.what();
+    }
+    if(!done){
+        for(int fd : received) _eintr(::close(fd));
+        inheritedClientFd = inheritedSvcFd = -1;
+        inheritedServices.clear();
+        inheritedClients.clear();
+        //the old gateway carries on if it did not let go of anything.
+        if(received.empty()) return false;
+        throw std::runtime_error("the running gateway let go of its listeners but did not finish the handoff.");
+    }
+    //the sockets go on the descriptors the services know the clients by where 
+    //those are free here, none of the descriptors received may be in the way.
+    int floor = 0;
+    for(auto &c : inheritedClients) floor = std::max(floor, c.clientid + 1);
+    inheritedClientFd = liftHandoffFd(inheritedClientFd, floor);
+    inheritedSvcFd = liftHandoffFd(inheritedSvcFd, floor);
+    for(auto &rec : inheritedServices)
+        for(int &fd : rec.fds) fd = liftHandoffFd(fd, floor);
+    for(auto &c : inheritedClients) c.fd = liftHandoffFd(c.fd, floor);
+    for(auto &c : inheritedClients) placeHandoffClient(c);
+    _info<<"took over the listeners, "<<inheritedServices.size()<<" service connections and "
+        <<inheritedClients.size()<<" clients.";
+    return true;
+}
+
+//carry on with the service connections of the old gateway. the services are
+//told the clients handed over with their sockets, the other clients of the
+//old gateway are gone by the time they come to us.
+static void
+adoptServices()
+{
+    for(auto &c : inheritedClients){
+        if(c.fd != c.clientid) continue; //closed by adoptClients, left out of the resync.
+        for(int id : c.svcIds) getServicePool(id)->addClient(c.clientid);
+    }
+    for(auto &rec : inheritedServices){
+        size_t off = 0;
+        std::string sname, tag;
+        bool ring = (rec.fds.size() == 4);
+        bool ok = unpackBytes(rec.body, off, sname) && unpackBytes(rec.body, off, tag);
+        serviceConnection *sobj = nullptr;
+        if(ok){
+            sobj = new serviceConnection(&gIoSvc, sname, tag, -1);
+            sobj->setMqFd(serviceConnection::openSvcMessageQueue(tag));
+            sobj->getSocket().assign(boost::asio::local::stream_protocol(), rec.fds[0]);
+            ok = sobj->resumeState(rec.body, off);
+        }
+        if(!ok){
+            _error<<"unusable handoff record of service: "<<tag;
+            if(sobj) delete sobj;
+            else _eintr(::close(rec.fds[0]));
+            if(ring) for(size_t i = 1; i < rec.fds.size(); i++) _eintr(::close(rec.fds[i]));
+            continue;
+        }
+        if(ring && !sobj->attachRing(rec.fds[1], rec.fds[2], rec.fds[3])){
+            _error<<"dropping service instance: "<<tag<<" whose rings cannot be used.";
+            delete sobj;
+            continue;
+        }
+        servicePool *pool = sobj->getPool();
+        bool first = !pool->isUp();
+        sobj->markUp();
+        pool->add(sobj);
+        if(first) sobj->informSvcStatus2AllClients("up");
+        sobj->relayClientAndChannel2Service();
+        sobj->readAsync();
+        _info<<"adopted service instance: "<<tag;
+    }
+    inheritedServices.clear();
+    return;
+}
+
+//a client the services were told of that we do not carry on.
+static void
+forgetInheritedClient(const inheritedClient &c)
+{
+    if(c.fd != c.clientid) return; //never told.
+    for(int id : c.svcIds){
+        servicePool *pool = getServicePool(id);
+        pool->remClient(c.clientid);
+        for(serviceConnection *sc : pool->instances())
+            if(sc->isUp()) sc->queueClientStatus(c.clientid, false);
+    }
+    return;
+}
+
+//carry on with the websocket sessions of the old gateway on the sockets it
+//handed over, the open handler is not run again. a client whose socket could
+//not be put on the descriptor the services know it by, or whose session can
+//not be picked up, is closed with 1012 and reconnects.
+static void
+adoptClients()
+{
+    size_t adopted = 0;
+    for(auto &c : inheritedClients){
+        websocketpp::lib::error_code ec;
+        server::connection_ptr cptr = gw->get_connection();
+#ifdef AKORP_SSL_CAPABLE
+        ec = websocketpp::error::make_error_code(websocketpp::error::invalid_state); //no tls session to go on with.
+        _eintr(::close(c.fd));
+#else
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        boost::system::error_code bec;
+        if(::getsockname(c.fd, reinterpret_cast<struct sockaddr*>(&addr), &addrlen) < 0){
+            _eintr(::close(c.fd));
+            ec = websocketpp::error::make_error_code(websocketpp::error::bad_connection);
+        }else{
+            cptr->get_raw_socket().assign((addr.ss_family == AF_INET6) ? 
+                    boost::asio::ip::tcp::v6() : boost::asio::ip::tcp::v4(), c.fd, bec);
+            if(bec){
+                _eintr(::close(c.fd));
+                ec = websocketpp::error::make_error_code(websocketpp::error::bad_connection);
+            }else 
+                ec = cptr->adopt(c.request);
+        }
+#endif
+        bool open = !ec && (cptr->get_state() == websocketpp::session::state::open);
+        if(open && (c.fd == c.clientid)){
+            networkConnection *nconn = new networkConnection(cptr->get_handle(), c.ipAddress);
+            for(int id : c.svcIds) nconn->registerSvc(id);
+            if(c.uid) userLoggedIn(c.uid, c.clientid);
+#ifdef LIMITED
+            currentConnectionCount++;
+#endif
+            adopted++;
+            continue;
+        }
+        _error<<"unable to carry on client: "<<c.clientid<<", it reconnects.";
+        forgetInheritedClient(c);
+        if(open) cptr->close(websocketpp::close::status::service_restart, "gateway restarting", ec);
+    }
+    if(!inheritedClients.empty())
+        _info<<"carrying on "<<adopted<<" of the "<<inheritedClients.size()<<" clients handed over.";
+    inheritedClients.clear();
+    return;
+}
+
 int
 main(int argc, char* argv[])
 {
+    //started with --service-handoff the gateway takes the listeners, the
+    //service connections and the plain websocket clients of the running one.
+    bool serviceHandoff = (argc > 1) && !strcmp(argv[1], "--service-handoff");
     try{
         _except(daemon(0, 1)); //daemonize ourselves and detach from the controlling terminal.
 
         //load the configuration file in to the memory.
         loadConfig("/etc/antkorp/antkorp.cfg");
         readConfig();
+        if(admission_enabled) admission = new admissionControl(admission_user_rate, 
+                admission_user_burst, admission_max_inflight);
+        internValidServices();
 
         //Open the log file.
         openLog(log_file);
@@ -1513,6 +3152,12 @@ main(int argc, char* argv[])
         //set the core file limit as unlimited. 
         struct rlimit lim = {RLIM_INFINITY, RLIM_INFINITY};
         _except(::setrlimit(RLIMIT_CORE, &lim));
+        //a descriptor per client connection, take all we are allowed.
+        _except(::getrlimit(RLIMIT_NOFILE, &lim));
+        lim.rlim_cur = lim.rlim_max;
+        if(::setrlimit(RLIMIT_NOFILE, &lim) < 0)
+            _error<<"unable to raise the descriptor limit: "<<strerror(errno);
+        _info<<"descriptor limit: "<<lim.rlim_cur;
 #ifdef AKORP_SSL_CAPABLE
         _info<< "Starting gateway server on: " << gw_port<< std::endl;
 #else
@@ -1528,12 +3173,16 @@ main(int argc, char* argv[])
                 boost::bind(&handleSignal,
                     boost::asio::placeholders::error));
 
+        if(serviceHandoff) receiveHandoff();
+
         std::string mqName = AKORP_GW_MQ_NAME;
-        struct mq_attr mattr = {0, 10, sizeof(service::controlMessage), 0};
+        //logins and logouts of every client come through it, sized like the
+        //control queues of the services. a queue left from an earlier run 
+        //keeps its size.
+        struct mq_attr mattr = {0, service::controlQueueDepth(), sizeof(service::controlMessage), 0};
         //open the network gateway message queue and add it to the boost ioservice.
         int mqfd = _except(::mq_open(mqName.c_str(), O_RDWR | O_CREAT | O_NONBLOCK,\
-                    0660, NULL));
-        //int mqfd = _except(::mq_open(mqName.c_str(), O_RDWR | O_CREAT | O_NONBLOCK, 0660, &mattr));
+                    0660, &mattr));
         assert(mqfd > 0);
         gwMqFd = new boost::asio::posix::stream_descriptor(gIoSvc);
         gwMqFd->assign(mqfd);
@@ -1542,58 +3191,67 @@ main(int argc, char* argv[])
                 boost::bind(&handleMqRead,
                     boost::asio::placeholders::error));
 
-        ::unlink(AKORP_SVC_ENDPOINT); //Remove previous binding.
-        //open up the unix domain service channel.     
-        boost::asio::local::stream_protocol::endpoint svcConnEndpoint(AKORP_SVC_ENDPOINT);
-        boost::asio::local::stream_protocol::acceptor svcConnAcceptor(gIoSvc, svcConnEndpoint);
-        startServiceAccept(&gIoSvc, &svcConnAcceptor);
-
-        //open the peer connection interface. This interface will be used for other peers to 
-        //connect with us.
-        _info<<"Trying to open the peer connection port, this will be used for \
-            accepting peer connections.";
-        boost::asio::ip::tcp::endpoint peerConnEndpoint(
-                boost::asio::ip::tcp::v4(), 
-                peer_connection_port);
-        boost::asio::ip::tcp::acceptor peerConnAcceptor(gIoSvc, 
-                peerConnEndpoint);
-        startPeerConnAccept(&gIoSvc, &peerConnAcceptor);
-        _info<<"Peer connection port opened successfully.";
-        //open up the multicast channel 
-        //new peers will announce themselves on this channel. 
-        //once we announce ourselves the other peers will connect to use via tcp.
-        //forming a star topology.
-        _info<<"Trying to open the multicast channel and join the group.";
-        boost::asio::ip::address_v4 multicast_address = \
-        boost::asio::ip::address_v4::from_string(peer_multicast_address); 
-        boost::asio::ip::udp::endpoint multicast_endpoint(\
-                boost::asio::ip::udp::v4(), 
-                peer_multicast_port);
-        multicast_socket.open(multicast_endpoint.protocol());
-        multicast_socket.set_option(boost::asio::ip::udp::socket::reuse_address(true));
-        multicast_socket.bind(multicast_endpoint);
-        multicast_socket.set_option(
-                boost::asio::ip::multicast::join_group(multicast_address));
-        multicast_socket.async_receive_from(
-                boost::asio::buffer(recvBuf, sizeof(recvBuf)), 
-                multicast_sender_endpoint,
-                boost::bind(&newPeerArrival, 
-                    boost::asio::placeholders::error, 
-                    boost::asio::placeholders::bytes_transferred));
-        _info<<"Opened the multicast channel and join the group successfully.";
-        _info<<"Announcing arrival to peers on multicast channel.";
-        //put some thing on the channel to tell we have arrived.
-        //mostly this will be ip address.
-        //do it 3 times in a loop with a 1 sec interval, this is just to ensure 
-        //that no packets are lost.
-#if 0
-        unsigned int announceCount = 3;
-        while(announceCount--){
-            multicast_socket.send(boost::asio::buffer(sendBuf, sizeof(sendBuf)));
-            sleep(1);
+        int svcFd = inheritedSvcFd;
+        if(svcFd < 0){
+            ::unlink(AKORP_SVC_ENDPOINT); //Remove previous binding.
+            //open up the unix domain service channel.     
+            boost::asio::local::stream_protocol::endpoint svcConnEndpoint(AKORP_SVC_ENDPOINT);
+            svcFd = handoffListener(AF_UNIX, svcConnEndpoint.data(), svcConnEndpoint.size());
+        }
+        svcAcceptor = new boost::asio::local::stream_protocol::acceptor(gIoSvc);
+        svcAcceptor->assign(boost::asio::local::stream_protocol(), svcFd);
+        startServiceAccept(&gIoSvc, svcAcceptor);
+        adoptServices();
+
+        if(cluster_enabled && cluster_secret.empty()){
+            _error<<"ngw.cluster is set without ngw.cluster_secret, running without the cluster.";
+            cluster_enabled = false;
+        }
+        if(cluster_enabled){
+            //open the peer connection interface. This interface will be used for other peers to 
+            //connect with us.
+            _info<<"Trying to open the peer connection port, this will be used for \
+                accepting peer connections.";
+            cluster = new gatewayCluster(gIoSvc, cluster_address, peer_connection_port, cluster_secret);
+            cluster->setUserDelivery([](int uid, const char *frame, size_t len){
+                    deliverToUser(uid, frame, len, false); });
+            cluster->setBroadcastDelivery(&deliverBroadcast);
+            _info<<"Peer connection port opened successfully, node id: "<<cluster->getId();
+            //peers on networks the multicast does not reach.
+            std::stringstream peers(cluster_peers);
+            std::string peer;
+            while(std::getline(peers, peer, ','))
+                if(!peer.empty()) cluster->addPeer(peer);
+            //open up the multicast channel 
+            //new peers will announce themselves on this channel. 
+            //every gateway dials the ones it hears of, forming a full mesh.
+            _info<<"Trying to open the multicast channel and join the group.";
+            boost::asio::ip::address_v4 multicast_address = \
+            boost::asio::ip::address_v4::from_string(peer_multicast_address); 
+            boost::asio::ip::udp::endpoint multicast_endpoint(\
+                    boost::asio::ip::udp::v4(), 
+                    peer_multicast_port);
+            multicast_socket.open(multicast_endpoint.protocol());
+            multicast_socket.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+            multicast_socket.bind(multicast_endpoint);
+            multicast_socket.set_option(
+                    boost::asio::ip::multicast::join_group(multicast_address));
+            multicast_socket.async_receive_from(
+                    boost::asio::buffer(recvBuf, sizeof(recvBuf)), 
+                    multicast_sender_endpoint,
+                    boost::bind(&newPeerArrival, 
+                        boost::asio::placeholders::error, 
+                        boost::asio::placeholders::bytes_transferred));
+            _info<<"Opened the multicast channel and join the group successfully.";
+            //announce now and then periodically, a lost datagram only delays the link.
+            announceTimer = new boost::asio::deadline_timer(gIoSvc);
+            announceToPeers(boost::system::error_code());
+        }
+        if(admission){
+            admissionTimer = new boost::asio::deadline_timer(gIoSvc);
+            admissionTimer->expires_from_now(boost::posix_time::seconds(admission_report_interval));
+            admissionTimer->async_wait(&admissionReport);
         }
-        _info<<"Total 3 Announcements were made with an interval of 1 sec.";
-#endif
         _info<<"Trying to open the main port to the world.";
         gw = new server();
         if ((debug_level == "debug") || (debug_level == "info"))
@@ -1644,11 +3302,21 @@ main(int argc, char* argv[])
                     websocketpp::lib::placeholders::_1
                     ));
 #endif
-        gw->listen(boost::asio::ip::tcp::endpoint(
-                    boost::asio::ip::address::from_string(
-                        interface_address), 
-                    gw_port));
+        int clientFd = inheritedClientFd;
+        if(clientFd < 0){
+            boost::asio::ip::tcp::endpoint gwEndpoint(
+                        boost::asio::ip::address::from_string(
+                            interface_address), 
+                        gw_port);
+            clientFd = handoffListener(gwEndpoint.protocol().family(), gwEndpoint.data(), gwEndpoint.size());
+        }
+        websocketpp::lib::error_code lec;
+        gw->listen_on_handle(clientFd, lec);
+        if(lec) throw std::runtime_error("unable to listen on the gateway port: " + lec.message());
+        adoptClients();
         gw->start_accept();
+        startHandoffAccept();
+        startMetricsEndpoint("ngw");
         _info<< "Gateway server booted succesfully. Maximum payload message is 256kb.";
         gw->run();
     }
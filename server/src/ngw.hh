@@ -14,6 +14,8 @@
 
 #include <string>
 #include <queue>
+#include <deque>
+#include <memory>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
@@ -24,15 +26,24 @@
 #include <mqueue.h>
 #include <cstring>
 #include "common.hh"
+#include "svcring.hh"
+#include "ctlstream.hh"
+#include "metrics.hh"
 #include <websocketpp/config/asio.hpp>
 #include <websocketpp/message_buffer/alloc.hpp>
 #include <websocketpp/server.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#define NGW_READ_BUFFER_SIZE (4096) //per connection read buffer of websocketpp, 16kb by default.
+//the read buffer of websocketpp lives in every connection, idle or not.
+template<typename base> struct leanConfig : public base
+{
+    static const size_t connection_read_buffer_size = NGW_READ_BUFFER_SIZE;
+};
 #ifdef AKORP_SSL_CAPABLE
-typedef websocketpp::server<websocketpp::config::asio_tls> server;
+typedef websocketpp::server<leanConfig<websocketpp::config::asio_tls>> server;
 #else
-typedef websocketpp::server<websocketpp::config::asio> server;
+typedef websocketpp::server<leanConfig<websocketpp::config::asio>> server;
 #endif
 
 typedef websocketpp::config::asio::message_type::ptr message_ptr;
@@ -42,6 +53,19 @@ typedef websocketpp::lib::shared_ptr<boost::asio::ssl::context> context_ptr;
 class serviceConnection;
 class networkConnection;
 
+//outbound lanes of a client connection, a service is put in a lane by the 
+//configuration (ngw.lane.<service>). the lanes share the connection by deficit
+//round robin, the quantum is the bytes a lane may send per round.
+enum
+{
+    LANE_INTERACTIVE = 0, //chat, presence, call signaling.
+    LANE_NORMAL = 1,
+    LANE_BULK = 2, //file transfer blocks, repaints.
+    LANE_COUNT = 3,
+};
+#define NGW_WS_LOW_WATER (64*1024) //bytes queued in the websocket before we hold back.
+class servicePool;
+
 class serviceConnection : 
     public boost::enable_shared_from_this<serviceConnection>,
     public boost::intrusive::set_base_hook<boost::intrusive::optimize_size<true>>
@@ -51,6 +75,10 @@ class serviceConnection :
                                //at the time of service registration only a new service connection is 
                                //allocated if there is no old object.
     std::string _name = ""; //name of the service.
+    int _id = 0; //interned id of the name, index of the service in the routing table.
+    std::string _tag = ""; //name the instance registered with, unique among the instances.
+    servicePool *_pool = nullptr; //instances of the service this one belongs to.
+    unsigned int _outstanding = 0; //client messages relayed to the instance not yet answered.
     boost::asio::local::stream_protocol::socket _socket;
     unsigned int _svcFrameLen = 0; //length of the service frame.
     unsigned int _svcFrameLenRecvd = 0; //length of the service frame recieved so far.
@@ -64,31 +92,66 @@ class serviceConnection :
     message_ptr _svcmsg = nullptr; //This is a response from service to an earlier reply from the client.
     con_msg_man_type::ptr _connMngr;
     unsigned int _totalSvcMsgLen = 0;
-    networkConnection *_nconn = nullptr;
+    int _clientid = -1; //addressee of the frame being read from the socket.
+    int _channelid = -1;
     unsigned int _totalSvcBytesSent = 0;
     bool _newSvcMsg = true;
     unsigned int _hbMissCount = 0;
     bool _health = false;
     char payloadLabel[2*sizeof(int)]; //label holding the client and channel id across function calls.
-    bool _isBroadcast = false; //if the out going message is a broadcast one.
+    typedef struct ringPending
+    {
+        int clientid;
+        int channelid;
+        message_ptr msg;
+    }ringPending;
+    void *_ringBase = nullptr; //rings shared with the service, null when it talks over the socket.
+    uint32_t _ringSize = 0;
+    svcRing _ringDown, _ringUp;
+    int _ringDownFd = -1; //doorbell of the service.
+    int _ringShmFd = -1; //kept to hand the segment over on a restart.
+    boost::asio::posix::stream_descriptor *_ringDoorbell = nullptr; //ours.
+    std::deque<ringPending> _ringBacklog; //client messages waiting for room in the down ring.
+    bool ringPut(int, int, message_ptr &);
+    void flushRingBacklog();
+    void armRingDoorbell();
+    controlStream _ctl; //client arrivals and departures for the control queue.
+    bool sendControl(void *, size_t);
+    bool _handoff = false; //going to another gateway, no more reads.
+    bool _handoffCancelled = false;
+    bool _readQuiet = false; //no read pending, the socket is at rest.
 
     public:
-    std::map<int, std::vector<int>> clientList; //list of clients and channels.
+    std::map<int, std::vector<int>> &clientList; //list of clients and channels, shared by the instances.
     //accepting socket in to which new service connectsion will be accepted.
     static boost::asio::local::stream_protocol::socket *_gSvcAcceptSocket;
 
-    serviceConnection(boost::asio::io_service *, std::string, int);
+    serviceConnection(boost::asio::io_service *, std::string, std::string, int);
     ~serviceConnection();
     void addToList();
     void readComplete(const boost::system::error_code&, size_t);
     void writeComplete(networkConnection *, const boost::system::error_code&, size_t);
     void readAsync(); //trigger an asynchronous read.
     void writeAsync(networkConnection *); //trigger an asynchronous write.
+    void dispatchSvcFrame(int, int, message_ptr);
+    bool attachRing(int, int, int); //segment, doorbell of the service, our doorbell.
+    bool hasRing();
+    void ringSend(networkConnection *, message_ptr);
+    void readRing(const boost::system::error_code&);
+    bool quiesce(); //true once the connection can be handed over, call till then.
+    void abortHandoff();
+    std::string handoffState(std::vector<int> &fds);
+    bool resumeState(const std::string &, size_t);
     static int openSvcMessageQueue(std::string);
     void setMqFd(int);
     int getMqFd(void);
     boost::asio::local::stream_protocol::socket& getSocket();
     std::string getName();
+    int getId();
+    std::string getTag();
+    servicePool* getPool();
+    unsigned int getOutstanding();
+    void requestSent();
     void nq(message_ptr);
     message_ptr dq();
     void setName(std::string);
@@ -108,59 +171,117 @@ class serviceConnection :
     bool isClientPresent(int clientid);
     bool isChannelPresent(int clientid, int channelid);
     void relayClientAndChannel2Service();
+    void queueClientStatus(int clientid, bool arrival);
+    void flushClientStatus();
+    bool hasControlWork();
+    bool passNote(service::controlMessage &cmsg) { return sendControl(&cmsg, sizeof(cmsg)); }
     void informSvcStatus2AllClients(std::string);
     std::map<int, std::vector<int>>& getClientList(); //list of clients and channels.
     size_t mqSize();
 };
 typedef boost::intrusive::set<serviceConnection, boost::intrusive::compare<std::greater<serviceConnection>>> svcConnListT;
 
+//the instances registered under one service name. the clients belong to the 
+//pool and every instance is told of all of them, so the clients of an 
+//instance that dies move to the others without the service noticing. a client
+//message goes to one live instance picked by the routing policy:
+//  hash  : consistent hashing of the client id, a client sticks to an instance 
+//          and only the clients of a dead instance move.
+//  least : the instance with the fewest unanswered messages, for stateless services.
+class servicePool
+{
+    public:
+    enum
+    {
+        ROUTE_HASH,
+        ROUTE_LEAST_OUTSTANDING,
+    };
+
+    private:
+    std::vector<serviceConnection*> _instances; //live instances.
+    std::map<uint32_t, serviceConnection*> _ring; //consistent hash ring of the live instances.
+    int _policy = ROUTE_HASH;
+    void rebuildRing();
+
+    public:
+    std::string name;
+    int lane = LANE_NORMAL; //outbound lane of the frames of the service.
+    bool answers = true; //answers every request of the clients, counted in flight only then.
+    metricCounter &requests; //client frames routed to the service.
+    metricCounter &frames; //service frames to the clients.
+    std::map<int, std::vector<int>> clientList; //list of clients and channels.
+    servicePool(std::string, int);
+    void add(serviceConnection *);
+    void remove(serviceConnection *);
+    serviceConnection* route(int clientid);
+    serviceConnection* findByTag(const std::string &);
+    std::vector<serviceConnection*>& instances();
+    bool isUp();
+    void addClient(int clientid);
+    void remClient(int clientid);
+};
+
+//the outbound lanes exist only while a connection has messages waiting, an
+//idle connection holds a null pointer.
+typedef struct outLanes
+{
+    std::queue<message_ptr> lanes[LANE_COUNT];
+    int deficit[LANE_COUNT] = {0, 0, 0};
+    int lane = LANE_INTERACTIVE; //lane being served.
+    bool credited = false; //the lane got its quantum for this round.
+    size_t queued = 0; //messages in all the lanes.
+}outLanes;
+
+//a request relayed to a service and not answered yet.
+typedef struct inflightRequest
+{
+    int svcid;
+    time_t sent; //monotonic seconds.
+}inflightRequest;
+
+//kept small, a gateway holds many mostly idle connections. what is needed 
+//only for logging is read from the websocketpp connection when logged.
 class networkConnection : public boost::intrusive::set_base_hook<boost::intrusive::optimize_size<true>>
 {
-    std::queue<message_ptr> _mq;
-    std::queue<message_ptr> _mq_bcast;
+    std::unique_ptr<outLanes> _out;
     websocketpp::connection_hdl _wsppconn;
     int _fd = -1;
     int _channelId = -1; //valid only when using demultiplexing extension.
-    std::string _apikey = ""; //valid api key.
-    std::vector<std::string> _svcList; //list of services negotiated by the connection.
-    int _channels[256]; //list of channels opened on this connection.
+    uint64_t _svcMask = 0; //bit per interned id of the services negotiated by the connection.
+    bool _pumping = false; //waiting for the websocket to drain.
+    std::unique_ptr<std::deque<inflightRequest>> _inflight; //oldest first, null when none.
+    bool _handedOver = false; //the socket went to a new gateway, nothing to tear down.
 
     public:
-    //Accounting garb. nothing significant.
-    std::string subProtocol = ""; //negotiated subprotocol
-    std::vector<std::string> requestedSubProtocols; //subprotocols negotiated on this connection.
+    int uid = 0; //user logged in on the connection, told by the auth service.
     std::string _ipAddress = ""; //public ip address of the client connection.
-    std::string _userAgent = ""; //useragent of the client connection.
-    uint64_t _connectTimestamp = 0;//time @ which the connection was opened.
     uint64_t _inputByteCount = 0; //input Byte count.
     uint64_t _outputByteCount = 0; //output Byte count.
-    bool _keepAliveEnabled = false; //are we xmitting websocket keep alives for this connection.
-    bool _compressionEnabled = false; //are we enabled per message compression on this connection.
-    std::string origin = ""; //origin of the websocket connection.
-    std::vector<std::string> extensions; //extensions negotiated by the connection.
-    std::string version = ""; //version of the websocket protocol client is running on.
-    bool flowControlEnabled = false; //enabled flow control on this connection.
-    bool xonXmitted = false; //xon sent.
-    bool xoffXmitted = false; //xoff sent.
-    std::string deviceType = "desktop";  //devicetype can be "mobile", "tablet", "desktop".
-    bool compressionEnabled = false; //compression enabled on the connection.
-    bool ipv6Conn = false; // is it an ipv6 connection.
-    double connectionBandwidth = 0; //bandwidth of the client connection. depending on the bandwidth 
-                                    //vary the compression ratio.
-    networkConnection(websocketpp::connection_hdl, std::string, std::string);
+    networkConnection(websocketpp::connection_hdl, std::string);
     ~networkConnection();
-    int getConnId();
+    int getConnId() const;
+    void requestSent(int svcid);
+    void requestAnswered(int svcid); //the oldest request to the service is answered.
+    void requestsLost(int svcid); //an instance of the service went down.
+    unsigned int inflight(int timeout); //requests not answered within timeout seconds are let go.
     websocketpp::connection_hdl getConnHdl();
-    void nq(message_ptr);
+    void nq(message_ptr, int lane = LANE_NORMAL);
     void nq_broadcast();
     void broadcast();
-    message_ptr dq();
     int getChannelId();
     void send();
-    void registerSvc(std::string);
-	bool operator < (const networkConnection &);
-	bool operator > (const networkConnection &);
-	bool operator == (const networkConnection &);
+    void pumped() { _pumping = false; }
+    bool idle() const { return !_out && !_pumping; } //nothing of ours left to send.
+    void handOver();
+    void takeBack();
+    void registerSvc(int);
+    template<typename fnT> void forEachSvc(fnT fn) const
+    {
+        for(uint64_t m = _svcMask; m; m &= (m - 1)) fn(__builtin_ctzll(m));
+    }
+	bool operator < (const networkConnection &) const;
+	bool operator > (const networkConnection &) const;
+	bool operator == (const networkConnection &) const;
     void informClientStatus2AllServices(bool);
 };
 typedef boost::intrusive::set<networkConnection, boost::intrusive::compare<std::greater<networkConnection>>> ntwConnListT;
@@ -16,11 +16,19 @@
 #include <boost/interprocess/containers/map.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
 #include <boost/interprocess/containers/string.hpp>
+#include <boost/interprocess/containers/deque.hpp>
 #include <functional>
 #include <utility>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <string.h>
 #include "akorpdefs.h"
 #include "ocache.hh"
 #include "log.hh"
+#include "metrics.hh"
 
 //Donot be fooled by the simple and small code in this file. much of the heavy 
 //duty is done inside the boost library.
@@ -29,6 +37,12 @@
 //XXX: for storing strings in the ocache use boost::interprocess::basic_string instead of std::string
 //FIXME: replace all mutexes with robust mutexes on linux 
 using namespace boost::interprocess;
+
+//time spent in the cache, the waits for its locks included.
+static metricHistogram &sessionLookupLatency = metrics().histogram("ocache_session_lookup_us");
+static metricHistogram &sessionUpdateLatency = metrics().histogram("ocache_session_update_us");
+static metricHistogram &counterLatency = metrics().histogram("ocache_counter_us");
+
 boost::interprocess::permissions perms(0660);
 static managed_shared_memory ocache(open_or_create, 
         AKORP_OBJECT_CACHE, 
@@ -356,6 +370,7 @@ sessionMapT* getSessionMapRef(void) { return sessionMap; }
 int
 getClientIdForUid(const int uid)
 {
+    metricTimer timer(sessionLookupLatency);
 	try 
 	{
         boost::interprocess::sharable_lock<boost::interprocess::named_upgradable_mutex> \
@@ -386,6 +401,7 @@ getClientIdForUid(const int uid)
 int
 getUidForClientId(const int clientId)
 {
+    metricTimer timer(sessionLookupLatency);
 	try 
 	{
         boost::interprocess::sharable_lock<boost::interprocess::named_upgradable_mutex> \
@@ -412,10 +428,39 @@ getUidForClientId(const int clientId)
 	return 0;
 }
 
+//get the gid the user logged in with, 0 if the user has no session.
+int
+getGidForUid(const int uid)
+{
+    metricTimer timer(sessionLookupLatency);
+	try 
+	{
+        boost::interprocess::sharable_lock<boost::interprocess::named_upgradable_mutex> \
+            lock(sessionMapMutex);
+        if (!sessionMap) createSessionMap();
+        assert(sessionMap);
+        sessionMapT::iterator itr = sessionMap->find(uid);
+        if (itr != sessionMap->end()) 
+            return ((*itr).second).first;
+    }
+    catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+	return 0;
+}
+
 //store a mapping in to the session map
 void
 putSession(const int uid, const int clientId, const int gid)
 {
+    metricTimer timer(sessionUpdateLatency);
 	try 
 	{
         boost::interprocess::scoped_lock<boost::interprocess::named_upgradable_mutex> \
@@ -443,6 +488,7 @@ putSession(const int uid, const int clientId, const int gid)
 void
 delSession(const int uid)
 {
+    metricTimer timer(sessionUpdateLatency);
 	try 
 	{
         boost::interprocess::scoped_lock<boost::interprocess::named_upgradable_mutex> \
@@ -480,6 +526,7 @@ delSession(const int uid)
 void
 delSessionByClientId(const int cid)
 {
+    metricTimer timer(sessionUpdateLatency);
 	try 
 	{
         boost::interprocess::scoped_lock<boost::interprocess::named_upgradable_mutex> \
@@ -657,6 +704,7 @@ delUidAndGidMapping(int uid, int gid)
 bool
 isGroupMember(int uid, int gid)
 {
+    metricTimer timer(sessionLookupLatency);
 	try 
 	{
         if(!membershipMap) createMembershipMap();
@@ -682,3 +730,587 @@ isGroupMember(int uid, int gid)
 	}
     return false;
 }
+
+//Counters live in a fixed open addressed table in the shared segment, the 
+//increments are lock free atomics so that concurrent replies from any of the 
+//services donot lose updates and hot counters are served without going to the 
+//database. the table lock is only taken to claim, release or evict a slot. the
+//owner of a counter writes it back to the database periodically, flushed tracks
+//the value last handed out for write back and flushing that the write back may
+//still be in progress (it is done when the owner asks for the next flush).
+//a reader pins the slot while it uses it, a slot is only released or reused 
+//with no pins, so an increment never lands on a slot that went to another key.
+//a slot being released may still come back as used, readers wait for the 
+//outcome rather than going to the database meanwhile.
+typedef enum
+{
+    COUNTER_SLOT_FREE = 0,
+    COUNTER_SLOT_USED,
+    COUNTER_SLOT_DELETED,
+    COUNTER_SLOT_RELEASING,
+}counterSlotState;
+
+typedef struct counterSlot
+{
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> pins;
+    std::atomic<uint32_t> flushing;
+    char key[OCACHE_COUNTER_KEY_LEN];
+    std::atomic<int64_t> value;
+    std::atomic<int64_t> flushed;
+    std::atomic<int64_t> touched; //last update, idle counters are evicted.
+}counterSlot;
+
+typedef struct counterTableT
+{
+    counterSlot slots[OCACHE_COUNTER_SLOTS];
+}counterTableT;
+
+static boost::interprocess::named_upgradable_mutex \
+counterTableMutex(boost::interprocess::open_or_create, OCACHE_COUNTER_TABLE_LOCK);
+static counterTableT *counterTable = nullptr;
+
+//fnv-1a, the slot of a key must be the same in all the processes.
+static uint32_t
+counterHash(const std::string &key)
+{
+    uint32_t hash = 2166136261u;
+    for(char c : key){ hash ^= static_cast<unsigned char>(c); hash *= 16777619u; }
+    return hash;
+}
+
+void
+createCounterTable(void)
+{
+	try 
+	{
+        counterTable = ocache.find_or_construct<counterTableT>(OCACHE_COUNTER_TABLE)();
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+    return;
+}
+
+//the pin of a reader on a slot, the slot is nullptr if the key is not cached.
+class counterPin
+{
+    public:
+    counterSlot *slot = nullptr;
+    counterPin(){}
+    counterPin(const counterPin&) = delete;
+    ~counterPin(){ if(slot) slot->pins.fetch_sub(1); }
+    void touch(){ slot->touched.store(time(nullptr), std::memory_order_relaxed); }
+};
+
+static void
+checkCounterKey(const std::string &key)
+{
+    if(key.empty() || (key.length() >= OCACHE_COUNTER_KEY_LEN))
+        throw std::invalid_argument("counter key must be 1 to 63 characters long");
+    if(!counterTable) createCounterTable();
+    return;
+}
+
+//the state of the slot once a release in progress is decided, the releaser
+//holds the table lock and only waits for the pins taken before it started.
+static uint32_t
+settledSlotState(counterSlot *slot)
+{
+    uint32_t state;
+    while((state = slot->state.load()) == COUNTER_SLOT_RELEASING) std::this_thread::yield();
+    return state;
+}
+
+//lock free lookup, pins the slot of the key if it is present. the state is 
+//checked again after the pin, a release or an eviction sets the state first 
+//and then waits for the pins. a pin that ran into a release tries the slot
+//again once the release is decided.
+static void
+pinCounterSlot(const std::string &key, counterPin &pin)
+{
+    checkCounterKey(key);
+    uint32_t idx = counterHash(key) % OCACHE_COUNTER_SLOTS;
+    for(uint32_t probe = 0; probe < OCACHE_COUNTER_SLOTS; probe++){
+        counterSlot *slot = &counterTable->slots[(idx + probe) % OCACHE_COUNTER_SLOTS];
+        while(true){
+            uint32_t state = settledSlotState(slot);
+            if(state == COUNTER_SLOT_FREE) return;
+            if((state != COUNTER_SLOT_USED) || (key != slot->key)) break;
+            slot->pins.fetch_add(1);
+            if((slot->state.load() == COUNTER_SLOT_USED) && (key == slot->key)){
+                pin.slot = slot;
+                return;
+            }
+            slot->pins.fetch_sub(1);
+        }
+    }
+    return;
+}
+
+//start taking the slot out of the table, with the table lock held. the caller
+//decides with the pins gone whether it goes (COUNTER_SLOT_DELETED) or stays
+//(COUNTER_SLOT_USED) and must store one of them before unlocking.
+static void
+releaseCounterSlot(counterSlot *slot)
+{
+    slot->state.store(COUNTER_SLOT_RELEASING);
+    while(slot->pins.load()) std::this_thread::yield();
+    return;
+}
+
+//claim a slot for the key with the initial value and pin it, if the key got
+//in meanwhile the existing slot is pinned. a released slot is only reused 
+//once the write back of its last flush is done.
+static void
+claimCounterSlot(const std::string &key, int64_t seed, counterPin &pin)
+{
+    boost::interprocess::scoped_lock<boost::interprocess::named_upgradable_mutex> \
+        lock(counterTableMutex);
+    pinCounterSlot(key, pin);
+    if(pin.slot) return;
+    uint32_t idx = counterHash(key) % OCACHE_COUNTER_SLOTS;
+    for(uint32_t probe = 0; probe < OCACHE_COUNTER_SLOTS; probe++){
+        counterSlot *slot = &counterTable->slots[(idx + probe) % OCACHE_COUNTER_SLOTS];
+        if(slot->state.load() == COUNTER_SLOT_USED) continue;
+        if(slot->pins.load() || slot->flushing.load()) continue;
+        memset(slot->key, 0, sizeof(slot->key));
+        memcpy(slot->key, key.c_str(), key.length());
+        slot->value.store(seed);
+        slot->flushed.store(seed);
+        slot->touched.store(time(nullptr));
+        slot->pins.fetch_add(1);
+        slot->state.store(COUNTER_SLOT_USED);
+        pin.slot = slot;
+        return;
+    }
+    throw std::runtime_error("counter table full");
+}
+
+//read the counter, returns false if the counter is not cached.
+bool
+getCounter(const std::string &key, int64_t &value)
+{
+    metricTimer timer(counterLatency);
+	try 
+	{
+        counterPin pin;
+        pinCounterSlot(key, pin);
+        if(!pin.slot) return false;
+        value = pin.slot->value.load();
+        return true;
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+}
+
+//increment the counter only if it is cached, value is the result.
+bool
+incrCounter(const std::string &key, int64_t delta, int64_t &value)
+{
+    metricTimer timer(counterLatency);
+	try 
+	{
+        counterPin pin;
+        pinCounterSlot(key, pin);
+        if(!pin.slot) return false;
+        value = pin.slot->value.fetch_add(delta) + delta;
+        pin.touch();
+        return true;
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+}
+
+//increment the counter, a missing counter is created with the seed value 
+//which is usually what the database has. throws if the table is full, the
+//caller then keeps to the database.
+int64_t
+seedAndIncrCounter(const std::string &key, int64_t seed, int64_t delta)
+{
+    metricTimer timer(counterLatency);
+	try 
+	{
+        counterPin pin;
+        pinCounterSlot(key, pin);
+        if(!pin.slot) claimCounterSlot(key, seed, pin);
+        pin.touch();
+        return pin.slot->value.fetch_add(delta) + delta;
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+}
+
+void
+setCounter(const std::string &key, int64_t value)
+{
+	try 
+	{
+        counterPin pin;
+        pinCounterSlot(key, pin);
+        if(!pin.slot) claimCounterSlot(key, value, pin);
+        pin.slot->value.store(value);
+        pin.touch();
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+    return;
+}
+
+//drop the counter, the next reader seeds it again from the database. returns
+//true with the value if it changed since the last flush, the caller writes it
+//back first.
+bool
+delCounter(const std::string &key, int64_t &unflushed)
+{
+	try 
+	{
+        checkCounterKey(key);
+        boost::interprocess::scoped_lock<boost::interprocess::named_upgradable_mutex> \
+            lock(counterTableMutex);
+        counterPin pin;
+        pinCounterSlot(key, pin);
+        if(!pin.slot) return false;
+        counterSlot *slot = pin.slot;
+        slot->pins.fetch_sub(1);
+        pin.slot = nullptr;
+        releaseCounterSlot(slot);
+        unflushed = slot->value.load();
+        slot->state.store(COUNTER_SLOT_DELETED);
+        return slot->flushed.load() != unflushed;
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+}
+
+//return the counters under the prefix which changed since the last call 
+//and mark them clean, the caller writes them back to the database. the write
+//back of the last call is taken as done. counters under the prefix which are
+//clean and not updated for idleSecs are evicted, 0 keeps them.
+std::vector<std::pair<std::string, int64_t>>
+collectDirtyCounters(const std::string &prefix, int idleSecs)
+{
+	try 
+	{
+        std::vector<std::pair<std::string, int64_t>> dirty;
+        if(!counterTable) createCounterTable();
+        boost::interprocess::scoped_lock<boost::interprocess::named_upgradable_mutex> \
+            lock(counterTableMutex);
+        int64_t idleSince = time(nullptr) - idleSecs;
+        for(uint32_t i = 0; i < OCACHE_COUNTER_SLOTS; i++){
+            counterSlot *slot = &counterTable->slots[i];
+            uint32_t state = slot->state.load();
+            if(state == COUNTER_SLOT_FREE) continue;
+            if(strncmp(slot->key, prefix.c_str(), prefix.length())) continue;
+            bool wasFlushing = slot->flushing.exchange(0);
+            if(state != COUNTER_SLOT_USED) continue;
+            int64_t value = slot->value.load();
+            if(slot->flushed.exchange(value) != value){
+                slot->flushing.store(1);
+                dirty.push_back(std::make_pair(std::string(slot->key), value));
+                continue;
+            }
+            if(!idleSecs || wasFlushing || (slot->touched.load() > idleSince)) continue;
+            releaseCounterSlot(slot);
+            //an increment may have landed before the release, the ones which
+            //came after it waited and land on the slot kept.
+            if(slot->value.load() != value){
+                slot->touched.store(time(nullptr));
+                slot->state.store(COUNTER_SLOT_USED);
+            }else{
+                slot->state.store(COUNTER_SLOT_DELETED);
+            }
+        }
+        return dirty;
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+}
+
+//Event log, a bounded ring per user of the events sent to the user by all the 
+//services. every event gets the next sequence number of the user, a client 
+//which lost its connection presents the last sequence number it saw and gets 
+//only the events after it. the ring forgets the oldest events past the depth 
+//or the byte budget of the user, floor is the lowest sequence number a client 
+//can still resume from. the epoch changes whenever the ring is created again, 
+//so sequence numbers from an older incarnation of the cache are never trusted.
+//the log lives in a segment of its own so that it never starves the session 
+//maps and counters, and past the total budget the rings of the users who are 
+//not connected go first.
+static managed_shared_memory eventCache(open_or_create, 
+        AKORP_EVENT_LOG_CACHE, 
+        AKORP_EVENT_LOG_CACHE_SIZE, 
+        nullptr, 
+        perms);
+
+typedef struct shmEventT
+{
+    int64_t seq;
+    char svcname[MAX_SERVICE_NAME_LEN];
+    shmStringT event;
+    shmEventT(int64_t _seq, const std::string &_svcname, const std::string &_event, 
+            const shmStringAllocatorT &a) : 
+        seq(_seq), 
+        event(_event.c_str(), _event.length(), a)
+    {
+        memset(svcname, 0, sizeof(svcname));
+        memcpy(svcname, _svcname.c_str(), std::min(_svcname.length(), sizeof(svcname)));
+        return;
+    }
+}shmEventT;
+
+typedef boost::interprocess::allocator<shmEventT, \
+boost::interprocess::managed_shared_memory::segment_manager> \
+shmEventAllocatorT;
+typedef boost::interprocess::deque<shmEventT, shmEventAllocatorT> shmEventDequeT;
+
+typedef struct eventRingT
+{
+    int64_t epoch = 0;
+    int64_t head = 0; //last sequence number handed out.
+    int64_t floor = 0; //resume is possible from here onwards.
+    size_t bytes = 0;
+    shmEventDequeT events;
+    eventRingT(int64_t _epoch, const shmEventAllocatorT &a) : epoch(_epoch), events(a) {}
+}eventRingT;
+
+typedef std::pair<const int, eventRingT> eventRingValueT;
+typedef boost::interprocess::allocator<eventRingValueT, \
+boost::interprocess::managed_shared_memory::segment_manager> \
+eventRingAllocatorT;
+typedef map<int, eventRingT, std::less<int>, eventRingAllocatorT> eventLogMapT;
+
+typedef struct eventLogT
+{
+    size_t bytes = 0; //of all the rings.
+    eventLogMapT rings;
+    eventLogT(const eventRingAllocatorT &a) : rings(std::less<int>(), a) {}
+}eventLogT;
+
+static shmStringAllocatorT eventStringAllocator(eventCache.get_segment_manager());
+static shmEventAllocatorT shmEventAllocator(eventCache.get_segment_manager());
+static eventRingAllocatorT eventRingAllocator(eventCache.get_segment_manager());
+static boost::interprocess::named_upgradable_mutex \
+eventLogMutex(boost::interprocess::open_or_create, OCACHE_EVENT_LOG_LOCK);
+static eventLogT *eventLog = nullptr;
+
+void
+createEventLog(void)
+{
+	try 
+	{
+        eventLog = eventCache.find_or_construct<eventLogT>(OCACHE_EVENT_LOG)
+            (eventRingAllocator);
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception "<<ex.what(); 
+		throw ex;
+	}
+	return;
+}
+
+//returns the bytes given up.
+static size_t
+trimEventRing(eventRingT &ring, size_t depth, size_t bytes)
+{
+    size_t freed = 0;
+    while(!ring.events.empty() && 
+            ((ring.events.size() > depth) || (ring.bytes > bytes))){
+        ring.floor = ring.events.front().seq;
+        ring.bytes -= ring.events.front().event.length();
+        freed += ring.events.front().event.length();
+        ring.events.pop_front();
+    }
+    return freed;
+}
+
+//bring the log back under 3/4 of the total budget. the rings of the users 
+//without a session are dropped whole, they resync when they are back. if the 
+//connected ones alone are over it their rings get an equal share each. the 
+//ring of keep is being written to and is left alone. caller holds the log lock.
+static void
+evictEventLogs(int keep)
+{
+    size_t lowWater = OCACHE_EVENT_LOG_TOTAL_BYTES / 4 * 3;
+    {
+        boost::interprocess::sharable_lock<boost::interprocess::named_upgradable_mutex> \
+            lock(sessionMapMutex);
+        if (!sessionMap) createSessionMap();
+        for(eventLogMapT::iterator itr = eventLog->rings.begin(); 
+                (itr != eventLog->rings.end()) && (eventLog->bytes > lowWater);){
+            if(((*itr).first == keep) || (sessionMap->find((*itr).first) != sessionMap->end())){
+                itr++;
+                continue;
+            }
+            eventLog->bytes -= (*itr).second.bytes;
+            itr = eventLog->rings.erase(itr);
+        }
+    }
+    if((eventLog->bytes <= lowWater) || eventLog->rings.empty()) return;
+    size_t share = lowWater / eventLog->rings.size();
+    for(auto &ring : eventLog->rings)
+        if(ring.first != keep) 
+            eventLog->bytes -= trimEventRing(ring.second, OCACHE_EVENT_LOG_DEPTH, share);
+    _info<<__FUNCTION__<<"() event log trimmed to bytes:"<<eventLog->bytes;
+    return;
+}
+
+//log the event for the user and return it as stamped, the event is logged 
+//whether the user is online or not.
+std::string
+logEvent(int uid, const std::string &svcname, const std::string &event, eventStamperT stamp)
+{
+	try 
+	{
+        boost::interprocess::scoped_lock<boost::interprocess::named_upgradable_mutex> \
+            lock(eventLogMutex);
+        if(!eventLog) createEventLog();
+        eventLogMapT::iterator itr = eventLog->rings.find(uid);
+        if(itr == eventLog->rings.end()){
+            int64_t epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+            try{
+                itr = eventLog->rings.insert(eventRingValueT(uid, eventRingT(epoch, shmEventAllocator))).first;
+            }catch(boost::interprocess::bad_alloc &ex){
+                //the event still goes out, it just cannot be replayed.
+                _error<<__FUNCTION__<<"() out of event log memory, not logging for uid: "<<uid;
+                return event;
+            }
+        }
+        eventRingT &ring = (*itr).second;
+        int64_t seq = ++ring.head;
+        std::string stamped = stamp(ring.epoch, seq, event);
+        if(stamped.length() > OCACHE_EVENT_LOG_BYTES){
+            //too big to keep, whoever missed it has to reload.
+            eventLog->bytes -= trimEventRing(ring, 0, 0);
+            ring.floor = seq;
+            return stamped;
+        }
+        try{
+            ring.events.push_back(shmEventT(seq, svcname, stamped, eventStringAllocator));
+            ring.bytes += stamped.length();
+            eventLog->bytes += stamped.length();
+            eventLog->bytes -= trimEventRing(ring, OCACHE_EVENT_LOG_DEPTH, OCACHE_EVENT_LOG_BYTES);
+            if(eventLog->bytes > OCACHE_EVENT_LOG_TOTAL_BYTES) evictEventLogs(uid);
+        }catch(boost::interprocess::bad_alloc &ex){
+            //segment is full, give up the history of this user rather than the event.
+            _error<<__FUNCTION__<<"() out of event log memory, dropping event log of uid: "<<uid;
+            eventLog->bytes -= trimEventRing(ring, 0, 0);
+            ring.floor = seq;
+            evictEventLogs(uid);
+        }
+        return stamped;
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+}
+
+//the events after seq in order, returns false if the user has to reload as 
+//some of them are gone or the epoch does not match. head and curEpoch are 
+//what the client has to remember from now on.
+bool
+getEventsSince(int uid, int64_t epoch, int64_t seq, 
+        std::vector<loggedEvent> &events, int64_t &head, int64_t &curEpoch)
+{
+	try 
+	{
+        boost::interprocess::sharable_lock<boost::interprocess::named_upgradable_mutex> \
+            lock(eventLogMutex);
+        if(!eventLog) createEventLog();
+        head = curEpoch = 0;
+        eventLogMapT::iterator itr = eventLog->rings.find(uid);
+        if(itr == eventLog->rings.end()) return (seq == 0); //nothing was ever sent.
+        eventRingT &ring = (*itr).second;
+        head = ring.head;
+        curEpoch = ring.epoch;
+        if((epoch != ring.epoch) || (seq < ring.floor) || (seq > ring.head)) return false;
+        for(shmEventT &e : ring.events){
+            if(e.seq <= seq) continue;
+            loggedEvent le;
+            le.seq = e.seq;
+            le.svcname = std::string(e.svcname, strnlen(e.svcname, sizeof(e.svcname)));
+            le.event = std::string(e.event.c_str(), e.event.length());
+            events.push_back(le);
+        }
+        return true;
+	}
+	catch(boost::interprocess::interprocess_exception &ex) 
+	{
+		_error<<__FUNCTION__<<"() caught boost interprocess exception."<<ex.what(); 
+		throw ex;
+	}
+	catch(std::exception &ex)
+	{
+		_error<<__FUNCTION__<<"() caught standard exception."<<ex.what(); 
+		throw ex;
+	}
+}
@@ -14,8 +14,15 @@
 #ifndef __INC_OCACHE_HH 
 #define __INC_OCACHE_HH
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+
 extern int getClientIdForUid(const int uid);
 extern int getUidForClientId(const int clientId);
+extern int getGidForUid(const int uid);
 extern void putAddress(const int uid, const int clientId, const int gid);
 extern void putSession(const int uid, const int clientId, const int gid);
 extern void delSession(const int uid);
@@ -29,4 +36,25 @@ extern std::string getUnameForUid(int uid);
 extern bool isGroupMember(int uid, int gid);
 extern void addUidAndGidMapping(int uid, int gid);
 extern void delUidAndGidMapping(int uid, int gid);
+extern bool getCounter(const std::string &key, int64_t &value);
+extern bool incrCounter(const std::string &key, int64_t delta, int64_t &value);
+extern int64_t seedAndIncrCounter(const std::string &key, int64_t seed, int64_t delta);
+extern void setCounter(const std::string &key, int64_t value);
+extern bool delCounter(const std::string &key, int64_t &unflushed);
+extern std::vector<std::pair<std::string, int64_t>> collectDirtyCounters(const std::string &prefix, 
+        int idleSecs = 0);
+
+typedef struct loggedEvent
+{
+    int64_t seq;
+    std::string svcname; //service which sent the event.
+    std::string event;
+}loggedEvent;
+
+//stamps the event with the epoch and sequence number it is logged under.
+typedef std::function<std::string(int64_t epoch, int64_t seq, const std::string &event)> eventStamperT;
+extern std::string logEvent(int uid, const std::string &svcname, const std::string &event, 
+        eventStamperT stamp);
+extern bool getEventsSince(int uid, int64_t epoch, int64_t seq, 
+        std::vector<loggedEvent> &events, int64_t &head, int64_t &curEpoch);
 #endif 
@@ -0,0 +1,205 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include "common.hh"
+#include "uring.hh"
+
+//drives the file ring the way akorp_fmgr does. a number of uploads write
+//their files block by block in random order, more blocks at once than the
+//ring has entries and more uploads than it has registered buffers, half of
+//the blocks are prepared by other threads the way the thread pool does. the
+//files are then downloaded through the ring with readahead and checked
+//against what was written. every completion has to run on the loop thread,
+//a read past the end has to come back empty and one on a closed descriptor
+//with EBADF.
+#define SIM_BLOCK_SIZE (64 * 4096) //the block of a transfer in the fmgr.
+
+static unsigned char
+pattern(int file, int block, size_t i)
+{
+    return (unsigned char)((file * 131) + (block * 31) + i);
+}
+
+static void
+runUntil(boost::asio::io_service &io, std::function<bool()> done, int seconds)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    while(!done() && (std::chrono::steady_clock::now() < deadline)){
+        io.poll();
+        if(!done()) usleep(100);
+    }
+}
+
+int
+main(int ac, char* av[])
+{
+    try
+    {
+        int files = 16, blocks = 32, entries = 32, buffers = 8;
+        std::string dir = "/tmp";
+        boost::program_options::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("files", boost::program_options::value<int>(), "uploads at once, default 16.")
+            ("blocks", boost::program_options::value<int>(), "blocks of every file, default 32.")
+            ("entries", boost::program_options::value<int>(), "entries of the ring, default 32.")
+            ("buffers", boost::program_options::value<int>(), "registered buffers, default 8.")
+            ("dir", boost::program_options::value<std::string>(), "where the files go, default /tmp.")
+        ;
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(ac, av, desc), vm);
+        boost::program_options::notify(vm);
+        if(vm.count("help")){ std::cerr << desc << "\n"; return 0; }
+        if(vm.count("files")) files = vm["files"].as<int>();
+        if(vm.count("blocks")) blocks = vm["blocks"].as<int>();
+        if(vm.count("entries")) entries = vm["entries"].as<int>();
+        if(vm.count("buffers")) buffers = vm["buffers"].as<int>();
+        if(vm.count("dir")) dir = vm["dir"].as<std::string>();
+        if((files < 1) || (blocks < 1) || (entries < 1)){
+            std::cerr<<"need at least 1 file, 1 block and 1 entry\n";
+            return -1;
+        }
+
+        boost::asio::io_service io;
+        fileRing ring(io, entries, buffers, SIM_BLOCK_SIZE);
+        std::thread::id loop = std::this_thread::get_id();
+        bool failed = false;
+        int offLoop = 0, errors = 0, mismatches = 0;
+        std::atomic<int> registered(0);
+
+        std::vector<int> fds;
+        std::vector<std::string> names;
+        for(int f = 0; f < files; f++){
+            names.push_back(dir + "/ringsim." + std::to_string(getpid()) + "." + std::to_string(f));
+            fds.push_back(_except(::open(names.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)));
+        }
+
+        //the uploads.
+        std::vector<std::pair<int, int>> order;
+        for(int f = 0; f < files; f++)
+            for(int b = 0; b < blocks; b++) order.push_back(std::make_pair(f, b));
+        std::shuffle(order.begin(), order.end(), std::mt19937(getpid()));
+        int written = 0;
+        auto upload = [&](int f, int b){
+            int index;
+            auto buf = ring.buffer(index);
+            if(index >= 0) registered++;
+            for(size_t i = 0; i < SIM_BLOCK_SIZE; i++) buf.get()[i] = pattern(f, b, i);
+            ring.write(fds[f], buf.get(), SIM_BLOCK_SIZE, (off_t)b * SIM_BLOCK_SIZE, index,
+                    [&, buf, f, b](int res){
+                        if(std::this_thread::get_id() != loop) offLoop++;
+                        if(res != SIM_BLOCK_SIZE){
+                            std::cerr<<"write of file "<<f<<" block "<<b<<" returned "<<res<<"\n";
+                            errors++;
+                        }
+                        written++;
+                    });
+        };
+        std::vector<std::pair<int, int>> mine, theirs;
+        for(size_t i = 0; i < order.size(); i++) (i % 2 ? theirs : mine).push_back(order[i]);
+        std::thread pool([&](){ for(auto &o : theirs) upload(o.first, o.second); });
+        for(auto &o : mine) upload(o.first, o.second);
+        pool.join();
+        for(int f = 0; f < files; f++) ring.syncRange(fds[f], 0, 0, SYNC_FILE_RANGE_WRITE);
+        runUntil(io, [&](){ return written == files * blocks; }, 30);
+        if(written != files * blocks){
+            std::cerr<<"only "<<written<<" of "<<files * blocks<<" writes completed\n";
+            failed = true;
+        }
+
+        //the downloads, a block at a time with readahead as fileXfer does,
+        //until the read comes back empty.
+        int finished = 0;
+        std::vector<std::function<void(int)>> next(files);
+        for(int f = 0; f < files; f++){
+            next[f] = [&, f](int b){
+                int index;
+                auto buf = ring.buffer(index);
+                ring.read(fds[f], buf.get(), SIM_BLOCK_SIZE, (off_t)b * SIM_BLOCK_SIZE, index,
+                        [&, buf, f, b](int res){
+                            if(std::this_thread::get_id() != loop) offLoop++;
+                            if(res == 0){
+                                if(b != blocks){
+                                    std::cerr<<"file "<<f<<" ended at block "<<b<<"\n";
+                                    errors++;
+                                }
+                                finished++;
+                                return;
+                            }
+                            if(res != SIM_BLOCK_SIZE){
+                                std::cerr<<"read of file "<<f<<" block "<<b<<" returned "<<res<<"\n";
+                                errors++;
+                                finished++;
+                                return;
+                            }
+                            for(size_t i = 0; i < SIM_BLOCK_SIZE; i++){
+                                if(buf.get()[i] == pattern(f, b, i)) continue;
+                                mismatches++;
+                                break;
+                            }
+                            ring.fadvise(fds[f], (off_t)(b + 1) * SIM_BLOCK_SIZE, 4 * SIM_BLOCK_SIZE,
+                                    POSIX_FADV_WILLNEED);
+                            next[f](b + 1);
+                        });
+            };
+            next[f](0);
+        }
+        runUntil(io, [&](){ return finished == files; }, 30);
+        if(finished != files){
+            std::cerr<<"only "<<finished<<" of "<<files<<" downloads finished\n";
+            failed = true;
+        }
+
+        //a descriptor closed before the read goes in.
+        int bad = _except(::open(names[0].c_str(), O_RDONLY));
+        ::close(bad);
+        int badRes = 0;
+        std::vector<unsigned char> small(16);
+        ring.read(bad, small.data(), small.size(), 0, -1, [&](int res){ badRes = res; });
+        runUntil(io, [&](){ return badRes != 0; }, 5);
+        if(badRes != -EBADF){
+            std::cerr<<"read on a closed descriptor returned "<<badRes<<"\n";
+            failed = true;
+        }
+
+        if(offLoop || errors || mismatches){
+            std::cerr<<"completions off the loop: "<<offLoop<<" errors: "<<errors
+                <<" corrupt blocks: "<<mismatches<<"\n";
+            failed = true;
+        }
+        for(int f = 0; f < files; f++){
+            ::close(fds[f]);
+            ::unlink(names[f].c_str());
+        }
+        std::cout<<"files: "<<files<<" blocks: "<<blocks<<" entries: "<<entries
+            <<" writes: "<<written<<" registered: "<<registered<<" downloads: "<<finished
+            <<", "<<(failed ? "FAIL" : "PASS")<<std::endl;
+        return failed ? -1 : 0;
+    }
+    catch(std::exception& e)
+    {
+        std::cerr << "error: " << e.what() << "\n";
+        return -1;
+    }
+    return 0;
+}
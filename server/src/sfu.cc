@@ -0,0 +1,216 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <sys/resource.h>
+#include "akorpdefs.h"
+#include "common.hh"
+#include "svclib.hh"
+#include "ocache.hh"
+#include "config.hh"
+#include "log.hh"
+#include "mediarelay.hh"
+
+//media relay service for the group calls, the signaling comes through the
+//gateway like for any other service and the media goes straight to the udp
+//port of the relay.
+//  request  : {mesgtype:"request", request:"join"|"leave", room, cookie}
+//  response : {mesgtype:"response", cookie, status, token, address, port}
+//a room is named after what is behind it, only its members can join:
+//  group.<gid>            a call of the group, members of the group.
+//  call.<uid>.<uid>       a call between two users, the two of them.
+static mediaRelay *relay = nullptr;
+static std::string debug_level = "error";
+static std::string log_file = "/var/log/antkorp/sfu";
+static std::string media_address = "0.0.0.0"; //address the media socket binds to.
+static std::string public_address = ""; //address the clients send the media to.
+static int media_port = 23460;
+static int max_room_size = 16;
+static int idle_timeout = 30; //seconds without media after which a participant is dropped.
+
+static void
+sendResponse(service *svc, int clientid, int channelid, std::string &cookie,
+        std::string status, std::string token = "")
+{
+    std::string mesgtype = "response";
+    tupl tv[] =
+    {
+        {"mesgtype", mesgtype},
+        {"cookie", cookie},
+        {"status", status},
+        {"token", token},
+        {"address", public_address},
+        {"port", (int)relay->getPort()},
+    };
+    std::string json = putJsonVal(tv, sizeof(tv)/sizeof(tupl));
+    svc->sendToClient(clientid, channelid, json);
+    return;
+}
+
+//the id after prefix in the room name, 0 if the room does not start with it.
+static int
+roomId(const std::string &room, const std::string &prefix, size_t &end)
+{
+    end = prefix.length();
+    if(room.compare(0, prefix.length(), prefix)) return 0;
+    size_t digits = room.find_first_not_of("0123456789", end);
+    if(digits == std::string::npos) digits = room.length();
+    if((digits == end) || (digits - end > 9)) return 0;
+    int id = std::stoi(room.substr(end, digits - end));
+    end = digits;
+    return id;
+}
+
+static bool
+canJoin(const std::string &room, int uid)
+{
+    size_t end = 0;
+    if(int gid = roomId(room, "group.", end))
+        return (end == room.length()) && isGroupMember(uid, gid);
+    if(int caller = roomId(room, "call.", end)){
+        std::string rest = room.substr(end);
+        int callee = roomId(rest, ".", end);
+        if(!callee || (end != rest.length())) return false;
+        return (uid == caller) || (uid == callee);
+    }
+    return false;
+}
+
+static void
+handleRequest(service *svc, int clientid, int channelid, std::string &data)
+{
+    std::string request, room, cookie;
+    tupl t[] =
+    {
+        {"request", &request},
+        {"room", &room},
+        {"cookie", &cookie},
+    };
+    try{
+        JSONNode n = libjson::parse(data);
+        if(!getJsonVal(n, t, sizeof(t)/sizeof(tupl))){
+            _error<<__FUNCTION__<<"() Not enough data to perform operation requested.";
+            return;
+        }
+        //the user is whoever logged in on the connection, not what the request says.
+        int uid = getUidForClientId(clientid);
+        if(!uid){
+            sendResponse(svc, clientid, channelid, cookie, "not_logged_in");
+            return;
+        }
+        if(request == "join"){
+            if(!canJoin(room, uid)){
+                _error<<__FUNCTION__<<"() uid: "<<uid<<" not a member of room: "<<room;
+                sendResponse(svc, clientid, channelid, cookie, "not_a_member");
+                return;
+            }
+            try{
+                std::string token = relay->join(room, uid, clientid);
+                sendResponse(svc, clientid, channelid, cookie, "success", token);
+            }catch(std::runtime_error &ex){
+                sendResponse(svc, clientid, channelid, cookie, ex.what());
+            }
+        }else if(request == "leave"){
+            relay->leave(room, uid);
+            sendResponse(svc, clientid, channelid, cookie, "success");
+        }else
+            _error<<__FUNCTION__<<"() unknown request: "<<request;
+    }
+    catch(std::exception &ex){
+        _error<<__FUNCTION__<<"() caught: standard exception:"<<ex.what();
+    }
+    return;
+}
+
+static void
+handleControlMesg(service *svc, service::controlMessage &cmsg)
+{
+    if(cmsg.messageType == service::controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_DEPARTURE)
+        relay->leaveAll(cmsg.clientDeparture.clientid);
+    return;
+}
+
+static void
+expireParticipants(service *svc, std::string cookie)
+{
+    relay->expire(idle_timeout);
+    return;
+}
+
+static void
+processSignals(service *svc, struct signalfd_siginfo *fdsi)
+{
+    if(fdsi->ssi_signo == SIGTERM) exit(0);
+    return;
+}
+
+static void
+readConfig()
+{
+    debug_level = getConfigValue<std::string>("sfu.debug_level", debug_level);
+    log_file = getConfigValue<std::string>("sfu.log_file", log_file);
+    media_address = getConfigValue<std::string>("sfu.media_address", media_address);
+    public_address = getConfigValue<std::string>("sfu.public_address", public_address);
+    media_port = getConfigValue<int>("sfu.media_port", media_port);
+    max_room_size = getConfigValue<int>("sfu.max_room_size", max_room_size);
+    idle_timeout = getConfigValue<int>("sfu.idle_timeout", idle_timeout);
+    return;
+}
+
+static void
+dumpConfig()
+{
+    _trace<<"debug_level: "<<debug_level;
+    _trace<<"log_file: "<<log_file;
+    _trace<<"media_address: "<<media_address;
+    _trace<<"public_address: "<<public_address;
+    _trace<<"media_port: "<<media_port;
+    _trace<<"max_room_size: "<<max_room_size;
+    _trace<<"idle_timeout: "<<idle_timeout;
+    return;
+}
+
+int
+main(int ac, char **av)
+{
+    try
+    {
+        struct rlimit lim = {RLIM_INFINITY, RLIM_INFINITY};
+        _except(::setrlimit(RLIMIT_CORE, &lim));
+        _except(daemon(0, 1));
+        loadConfig("/etc/antkorp/antkorp.cfg");
+        readConfig();
+        openLog(log_file);
+        setLogLevel(SEVERITY_TRACE);
+        dumpConfig();
+
+        if(debug_level == "info")  setLogLevel(SEVERITY_INFO);
+        else if(debug_level == "error") setLogLevel(SEVERITY_ERROR);
+        else if(debug_level == "warning") setLogLevel(SEVERITY_WARNING);
+        else if(debug_level == "fatal") setLogLevel(SEVERITY_FATAL);
+        else if(debug_level == "debug") setLogLevel(SEVERITY_DEBUG);
+        else if(debug_level == "trace") setLogLevel(SEVERITY_TRACE);
+
+        service svc("sfu");
+        relay = new mediaRelay(*svc.getAsioSvcRef(), media_address, media_port, max_room_size);
+        _info<<"media relay listening on "<<media_address<<":"<<relay->getPort();
+        svc.setDataRecvHandler(handleRequest);
+        svc.setControlRecvHandler(handleControlMesg);
+        svc.setSignalHandler(processSignals);
+        svc.addPeriodicTimer("expire", idle_timeout * 1000, expireParticipants);
+        svc.run();
+    }
+    catch(std::exception &e)
+    {
+        _error<<"service exited with exception:"<<e.what();
+        return -1;
+    }
+    return 0;
+}
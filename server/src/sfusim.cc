@@ -0,0 +1,143 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <boost/program_options.hpp>
+#include "mediarelay.hh"
+
+//drives the media relay over loopback with synthetic rtp streams, every
+//participant binds a udp socket, sends its stream and checks that it got the
+//streams of all the others and never its own.
+typedef struct simParticipant
+{
+    int uid = 0;
+    uint32_t ssrc = 0;
+    boost::asio::ip::udp::socket *sock = nullptr;
+    std::map<uint32_t, uint64_t> recvd; //ssrc to packet count.
+}simParticipant;
+
+static void
+buildRtp(std::vector<char> &pkt, uint32_t ssrc, uint16_t seq, uint32_t ts)
+{
+    pkt[0] = (char)0x80; //version 2, no padding, no extension, no csrc.
+    pkt[1] = 96; //dynamic payload type.
+    uint16_t nseq = htons(seq);
+    uint32_t nts = htonl(ts), nssrc = htonl(ssrc);
+    memcpy(&pkt[2], &nseq, sizeof(nseq));
+    memcpy(&pkt[4], &nts, sizeof(nts));
+    memcpy(&pkt[8], &nssrc, sizeof(nssrc));
+    return;
+}
+
+static void
+drain(simParticipant &p)
+{
+    char buf[MEDIA_RELAY_MAX_DATAGRAM];
+    boost::asio::ip::udp::endpoint from;
+    boost::system::error_code ec;
+    for(;;){
+        size_t len = p.sock->receive_from(boost::asio::buffer(buf), from, 0, ec);
+        if(ec) break;
+        if((len < 12) || (((unsigned char)buf[0] >> 6) != 2)) continue; //not rtp.
+        uint32_t ssrc;
+        memcpy(&ssrc, buf + 8, sizeof(ssrc));
+        p.recvd[ntohl(ssrc)]++;
+    }
+    return;
+}
+
+int
+main(int ac, char* av[])
+{
+    try
+    {
+        int count = 4, packets = 1000, size = 1200;
+        boost::program_options::options_description desc("Allowed options");
+        desc.add_options()
+            ("help", "produce help message")
+            ("participants", boost::program_options::value<int>(), "participants in the room, default 4.")
+            ("packets", boost::program_options::value<int>(), "packets sent by every participant, default 1000.")
+            ("size", boost::program_options::value<int>(), "rtp packet size, default 1200.")
+        ;
+        boost::program_options::variables_map vm;
+        boost::program_options::store(boost::program_options::parse_command_line(ac, av, desc), vm);
+        boost::program_options::notify(vm);
+        if(vm.count("help")){ std::cerr << desc << "\n"; return 0; }
+        if(vm.count("participants")) count = vm["participants"].as<int>();
+        if(vm.count("packets")) packets = vm["packets"].as<int>();
+        if(vm.count("size")) size = vm["size"].as<int>();
+        if((count < 2) || (size < 12) || (size > MEDIA_RELAY_MAX_DATAGRAM)){
+            std::cerr<<"need at least 2 participants and a size between 12 and "
+                <<MEDIA_RELAY_MAX_DATAGRAM<<"\n";
+            return -1;
+        }
+
+        boost::asio::io_service iosvc;
+        mediaRelay relay(iosvc, "127.0.0.1", 0, count);
+        boost::asio::ip::udp::endpoint relayEp(
+                boost::asio::ip::address::from_string("127.0.0.1"), relay.getPort());
+
+        std::vector<simParticipant> sims(count);
+        for(int i = 0; i < count; i++){
+            simParticipant &p = sims[i];
+            p.uid = i + 1;
+            p.ssrc = 0x1000 + i;
+            p.sock = new boost::asio::ip::udp::socket(iosvc,
+                    boost::asio::ip::udp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 0));
+            p.sock->non_blocking(true);
+            std::string bind = MEDIA_RELAY_BIND_MAGIC + relay.join("simroom", p.uid, p.uid);
+            p.sock->send_to(boost::asio::buffer(bind), relayEp);
+        }
+        while(iosvc.poll());
+        for(auto &p : sims) drain(p); //bind acknowledgements.
+
+        std::vector<char> pkt(size, 0);
+        auto start = std::chrono::steady_clock::now();
+        for(int n = 0; n < packets; n++){
+            for(auto &p : sims){
+                buildRtp(pkt, p.ssrc, n, n * 960);
+                p.sock->send_to(boost::asio::buffer(pkt), relayEp);
+            }
+            while(iosvc.poll());
+            for(auto &p : sims) drain(p);
+        }
+        while(iosvc.poll());
+        for(auto &p : sims) drain(p);
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        bool ok = true;
+        for(auto &p : sims){
+            uint64_t total = 0;
+            for(auto &s : p.recvd){
+                total += s.second;
+                if(s.first == p.ssrc){
+                    std::cerr<<"uid: "<<p.uid<<" got its own stream back\n";
+                    ok = false;
+                }
+            }
+            std::cerr<<"uid: "<<p.uid<<" sent: "<<packets<<" received: "<<total
+                <<" expected: "<<(uint64_t)packets * (count - 1)
+                <<" forwarded by relay: "<<relay.forwarded("simroom", p.uid)<<"\n";
+            if(total != (uint64_t)packets * (count - 1)) ok = false;
+        }
+        std::cerr<<"relayed "<<(uint64_t)packets * count * (count - 1)<<" packets in "<<secs
+            <<" secs, dropped: "<<relay.dropped()<<(ok ? ", PASS" : ", FAIL")<<"\n";
+        for(auto &p : sims) delete p.sock;
+        return ok ? 0 : -1;
+    }
+    catch (const std::exception &e){ std::cerr << e.what() << std::endl; return -1; }
+    return 0;
+}
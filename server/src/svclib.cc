@@ -17,14 +17,25 @@
 #include <boost/asio.hpp>
 #include <sys/un.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "config.hh"
 #include "svclib.hh"
+#include "metrics.hh"
+
+static metricCounter &framesSent = metrics().counter("svc_frames_sent");
+static metricCounter &bytesSent = metrics().counter("svc_bytes_sent");
+static metricHistogram &sendLatency = metrics().histogram("svc_send_us"); //waits for the lock and the ring included.
+static metricCounter &framesReceived = metrics().counter("svc_frames_received");
+static metricHistogram &handlerLatency = metrics().histogram("svc_handler_us");
 
 service::service(std::string _svcname)
     :
    ep(AKORP_SVC_ENDPOINT),
    dataChannel(svc),
    controlChannel(svc),
-   signalChannel(svc)
+   signalChannel(svc),
+   ringDoorbell(svc)
 {
     try
     {
@@ -33,6 +44,10 @@ service::service(std::string _svcname)
                 (_svcname.length() <= MAX_SERVICE_NAME_LEN) ? 
                 _svcname.length() : 
                 MAX_SERVICE_NAME_LEN);
+        //several instances of a service can run, each registers with the 
+        //gateway and has its control queue under its own tag.
+        tag = name + "." + std::to_string(::getpid());
+        if(tag.length() > MAX_SERVICE_NAME_LEN) tag = name;
         //allocate memory for the data buffer. 
         data = new char [OPTIMAL_BUF_SIZE];
         //Try to open the message queue of gateway.
@@ -43,8 +58,8 @@ service::service(std::string _svcname)
             <<" to the network gateway.";
         //full name of the message queue.
         //open the message queue for the gateway to send control messages.
-        struct mq_attr mattr = {0, 10, sizeof(controlMessage), 0};
-        mqName = "/" + _svcname + ".mq";
+        struct mq_attr mattr = {0, controlQueueDepth(), sizeof(controlMessage), 0};
+        mqName = "/" + tag + ".mq";
         ::mq_unlink(mqName.c_str());
         mqFd = _except(::mq_open(mqName.c_str(), 
                     O_RDWR | O_CREAT | O_NONBLOCK, 
@@ -79,12 +94,20 @@ service::service(std::string _svcname)
         dataChannel.connect(ep);
         _info<<"service::service() "<<_svcname<<
             " connected to the network gateway, opened data channel.";
-        boost::asio::write(dataChannel, 
-                boost::asio::buffer(_svcname.c_str(), 
-                    _svcname.length()));
+        //with the rings configured the tag carries the segment and the 
+        //doorbells to the gateway and the socket carries no data after it.
+        uint32_t ringConf = getConfigValue<uint32_t>("svclib.ring_size", 0);
+        if(ringConf){
+            setupRing(ringConf);
+        }else{
+            boost::asio::write(dataChannel, 
+                    boost::asio::buffer(tag.c_str(), 
+                        tag.length()));
+        }
         _info<<"service::service() "<<_svcname<<
             " sent service tag to the network gateway.";
         readAsync();
+        startMetricsEndpoint(tag);
         allOk = true;
         return;
     }
@@ -98,6 +121,8 @@ service::service(std::string _svcname)
 
 service::~service()
 {
+    if(ringUpFd >= 0) _eintr(::close(ringUpFd));
+    svcRingUnmap(ringBase, ringSize);
     _eintr(::close(sFd));
     _eintr(::close(mqFd));
     _eintr(::close(gwMqFd));
@@ -111,6 +136,18 @@ service::_sendSvcMessage(int clientid,
         int channelid, 
         const char *wbuf, 
         size_t wbufSize)
+{
+    _sendSvcMessage(clientid, channelid, name, wbuf, wbufSize);
+    return;
+}
+
+//the svcname in the header decides the client side handler of the message.
+void
+service::_sendSvcMessage(int clientid, 
+        int channelid, 
+        const std::string &svcname,
+        const char *wbuf, 
+        size_t wbufSize)
 {
 	char svcHeader[sizeof(int32_t) + sizeof(int32_t) + MAX_SERVICE_NAME_LEN \
         + sizeof(int32_t)] = {' '};
@@ -118,17 +155,25 @@ service::_sendSvcMessage(int clientid,
     int rc = 0;
     int32_t _dataSize = htonl(wbufSize);
     int32_t chnid = htonl(channelid);
+    metricTimer timer(sendLatency);
+    framesSent.add();
+    bytesSent.add(wbufSize);
 
     try{
+        std::lock_guard<std::mutex> lock(sendLock); //senders may be on the shard threads.
         memset(&svcHeader, 0, sizeof(svcHeader));
         memcpy(svcHeader, &cnid, sizeof(clientid)); //set the clientid
         memcpy(svcHeader + sizeof(clientid), &chnid, sizeof(channelid)); //set the svcname
         memcpy(svcHeader + sizeof(clientid) + sizeof(chnid), 
-                name.c_str(), 
-                name.length()); //set the svcname
+                svcname.c_str(), 
+                std::min(svcname.length(), (size_t)MAX_SERVICE_NAME_LEN)); //set the svcname
         memcpy(svcHeader + sizeof(clientid) + sizeof(chnid) + MAX_SERVICE_NAME_LEN, 
                 &_dataSize, 
                 sizeof(int32_t)); //set the msglen
+        if(ringBase){
+            ringSend(svcHeader, sizeof(svcHeader), wbuf, wbufSize);
+            return;
+        }
         boost::asio::write(dataChannel, 
                 boost::asio::buffer(svcHeader, 
                     sizeof(svcHeader)));
@@ -144,6 +189,162 @@ service::_sendSvcMessage(int clientid,
     return;
 }
 
+//create the segment with the two rings and the doorbells and hand them to the
+//gateway along with the tag, the ring is at least SVC_RING_MIN_SIZE and a 
+//power of 2.
+void
+service::setupRing(uint32_t size)
+{
+    uint32_t capacity = SVC_RING_MIN_SIZE;
+    while((capacity < size) && (capacity < (1u << 30))) capacity <<= 1;
+    std::string shmName = "/" + tag + ".ring";
+    ::shm_unlink(shmName.c_str());
+    int shmfd = _except(::shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600));
+    ::shm_unlink(shmName.c_str()); //reachable only through the descriptors from now on.
+    SCOPE_EXIT{ _eintr(::close(shmfd)); };
+    _except(::ftruncate(shmfd, svcRingSegmentSize(capacity)));
+    ringBase = svcRingMap(shmfd, capacity);
+    ringSize = capacity;
+    ringDown.init(svcRingControl(ringBase, 0), svcRingData(ringBase, capacity, 0), capacity);
+    ringUp.init(svcRingControl(ringBase, 1), svcRingData(ringBase, capacity, 1), capacity);
+    int downFd = _except(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    ringDoorbell.assign(downFd);
+    ringUpFd = _except(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+
+    int fds[3] = {shmfd, downFd, ringUpFd};
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+    struct iovec iov = {const_cast<char*>(tag.data()), tag.length()};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    _except(::sendmsg(dataChannel.native_handle(), &mh, 0));
+    _info<<"service::setupRing() "<<tag<<" talks to the gateway over rings of "<<capacity<<" bytes.";
+
+    ringDown.prepareSleep(); //the gateway rings on the first frame.
+    ringDoorbell.async_read_some(boost::asio::null_buffers(),
+            boost::bind(&service::readRing,
+                this,
+                boost::asio::placeholders::error));
+    return;
+}
+
+void
+service::ringGw(void)
+{
+    uint64_t one = 1;
+    if(::write(ringUpFd, &one, sizeof(one)) < 0)
+        _error<<"service::ringGw() unable to ring the doorbell of the gateway.";
+    return;
+}
+
+//called with the send lock held, the ring has a single producer. a frame that
+//finds the ring full, or other frames waiting, goes to the backlog. the
+//gateway rings our doorbell once it made room and readRing flushes it.
+void
+service::ringSend(const char *head, size_t headLen, const char *body, size_t bodyLen)
+{
+    if(ringBacklog.empty()){
+        size_t total = headLen + bodyLen;
+        size_t offset = 0;
+        if((2 * sizeof(uint32_t) + total) <= ringUp.maxRecord()){
+            if(ringUp.write(head, headLen, body, bodyLen)) offset = total;
+        }else
+            offset = ringUp.writeChunked(head, headLen, body, bodyLen, 0);
+        if(offset == total){
+            if(ringUp.needsDoorbell()) ringGw();
+            return;
+        }
+        ringBacklog.push_back(ringFrame{std::string(head, headLen), std::string(body, bodyLen), offset});
+    }else
+        ringBacklog.push_back(ringFrame{std::string(head, headLen), std::string(body, bodyLen), 0});
+    flushRingBacklog();
+    return;
+}
+
+//true once the whole frame is in the ring, a chunked frame keeps its offset.
+bool
+service::ringPut(ringFrame &f)
+{
+    size_t total = f.head.length() + f.body.length();
+    if((2 * sizeof(uint32_t) + total) <= ringUp.maxRecord())
+        return ringUp.write(f.head.data(), f.head.length(), f.body.data(), f.body.length());
+    f.offset = ringUp.writeChunked(f.head.data(), f.head.length(), 
+            f.body.data(), f.body.length(), f.offset);
+    return f.offset == total;
+}
+
+//called with the send lock held.
+void
+service::flushRingBacklog(void)
+{
+    while(!ringBacklog.empty()){
+        if(!ringPut(ringBacklog.front())){
+            ringUp.markProducerWaiting();
+            //it may have drained before it could see the flag.
+            if(!ringPut(ringBacklog.front())) break;
+        }
+        ringBacklog.pop_front();
+    }
+    if(ringUp.needsDoorbell()) ringGw();
+    return;
+}
+
+//drain the down ring, the frames are laid out as on the socket. after a 
+//while we ring our own doorbell to let the other handlers of the loop run.
+void
+service::readRing(boost::system::error_code error)
+{
+    if(error){
+        _error<<"service::readRing() encountered an error."<<error.message();
+        THROW_ERRNO_EXCEPTION;
+    }
+    uint64_t count;
+    if(::read(ringDoorbell.native_handle(), &count, sizeof(count)) < 0) count = 0;
+    std::string frameData;
+    auto handler = [this, &frameData](const char *frame, size_t len){
+        if(len < sizeof(svcHeader)) return;
+        int32_t cid, chid;
+        memcpy(&cid, frame, sizeof(cid));
+        memcpy(&chid, frame + sizeof(cid), sizeof(chid));
+        frameData.assign(frame + sizeof(svcHeader), len - sizeof(svcHeader));
+        framesReceived.add();
+        metricTimer timer(handlerLatency);
+        if(dataHandlerSet) _dh(this, ntohl(cid), ntohl(chid), frameData);
+    };
+    size_t frames = 0;
+    for(;;){
+        size_t n = ringDown.read(handler, 256);
+        frames += n;
+        if(ringDown.producerWaiting()) ringGw(); //the gateway has client messages for the room we made.
+        {
+            std::lock_guard<std::mutex> lock(sendLock);
+            if(!ringBacklog.empty()) flushRingBacklog(); //the gateway made room for them.
+        }
+        if(n){
+            if(frames < 4096) continue;
+            uint64_t one = 1;
+            if(::write(ringDoorbell.native_handle(), &one, sizeof(one)) < 0)
+                _error<<"service::readRing() unable to ring our own doorbell.";
+            break;
+        }
+        if(ringDown.prepareSleep()) break;
+    }
+    ringDoorbell.async_read_some(boost::asio::null_buffers(),
+            boost::bind(&service::readRing,
+                this,
+                boost::asio::placeholders::error));
+    return;
+}
+
 void 
 service::readAsync()
 {
@@ -222,7 +423,11 @@ service::readComplete(const boost::system::error_code& error, size_t bytesRecvd)
     if(totalSvcBytesRecvd == totalSvcMsgLen){
         _info<<"service::readComplete() full service message recvd.";
         //std::cerr<<"data dump in service::readComplete()"<<dataBuf;
-        if(dataHandlerSet) _dh(this, clientid, channelid, dataBuf);
+        framesReceived.add();
+        {
+            metricTimer timer(handlerLatency);
+            if(dataHandlerSet) _dh(this, clientid, channelid, dataBuf);
+        }
         dataBuf.clear();
         totalSvcBytesRecvd = totalSvcMsgLen = 0;
         newSvcMsg = true;
@@ -246,6 +451,75 @@ service::sendToClient(int clientid, int channelid, const char *wbuf,
     return;
 }
 
+//send a message logged by another service to the client, the client 
+//dispatches it to the handler of that service.
+void
+service::sendToClient(int clientid, int channelid, const std::string &svcname, 
+        const char *wbuf, size_t wbufSize)
+{
+    _sendSvcMessage(clientid, channelid, svcname, wbuf, wbufSize);
+    return;
+}
+
+//the gateway delivers the frame if the user is logged in on it, else hands 
+//it to the gateway of the cluster holding the user.
+void
+service::sendToUser(int uid, const char *wbuf, size_t wbufSize)
+{
+    _sendSvcMessage(SVC_USER_CLIENTID, uid, wbuf, wbufSize);
+    return;
+}
+
+//the gateways learn which user is on which client from the login, the 
+//cluster routes the messages for a user with it.
+void
+service::announceLogin(int uid, int clientid)
+{
+    controlMessage cmsg;
+    memset(&cmsg, 0, sizeof(cmsg));
+    cmsg.messageType = controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_LOGIN;
+    cmsg.userSession.clientid = clientid;
+    cmsg.userSession.uid = uid;
+    sendToGw(cmsg);
+    return;
+}
+
+void
+service::announceLogout(int uid)
+{
+    controlMessage cmsg;
+    memset(&cmsg, 0, sizeof(cmsg));
+    cmsg.messageType = controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_LOGOUT;
+    cmsg.userSession.uid = uid;
+    sendToGw(cmsg);
+    return;
+}
+
+//the gateway passes it on, a note for a service that is not up or whose 
+//queue is full is lost.
+void
+service::notifyService(const std::string &svcname, const std::string &topic, const std::string &key)
+{
+    controlMessage cmsg;
+    memset(&cmsg, 0, sizeof(cmsg));
+    if((svcname.length() > sizeof(cmsg.serviceNote.service)) || 
+            (topic.length() >= sizeof(cmsg.serviceNote.topic)) ||
+            (key.length() >= sizeof(cmsg.serviceNote.key)))
+        throw std::invalid_argument("service note too long");
+    cmsg.messageType = controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_SERVICE_NOTE;
+    memcpy(cmsg.serviceNote.service, svcname.data(), svcname.length());
+    memcpy(cmsg.serviceNote.topic, topic.data(), topic.length());
+    memcpy(cmsg.serviceNote.key, key.data(), key.length());
+    sendToGw(cmsg);
+    return;
+}
+
+std::string
+service::getName()
+{
+    return name;
+}
+
 void 
 service::broadcast(std::string &wbuf)
 {
@@ -260,6 +534,77 @@ service::broadcast(const char *wbuf, size_t wbufSize)
     return;
 }
 
+//hand an arrival or departure to the control handler like the gateway used 
+//to send them, one message per client.
+void
+service::dispatchClientStatus(int clientid, bool arrival)
+{
+    if(arrival && !knownClients.insert(clientid).second) return;
+    if(!arrival && !knownClients.erase(clientid)) return;
+    if(!controlHandlerSet) return;
+    controlMessage cmsg;
+    memset(&cmsg, 0, sizeof(cmsg));
+    memcpy(cmsg.sender, "ngw", strlen("ngw"));
+    if(arrival){
+        cmsg.messageType = controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_ARRIVAL;
+        cmsg.clientArrival.clientid = clientid;
+        cmsg.clientArrival.channelid = -1;
+    }else{
+        cmsg.messageType = controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_DEPARTURE;
+        cmsg.clientDeparture.clientid = clientid;
+        cmsg.clientDeparture.channelid = -1;
+    }
+    _ch(this, cmsg);
+    return;
+}
+
+//batches are replayed in order, a complete snapshot is turned into the 
+//arrivals and departures that take the known clients to it.
+void
+service::handleClientBatch(controlMessage &cmsg)
+{
+    int count = std::min(std::max(0, (int)cmsg.clientBatch.count), CONTROL_CHANNEL_BATCH_SIZE);
+    bool snapshot = (cmsg.messageType == controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_SNAPSHOT);
+    bool gap = ctlSeqValid && (cmsg.clientBatch.seq != ctlSeq + 1);
+    if(snapshot && !cmsg.clientBatch.part){
+        snapshotClients.clear();
+        gap = false;
+        ctlResyncPending = false;
+    }
+    if(gap){
+        if(!ctlResyncPending){
+            _error<<"service::handleClientBatch() control sequence gap, expected: "<<ctlSeq + 1
+                <<" got: "<<cmsg.clientBatch.seq<<", asking the gateway for a snapshot.";
+            controlMessage req;
+            memset(&req, 0, sizeof(req));
+            req.messageType = controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_RESYNC_REQUEST;
+            sendToGw(req);
+            ctlResyncPending = true;
+        }
+        ctlSeq = cmsg.clientBatch.seq;
+        return;
+    }
+    ctlSeq = cmsg.clientBatch.seq;
+    ctlSeqValid = true;
+    if(ctlResyncPending) return;
+    if(!snapshot){
+        for(int i = 0; i < count; i++)
+            dispatchClientStatus(cmsg.clientBatch.clients[i].clientid, 
+                    cmsg.clientBatch.clients[i].arrival);
+        return;
+    }
+    for(int i = 0; i < count; i++) snapshotClients.insert(cmsg.clientBatch.clients[i].clientid);
+    if(!cmsg.clientBatch.last) return;
+    std::vector<int> gone;
+    for(int clientid : knownClients) if(!snapshotClients.count(clientid)) gone.push_back(clientid);
+    for(int clientid : gone) dispatchClientStatus(clientid, false);
+    for(int clientid : snapshotClients) dispatchClientStatus(clientid, true);
+    _info<<"service::handleClientBatch() resynced to a snapshot of "<<snapshotClients.size()<<" clients.";
+    snapshotClients.clear();
+    return;
+}
+
+//drain the queue, the gateway may have put several messages in it.
 void
 service::readControlMessages(boost::system::error_code error)
 {
@@ -269,18 +614,32 @@ service::readControlMessages(boost::system::error_code error)
             error.message(); 
         THROW_ERRNO_EXCEPTION; 
     }
-    controlMessage cmsg;
-    memset(&cmsg, 0, sizeof(cmsg));
-    char *ptr = reinterpret_cast<char*>(&cmsg);
-    int bytes2Read = sizeof(controlMessage); 
-    int bytesRead = 0;
-    do{
-        ptr += bytesRead;
-        bytesRead += _except(::mq_receive(mqFd, ptr, bytes2Read, nullptr));
-        bytes2Read -= bytesRead;
-    } while(bytes2Read);
-    if(bytesRead && controlHandlerSet) 
-        _ch(this, cmsg);
+    for(;;){
+        controlMessage cmsg;
+        memset(&cmsg, 0, sizeof(cmsg));
+        int bytesRead = _eintr(::mq_receive(mqFd, reinterpret_cast<char*>(&cmsg), sizeof(cmsg), nullptr));
+        if(bytesRead < 0){
+            if(errno == EAGAIN) break;
+            THROW_ERRNO_EXCEPTION;
+        }
+        switch(cmsg.messageType)
+        {
+            case controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_BATCH:
+            case controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_SNAPSHOT:
+                handleClientBatch(cmsg);
+                break;
+            case controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_ARRIVAL:
+                knownClients.insert(cmsg.clientArrival.clientid);
+                if(controlHandlerSet) _ch(this, cmsg);
+                break;
+            case controlMessage::CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_DEPARTURE:
+                knownClients.erase(cmsg.clientDeparture.clientid);
+                if(controlHandlerSet) _ch(this, cmsg);
+                break;
+            default:
+                if(controlHandlerSet) _ch(this, cmsg);
+        }
+    }
     controlChannel.async_read_some(boost::asio::null_buffers(),
             boost::bind(&service::readControlMessages,
             this,
@@ -419,10 +778,32 @@ service::getSignalHandle()
     return sFd;
 }
 
+//a snapshot of the expected clients and some batches, within what the kernel
+//lets an unprivileged process ask for.
+long
+service::controlQueueDepth()
+{
+    long clients = getConfigValue<long>("svclib.expected_clients", CONTROL_CHANNEL_EXPECTED_CLIENTS);
+    long depth = (clients + CONTROL_CHANNEL_BATCH_SIZE - 1) / CONTROL_CHANNEL_BATCH_SIZE 
+        + CONTROL_CHANNEL_QUEUE_SLACK;
+    long limit = 10;
+    FILE *fp = fopen("/proc/sys/fs/mqueue/msg_max", "r");
+    if(fp){
+        if(fscanf(fp, "%ld", &limit) != 1) limit = 10;
+        fclose(fp);
+    }
+    if(::geteuid() != 0 && depth > limit){
+        _error<<"service::controlQueueDepth() "<<depth<<" messages wanted for "<<clients
+            <<" clients, fs.mqueue.msg_max allows "<<limit<<", raise it.";
+        depth = limit;
+    }
+    return depth;
+}
+
 void 
 service::sendToGw(controlMessage &cmsg)
 {
-    memcpy(cmsg.sender, name.c_str(), name.length());
+    memcpy(cmsg.sender, tag.c_str(), tag.length());
     if(gwMqFd){
         int rc = _eintr(::mq_send(gwMqFd, 
                     reinterpret_cast<char*>(&cmsg), 
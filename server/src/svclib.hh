@@ -20,11 +20,20 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <set>
+#include <deque>
+#include <mutex>
 #include <fcntl.h>           /* For O_* constants */
 #include <sys/stat.h>        /* For mode constants */
 #include <sys/signalfd.h>        /* For mode constants */
 #include <mqueue.h>
 #include <boost/asio.hpp>
+#include "svcring.hh"
+
+#define CONTROL_CHANNEL_BATCH_SIZE (32) //client entries in one batch or snapshot message.
+#define CONTROL_CHANNEL_EXPECTED_CLIENTS (4096) //clients of one service instance its control queue is sized for.
+#define CONTROL_CHANNEL_QUEUE_SLACK (16) //messages beyond a full snapshot, for the batches that follow it.
+#define SVC_USER_CLIENTID (-2) //data frame addressed to a user rather than a client, the channelid holds the uid.
 
 class service;
 class service
@@ -44,6 +53,12 @@ class service
             CONTROL_CHANNEL_MESSAGE_TYPE_CHANNEL_ADD = 4, //A new channel is added to the network connection.
             CONTROL_CHANNEL_MESSAGE_TYPE_CHANNEL_DELETE = 5, //A channel is deleted from the network connection.
             CONTROL_CHANNEL_MESSAGE_TYPE_HEART_BEAT = 6,  //A periodic heart beat sent by the service daemons to report health to gw.
+            CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_BATCH = 7, //arrivals and departures since the last batch, in order.
+            CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_SNAPSHOT = 8, //part of the full list of clients of the service.
+            CONTROL_CHANNEL_MESSAGE_TYPE_RESYNC_REQUEST = 9, //sent by a service which lost track of its clients.
+            CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_LOGIN = 10, //a user logged in on the client, sent by the auth service.
+            CONTROL_CHANNEL_MESSAGE_TYPE_CLIENT_LOGOUT = 11, //the user logged out.
+            CONTROL_CHANNEL_MESSAGE_TYPE_SERVICE_NOTE = 12, //for the instances of another service, passed on by the gateway.
         };
         char sender[MAX_SERVICE_NAME_LEN];
         int32_t messageType;
@@ -62,6 +77,28 @@ class service
                 int32_t channelid;
                 int32_t waitingTime;  // 0 value means immediatly close the connection, else start a close timer.
             }clientDisconnect;
+            //batches and snapshots share one sequence per service, a gap means
+            //lost messages and the service asks for a snapshot.
+            struct __attribute__((packed)){
+                uint32_t seq;
+                int32_t part; //snapshot only, parts are numbered from 0.
+                int32_t last; //snapshot only, this is the last part.
+                int32_t count; //entries used.
+                struct __attribute__((packed)){
+                    int32_t clientid;
+                    int32_t arrival; //0 for a departure, always 1 in a snapshot.
+                }clients[CONTROL_CHANNEL_BATCH_SIZE];
+            }clientBatch;
+            struct __attribute__((packed)){
+                int32_t clientid; //0 on a logout.
+                int32_t uid;
+            }userSession;
+            //what changed under the service, it is up to it to look again.
+            struct __attribute__((packed)){
+                char service[MAX_SERVICE_NAME_LEN]; //to all the instances of this service.
+                char topic[32];
+                char key[64];
+            }serviceNote;
         };
     }controlMessage;
 
@@ -108,6 +145,7 @@ class service
     uint32_t dataSize = OPTIMAL_BUF_SIZE;
     std::string dataBuf;
     std::string name = "";
+    std::string tag = ""; //name of this instance, <name>.<pid>.
     std::string mqName = "";
     int mqFd = -1; //our message queue.
     int gwMqFd = -1; //message queue of the network gateway.
@@ -133,13 +171,40 @@ class service
     boost::asio::posix::stream_descriptor controlChannel, signalChannel;
     boost::asio::local::stream_protocol::endpoint ep;
     boost::asio::local::stream_protocol::socket dataChannel;
+    std::mutex sendLock; //header and payload of a message must go out back to back.
+    void *ringBase = nullptr; //rings shared with the gateway, null when talking over the socket.
+    uint32_t ringSize = 0;
+    svcRing ringDown, ringUp;
+    int ringUpFd = -1; //doorbell of the gateway.
+    boost::asio::posix::stream_descriptor ringDoorbell; //ours.
+    void setupRing(uint32_t);
+    void ringGw(void);
+    struct ringFrame
+    {
+        std::string head, body;
+        size_t offset; //written so far of a frame that goes in chunks.
+    };
+    std::deque<ringFrame> ringBacklog; //frames waiting for room in the up ring, under the send lock.
+    void ringSend(const char *, size_t, const char *, size_t);
+    bool ringPut(ringFrame &);
+    void flushRingBacklog(void);
+    void readRing(boost::system::error_code);
+    std::set<int> knownClients; //clients as told to the control handler.
+    std::set<int> snapshotClients; //snapshot being assembled.
+    uint32_t ctlSeq = 0; //sequence of the last batch or snapshot message.
+    bool ctlSeqValid = false;
+    bool ctlResyncPending = false; //asked for a snapshot, batches are ignored till it comes.
+    void dispatchClientStatus(int, bool);
+    void handleClientBatch(controlMessage &);
 
     public:
     void _sendSvcMessage(int, int, const char *, size_t);
+    void _sendSvcMessage(int, int, const std::string &, const char *, size_t);
     service(std::string name);
     ~service();
     std::map<int, std::pair<boost::asio::posix::stream_descriptor*, std::function<void(service*, int)>>> dynamicFdTable;
     boost::system::error_code readError;
+    std::string getName();
     int getControlChannelHandle();
     int getDataChannelHandle();
     int getSignalHandle();
@@ -150,7 +215,13 @@ class service
     void setSignalHandler(std::function<void(service *, struct signalfd_siginfo *fdsi)>);
     void sendToClient(int, int, std::string &);
     void sendToClient(int, int, const char*, size_t);
+    void sendToClient(int, int, const std::string &, const char*, size_t); //as the named service.
     void sendToGw(controlMessage &);
+    static long controlQueueDepth(); //messages a control queue holds, a snapshot of the expected clients fits.
+    void sendToUser(int, const char*, size_t); //to the user on whichever gateway of the cluster holds it.
+    void announceLogin(int, int); //uid, clientid.
+    void announceLogout(int);
+    void notifyService(const std::string &, const std::string &, const std::string &); //service, topic, key.
     void broadcast(std::string &);
     void broadcast(const char*, size_t);
     void readControlMessages(boost::system::error_code);
@@ -0,0 +1,186 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include "common.hh"
+#include "svcring.hh"
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the rings need lock free 64 bit atomics across processes");
+
+size_t
+svcRingSegmentSize(uint32_t capacity)
+{
+    return 2 * sizeof(ringControl) + 2 * (size_t)capacity;
+}
+
+void*
+svcRingMap(int fd, uint32_t capacity)
+{
+    void *base = ::mmap(nullptr, svcRingSegmentSize(capacity), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED) THROW_ERRNO_EXCEPTION;
+    return base;
+}
+
+void
+svcRingUnmap(void *base, uint32_t capacity)
+{
+    if(base) ::munmap(base, svcRingSegmentSize(capacity));
+    return;
+}
+
+ringControl*
+svcRingControl(void *base, int ring)
+{
+    return reinterpret_cast<ringControl*>(static_cast<char*>(base) + ring * sizeof(ringControl));
+}
+
+char*
+svcRingData(void *base, uint32_t capacity, int ring)
+{
+    return static_cast<char*>(base) + 2 * sizeof(ringControl) + ring * (size_t)capacity;
+}
+
+void
+svcRing::init(ringControl *ctl, char *data, uint32_t capacity)
+{
+    new (ctl) ringControl();
+    ctl->capacity = capacity;
+    ctl->head.store(0);
+    ctl->tail.store(0);
+    ctl->producerWaiting.store(0);
+    ctl->consumerWaiting.store(0);
+    ctl->magic = SVC_RING_MAGIC;
+    attach(ctl, data, capacity);
+    return;
+}
+
+bool
+svcRing::attach(ringControl *ctl, char *data, uint32_t capacity)
+{
+    if((ctl->magic != SVC_RING_MAGIC) || (ctl->capacity != capacity) ||
+            (capacity & (capacity - 1)) || (capacity < SVC_RING_MIN_SIZE))
+        return false;
+    _ctl = ctl;
+    _data = data;
+    _mask = capacity - 1;
+    return true;
+}
+
+//copy n bytes of the frame starting at from, the frame being head followed by body.
+static void
+copyFrame(char *dst, const char *head, size_t headLen, const char *body, size_t from, size_t n)
+{
+    if(from < headLen){
+        size_t h = std::min(n, headLen - from);
+        memcpy(dst, head + from, h);
+        dst += h;
+        n -= h;
+        from = headLen;
+    }
+    if(n) memcpy(dst, body + (from - headLen), n);
+    return;
+}
+
+//one record of n bytes of the frame, false if there is no room for it.
+static bool
+putRecord(ringControl *ctl, char *data, uint32_t mask, const char *head, size_t headLen,
+        const char *body, size_t from, size_t n, uint32_t flags)
+{
+    uint64_t capacity = (uint64_t)mask + 1;
+    uint64_t pos = ctl->head.load(std::memory_order_relaxed);
+    uint64_t tail = ctl->tail.load(std::memory_order_acquire);
+    uint64_t rec = (2 * sizeof(uint32_t) + n + 7) & ~(uint64_t)7;
+    uint64_t toEnd = capacity - (pos & mask);
+    uint64_t need = (toEnd < rec) ? toEnd + rec : rec;
+    if((pos + need - tail) > capacity) return false;
+    if(toEnd < rec){
+        uint32_t wrap[2] = {0, SVC_RING_REC_WRAP};
+        memcpy(data + (pos & mask), wrap, sizeof(wrap));
+        pos += toEnd;
+    }
+    char *dst = data + (pos & mask);
+    uint32_t len = n;
+    memcpy(dst, &len, sizeof(len));
+    memcpy(dst + sizeof(len), &flags, sizeof(flags));
+    copyFrame(dst + 2 * sizeof(uint32_t), head, headLen, body, from, n);
+    ctl->head.store(pos + rec, std::memory_order_release);
+    return true;
+}
+
+bool
+svcRing::write(const char *head, size_t headLen, const char *body, size_t bodyLen)
+{
+    if((2 * sizeof(uint32_t) + headLen + bodyLen) > maxRecord()) return false;
+    return putRecord(_ctl, _data, _mask, head, headLen, body, 0, headLen + bodyLen, 0);
+}
+
+size_t
+svcRing::writeChunked(const char *head, size_t headLen, const char *body, size_t bodyLen,
+        size_t offset)
+{
+    size_t total = headLen + bodyLen;
+    size_t chunk = maxRecord() - 2 * sizeof(uint32_t);
+    while(offset < total){
+        size_t n = std::min(chunk, total - offset);
+        uint32_t flags = ((offset + n) < total) ? SVC_RING_REC_MORE : 0;
+        if(!putRecord(_ctl, _data, _mask, head, headLen, body, offset, n, flags)) break;
+        offset += n;
+    }
+    return offset;
+}
+
+//the head store and the load of the waiting flag are ordered by the fence
+//here and the one in prepareSleep(), either the consumer sees the new head or
+//we see its flag.
+bool
+svcRing::needsDoorbell(void)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!_ctl->consumerWaiting.load(std::memory_order_relaxed)) return false;
+    return _ctl->consumerWaiting.exchange(0);
+}
+
+bool
+svcRing::prepareSleep(void)
+{
+    _ctl->consumerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(_ctl->head.load(std::memory_order_relaxed) == _ctl->tail.load(std::memory_order_relaxed))
+        return true;
+    cancelSleep();
+    return false;
+}
+
+void
+svcRing::cancelSleep(void)
+{
+    _ctl->consumerWaiting.store(0, std::memory_order_relaxed);
+    return;
+}
+
+void
+svcRing::markProducerWaiting(void)
+{
+    _ctl->producerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return;
+}
+
+bool
+svcRing::producerWaiting(void)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!_ctl->producerWaiting.load(std::memory_order_relaxed)) return false;
+    return _ctl->producerWaiting.exchange(0);
+}
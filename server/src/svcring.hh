@@ -0,0 +1,123 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//shared memory transport between the gateway and a service instance. the
+//service creates a segment holding two single producer single consumer rings,
+//down (gateway to service) and up (service to gateway), and an eventfd per
+//direction as the doorbell of the consumer. the descriptors go to the gateway
+//with the tag when the service connects, from then on the data frames travel
+//through the rings and the unix socket only tells the gateway the service died.
+//a ring record carries the bytes of a frame as it would be written on the
+//socket (clientid | channelid | svcname | len | payload):
+//  record : uint32 length | uint32 flags | bytes, padded to 8 bytes.
+//a frame bigger than a quarter of the ring is split in records flagged MORE,
+//a record never wraps, the space left at the end is skipped with a WRAP record.
+//the consumer sets its waiting flag before sleeping on the doorbell and the
+//producer rings the doorbell only when the flag is set, a busy consumer drains
+//many frames per wake up without a single syscall.
+#ifndef __INC_SVCRING_HH
+#define __INC_SVCRING_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+#define SVC_RING_MAGIC        (0x414b5247) //"AKRG"
+#define SVC_RING_MIN_SIZE     (4*1024*1024) //a client frame (2*OPTIMAL_BUF_SIZE) fits in one record.
+#define SVC_RING_REC_MORE     (1) //the frame continues in the next record.
+#define SVC_RING_REC_WRAP     (2) //nothing more till the end of the ring.
+
+typedef struct ringControl
+{
+    uint32_t magic;
+    uint32_t capacity; //bytes, power of 2.
+    alignas(64) std::atomic<uint64_t> head; //written by the producer.
+    std::atomic<uint32_t> producerWaiting; //the producer found the ring full.
+    alignas(64) std::atomic<uint64_t> tail; //written by the consumer.
+    std::atomic<uint32_t> consumerWaiting; //the consumer sleeps on the doorbell.
+}ringControl;
+
+class svcRing
+{
+    ringControl *_ctl = nullptr;
+    char *_data = nullptr;
+    uint32_t _mask = 0;
+    std::string _partial; //frame split over records, consumer side.
+
+    public:
+    void init(ringControl *ctl, char *data, uint32_t capacity); //creator of the segment.
+    bool attach(ringControl *ctl, char *data, uint32_t capacity);
+    //producer side. the frame is the concatenation of head and body, false
+    //when it does not fit right now. a frame bigger than maxRecord() has to
+    //go with writeChunked().
+    bool write(const char *head, size_t headLen, const char *body, size_t bodyLen);
+    //writes as much of the frame as fits and returns the bytes written,
+    //call again with the rest.
+    size_t writeChunked(const char *head, size_t headLen, const char *body, size_t bodyLen,
+            size_t offset);
+    size_t maxRecord(void) { return (_mask + 1) / 4; }
+    bool needsDoorbell(void); //after writing, the consumer sleeps.
+    void markProducerWaiting(void);
+    bool producerWaiting(void); //clears the flag, the consumer rings back.
+    //consumer side. hands every complete frame to the handler, at most limit
+    //of them, and returns the count.
+    template<typename handlerT> size_t read(handlerT handler, size_t limit);
+    bool prepareSleep(void); //true if the ring is still empty after setting the waiting flag.
+    void cancelSleep(void);
+    //frame split over records read so far, goes along with the ring on a restart.
+    const std::string& partial(void) { return _partial; }
+    void setPartial(const std::string &p) { _partial = p; }
+};
+
+//layout of the segment: control of down, control of up, data of down, data of up.
+size_t svcRingSegmentSize(uint32_t capacity);
+void* svcRingMap(int fd, uint32_t capacity);
+void svcRingUnmap(void *base, uint32_t capacity);
+ringControl* svcRingControl(void *base, int ring); //0 down, 1 up.
+char* svcRingData(void *base, uint32_t capacity, int ring);
+
+template<typename handlerT> size_t
+svcRing::read(handlerT handler, size_t limit)
+{
+    size_t frames = 0;
+    uint64_t tail = _ctl->tail.load(std::memory_order_relaxed);
+    uint64_t head = _ctl->head.load(std::memory_order_acquire);
+    while((tail != head) && (frames < limit)){
+        const char *rec = _data + (tail & _mask);
+        uint32_t len, flags;
+        __builtin_memcpy(&len, rec, sizeof(len));
+        __builtin_memcpy(&flags, rec + sizeof(len), sizeof(flags));
+        if(flags & SVC_RING_REC_WRAP){
+            tail += (_mask + 1) - (tail & _mask);
+            _ctl->tail.store(tail, std::memory_order_release);
+            continue;
+        }
+        const char *bytes = rec + 2 * sizeof(uint32_t);
+        if((flags & SVC_RING_REC_MORE) || !_partial.empty()){
+            _partial.append(bytes, len);
+            if(!(flags & SVC_RING_REC_MORE)){
+                handler(_partial.data(), _partial.length());
+                _partial.clear();
+                frames++;
+            }
+        }else{
+            handler(bytes, (size_t)len); //straight out of the ring, no copy.
+            frames++;
+        }
+        tail += (2 * sizeof(uint32_t) + len + 7) & ~(uint64_t)7;
+        //give the space back as we go, a waiting producer can refill behind us.
+        _ctl->tail.store(tail, std::memory_order_release);
+    }
+    return frames;
+}
+
+#endif
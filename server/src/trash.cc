@@ -0,0 +1,232 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include "common.hh"
+#include "log.hh"
+#include "trash.hh"
+
+//glibc has no wrapper for ioprio_set.
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+static std::string
+trashDir(const std::string &root)
+{
+    return root + "/" + TRASH_DIR;
+}
+
+std::string
+moveToTrash(const std::string &root, const std::string &path, int uid, int gid)
+{
+    std::string tdir = trashDir(root);
+    if((::mkdir(tdir.c_str(), S_IRWXU | S_IRWXG) < 0) && (errno != EEXIST))
+        THROW_ERRNO_EXCEPTION;
+    std::string tmpl = tdir + "/" + std::to_string(time(nullptr)) + "-XXXXXX";
+    std::vector<char> entryName(tmpl.begin(), tmpl.end());
+    entryName.push_back('\0');
+    if(!mkdtemp(entryName.data())) THROW_ERRNO_EXCEPTION;
+    std::string entry(entryName.data());
+    bool allOk = false;
+    SCOPE_EXIT{
+        if(!allOk){
+            ::unlink((entry + "/origin").c_str());
+            ::rmdir(entry.c_str());
+        }
+    };
+    {
+        std::ofstream origin(entry + "/origin");
+        origin<<path<<"\n"<<uid<<"\n"<<gid<<"\n";
+        if(!origin.flush()) throw std::runtime_error("unable to record origin of:" + path);
+    }
+    _except(::rename(path.c_str(), (entry + "/item").c_str()));
+    allOk = true;
+    return entry.substr(tdir.length() + 1);
+}
+
+bool
+readTrashEntry(const std::string &root, const std::string &id, trashEntry &entry)
+{
+    if(id.empty() || (id.find('/') != std::string::npos) || (id[0] == '.')) return false;
+    std::ifstream origin(trashDir(root) + "/" + id + "/origin");
+    if(!std::getline(origin, entry.origin)) return false;
+    if(!(origin>>entry.uid>>entry.gid)) return false;
+    entry.id = id;
+    entry.time = strtol(id.c_str(), nullptr, 10);
+    return true;
+}
+
+void
+listTrash(const std::string &root, std::vector<trashEntry> &entries)
+{
+    entries.clear();
+    DIR *dir = opendir(trashDir(root).c_str());
+    if(!dir) return; //nothing deleted yet.
+    SCOPE_EXIT{ closedir(dir); };
+    while(struct dirent *ent = readdir(dir)){
+        trashEntry entry;
+        if(readTrashEntry(root, ent->d_name, entry)) entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(),
+            [](const trashEntry &a, const trashEntry &b){ return a.time > b.time; });
+    return;
+}
+
+bool
+restoreFromTrash(const std::string &root, const trashEntry &entry)
+{
+    std::string edir = trashDir(root) + "/" + entry.id;
+    struct stat sb = {0};
+    if(lstat(entry.origin.c_str(), &sb) == 0) return false;
+    _except(::rename((edir + "/item").c_str(), entry.origin.c_str()));
+    ::unlink((edir + "/origin").c_str());
+    ::rmdir(edir.c_str());
+    return true;
+}
+
+trashReclaimer::trashReclaimer(const std::string &base, time_t retention, int batch,
+        int pauseMs, std::function<void (const std::string&, const std::string&)> reaping,
+        std::function<void (const trashEntry&)> purged,
+        std::function<void (const std::string&)> collect) :
+    _base(base),
+    _retention(retention),
+    _batch(std::max(batch, 1)),
+    _pauseMs(pauseMs),
+    _reaping(reaping),
+    _purged(purged),
+    _collect(collect)
+{
+    return;
+}
+
+void
+trashReclaimer::throttle()
+{
+    if((++_unlinked % _batch) == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(_pauseMs));
+    return;
+}
+
+//unlink the tree under dirfd/name without following links.
+void
+trashReclaimer::removeTree(int dirfd, const char *name)
+{
+    if(::unlinkat(dirfd, name, 0) == 0){ throttle(); return; }
+    if((errno != EISDIR) && (errno != EPERM)){
+        if(errno == ENOENT) return;
+        THROW_ERRNO_EXCEPTION;
+    }
+    int fd = _except(::openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW));
+    DIR *dir = fdopendir(fd);
+    if(!dir){ _eintr(::close(fd)); THROW_ERRNO_EXCEPTION; }
+    {
+        SCOPE_EXIT{ closedir(dir); };
+        while(struct dirent *ent = readdir(dir)){
+            if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+            removeTree(fd, ent->d_name);
+        }
+    }
+    _except(::unlinkat(dirfd, name, AT_REMOVEDIR));
+    throttle();
+    return;
+}
+
+int
+trashReclaimer::reclaim(const std::string &root)
+{
+    std::vector<trashEntry> entries;
+    listTrash(root, entries);
+    time_t now = time(nullptr);
+    int reclaimed = 0;
+    for(auto &entry : entries){
+        if((entry.time + _retention) > now) continue;
+        std::string edir = trashDir(root) + "/" + entry.id;
+        try{
+            _reaping(root, edir + "/item");
+            removeTree(AT_FDCWD, (edir + "/item").c_str());
+            //the records are by path, if something new took the path they are
+            //its now. the last delete of a path purges them.
+            struct stat sb = {0};
+            bool reused = (lstat(entry.origin.c_str(), &sb) == 0) ||
+                std::any_of(entries.begin(), entries.end(), [&entry](const trashEntry &e){ 
+                        return (e.origin == entry.origin) && ((e.time > entry.time) || 
+                            ((e.time == entry.time) && (e.id > entry.id))); });
+            if(reused)
+                _info<<"origin in use again, records kept for:"<<entry.origin;
+            else
+                _purged(entry);
+            _except(::unlink((edir + "/origin").c_str()));
+            _except(::rmdir(edir.c_str()));
+            _info<<"reclaimed from trash:"<<entry.origin;
+            reclaimed++;
+        }
+        catch(std::exception &ex){
+            _error<<"trashReclaimer::reclaim() unable to reclaim:"<<edir<<" error:"<<ex.what();
+        }
+    }
+    return reclaimed;
+}
+
+void
+trashReclaimer::collect(const std::string &root, bool reclaimed)
+{
+    time_t now = time(nullptr);
+    time_t &last = _collected[root];
+    if(!reclaimed && ((last + 24*3600) > now)) return;
+    last = now;
+    try{
+        _collect(root);
+    }
+    catch(std::exception &ex){
+        _error<<"trashReclaimer::collect() unable to collect:"<<root<<" error:"<<ex.what();
+    }
+    return;
+}
+
+void
+trashReclaimer::run()
+{
+    //the reclaim io only gets the disk when nobody else wants it.
+    if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+        _error<<"trashReclaimer unable to lower io priority:"<<strerror(errno);
+    for(;;){
+        reclaim(_base); //deletes of a whole organization.
+        DIR *dir = opendir(_base.c_str());
+        if(dir){
+            SCOPE_EXIT{ closedir(dir); };
+            while(struct dirent *ent = readdir(dir)){
+                if(ent->d_name[0] == '.') continue;
+                std::string root = _base + "/" + ent->d_name;
+                collect(root, reclaim(root) > 0);
+            }
+        }else
+            _error<<"trashReclaimer unable to open:"<<_base<<" error:"<<strerror(errno);
+        std::this_thread::sleep_for(std::chrono::seconds(60));
+    }
+    return;
+}
+
+void
+trashReclaimer::start()
+{
+    std::thread(&trashReclaimer::run, this).detach();
+    return;
+}
@@ -0,0 +1,74 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//deleted files and directories are renamed in to the trash of their
+//organization and are gone for the user at once. they can be brought back
+//until the retention runs out, after which the reclaimer unlinks them in the
+//background:
+//  <root>/.trash/<deletion time>-<uuid>/item    the deleted file or directory
+//  <root>/.trash/<deletion time>-<uuid>/origin  path, uid and gid of the delete
+#ifndef __INC_TRASH_HH
+#define __INC_TRASH_HH
+
+#include <time.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <map>
+
+#define TRASH_DIR ".trash"
+
+struct trashEntry
+{
+    std::string id;
+    std::string origin; //where the item was deleted from.
+    int uid = 0;
+    int gid = 0;
+    time_t time = 0;
+};
+
+//move path in to the trash of root, throws a syscallException when it cannot
+//be renamed there (EXDEV if it is on another file system).
+std::string moveToTrash(const std::string &root, const std::string &path, int uid, int gid);
+void listTrash(const std::string &root, std::vector<trashEntry> &entries);
+bool readTrashEntry(const std::string &root, const std::string &id, trashEntry &entry);
+//put the item back where it was, false if something took its place.
+bool restoreFromTrash(const std::string &root, const trashEntry &entry);
+
+class trashReclaimer
+{
+    std::string _base; //the organizations are the directories in here.
+    time_t _retention;
+    int _batch; //unlinks between two pauses.
+    int _pauseMs;
+    std::function<void (const std::string&, const std::string&)> _reaping; //root and item about to go.
+    std::function<void (const trashEntry&)> _purged; //called once an entry is gone, unless its origin is taken again.
+    std::function<void (const std::string&)> _collect; //garbage collection of a root.
+    std::map<std::string, time_t> _collected; //last collect of the roots.
+    unsigned int _unlinked = 0;
+
+    void throttle();
+    void removeTree(int dirfd, const char *name);
+    int reclaim(const std::string &root);
+    void collect(const std::string &root, bool reclaimed);
+    void run();
+
+    public:
+    //collect runs for a root after something of it was reclaimed and at
+    //least once a day.
+    trashReclaimer(const std::string &base, time_t retention, int batch, int pauseMs,
+            std::function<void (const std::string&, const std::string&)> reaping,
+            std::function<void (const trashEntry&)> purged,
+            std::function<void (const std::string&)> collect);
+    void start(); //runs in its own thread at idle io priority.
+};
+
+#endif
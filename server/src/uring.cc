@@ -0,0 +1,345 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "common.hh"
+#include "log.hh"
+#include "uring.hh"
+
+//glibc has no wrappers for the io_uring syscalls.
+static int
+uringSetup(unsigned entries, io_uring_params *p)
+{
+    return ::syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uringEnter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+    return ::syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0);
+}
+
+static int
+uringRegister(int fd, unsigned opcode, void *arg, unsigned args)
+{
+    return ::syscall(__NR_io_uring_register, fd, opcode, arg, args);
+}
+
+fileRing::fileRing(boost::asio::io_service &io, unsigned entries, unsigned buffers, size_t bufferSize):
+    _io(io),
+    _event(io),
+    _bufferSize(bufferSize)
+{
+    bool allOk = false;
+    SCOPE_EXIT{
+        if(allOk) return;
+        if(_sqes) ::munmap(_sqes, _sqEntries * sizeof(io_uring_sqe));
+        if(_cqRing && (_cqRing != _sqRing)) ::munmap(_cqRing, _cqRingSize);
+        if(_sqRing) ::munmap(_sqRing, _sqRingSize);
+        if(_ringFd >= 0) ::close(_ringFd);
+        free(_buffers);
+    };
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    _ringFd = _except(uringSetup(entries, &p));
+    _sqEntries = p.sq_entries;
+    _cqEntries = p.cq_entries;
+
+    //the rings and the submission entries are shared with the kernel, newer
+    //kernels put both rings in one mapping.
+    _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+    void *ring = ::mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+    if(ring == MAP_FAILED) THROW_ERRNO_EXCEPTION;
+    _sqRing = _cqRing = ring;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)){
+        ring = ::mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_CQ_RING);
+        if(ring == MAP_FAILED){ _cqRing = nullptr; THROW_ERRNO_EXCEPTION; }
+        _cqRing = ring;
+    }
+    ring = ::mmap(nullptr, _sqEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+    if(ring == MAP_FAILED) THROW_ERRNO_EXCEPTION;
+    _sqes = static_cast<io_uring_sqe*>(ring);
+
+    unsigned char *sq = static_cast<unsigned char*>(_sqRing);
+    unsigned char *cq = static_cast<unsigned char*>(_cqRing);
+    _sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    _sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    _sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    _cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    _cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    //IORING_OP_READ and IORING_OP_WRITE came with the probe, a kernel without
+    //it is left to the thread pool.
+    std::vector<unsigned char> probeBuf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe *probe = reinterpret_cast<io_uring_probe*>(probeBuf.data());
+    _except(uringRegister(_ringFd, IORING_REGISTER_PROBE, probe, 256));
+    auto supported = [probe](unsigned op){
+        return (op <= probe->last_op) && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    };
+    if(!supported(IORING_OP_READ) || !supported(IORING_OP_WRITE) ||
+            !supported(IORING_OP_READ_FIXED) || !supported(IORING_OP_WRITE_FIXED) ||
+            !supported(IORING_OP_SYNC_FILE_RANGE))
+        throw std::runtime_error("io_uring without file reads and writes");
+    _fadvise = supported(IORING_OP_FADVISE);
+
+    int efd = _except(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    _event.assign(efd);
+    _except(uringRegister(_ringFd, IORING_REGISTER_EVENTFD, &efd, 1));
+
+    //the buffers are pinned once here instead of on every op, they count
+    //against RLIMIT_MEMLOCK and the ring works without them if that is short.
+    if(buffers){
+        _except(posix_memalign(reinterpret_cast<void**>(&_buffers), 4096, buffers * bufferSize));
+        std::vector<iovec> iov(buffers);
+        for(unsigned i = 0; i < buffers; i++){
+            iov[i].iov_base = _buffers + i * bufferSize;
+            iov[i].iov_len = bufferSize;
+        }
+        if(uringRegister(_ringFd, IORING_REGISTER_BUFFERS, iov.data(), buffers) < 0){
+            _error<<"fileRing() unable to register buffers, errno:"<<errno;
+            free(_buffers);
+            _buffers = nullptr;
+        }else{
+            for(int i = buffers - 1; i >= 0; i--) _freeBuffers.push_back(i);
+        }
+    }
+    armEvent();
+    allOk = true;
+    _info<<"fileRing() io_uring with "<<_sqEntries<<" entries, "<<
+        _freeBuffers.size()<<" registered buffers";
+}
+
+fileRing::~fileRing()
+{
+    boost::system::error_code ec;
+    _event.close(ec);
+    ::munmap(_sqes, _sqEntries * sizeof(io_uring_sqe));
+    if(_cqRing != _sqRing) ::munmap(_cqRing, _cqRingSize);
+    ::munmap(_sqRing, _sqRingSize);
+    ::close(_ringFd); //the kernel cancels what is still in flight.
+    free(_buffers);
+}
+
+std::shared_ptr<unsigned char>
+fileRing::buffer(int &index)
+{
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        if(!_freeBuffers.empty()){
+            index = _freeBuffers.back();
+            _freeBuffers.pop_back();
+            return std::shared_ptr<unsigned char>(_buffers + index * _bufferSize,
+                    [this, index](unsigned char*){
+                        std::unique_lock<std::mutex> lock(_lock);
+                        _freeBuffers.push_back(index);
+                    });
+        }
+    }
+    index = -1;
+    unsigned char *buf = nullptr;
+    _except(posix_memalign(reinterpret_cast<void**>(&buf), 4096, _bufferSize));
+    return std::shared_ptr<unsigned char>(buf, free);
+}
+
+void
+fileRing::read(int fd, void *buf, size_t len, off_t offset, int index, completion done)
+{
+    request req = {
+        (uint8_t)((index < 0) ? IORING_OP_READ : IORING_OP_READ_FIXED), fd,
+        reinterpret_cast<uint64_t>(buf), (uint32_t)len, (uint64_t)offset, 0, index,
+        new completion(std::move(done))
+    };
+    queue(req);
+}
+
+void
+fileRing::write(int fd, const void *buf, size_t len, off_t offset, int index, completion done)
+{
+    request req = {
+        (uint8_t)((index < 0) ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED), fd,
+        reinterpret_cast<uint64_t>(buf), (uint32_t)len, (uint64_t)offset, 0, index,
+        new completion(std::move(done))
+    };
+    queue(req);
+}
+
+//the readahead a WILLNEED starts is queued by the kernel either way, the
+//synchronous call is only left for kernels before 5.6.
+void
+fileRing::fadvise(int fd, off_t offset, off_t len, int advice)
+{
+    if(!_fadvise){
+        posix_fadvise(fd, offset, len, advice);
+        return;
+    }
+    request req = {IORING_OP_FADVISE, fd, 0, (uint32_t)len, (uint64_t)offset, (uint32_t)advice, -1, nullptr};
+    queue(req);
+}
+
+void
+fileRing::syncRange(int fd, off_t offset, off_t len, unsigned flags, completion done)
+{
+    request req = {
+        IORING_OP_SYNC_FILE_RANGE, fd, 0, (uint32_t)len, (uint64_t)offset, flags, -1,
+        done ? new completion(std::move(done)) : nullptr
+    };
+    queue(req);
+}
+
+void
+fileRing::submit()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    enter();
+}
+
+//with no more ops in flight than the completion queue holds no completion
+//can be lost, the rest wait in the backlog.
+void
+fileRing::queue(request &req)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    if(_inFlight >= _cqEntries){
+        _backlog.push_back(req);
+        return;
+    }
+    prepare(req);
+    schedule();
+}
+
+//called with the lock held.
+void
+fileRing::prepare(const request &req)
+{
+    unsigned tail = *_sqTail;
+    if(tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries){
+        enter();
+        tail = *_sqTail;
+    }
+    io_uring_sqe *sqe = &_sqes[tail & *_sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req.opcode;
+    sqe->fd = req.fd;
+    sqe->addr = req.addr;
+    sqe->len = req.len;
+    sqe->off = req.offset;
+    if(req.opcode == IORING_OP_FADVISE) sqe->fadvise_advice = req.flags;
+    else if(req.opcode == IORING_OP_SYNC_FILE_RANGE) sqe->sync_range_flags = req.flags;
+    if(req.index >= 0) sqe->buf_index = req.index;
+    sqe->user_data = reinterpret_cast<uint64_t>(req.done);
+    _sqArray[tail & *_sqMask] = tail & *_sqMask;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    _prepared++;
+    _inFlight++;
+}
+
+//called with the lock held.
+void
+fileRing::enter()
+{
+    while(_prepared){
+        int rc = uringEnter(_ringFd, _prepared, 0, 0);
+        if(rc >= 0){
+            _prepared -= rc;
+            continue;
+        }
+        if(errno == EINTR) continue;
+        //EAGAIN and EBUSY clear up with the completions, the next reap
+        //enters them again.
+        if((errno != EAGAIN) && (errno != EBUSY))
+            _error<<"fileRing::enter() io_uring_enter failed errno:"<<errno;
+        return;
+    }
+}
+
+//all the ops prepared by one turn of the loop go in with one syscall.
+void
+fileRing::schedule()
+{
+    if(_flushPosted) return;
+    _flushPosted = true;
+    _io.post(std::bind(&fileRing::flush, this));
+}
+
+void
+fileRing::flush()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _flushPosted = false;
+    enter();
+}
+
+void
+fileRing::armEvent()
+{
+    _event.async_read_some(boost::asio::null_buffers(),
+            [this](const boost::system::error_code &error, size_t){
+                if(error){
+                    if(error != boost::asio::error::operation_aborted)
+                        _error<<"fileRing eventfd error:"<<error.message();
+                    return;
+                }
+                reap();
+                armEvent();
+            });
+}
+
+void
+fileRing::reap()
+{
+    uint64_t count;
+    if(::read(_event.native_handle(), &count, sizeof(count)) < 0) {}
+    std::vector<std::pair<completion*, int>> done;
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++){
+        io_uring_cqe *cqe = &_cqes[head & *_cqMask];
+        done.push_back(std::make_pair(reinterpret_cast<completion*>(cqe->user_data), cqe->res));
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    if(done.empty()) return;
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _inFlight -= done.size();
+        while(!_backlog.empty() && (_inFlight < _cqEntries)){
+            prepare(_backlog.front());
+            _backlog.pop_front();
+        }
+        if(_prepared) schedule();
+    }
+    for(auto &d : done){
+        if(!d.first) continue;
+        try{
+            (*d.first)(d.second);
+        }
+        catch(std::exception &ex){
+            _error<<"fileRing::reap() completion threw:"<<ex.what();
+        }
+        delete d.first;
+    }
+}
@@ -0,0 +1,104 @@
+/****************************************************************
+ * Copyright (c) Neptunium Pvt Ltd., 2014.
+ * Author: Neptunium Pvt Ltd..
+ *
+ * This unpublished material is proprietary to Neptunium Pvt Ltd..
+ * All rights reserved. The methods and techniques described herein
+ * are considered trade secrets and/or confidential. Reproduction or
+ * distribution, in whole or in part, is forbidden except by express
+ * written permission of Neptunium.
+ ****************************************************************/
+
+//file i/o through an io_uring driven from an asio event loop, the loop hands
+//the reads and writes to the kernel and picks up their results instead of a
+//thread sleeping in pread/pwrite for each of them. there is no liburing on
+//the build hosts, the ring is set up with the raw syscalls.
+//ops are prepared by any thread and go to the kernel together once the loop
+//comes around, their completions are called on the loop thread with the
+//result of the op, -errno when it failed.
+#ifndef __INC_URING_HH
+#define __INC_URING_HH
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <boost/asio.hpp>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class fileRing
+{
+    public:
+    typedef std::function<void (int)> completion;
+
+    private:
+    struct request
+    {
+        uint8_t opcode;
+        int fd;
+        uint64_t addr;
+        uint32_t len;
+        uint64_t offset;
+        uint32_t flags; //fadvise advice or sync_file_range flags.
+        int index; //registered buffer of a fixed read or write.
+        completion *done;
+    };
+
+    boost::asio::io_service &_io;
+    boost::asio::posix::stream_descriptor _event; //eventfd the kernel signals completions on.
+    int _ringFd = -1;
+    void *_sqRing = nullptr, *_cqRing = nullptr;
+    size_t _sqRingSize = 0, _cqRingSize = 0;
+    unsigned *_sqHead, *_sqTail, *_sqMask, *_sqArray;
+    unsigned *_cqHead, *_cqTail, *_cqMask;
+    io_uring_sqe *_sqes = nullptr;
+    io_uring_cqe *_cqes;
+    unsigned _sqEntries = 0, _cqEntries = 0;
+    bool _fadvise = false;
+
+    std::mutex _lock; //the submission side, completions are only reaped on the loop.
+    unsigned _prepared = 0; //in the submission queue, not yet entered.
+    unsigned _inFlight = 0; //prepared and not completed, kept below the completion queue size.
+    std::deque<request> _backlog; //waiting for room in the completion queue.
+    bool _flushPosted = false;
+
+    unsigned char *_buffers = nullptr;
+    size_t _bufferSize;
+    std::vector<int> _freeBuffers; //registered buffer slots.
+
+    void queue(request &req);
+    void prepare(const request &req);
+    void enter();
+    void flush();
+    void schedule();
+    void reap();
+    void armEvent();
+
+    public:
+    //entries of the submission queue, buffers registered with the kernel of
+    //bufferSize each. throws when the kernel has no io_uring or the ring
+    //lacks plain reads and writes (before 5.6).
+    fileRing(boost::asio::io_service &io, unsigned entries, unsigned buffers, size_t bufferSize);
+    ~fileRing();
+
+    //a page aligned buffer of bufferSize, index is its slot in the registered
+    //buffers or -1 if they are all taken, it goes back when the last copy is
+    //gone, which has to be before the ring is.
+    std::shared_ptr<unsigned char> buffer(int &index);
+
+    //index -1 for a buffer that is not registered.
+    void read(int fd, void *buf, size_t len, off_t offset, int index, completion done);
+    void write(int fd, const void *buf, size_t len, off_t offset, int index, completion done);
+    void fadvise(int fd, off_t offset, off_t len, int advice);
+    void syncRange(int fd, off_t offset, off_t len, unsigned flags, completion done = nullptr);
+
+    //hand the prepared ops to the kernel now, before closing an fd they use.
+    void submit();
+};
+
+#endif
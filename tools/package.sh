@@ -92,6 +92,9 @@ cp $2/server/src/obj/akorp_ngw $dest_dir/opt/antkorp/custom/bin/
 #cp $2/server/src/obj/akorp_broadway_tunneld $dest_dir/opt/antkorp/custom/bin/ 
 cp $2/server/src/obj/akorp_fmgr $dest_dir/opt/antkorp/custom/bin/
 cp $2/server/src/obj/clntsim $dest_dir/opt/antkorp/custom/bin/
+cp $2/server/src/obj/akorp_sfu $dest_dir/opt/antkorp/custom/bin/
+cp $2/server/src/obj/sfusim $dest_dir/opt/antkorp/custom/bin/
+cp $2/server/src/obj/clustersim $dest_dir/opt/antkorp/custom/bin/
 cp $2/server/src/obj/fattr $dest_dir/opt/antkorp/custom/bin/
 cp $2/server/src/obj/*.so $dest_dir/opt/antkorp/custom/lib/
 
@@ -133,6 +136,7 @@ cp $2/init/upstart/antkorp_auth.conf $dest_dir/etc/init/
 cp $2/init/upstart/antkorp_kons.conf $dest_dir/etc/init/
 cp $2/init/upstart/antkorp_cron.conf $dest_dir/etc/init/
 cp $2/init/upstart/antkorp_rtc.conf $dest_dir/etc/init/
+#cp $2/init/upstart/antkorp_sfu.conf $dest_dir/etc/init/
 #cp $2/init/upstart/antkorp_broadway.conf $dest_dir/etc/init/
 #cp $2/init/upstart/antkorp_broadway_tunnel.conf $dest_dir/etc/init/
 cp -R $2/client/src/antkorp/dist/*  $dest_dir/var/www/antkorp/